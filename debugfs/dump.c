@@ -97,8 +97,128 @@ static void fix_perms(const char *cmd, const struct ext2_inode *inode,
 		com_err(cmd, errno, "while setting times of %s", name);
 }
 
+/*
+ * Extent-mapped files are copied out an extent at a time: each extent
+ * is read with a few large reads straight into the output buffer, and
+ * holes and unwritten extents are skipped over with lseek() when the
+ * output is a regular file we have just created.  Everything else, and
+ * anything left over when the extent tree can't be followed, goes
+ * through ext2fs_file_read() as before.
+ */
+#define DUMP_BUFSIZE	(1024 * 1024)
+
+static int dump_write(int fd, const char *buf, size_t len)
+{
+	ssize_t	nbytes;
+
+	while (len) {
+		nbytes = write(fd, buf, len);
+		if (nbytes <= 0)
+			return -1;
+		buf += nbytes;
+		len -= nbytes;
+	}
+	return 0;
+}
+
+static int dump_hole(int fd, int sparse, char *buf, size_t bufsize,
+		     __u64 len)
+{
+	size_t	n;
+
+	if (sparse)
+		return lseek(fd, len, SEEK_CUR) == (off_t) -1 ? -1 : 0;
+	memset(buf, 0, len < bufsize ? len : bufsize);
+	while (len) {
+		n = len < bufsize ? len : bufsize;
+		if (dump_write(fd, buf, n))
+			return -1;
+		len -= n;
+	}
+	return 0;
+}
+
+/*
+ * Copy out the extents of a file, starting at *pos (which must be
+ * block aligned) and leaving *pos after the last byte written.
+ */
+static errcode_t dump_extents(const char *cmdname, ext2_ino_t ino,
+			      struct ext2_inode *inode, int fd, int sparse,
+			      char *buf, size_t bufsize, __u64 *pos)
+{
+	ext2_extent_handle_t	handle;
+	struct ext2fs_extent	extent;
+	unsigned int	blocksize = current_fs->blocksize;
+	__u64		size = EXT2_I_SIZE(inode), start, len, skip;
+	blk64_t		blk, count;
+	size_t		n;
+	int		op = EXT2_EXTENT_ROOT;
+	errcode_t	retval;
+
+	retval = ext2fs_extent_open2(current_fs, ino, inode, &handle);
+	if (retval)
+		return retval;
+
+	while (*pos < size) {
+		retval = ext2fs_extent_get(handle, op, &extent);
+		if (retval) {
+			if (retval == EXT2_ET_EXTENT_NO_NEXT)
+				retval = 0;
+			break;
+		}
+		op = EXT2_EXTENT_NEXT;
+		if (!(extent.e_flags & EXT2_EXTENT_FLAGS_LEAF) ||
+		    (extent.e_flags & EXT2_EXTENT_FLAGS_UNINIT))
+			continue;
+
+		start = extent.e_lblk * (__u64) blocksize;
+		len = extent.e_len * (__u64) blocksize;
+		blk = extent.e_pblk;
+		if (start >= size)
+			break;
+		if (start + len <= *pos)
+			continue;
+		if (start < *pos) {
+			skip = (*pos - start) / blocksize;
+			blk += skip;
+			start += skip * blocksize;
+			len -= skip * blocksize;
+		}
+		if (start + len > size)
+			len = size - start;
+
+		if (start > *pos) {
+			if (dump_hole(fd, sparse, buf, bufsize, start - *pos))
+				goto write_error;
+			*pos = start;
+		}
+		while (len) {
+			n = len < bufsize ? len : bufsize;
+			count = (n + blocksize - 1) / blocksize;
+			retval = io_channel_read_blk64(current_fs->io, blk,
+						       count, buf);
+			if (retval)
+				goto out;
+			if (dump_write(fd, buf, n))
+				goto write_error;
+			blk += count;
+			*pos += n;
+			len -= n;
+		}
+	}
+out:
+	ext2fs_extent_free(handle);
+	return retval;
+
+write_error:
+	com_err(cmdname, errno, "while writing file");
+	*pos = size;
+	ext2fs_extent_free(handle);
+	return 0;
+}
+
 static void dump_file(const char *cmdname, ext2_ino_t ino, int fd,
-		      int preserve, char *outname)
+		      int preserve, int sparse, char *outname)
 {
 	errcode_t retval;
 	struct ext2_inode	inode;
@@ -106,22 +226,52 @@ static void dump_file(const char *cmdname, ext2_ino_t ino, int fd,
 	ext2_file_t	e2_file;
 	int		nbytes;
 	unsigned int	got, blocksize = current_fs->blocksize;
+	size_t		bufsize = DUMP_BUFSIZE;
+	__u64		size, pos = 0;
+	struct stat	st;
 
 	if (debugfs_read_inode(ino, &inode, cmdname))
 		return;
 
+	/* Pipes and devices can't seek over holes; write zeroes to them */
+	if (sparse && (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)))
+		sparse = 0;
+
 	retval = ext2fs_file_open(current_fs, ino, 0, &e2_file);
 	if (retval) {
 		com_err(cmdname, retval, "while opening ext2 file");
 		return;
 	}
-	retval = ext2fs_get_mem(blocksize, &buf);
+	size = EXT2_I_SIZE(&inode);
+	if (size < bufsize)
+		bufsize = (size + blocksize - 1) / blocksize * blocksize;
+	if (bufsize < blocksize)
+		bufsize = blocksize;
+	retval = ext2fs_get_mem(bufsize, &buf);
 	if (retval) {
 		com_err(cmdname, retval, "while allocating memory");
 		return;
 	}
+
+	if ((inode.i_flags & EXT4_EXTENTS_FL) &&
+	    !(inode.i_flags & EXT4_INLINE_DATA_FL) &&
+	    !dump_extents(cmdname, ino, &inode, fd, sparse, buf, bufsize,
+			  &pos)) {
+		if (pos < size) {
+			if (sparse ? ftruncate(fd, size) :
+			    dump_hole(fd, 0, buf, bufsize, size - pos))
+				com_err(cmdname, errno, "while writing file");
+		}
+		goto done;
+	}
+
+	if (pos) {
+		retval = ext2fs_file_llseek(e2_file, pos, EXT2_SEEK_SET, NULL);
+		if (retval)
+			com_err(cmdname, retval, "while reading ext2 file");
+	}
 	while (1) {
-		retval = ext2fs_file_read(e2_file, buf, blocksize, &got);
+		retval = ext2fs_file_read(e2_file, buf, bufsize, &got);
 		if (retval)
 			com_err(cmdname, retval, "while reading ext2 file");
 		if (got == 0)
@@ -130,6 +280,7 @@ static void dump_file(const char *cmdname, ext2_ino_t ino, int fd,
 		if ((unsigned) nbytes != got)
 			com_err(cmdname, errno, "while writing file");
 	}
+done:
 	if (buf)
 		ext2fs_free_mem(&buf);
 	retval = ext2fs_file_close(e2_file);
@@ -186,7 +337,7 @@ void do_dump(int argc, char **argv, int sci_idx EXT2FS_ATTR((unused)),
 		return;
 	}
 
-	dump_file(argv[0], inode, fd, preserve, out_fn);
+	dump_file(argv[0], inode, fd, preserve, 1, out_fn);
 	if (close(fd) != 0) {
 		com_err(argv[0], errno, "while closing %s for dump_inode",
 			out_fn);
@@ -271,7 +422,7 @@ static void rdump_inode(ext2_ino_t ino, struct ext2_inode *inode,
 			com_err("rdump", errno, "while opening %s", fullname);
 			goto errout;
 		}
-		dump_file("rdump", ino, fd, 1, fullname);
+		dump_file("rdump", ino, fd, 1, 1, fullname);
 		if (close(fd) != 0) {
 			com_err("rdump", errno, "while closing %s", fullname);
 			goto errout;
@@ -378,7 +529,7 @@ void do_cat(int argc, char **argv, int sci_idx EXT2FS_ATTR((unused)),
 
 	fflush(stdout);
 	fflush(stderr);
-	dump_file(argv[0], inode, 1, 0, argv[2]);
+	dump_file(argv[0], inode, 1, 0, 0, argv[2]);
 
 	return;
 }
@@ -32,17 +32,18 @@ struct block_walk_struct {
 };
 
 static int icheck_proc(ext2_filsys fs EXT2FS_ATTR((unused)),
-		       blk64_t	*block_nr,
-		       e2_blkcnt_t blockcnt EXT2FS_ATTR((unused)),
-		       blk64_t ref_block EXT2FS_ATTR((unused)),
-		       int ref_offset EXT2FS_ATTR((unused)),
+		       e2_blkcnt_t lblk EXT2FS_ATTR((unused)),
+		       blk64_t pblk,
+		       blk64_t len,
+		       int run_flags EXT2FS_ATTR((unused)),
 		       void *private)
 {
 	struct block_walk_struct *bw = (struct block_walk_struct *) private;
 	e2_blkcnt_t	i;
 
 	for (i=0; i < bw->num_blocks; i++) {
-		if (!bw->barray[i].ino && bw->barray[i].blk == *block_nr) {
+		if (!bw->barray[i].ino && bw->barray[i].blk >= pblk &&
+		    bw->barray[i].blk - pblk < len) {
 			bw->barray[i].ino = bw->inode;
 			bw->blocks_left--;
 		}
@@ -117,11 +118,10 @@ void do_icheck(int argc, char **argv, int sci_idx EXT2FS_ATTR((unused)),
 
 		blk = ext2fs_file_acl_block(current_fs, &inode);
 		if (blk) {
-			icheck_proc(current_fs, &blk, 0,
-				    0, 0, &bw);
+			icheck_proc(current_fs, 0, blk, 1, BLOCK_RUN_METADATA,
+				    &bw);
 			if (bw.blocks_left == 0)
 				break;
-			ext2fs_file_acl_block_set(current_fs, &inode, blk);
 		}
 
 		if (!ext2fs_inode_has_valid_blocks2(current_fs, &inode))
@@ -133,12 +133,12 @@ void do_icheck(int argc, char **argv, int sci_idx EXT2FS_ATTR((unused)),
 		if (inode.i_dtime)
 			goto next;
 
-		retval = ext2fs_block_iterate3(current_fs, ino,
-					       BLOCK_FLAG_READ_ONLY, block_buf,
-					       icheck_proc, &bw);
+		retval = ext2fs_block_iterate_runs(current_fs, ino, 0,
+						   block_buf, icheck_proc,
+						   &bw);
 		if (retval) {
 			com_err("icheck", retval,
-				"while calling ext2fs_block_iterate");
+				"while calling ext2fs_block_iterate_runs");
 			goto next;
 		}
 
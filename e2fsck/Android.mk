@@ -30,7 +30,8 @@ e2fsck_src_files :=  \
 	region.c \
 	sigcatcher.c \
 	readahead.c \
-	extents.c
+	extents.c \
+	dirent_set.c
 
 e2fsck_shared_libraries := \
 	libext2fs \
@@ -0,0 +1,365 @@
+/*
+ * dirent_set.c --- find duplicate names within a directory block
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Public
+ * License.
+ * %End-Header%
+ */
+
+/*
+ * Pass 2 looks for duplicate names one directory block at a time, so
+ * the set never holds more than a block's worth of entries.  It is an
+ * open-addressed hash table of pointers into the block, allocated once
+ * and sized for the largest number of entries a block can hold; each
+ * slot is stamped with the generation of the block which filled it, so
+ * emptying the set between blocks is a single increment.
+ */
+
+#include "config.h"
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <string.h>
+
+#ifdef TEST_PROGRAM
+#undef ENABLE_NLS
+#endif
+#include "e2fsck.h"
+
+struct dirent_set_slot {
+	struct ext2_dir_entry	*dirent;
+	__u32			hash;
+	__u32			gen;
+};
+
+struct dirent_set_struct {
+	struct dirent_set_slot	*slots;
+	__u32			mask;
+	__u32			count;
+	__u32			gen;
+};
+
+static __u32 dirent_set_hash(const struct ext2_dir_entry *dirent, int len)
+{
+	const unsigned char *cp = (const unsigned char *) dirent->name;
+	__u32	hash = 2166136261U ^ len;
+
+	while (len--)
+		hash = (hash ^ *cp++) * 16777619U;
+	return hash;
+}
+
+static int dirent_set_alloc(dirent_set_t set, __u32 nr_slots)
+{
+	set->slots = calloc(nr_slots, sizeof(struct dirent_set_slot));
+	if (!set->slots)
+		return -1;
+	set->mask = nr_slots - 1;
+	set->count = 0;
+	set->gen = 1;
+	return 0;
+}
+
+dirent_set_t dirent_set_create(unsigned int max_entries)
+{
+	dirent_set_t	set;
+	__u32		nr_slots = 16;
+
+	/* Keep the table at most half full */
+	while (nr_slots < 2 * max_entries)
+		nr_slots *= 2;
+
+	set = malloc(sizeof(struct dirent_set_struct));
+	if (!set)
+		return NULL;
+	if (dirent_set_alloc(set, nr_slots)) {
+		free(set);
+		return NULL;
+	}
+	return set;
+}
+
+void dirent_set_free(dirent_set_t set)
+{
+	free(set->slots);
+	memset(set, 0, sizeof(struct dirent_set_struct));
+	free(set);
+}
+
+void dirent_set_clear(dirent_set_t set)
+{
+	set->count = 0;
+	if (++set->gen == 0) {
+		memset(set->slots, 0,
+		       (set->mask + 1) * sizeof(struct dirent_set_slot));
+		set->gen = 1;
+	}
+}
+
+static struct dirent_set_slot *dirent_set_find(dirent_set_t set,
+					       struct ext2_dir_entry *dirent,
+					       int len, __u32 hash)
+{
+	struct dirent_set_slot	*slot;
+	__u32			i = hash;
+
+	for (;; i++) {
+		slot = &set->slots[i & set->mask];
+		if (slot->gen != set->gen)
+			return slot;
+		if (slot->hash == hash &&
+		    ext2fs_dirent_name_len(slot->dirent) == len &&
+		    !memcmp(slot->dirent->name, dirent->name, len))
+			return slot;
+	}
+}
+
+/*
+ * A directory block can't hold more entries than the set was created
+ * for, but a set which is used for something bigger just gets slower
+ * rather than wrong.
+ */
+static void dirent_set_grow(dirent_set_t set)
+{
+	struct dirent_set_struct old = *set;
+	struct dirent_set_slot	*slot;
+	__u32			i;
+
+	if (dirent_set_alloc(set, 2 * (old.mask + 1))) {
+		*set = old;
+		return;
+	}
+	for (i = 0; i <= old.mask; i++) {
+		if (old.slots[i].gen != old.gen)
+			continue;
+		slot = dirent_set_find(set, old.slots[i].dirent,
+				ext2fs_dirent_name_len(old.slots[i].dirent),
+				old.slots[i].hash);
+		*slot = old.slots[i];
+		slot->gen = set->gen;
+		set->count++;
+	}
+	free(old.slots);
+}
+
+/*
+ * Add a directory entry to the set.  Returns 1 (and leaves the set
+ * alone) if an entry with the same name is already there.
+ */
+int dirent_set_insert(dirent_set_t set, struct ext2_dir_entry *dirent)
+{
+	struct dirent_set_slot	*slot;
+	int			len = ext2fs_dirent_name_len(dirent);
+	__u32			hash = dirent_set_hash(dirent, len);
+
+	slot = dirent_set_find(set, dirent, len, hash);
+	if (slot->gen == set->gen)
+		return 1;
+	if (2 * set->count >= set->mask) {
+		dirent_set_grow(set);
+		/* Always leave a free slot to end the search */
+		if (set->count >= set->mask)
+			return 0;
+		slot = dirent_set_find(set, dirent, len, hash);
+	}
+	slot->dirent = dirent;
+	slot->hash = hash;
+	slot->gen = set->gen;
+	set->count++;
+	return 0;
+}
+
+#ifdef TEST_PROGRAM
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include "support/dict.h"
+
+/*
+ * Check the set against a plain quadratic search over synthetic
+ * directory blocks, or with -b, time it against the dict-based check
+ * which pass 2 used to do.
+ */
+#define TST_BLOCKSIZE	4096
+
+static unsigned int tst_seed = 1;
+
+static unsigned int tst_random(void)
+{
+	tst_seed = tst_seed * 1103515245 + 12345;
+	return (tst_seed >> 16) & 0x7fff;
+}
+
+/* Fill a block with short names drawn from a small alphabet. */
+static int fill_block(char *buf, int name_max)
+{
+	struct ext2_dir_entry *dirent;
+	unsigned int	offset = 0, rec_len;
+	int		i, len, n = 0;
+
+	while (offset + EXT2_DIR_REC_LEN(name_max) <= TST_BLOCKSIZE) {
+		dirent = (struct ext2_dir_entry *) (buf + offset);
+		len = 1 + tst_random() % name_max;
+		for (i = 0; i < len; i++)
+			dirent->name[i] = 'a' + tst_random() % 4;
+		dirent->inode = 12 + n;
+		dirent->name_len = len;
+		rec_len = EXT2_DIR_REC_LEN(len);
+		dirent->rec_len = rec_len;
+		offset += rec_len;
+		n++;
+	}
+	return n;
+}
+
+static struct ext2_dir_entry *tst_dirent(char *buf, int i)
+{
+	unsigned int offset = 0;
+
+	while (i--)
+		offset += ((struct ext2_dir_entry *) (buf + offset))->rec_len;
+	return (struct ext2_dir_entry *) (buf + offset);
+}
+
+static int slow_dup(char *buf, int i)
+{
+	struct ext2_dir_entry *a = tst_dirent(buf, i), *b;
+	int j;
+
+	for (j = 0; j < i; j++) {
+		b = tst_dirent(buf, j);
+		if (ext2fs_dirent_name_len(a) == ext2fs_dirent_name_len(b) &&
+		    !memcmp(a->name, b->name, ext2fs_dirent_name_len(a)))
+			return 1;
+	}
+	return 0;
+}
+
+static int dict_de_cmp(const void *a, const void *b)
+{
+	const struct ext2_dir_entry *de_a = a, *de_b = b;
+	int	a_len = ext2fs_dirent_name_len(de_a);
+	int	b_len = ext2fs_dirent_name_len(de_b);
+
+	if (a_len != b_len)
+		return (a_len - b_len);
+	return memcmp(de_a->name, de_b->name, a_len);
+}
+
+static double tst_time(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void benchmark(dirent_set_t set, int nr_blocks)
+{
+	struct ext2_dir_entry *dirent;
+	char		*bufs;
+	int		*counts, b, i, dups;
+	unsigned int	offset;
+	unsigned long	entries = 0;
+	double		start, t_dict, t_set;
+	dict_t		de_dict;
+
+	bufs = malloc((size_t) nr_blocks * TST_BLOCKSIZE);
+	counts = malloc(nr_blocks * sizeof(int));
+	if (!bufs || !counts) {
+		fprintf(stderr, "Couldn't allocate test blocks\n");
+		exit(1);
+	}
+	for (b = 0; b < nr_blocks; b++) {
+		counts[b] = fill_block(bufs + (size_t) b * TST_BLOCKSIZE, 24);
+		entries += counts[b];
+	}
+
+	dups = 0;
+	start = tst_time();
+	for (b = 0; b < nr_blocks; b++) {
+		dict_init(&de_dict, DICTCOUNT_T_MAX, dict_de_cmp);
+		for (i = 0, offset = 0; i < counts[b]; i++) {
+			dirent = (struct ext2_dir_entry *)
+				(bufs + (size_t) b * TST_BLOCKSIZE + offset);
+			if (dict_lookup(&de_dict, dirent))
+				dups++;
+			else
+				dict_alloc_insert(&de_dict, dirent, dirent);
+			offset += dirent->rec_len;
+		}
+		dict_free_nodes(&de_dict);
+	}
+	t_dict = tst_time() - start;
+	printf("dict:       %8.3f s %8.1f ns/entry (%d dups)\n", t_dict,
+	       t_dict * 1e9 / entries, dups);
+
+	dups = 0;
+	start = tst_time();
+	for (b = 0; b < nr_blocks; b++) {
+		dirent_set_clear(set);
+		for (i = 0, offset = 0; i < counts[b]; i++) {
+			dirent = (struct ext2_dir_entry *)
+				(bufs + (size_t) b * TST_BLOCKSIZE + offset);
+			dups += dirent_set_insert(set, dirent);
+			offset += dirent->rec_len;
+		}
+	}
+	t_set = tst_time() - start;
+	printf("dirent_set: %8.3f s %8.1f ns/entry (%d dups)\n", t_set,
+	       t_set * 1e9 / entries, dups);
+
+	free(bufs);
+	free(counts);
+}
+
+int main(int argc, char **argv)
+{
+	char		buf[TST_BLOCKSIZE];
+	dirent_set_t	set;
+	int		b, i, n, dup;
+
+	set = dirent_set_create(TST_BLOCKSIZE / EXT2_DIR_REC_LEN(1) + 1);
+	if (!set) {
+		fprintf(stderr, "Couldn't create dirent set\n");
+		exit(1);
+	}
+
+	if (argc > 1 && !strcmp(argv[1], "-b")) {
+		benchmark(set, argc > 2 ? atoi(argv[2]) : 100000);
+		dirent_set_free(set);
+		return 0;
+	}
+
+	for (b = 0; b < 2000; b++) {
+		dirent_set_clear(set);
+		n = fill_block(buf, 1 + b % 6);
+		for (i = 0; i < n; i++) {
+			dup = dirent_set_insert(set, tst_dirent(buf, i));
+			if (dup != slow_dup(buf, i)) {
+				printf("Block %d entry %d: dirent_set says %d\n",
+				       b, i, dup);
+				exit(1);
+			}
+		}
+	}
+
+	/* A set can be used for more entries than it was sized for */
+	dirent_set_free(set);
+	set = dirent_set_create(1);
+	dirent_set_clear(set);
+	n = fill_block(buf, 3);
+	for (i = 0; i < n; i++) {
+		dup = dirent_set_insert(set, tst_dirent(buf, i));
+		if (dup != slow_dup(buf, i)) {
+			printf("Small set entry %d: dirent_set says %d\n",
+			       i, dup);
+			exit(1);
+		}
+	}
+	dirent_set_free(set);
+	printf("dirent_set tests passed\n");
+	return 0;
+}
+#endif /* TEST_PROGRAM */
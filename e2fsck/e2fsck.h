@@ -427,6 +427,9 @@ struct extent_tree_info {
 typedef __u64 region_addr_t;
 typedef struct region_struct *region_t;
 
+/* Used by pass 2 to find duplicate names in a directory block */
+typedef struct dirent_set_struct *dirent_set_t;
+
 #ifndef HAVE_STRNLEN
 #define strnlen(str, x) e2fsck_strnlen((str),(x))
 extern int e2fsck_strnlen(const char * s, int count);
@@ -454,6 +457,12 @@ extern int e2fsck_run(e2fsck_t ctx);
 extern void read_bad_blocks_file(e2fsck_t ctx, const char *bad_blocks_file,
 				 int replace_bad_blocks);
 
+/* dirent_set.c */
+extern dirent_set_t dirent_set_create(unsigned int max_entries);
+extern void dirent_set_free(dirent_set_t set);
+extern void dirent_set_clear(dirent_set_t set);
+extern int dirent_set_insert(dirent_set_t set, struct ext2_dir_entry *dirent);
+
 /* dirinfo.c */
 extern void e2fsck_add_dir_info(e2fsck_t ctx, ext2_ino_t ino, ext2_ino_t parent);
 extern void e2fsck_free_dir_info(e2fsck_t ctx);
@@ -569,6 +578,8 @@ errcode_t e2fsck_readahead_dblist(ext2_filsys fs, int flags,
 				  ext2_dblist dblist,
 				  unsigned long long start,
 				  unsigned long long count);
+errcode_t e2fsck_readahead_dir(ext2_filsys fs, ext2_ino_t ino,
+			       blk64_t max_blocks);
 int e2fsck_can_readahead(ext2_filsys fs);
 unsigned long long e2fsck_guess_readahead(ext2_filsys fs);
 
@@ -1251,7 +1251,7 @@ void e2fsck_pass1(e2fsck_t ctx)
 		return;
 	}
 	pctx.errcode = e2fsck_allocate_subcluster_bitmap(fs,
-			_("in-use block map"), EXT2FS_BMAP64_RBTREE,
+			_("in-use block map"), EXT2FS_BMAP64_HYBRID,
 			"block_found_map", &ctx->block_found_map);
 	if (pctx.errcode) {
 		pctx.num = 1;
@@ -2268,7 +2268,7 @@ static _INLINE_ void mark_block_used(e2fsck_t ctx, blk64_t block)
 		if (!ctx->block_dup_map) {
 			pctx.errcode = e2fsck_allocate_block_bitmap(ctx->fs,
 					_("multiply claimed block map"),
-					EXT2FS_BMAP64_RBTREE, "block_dup_map",
+					EXT2FS_BMAP64_HYBRID, "block_dup_map",
 					&ctx->block_dup_map);
 			if (pctx.errcode) {
 				pctx.num = 3;
@@ -2393,7 +2393,7 @@ static int check_ext_attr(e2fsck_t ctx, struct problem_context *pctx,
 	if (!ctx->block_ea_map) {
 		pctx->errcode = e2fsck_allocate_block_bitmap(fs,
 					_("ext attr block map"),
-					EXT2FS_BMAP64_RBTREE, "block_ea_map",
+					EXT2FS_BMAP64_HYBRID, "block_ea_map",
 					&ctx->block_ea_map);
 		if (pctx->errcode) {
 			pctx->num = 2;
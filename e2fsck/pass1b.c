@@ -285,6 +285,98 @@ struct process_block_struct {
 	struct problem_context *pctx;
 };
 
+/*
+ * Most blocks of a file aren't multiply-claimed, so rather than hand
+ * every block of an extent-mapped file to process_pass1b_block() the
+ * way ext2fs_block_iterate3() would, look each extent up in
+ * block_dup_map and only visit the blocks which are set there.  The
+ * logical and physical cluster of the last block skipped are carried
+ * over, so process_pass1b_block() sees the same state as it would have
+ * after being called for every block.
+ */
+static void pass1b_scan_range(ext2_filsys fs, struct process_block_struct *pb,
+			      blk64_t blk, e2_blkcnt_t blockcnt, blk64_t len)
+{
+	blk64_t	end = blk + len, dup, b;
+
+	if (blk == 0 || blk < fs->super->s_first_data_block ||
+	    end > ext2fs_blocks_count(fs->super) || end < blk) {
+		/* Let process_pass1b_block() sort out the bad blocks */
+		for (; len; len--, blk++, blockcnt++) {
+			b = blk;
+			process_pass1b_block(fs, &b, blockcnt, 0, 0, pb);
+		}
+		return;
+	}
+
+	while (blk < end) {
+		if (ext2fs_find_first_set_block_bitmap2(pb->ctx->block_dup_map,
+							blk, end - 1, &dup))
+			dup = end;
+		else if (dup < blk)
+			dup = blk;	/* in the same cluster */
+		if (dup > blk) {
+			pb->cur_cluster = EXT2FS_B2C(fs, blockcnt + (dup - blk) - 1);
+			pb->phys_cluster = EXT2FS_B2C(fs, dup - 1);
+			blockcnt += dup - blk;
+			blk = dup;
+			if (blk == end)
+				break;
+		}
+		b = blk;
+		process_pass1b_block(fs, &b, blockcnt, 0, 0, pb);
+		blk++;
+		blockcnt++;
+	}
+}
+
+/*
+ * Walk the extent tree in the same order as ext2fs_block_iterate3(),
+ * passing interior tree blocks to process_pass1b_block() and leaf
+ * extents to pass1b_scan_range().
+ */
+static errcode_t pass1b_scan_extents(e2fsck_t ctx, ext2_ino_t ino,
+				     struct process_block_struct *pb)
+{
+	ext2_filsys		fs = ctx->fs;
+	ext2_extent_handle_t	handle;
+	struct ext2fs_extent	extent;
+	e2_blkcnt_t		blockcnt = 0;
+	blk64_t			blk;
+	int			op = EXT2_EXTENT_ROOT;
+	errcode_t		retval;
+
+	retval = ext2fs_extent_open2(fs, ino, EXT2_INODE(pb->inode), &handle);
+	if (retval)
+		return retval;
+
+	while (1) {
+		retval = ext2fs_extent_get(handle, op, &extent);
+		if (retval) {
+			if (retval == EXT2_ET_EXTENT_NO_NEXT)
+				retval = 0;
+			break;
+		}
+		op = EXT2_EXTENT_NEXT;
+		blk = extent.e_pblk;
+		if (!(extent.e_flags & EXT2_EXTENT_FLAGS_LEAF)) {
+			if (!(extent.e_flags & EXT2_EXTENT_FLAGS_SECOND_VISIT))
+				process_pass1b_block(fs, &blk, -1, 0, 0, pb);
+			continue;
+		}
+		if (extent.e_lblk + extent.e_len <= (blk64_t) blockcnt)
+			continue;
+		if (extent.e_lblk > (blk64_t) blockcnt)
+			blockcnt = extent.e_lblk;
+		blk += blockcnt - extent.e_lblk;
+		pass1b_scan_range(fs, pb, blk, extent.e_lblk, extent.e_len);
+		blockcnt = extent.e_lblk + extent.e_len;
+	}
+
+	ext2fs_extent_free(handle);
+	return retval;
+}
+
 static void pass1b(e2fsck_t ctx, char *block_buf)
 {
 	ext2_filsys fs = ctx->fs;
@@ -340,8 +432,12 @@ static void pass1b(e2fsck_t ctx, char *block_buf)
 		pb.last_blk = 0;
 		pb.pctx->blk = pb.pctx->blk2 = 0;
 
-		if (ext2fs_inode_has_valid_blocks2(fs, EXT2_INODE(&inode)) ||
-		    (ino == EXT2_BAD_INO))
+		if (ext2fs_inode_has_valid_blocks2(fs, EXT2_INODE(&inode)) &&
+		    (inode.i_flags & EXT4_EXTENTS_FL))
+			pctx.errcode = pass1b_scan_extents(ctx, ino, &pb);
+		else if (ext2fs_inode_has_valid_blocks2(fs,
+							EXT2_INODE(&inode)) ||
+			 (ino == EXT2_BAD_INO))
 			pctx.errcode = ext2fs_block_iterate3(fs, ino,
 					     BLOCK_FLAG_READ_ONLY, block_buf,
 					     process_pass1b_block, &pb);
@@ -435,6 +531,10 @@ struct search_dir_struct {
 	int		count;
 	ext2_ino_t	first_inode;
 	ext2_ino_t	max_inode;
+	char		*buf;
+	unsigned long long list_offset;
+	unsigned long long ra_entries;
+	unsigned long long next_ra_off;
 };
 
 static int search_dirent_proc(ext2_ino_t dir, int entry,
@@ -470,6 +570,69 @@ static int search_dirent_proc(ext2_ino_t dir, int entry,
 	return(sd->count ? 0 : DIRENT_ABORT);
 }
 
+/*
+ * Look through one block of the directory block list, the way pass 2
+ * does: the blocks are visited in disk order, with readahead kept a
+ * little in front of the current position.  The entries are handed to
+ * search_dirent_proc() just as ext2fs_dblist_dir_iterate() would.
+ */
+static int search_dir_block(ext2_filsys fs, struct ext2_db_entry2 *db,
+			    void *priv_data)
+{
+	struct search_dir_struct *sd = priv_data;
+	struct ext2_dir_entry *dirent;
+	struct ext2_inode	inode;
+	unsigned int		offset = 0, rec_len;
+	int			entry, ret;
+	errcode_t		err;
+
+	if (sd->ra_entries && sd->list_offset >= sd->next_ra_off) {
+		err = e2fsck_readahead_dblist(fs,
+					E2FSCK_RA_DBLIST_IGNORE_BLOCKCNT,
+					fs->dblist,
+					sd->list_offset + sd->ra_entries / 8,
+					sd->ra_entries);
+		if (err)
+			sd->ra_entries = 0;
+		sd->next_ra_off = sd->list_offset + (sd->ra_entries * 7 / 8);
+	}
+	sd->list_offset++;
+
+	if (db->blockcnt < 0)
+		return 0;
+	if (db->blk == 0 &&
+	    ext2fs_read_inode(fs, db->ino, &inode) == 0 &&
+	    (inode.i_flags & EXT4_INLINE_DATA_FL)) {
+		ext2fs_dir_iterate2(fs, db->ino, 0, sd->buf,
+				    search_dirent_proc, sd);
+		return sd->count ? 0 : DBLIST_ABORT;
+	}
+
+	if (ext2fs_read_dir_block4(fs, db->blk, sd->buf, 0, db->ino))
+		return 0;
+
+	entry = db->blockcnt ? DIRENT_OTHER_FILE : DIRENT_DOT_FILE;
+	while (offset < fs->blocksize - 8) {
+		dirent = (struct ext2_dir_entry *) (sd->buf + offset);
+		if (ext2fs_get_rec_len(fs, dirent, &rec_len) ||
+		    offset + rec_len > fs->blocksize || rec_len < 8 ||
+		    (rec_len % 4) != 0 ||
+		    ext2fs_dirent_name_len(dirent) + 8 > (int) rec_len)
+			return 0;
+		if (dirent->inode) {
+			ret = search_dirent_proc(db->ino, entry, dirent,
+						 offset, fs->blocksize,
+						 sd->buf, sd);
+			if (entry < DIRENT_OTHER_FILE)
+				entry++;
+			if (ret & DIRENT_ABORT)
+				return DBLIST_ABORT;
+		}
+		offset += rec_len;
+	}
+	return 0;
+}
+
 
 static void pass1c(e2fsck_t ctx, char *block_buf)
 {
@@ -489,8 +652,11 @@ static void pass1c(e2fsck_t ctx, char *block_buf)
 	sd.count = dup_inode_count - dup_inode_founddir;
 	sd.first_inode = EXT2_FIRST_INODE(fs->super);
 	sd.max_inode = fs->super->s_inodes_count;
-	ext2fs_dblist_dir_iterate(fs->dblist, 0, block_buf,
-				  search_dirent_proc, &sd);
+	sd.buf = block_buf;
+	sd.list_offset = 0;
+	sd.ra_entries = ctx->readahead_kb * 1024 / fs->blocksize;
+	sd.next_ra_off = 0;
+	ext2fs_dblist_iterate2(fs->dblist, search_dir_block, &sd);
 }
 
 static void pass1d(e2fsck_t ctx, char *block_buf)
@@ -749,6 +915,13 @@ static void delete_file(e2fsck_t ctx, ext2_ino_t ino,
 	}
 }
 
+/*
+ * clone_file() copies file data in runs of up to CLONE_RUN_SIZE bytes
+ * which are contiguous both where they are read from and where they
+ * are written to, rather than a block at a time.
+ */
+#define CLONE_RUN_SIZE	(1024 * 1024)
+
 struct clone_struct {
 	errcode_t	errcode;
 	blk64_t		dup_cluster;
@@ -757,11 +930,58 @@ struct clone_struct {
 	char	*buf;
 	e2fsck_t ctx;
 	struct ext2_inode_large	*inode;
+	int		should_write;
 
 	struct dup_cluster *save_dup_cluster;
 	blk64_t save_blocknr;
+
+	blk64_t		run_src, run_dst;
+	unsigned int	run_len, run_max;
 };
 
+static errcode_t clone_flush_run(ext2_filsys fs, struct clone_struct *cs)
+{
+	errcode_t	retval;
+
+	if (!cs->run_len)
+		return 0;
+	retval = io_channel_read_blk64(fs->io, cs->run_src, cs->run_len,
+				       cs->buf);
+	if (!retval && cs->should_write)
+		retval = io_channel_write_blk64(fs->io, cs->run_dst,
+						cs->run_len, cs->buf);
+	cs->run_len = 0;
+	return retval;
+}
+
+/*
+ * Queue the copy of one block.  Tree and EA blocks (blockcnt < 0) are
+ * copied straight away, since the library may read them from their new
+ * location as soon as we return.
+ */
+static errcode_t clone_copy_block(ext2_filsys fs, struct clone_struct *cs,
+				  blk64_t src, blk64_t dst,
+				  e2_blkcnt_t blockcnt)
+{
+	errcode_t	retval;
+
+	if (cs->run_len && cs->run_len < cs->run_max &&
+	    src == cs->run_src + cs->run_len &&
+	    dst == cs->run_dst + cs->run_len) {
+		cs->run_len++;
+	} else {
+		retval = clone_flush_run(fs, cs);
+		if (retval)
+			return retval;
+		cs->run_src = src;
+		cs->run_dst = dst;
+		cs->run_len = 1;
+	}
+	if (blockcnt < 0)
+		return clone_flush_run(fs, cs);
+	return 0;
+}
+
 /*
  * Decrement the bad count *after* we've shown that (a) we can allocate a
  * replacement block and (b) remap the file blocks.  Unfortunately, there's no
@@ -796,7 +1016,6 @@ static int clone_file_block(ext2_filsys fs,
 	e2fsck_t ctx;
 	blk64_t c;
 	int is_meta = 0;
-	int should_write = 1;
 
 	ctx = cs->ctx;
 	deferred_dec_badcount(cs);
@@ -804,11 +1023,6 @@ static int clone_file_block(ext2_filsys fs,
 	if (*block_nr == 0)
 		return 0;
 
-	if (ext2fs_has_feature_shared_blocks(ctx->fs->super) &&
-	    (ctx->options & E2F_OPT_UNSHARE_BLOCKS) &&
-	    (ctx->options & E2F_OPT_NO))
-		should_write = 0;
-
 	c = EXT2FS_B2C(fs, blockcnt);
 	if (check_if_fs_cluster(ctx, EXT2FS_B2C(fs, *block_nr)))
 		is_meta = 1;
@@ -876,25 +1090,19 @@ cluster_alloc_ok:
  		printf("Cloning block #%lld from %llu to %llu\n",
 		       blockcnt, *block_nr, new_block);
 #endif
-		retval = io_channel_read_blk64(fs->io, *block_nr, 1, cs->buf);
+		retval = clone_copy_block(fs, cs, *block_nr, new_block,
+					  blockcnt);
 		if (retval) {
 			cs->errcode = retval;
 			return BLOCK_ABORT;
 		}
-		if (should_write) {
-			retval = io_channel_write_blk64(fs->io, new_block, 1, cs->buf);
-			if (retval) {
-				cs->errcode = retval;
-				return BLOCK_ABORT;
-			}
-		}
 		cs->save_dup_cluster = (is_meta ? NULL : p);
 		cs->save_blocknr = *block_nr;
 		*block_nr = new_block;
 		ext2fs_mark_block_bitmap2(ctx->block_found_map, new_block);
 		ext2fs_mark_block_bitmap2(fs->block_map, new_block);
 
-		if (!should_write) {
+		if (!cs->should_write) {
 			/* Don't try to change extent information; we want e2fsck to
 			 * return success.
 			 */
@@ -928,7 +1136,14 @@ static errcode_t clone_file(e2fsck_t ctx, ext2_ino_t ino,
 	cs.inode = &dp->inode;
 	cs.save_dup_cluster = NULL;
 	cs.save_blocknr = 0;
-	retval = ext2fs_get_mem(fs->blocksize, &cs.buf);
+	cs.should_write = 1;
+	if (ext2fs_has_feature_shared_blocks(ctx->fs->super) &&
+	    (ctx->options & E2F_OPT_UNSHARE_BLOCKS) &&
+	    (ctx->options & E2F_OPT_NO))
+		cs.should_write = 0;
+	cs.run_len = 0;
+	cs.run_max = CLONE_RUN_SIZE / fs->blocksize;
+	retval = ext2fs_get_array(cs.run_max, fs->blocksize, &cs.buf);
 	if (retval)
 		return retval;
 
@@ -940,6 +1155,9 @@ static errcode_t clone_file(e2fsck_t ctx, ext2_ino_t ino,
 	if (ext2fs_inode_has_valid_blocks2(fs, EXT2_INODE(&dp->inode)))
 		pctx.errcode = ext2fs_block_iterate3(fs, ino, 0, block_buf,
 						     clone_file_block, &cs);
+	retval = clone_flush_run(fs, &cs);
+	if (retval && !cs.errcode)
+		cs.errcode = retval;
 	deferred_dec_badcount(&cs);
 	ext2fs_mark_bb_dirty(fs);
 	if (pctx.errcode) {
@@ -47,7 +47,6 @@
 
 #include "e2fsck.h"
 #include "problem.h"
-#include "support/dict.h"
 
 #ifdef NO_INLINE_FUNCS
 #define _INLINE_
@@ -75,6 +74,30 @@ static int htree_depth(struct dx_dir_info *dx_dir,
 		       struct dx_dirblock_info *dx_db);
 static EXT2_QSORT_TYPE special_dir_block_cmp(const void *a, const void *b);
 
+/*
+ * Directory blocks are read a batch at a time ahead of check_dir_block(),
+ * with each run of adjacent blocks fetched by a single read and the
+ * checksums verified as the batch comes in.  check_dir_block() then only
+ * copies its block out of the batch, and still makes every decision (and
+ * reports every problem) in dblist order.  Blocks which could not be read
+ * in the batch are read again by check_dir_block(), so that read errors
+ * are reported as before.
+ */
+#define DIRBLOCK_BATCH_SIZE	(1024 * 1024)
+
+#define DIRBLOCK_UNREAD		0
+#define DIRBLOCK_READ		1
+#define DIRBLOCK_BAD_CSUM	2
+
+struct dirblock_batch {
+	char		*buf;
+	blk64_t		*blk;
+	ext2_ino_t	*ino;
+	char		*state;
+	unsigned int	max, count;
+	unsigned long long first;	/* dblist offset of blk[0] */
+};
+
 struct check_dir_struct {
 	char *buf;
 	struct problem_context	pctx;
@@ -83,6 +106,8 @@ struct check_dir_struct {
 	unsigned long long list_offset;
 	unsigned long long ra_entries;
 	unsigned long long next_ra_off;
+	struct dirblock_batch batch;
+	dirent_set_t names;
 };
 
 static void update_parents(struct dx_dir_info *dx_dir, int type)
@@ -134,12 +159,11 @@ void e2fsck_pass2(e2fsck_t ctx)
 	int			i, depth;
 	problem_t		code;
 	int			bad_dir;
-	int (*check_dir_func)(ext2_filsys fs,
-			      struct ext2_db_entry2 *dir_blocks_info,
-			      void *priv_data);
 
 	init_resource_track(&rtrack, ctx->fs->io);
 	clear_problem_context(&cd.pctx);
+	memset(&cd.batch, 0, sizeof(cd.batch));
+	cd.names = NULL;
 
 #ifdef MTRACE
 	mtrace_print("Pass 2");
@@ -173,6 +197,25 @@ void e2fsck_pass2(e2fsck_t ctx)
 	cd.list_offset = 0;
 	cd.ra_entries = ctx->readahead_kb * 1024 / ctx->fs->blocksize;
 	cd.next_ra_off = 0;
+	cd.batch.max = DIRBLOCK_BATCH_SIZE / fs->blocksize;
+	cd.batch.buf = (char *) e2fsck_allocate_memory(ctx,
+			(size_t) cd.batch.max * fs->blocksize,
+			"directory block batch");
+	cd.batch.blk = (blk64_t *) e2fsck_allocate_memory(ctx,
+			cd.batch.max * sizeof(blk64_t),
+			"directory block batch list");
+	cd.batch.ino = (ext2_ino_t *) e2fsck_allocate_memory(ctx,
+			cd.batch.max * sizeof(ext2_ino_t),
+			"directory block batch inodes");
+	cd.batch.state = (char *) e2fsck_allocate_memory(ctx, cd.batch.max,
+			"directory block batch state");
+	cd.names = dirent_set_create(fs->blocksize / EXT2_DIR_REC_LEN(1) + 1);
+	if (!cd.names) {
+		cd.pctx.errcode = EXT2_ET_NO_MEMORY;
+		fix_problem(ctx, PR_2_ALLOCATE_DIRENT_SET, &cd.pctx);
+		ctx->flags |= E2F_FLAG_ABORT;
+		goto cleanup;
+	}
 
 	if (ctx->progress)
 		(void) (ctx->progress)(ctx, 2, 0, cd.max);
@@ -180,8 +223,7 @@ void e2fsck_pass2(e2fsck_t ctx)
 	if (ext2fs_has_feature_dir_index(fs->super))
 		ext2fs_dblist_sort2(fs->dblist, special_dir_block_cmp);
 
-	check_dir_func = cd.ra_entries ? check_dir_block2 : check_dir_block;
-	cd.pctx.errcode = ext2fs_dblist_iterate2(fs->dblist, check_dir_func,
+	cd.pctx.errcode = ext2fs_dblist_iterate2(fs->dblist, check_dir_block2,
 						 &cd);
 	if (ctx->flags & E2F_FLAG_RESTART_LATER) {
 		ctx->flags |= E2F_FLAG_RESTART;
@@ -307,6 +349,12 @@ void e2fsck_pass2(e2fsck_t ctx)
 	print_resource_track(ctx, _("Pass 2"), &rtrack, fs->io);
 cleanup:
 	ext2fs_free_mem(&buf);
+	ext2fs_free_mem(&cd.batch.buf);
+	ext2fs_free_mem(&cd.batch.blk);
+	ext2fs_free_mem(&cd.batch.ino);
+	ext2fs_free_mem(&cd.batch.state);
+	if (cd.names)
+		dirent_set_free(cd.names);
 }
 
 #define MAX_DEPTH 32000
@@ -322,22 +370,6 @@ static int htree_depth(struct dx_dir_info *dx_dir,
 	return depth;
 }
 
-static int dict_de_cmp(const void *a, const void *b)
-{
-	const struct ext2_dir_entry *de_a, *de_b;
-	int	a_len, b_len;
-
-	de_a = (const struct ext2_dir_entry *) a;
-	a_len = ext2fs_dirent_name_len(de_a);
-	de_b = (const struct ext2_dir_entry *) b;
-	b_len = ext2fs_dirent_name_len(de_b);
-
-	if (a_len != b_len)
-		return (a_len - b_len);
-
-	return memcmp(de_a->name, de_b->name, a_len);
-}
-
 /*
  * This is special sort function that makes sure that directory blocks
  * with a dirblock of zero are sorted to the beginning of the list.
@@ -877,6 +909,105 @@ err:
 	return retval;
 }
 
+static int batch_dir_block(ext2_filsys fs EXT2FS_ATTR((unused)),
+			   struct ext2_db_entry2 *db,
+			   void *priv_data)
+{
+	struct check_dir_struct *cd = priv_data;
+	struct dirblock_batch *batch = &cd->batch;
+	unsigned int i = batch->count++;
+
+	batch->blk[i] = 0;
+	batch->ino[i] = db->ino;
+	batch->state[i] = DIRBLOCK_UNREAD;
+	/* Holes and inline directories are left to check_dir_block() */
+	if (db->blk &&
+	    ext2fs_test_inode_bitmap2(cd->ctx->inode_used_map, db->ino))
+		batch->blk[i] = db->blk;
+	return 0;
+}
+
+/*
+ * Read in the directory blocks starting at the current dblist offset.
+ */
+static void fill_dirblock_batch(ext2_filsys fs, struct check_dir_struct *cd)
+{
+	struct dirblock_batch *batch = &cd->batch;
+	errcode_t	(*read_error)(io_channel channel, unsigned long block,
+				      int count, void *data, size_t size,
+				      int actual, errcode_t error);
+	unsigned int	i, j, k;
+	char		*block;
+
+	batch->first = cd->list_offset;
+	batch->count = 0;
+	if (ext2fs_dblist_iterate3(fs->dblist, batch_dir_block, batch->first,
+				   batch->max, cd)) {
+		batch->count = 0;
+		return;
+	}
+
+	/* Leave reporting read errors to check_dir_block() */
+	read_error = fs->io->read_error;
+	fs->io->read_error = 0;
+	for (i = 0; i < batch->count; i = j) {
+		for (j = i + 1; j < batch->count && batch->blk[i] &&
+		     batch->blk[j] == batch->blk[j - 1] + 1; j++)
+			;
+		if (!batch->blk[i])
+			continue;
+		block = batch->buf + (size_t) i * fs->blocksize;
+		if (io_channel_read_blk64(fs->io, batch->blk[i], j - i, block))
+			continue;
+		for (k = i; k < j; k++, block += fs->blocksize) {
+			if (ext2fs_dir_block_csum_verify(fs, batch->ino[k],
+					(struct ext2_dir_entry *) block))
+				batch->state[k] = DIRBLOCK_READ;
+			else
+				batch->state[k] = DIRBLOCK_BAD_CSUM;
+		}
+	}
+	fs->io->read_error = read_error;
+}
+
+/*
+ * Drop any batched copy of a directory block which is being rewritten.
+ */
+static void forget_dir_block(struct check_dir_struct *cd, blk64_t blk)
+{
+	struct dirblock_batch *batch = &cd->batch;
+	unsigned int i;
+
+	for (i = 0; i < batch->count; i++)
+		if (batch->blk[i] == blk)
+			batch->state[i] = DIRBLOCK_UNREAD;
+}
+
+/*
+ * Like ext2fs_read_dir_block4(), but takes the block from the batch if
+ * it is there.
+ */
+static errcode_t read_dir_block(ext2_filsys fs, struct check_dir_struct *cd,
+				blk64_t blk, char *buf, ext2_ino_t ino)
+{
+	struct dirblock_batch *batch = &cd->batch;
+	unsigned long long i = cd->list_offset - batch->first;
+	errcode_t retval = 0;
+
+	if (cd->list_offset < batch->first || i >= batch->count ||
+	    batch->blk[i] != blk || batch->state[i] == DIRBLOCK_UNREAD)
+		return ext2fs_read_dir_block4(fs, blk, buf, 0, ino);
+
+	memcpy(buf, batch->buf + i * fs->blocksize, fs->blocksize);
+#ifdef WORDS_BIGENDIAN
+	retval = ext2fs_dirent_swab_in(fs, buf, 0);
+#endif
+	if (!retval && batch->state[i] == DIRBLOCK_BAD_CSUM &&
+	    !(fs->flags & EXT2_FLAG_IGNORE_CSUM_ERRORS))
+		retval = EXT2_ET_DIR_CSUM_INVALID;
+	return retval;
+}
+
 static int check_dir_block2(ext2_filsys fs,
 			   struct ext2_db_entry2 *db,
 			   void *priv_data)
@@ -884,6 +1015,9 @@ static int check_dir_block2(ext2_filsys fs,
 	int err;
 	struct check_dir_struct *cd = priv_data;
 
+	if (cd->list_offset >= cd->batch.first + cd->batch.count)
+		fill_dirblock_batch(fs, cd);
+
 	if (cd->ra_entries && cd->list_offset >= cd->next_ra_off) {
 		err = e2fsck_readahead_dblist(fs,
 					E2FSCK_RA_DBLIST_IGNORE_BLOCKCNT,
@@ -922,7 +1056,6 @@ static int check_dir_block(ext2_filsys fs,
 	problem_t		problem;
 	struct ext2_dx_root_info *root;
 	struct ext2_dx_countlimit *limit;
-	static dict_t de_dict;
 	struct problem_context	pctx;
 	int	dups_found = 0;
 	int	ret;
@@ -987,6 +1120,7 @@ static int check_dir_block(ext2_filsys fs,
 		if (allocate_dir_block(ctx, db, buf, &cd->pctx))
 			return 0;
 		block_nr = db->blk;
+		forget_dir_block(cd, block_nr);
 	}
 
 	if (db->blockcnt)
@@ -1029,8 +1163,7 @@ skip_first_read_swab:
 				0);
 #endif
 	} else
-		cd->pctx.errcode = ext2fs_read_dir_block4(fs, block_nr,
-							  buf, 0, ino);
+		cd->pctx.errcode = read_dir_block(fs, cd, block_nr, buf, ino);
 inline_read_fail:
 	pctx.ino = ino;
 	pctx.num = inline_data_size;
@@ -1152,7 +1285,7 @@ skip_checksum:
 	if (ctx->encrypted_dirs)
 		encrypted = ext2fs_u32_list_test(ctx->encrypted_dirs, ino);
 
-	dict_init(&de_dict, DICTCOUNT_T_MAX, dict_de_cmp);
+	dirent_set_clear(cd->names);
 	prev = 0;
 	do {
 		dgrp_t group;
@@ -1222,7 +1355,7 @@ skip_checksum:
 					dir_modified++;
 					continue;
 				} else
-					goto abort_free_dict;
+					goto abort_dir;
 			}
 		} else {
 			if (dot_state == 0) {
@@ -1254,7 +1387,7 @@ skip_checksum:
 		} else if (dot_state == 1) {
 			ret = check_dotdot(ctx, dirent, ino, &cd->pctx);
 			if (ret < 0)
-				goto abort_free_dict;
+				goto abort_dir;
 			if (ret)
 				dir_modified++;
 		} else if (dirent->inode == ino) {
@@ -1454,7 +1587,7 @@ skip_checksum:
 						       &subdir_parent)) {
 				cd->pctx.ino = dirent->inode;
 				fix_problem(ctx, PR_2_NO_DIRINFO, &cd->pctx);
-				goto abort_free_dict;
+				goto abort_dir;
 			}
 			if (subdir_parent) {
 				cd->pctx.ino2 = subdir_parent;
@@ -1473,15 +1606,14 @@ skip_checksum:
 
 		if (dups_found) {
 			;
-		} else if (dict_lookup(&de_dict, dirent)) {
+		} else if (dirent_set_insert(cd->names, dirent)) {
 			clear_problem_context(&pctx);
 			pctx.ino = ino;
 			pctx.dirent = dirent;
 			fix_problem(ctx, PR_2_REPORT_DUP_DIRENT, &pctx);
 			e2fsck_rehash_dir_later(ctx, ino);
 			dups_found++;
-		} else
-			dict_alloc_insert(&de_dict, dirent, dirent);
+		}
 
 		ext2fs_icount_increment(ctx->inode_count, dirent->inode,
 					&links);
@@ -1576,14 +1708,16 @@ skip_first_write_swab:
 skip_second_write_swab:
 			if (cd->pctx.errcode &&
 			    !fix_problem(ctx, PR_2_WRITE_DIRBLOCK, &cd->pctx))
-				goto abort_free_dict;
+				goto abort_dir;
 #endif
 			cd->pctx.errcode =
 				ext2fs_inline_data_set(fs, ino, 0, buf,
 						       inline_data_size);
-		} else
+		} else {
 			cd->pctx.errcode = ext2fs_write_dir_block4(fs, block_nr,
 								   buf, 0, ino);
+			forget_dir_block(cd, block_nr);
+		}
 		if (will_rehash)
 			ctx->fs->flags = (flags &
 					  EXT2_FLAG_IGNORE_CSUM_ERRORS) |
@@ -1592,7 +1726,7 @@ skip_second_write_swab:
 		if (cd->pctx.errcode) {
 			if (!fix_problem(ctx, PR_2_WRITE_DIRBLOCK,
 					 &cd->pctx))
-				goto abort_free_dict;
+				goto abort_dir;
 		}
 		ext2fs_mark_changed(fs);
 	} else if (is_leaf && failed_csum && !dir_modified) {
@@ -1604,11 +1738,9 @@ skip_second_write_swab:
 				&cd->pctx))
 			goto write_and_fix;
 	}
-	dict_free_nodes(&de_dict);
 	return 0;
-abort_free_dict:
+abort_dir:
 	ctx->flags |= E2F_FLAG_ABORT;
-	dict_free_nodes(&de_dict);
 	return DIRENT_ABORT;
 }
 
@@ -1689,6 +1689,11 @@ static struct e2fsck_problem problem_table[] = {
 	  N_("Encrypted @E is too short.\n"),
 	  PROMPT_CLEAR, 0, 0, 0, 0 },
 
+	/* Error allocating the duplicate name set */
+	{ PR_2_ALLOCATE_DIRENT_SET,
+	  N_("@A @d @e name set: %m\n"),
+	  PROMPT_NONE, PR_FATAL, 0, 0, 0 },
+
 	/* Pass 3 errors */
 
 	/* Pass 3: Checking directory connectivity */
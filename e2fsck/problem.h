@@ -1009,6 +1009,9 @@ struct problem_context {
 /* Encrypted directory entry is too short */
 #define PR_2_BAD_ENCRYPTED_NAME		0x020050
 
+/* Error allocating the duplicate name set */
+#define PR_2_ALLOCATE_DIRENT_SET	0x020051
+
 /*
  * Pass 3 errors
  */
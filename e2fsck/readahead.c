@@ -81,6 +81,68 @@ errcode_t e2fsck_readahead_dblist(ext2_filsys fs, int flags,
 	return err;
 }
 
+struct read_dir {
+	errcode_t err;
+	blk64_t run_start;
+	blk64_t run_len;
+	blk64_t left;
+};
+
+static int readahead_dir_data(ext2_filsys fs, blk64_t *block_nr,
+			      e2_blkcnt_t blockcnt EXT2FS_ATTR((unused)),
+			      blk64_t ref_block EXT2FS_ATTR((unused)),
+			      int ref_offset EXT2FS_ATTR((unused)),
+			      void *priv_data)
+{
+	struct read_dir *pr = priv_data;
+
+	if (!pr->run_len || *block_nr != pr->run_start + pr->run_len) {
+		if (pr->run_len) {
+			pr->err = io_channel_cache_readahead(fs->io,
+							     pr->run_start,
+							     pr->run_len);
+			dbg_printf("readahead start=%llu len=%llu err=%d\n",
+				   pr->run_start, pr->run_len,
+				   (int)pr->err);
+		}
+		pr->run_start = *block_nr;
+		pr->run_len = 0;
+	}
+	pr->run_len++;
+
+	return (pr->err || --pr->left == 0) ? BLOCK_ABORT : 0;
+}
+
+/*
+ * Start reading in up to max_blocks of a directory's blocks.
+ */
+errcode_t e2fsck_readahead_dir(ext2_filsys fs, ext2_ino_t ino,
+			       blk64_t max_blocks)
+{
+	errcode_t err;
+	struct read_dir pr;
+
+	dbg_printf("%s: ino=%u\n", __func__, ino);
+	if (!max_blocks)
+		return 0;
+
+	memset(&pr, 0, sizeof(pr));
+	pr.left = max_blocks;
+	err = ext2fs_block_iterate3(fs, ino,
+				    BLOCK_FLAG_READ_ONLY | BLOCK_FLAG_DATA_ONLY,
+				    0, readahead_dir_data, &pr);
+	if (pr.err)
+		return pr.err;
+	if (err)
+		return err;
+
+	if (pr.run_len)
+		err = io_channel_cache_readahead(fs->io, pr.run_start,
+						 pr.run_len);
+
+	return err;
+}
+
 static errcode_t e2fsck_readahead_bitmap(ext2_filsys fs,
 					 ext2fs_block_bitmap ra_map)
 {
@@ -85,6 +85,9 @@ struct fill_dir_struct {
 	int compress;
 	ino_t parent;
 	ext2_ino_t dir;
+	struct ext2_db_entry2 *blocks;
+	e2_blkcnt_t num_blocks, max_blocks;
+	errcode_t map_err;
 };
 
 struct hash_entry {
@@ -101,44 +104,96 @@ struct out_dir {
 	ext2_dirhash_t	*hashes;
 };
 
-static int fill_dir_block(ext2_filsys fs,
-			  blk64_t *block_nr,
-			  e2_blkcnt_t blockcnt,
-			  blk64_t ref_block EXT2FS_ATTR((unused)),
-			  int ref_offset EXT2FS_ATTR((unused)),
-			  void *priv_data)
+/*
+ * Note where each block of the directory lives.  The blocks are read in
+ * afterwards, a contiguous run at a time, by read_dir_blocks().
+ */
+static int map_dir_block(ext2_filsys fs,
+			 blk64_t *block_nr,
+			 e2_blkcnt_t blockcnt,
+			 blk64_t ref_block EXT2FS_ATTR((unused)),
+			 int ref_offset EXT2FS_ATTR((unused)),
+			 void *priv_data)
 {
 	struct fill_dir_struct	*fd = (struct fill_dir_struct *) priv_data;
-	struct hash_entry 	*new_array, *ent;
-	struct ext2_dir_entry 	*dirent;
-	char			*dir;
-	unsigned int		offset, dir_offset, rec_len, name_len;
-	int			hash_alg, hash_flags;
+	struct ext2_db_entry2	*db;
 
 	if (blockcnt < 0)
 		return 0;
 
-	offset = blockcnt * fs->blocksize;
-	if (offset + fs->blocksize > fd->inode->i_size) {
-		fd->err = EXT2_ET_DIR_CORRUPTED;
+	if ((blockcnt + 1) * (ext2_off64_t) fs->blocksize > fd->inode->i_size) {
+		fd->map_err = EXT2_ET_DIR_CORRUPTED;
 		return BLOCK_ABORT;
 	}
+	if (fd->num_blocks >= fd->max_blocks) {
+		fd->map_err = EXT2_ET_DIR_CORRUPTED;
+		return BLOCK_ABORT;
+	}
+	db = fd->blocks + fd->num_blocks++;
+	db->ino = fd->dir;
+	db->blk = *block_nr;
+	db->blockcnt = blockcnt;
+	return 0;
+}
+
+/*
+ * Read in the run of blocks starting at fd->blocks[i] which are
+ * contiguous both on disk and in the directory, and return its length.
+ * If the run can't be read in one go, read just the first block so that
+ * an error is only reported for a block which is really unreadable.
+ */
+static e2_blkcnt_t read_dir_blocks(ext2_filsys fs, struct fill_dir_struct *fd,
+				   e2_blkcnt_t i)
+{
+	struct ext2_db_entry2	*db = fd->blocks + i;
+	char			*dir = fd->buf + db->blockcnt * fs->blocksize;
+	e2_blkcnt_t		n;
+	int			flags;
 
-	dir = (fd->buf+offset);
-	if (*block_nr == 0) {
+	if (db->blk == 0) {
 		memset(dir, 0, fs->blocksize);
-		dirent = (struct ext2_dir_entry *) dir;
-		(void) ext2fs_set_rec_len(fs, fs->blocksize, dirent);
-	} else {
-		int flags = fs->flags;
-		fs->flags |= EXT2_FLAG_IGNORE_CSUM_ERRORS;
-		fd->err = ext2fs_read_dir_block4(fs, *block_nr, dir, 0,
-						 fd->dir);
-		fs->flags = (flags & EXT2_FLAG_IGNORE_CSUM_ERRORS) |
-			    (fs->flags & ~EXT2_FLAG_IGNORE_CSUM_ERRORS);
-		if (fd->err)
-			return BLOCK_ABORT;
+		(void) ext2fs_set_rec_len(fs, fs->blocksize,
+					  (struct ext2_dir_entry *) dir);
+		return 1;
+	}
+
+	for (n = 1; i + n < fd->num_blocks && db[n].blk &&
+	     db[n].blk == db->blk + n && db[n].blockcnt == db->blockcnt + n;
+	     n++)
+		;
+	if (n > 1 && !io_channel_read_blk64(fs->io, db->blk, n, dir)) {
+#ifdef WORDS_BIGENDIAN
+		e2_blkcnt_t j;
+
+		for (j = 0; j < n; j++) {
+			fd->err = ext2fs_dirent_swab_in(fs,
+					dir + j * fs->blocksize, 0);
+			if (fd->err)
+				return 0;
+		}
+#endif
+		return n;
 	}
+
+	flags = fs->flags;
+	fs->flags |= EXT2_FLAG_IGNORE_CSUM_ERRORS;
+	fd->err = ext2fs_read_dir_block4(fs, db->blk, dir, 0, fd->dir);
+	fs->flags = (flags & EXT2_FLAG_IGNORE_CSUM_ERRORS) |
+		    (fs->flags & ~EXT2_FLAG_IGNORE_CSUM_ERRORS);
+	return 1;
+}
+
+static int fill_dir_block(ext2_filsys fs,
+			  struct ext2_db_entry2 *db,
+			  struct fill_dir_struct *fd)
+{
+	struct hash_entry 	*new_array, *ent;
+	struct ext2_dir_entry 	*dirent;
+	char			*dir;
+	unsigned int		dir_offset, rec_len, name_len;
+	int			hash_alg, hash_flags;
+
+	dir = fd->buf + db->blockcnt * fs->blocksize;
 	hash_flags = fd->inode->i_flags & EXT4_CASEFOLD_FL;
 	hash_alg = fs->super->s_def_hash_version;
 	if ((hash_alg <= EXT2_HASH_TEA) &&
@@ -155,7 +210,7 @@ static int fill_dir_block(ext2_filsys fs,
 		    ((rec_len % 4) != 0) ||
 		    (name_len + 8 > rec_len)) {
 			fd->err = EXT2_ET_DIR_CORRUPTED;
-			return BLOCK_ABORT;
+			return 1;
 		}
 		dir_offset += rec_len;
 		if (dirent->inode == 0)
@@ -173,7 +228,7 @@ static int fill_dir_block(ext2_filsys fs,
 			    sizeof(struct hash_entry) * (fd->max_array+500));
 			if (!new_array) {
 				fd->err = ENOMEM;
-				return BLOCK_ABORT;
+				return 1;
 			}
 			fd->harray = new_array;
 			fd->max_array += 500;
@@ -191,7 +246,7 @@ static int fill_dir_block(ext2_filsys fs,
 						  fs->super->s_hash_seed,
 						  &ent->hash, &ent->minor_hash);
 			if (fd->err)
-				return BLOCK_ABORT;
+				return 1;
 		}
 	}
 
@@ -860,8 +915,9 @@ errcode_t e2fsck_rehash_dir(e2fsck_t ctx, ext2_ino_t ino,
 	struct ext2_inode 	inode;
 	char			*dir_buf = 0;
 	struct fill_dir_struct	fd = { NULL, NULL, 0, 0, 0, NULL,
-				       0, 0, 0, 0, 0, 0 };
+				       0, 0, 0, 0, 0, 0, NULL, 0, 0, 0 };
 	struct out_dir		outdir = { 0, 0, 0, 0 };
+	e2_blkcnt_t		i, num_read = 0;
 
 	e2fsck_read_inode(ctx, ino, &inode, "rehash_dir");
 
@@ -879,6 +935,11 @@ errcode_t e2fsck_rehash_dir(e2fsck_t ctx, ext2_ino_t ino,
 	if (!fd.harray)
 		goto errout;
 
+	fd.max_blocks = inode.i_size / fs->blocksize + 1;
+	fd.blocks = malloc(fd.max_blocks * sizeof(struct ext2_db_entry2));
+	if (!fd.blocks)
+		goto errout;
+
 	fd.ino = ino;
 	fd.ctx = ctx;
 	fd.buf = dir_buf;
@@ -889,10 +950,21 @@ errcode_t e2fsck_rehash_dir(e2fsck_t ctx, ext2_ino_t ino,
 		fd.compress = 1;
 	fd.parent = 0;
 
-retry_nohash:
 	/* Read in the entire directory into memory */
-	retval = ext2fs_block_iterate3(fs, ino, 0, 0,
-				       fill_dir_block, &fd);
+	retval = ext2fs_block_iterate3(fs, ino, 0, 0, map_dir_block, &fd);
+
+retry_nohash:
+	for (i = 0; i < fd.num_blocks; i++) {
+		if (i >= num_read) {
+			num_read = i + read_dir_blocks(fs, &fd, i);
+			if (fd.err)
+				break;
+		}
+		if (fill_dir_block(fs, fd.blocks + i, &fd))
+			break;
+	}
+	if (!fd.err)
+		fd.err = fd.map_err;
 	if (fd.err) {
 		retval = fd.err;
 		goto errout;
@@ -967,23 +1039,38 @@ resort:
 errout:
 	free(dir_buf);
 	free(fd.harray);
+	free(fd.blocks);
 
 	free_out_dir(&outdir);
 	return retval;
 }
 
+static int next_dir_to_hash(e2fsck_t ctx, struct dir_info_iter *dirinfo_iter,
+			    ext2_u32_iterate iter, ext2_ino_t *ino)
+{
+	struct dir_info		*dir;
+
+	if (dirinfo_iter) {
+		if ((dir = e2fsck_dir_info_iter(ctx, dirinfo_iter)) == 0)
+			return 0;
+		*ino = dir->ino;
+		return 1;
+	}
+	return ext2fs_u32_list_iterate(iter, ino);
+}
+
 void e2fsck_rehash_directories(e2fsck_t ctx)
 {
 	struct problem_context	pctx;
 #ifdef RESOURCE_TRACK
 	struct resource_track	rtrack;
 #endif
-	struct dir_info		*dir;
-	ext2_u32_iterate 	iter;
+	ext2_u32_iterate 	iter = 0;
 	struct dir_info_iter *	dirinfo_iter = 0;
-	ext2_ino_t		ino;
+	ext2_ino_t		ino, next_ino;
 	errcode_t		retval;
-	int			cur, max, all_dirs, first = 1;
+	int			cur, max, all_dirs, first = 1, more;
+	blk64_t			ra_blocks;
 
 	init_resource_track(&rtrack, ctx->fs->io);
 	all_dirs = ctx->options & E2F_OPT_COMPRESS_DIRS;
@@ -1009,16 +1096,20 @@ void e2fsck_rehash_directories(e2fsck_t ctx)
 		}
 		max = ext2fs_u32_list_count(ctx->dirs_to_hash);
 	}
-	while (1) {
-		if (all_dirs) {
-			if ((dir = e2fsck_dir_info_iter(ctx,
-							dirinfo_iter)) == 0)
-				break;
-			ino = dir->ino;
-		} else {
-			if (!ext2fs_u32_list_iterate(iter, &ino))
-				break;
-		}
+
+	/*
+	 * Rebuilding a directory is mostly CPU bound once it has been
+	 * read in, so start reading the next directory before working
+	 * on the current one.
+	 */
+	ra_blocks = ctx->readahead_kb * 1024 / ctx->fs->blocksize;
+	more = next_dir_to_hash(ctx, dirinfo_iter, iter, &next_ino);
+	while (more) {
+		ino = next_ino;
+		more = next_dir_to_hash(ctx, dirinfo_iter, iter, &next_ino);
+		if (more && ra_blocks)
+			(void) e2fsck_readahead_dir(ctx->fs, next_ino,
+						    ra_blocks);
 
 		pctx.dir = ino;
 		if (first) {
@@ -52,6 +52,7 @@ struct blkid_struct_dev
 	unsigned int		bid_flags;	/* Device status bitflags */
 	char			*bid_label;	/* Shortcut to device LABEL */
 	char			*bid_uuid;	/* Shortcut to binary UUID */
+	blkid_dev		bid_hnext;	/* Next dev in cache name hash */
 };
 
 #define BLKID_BID_FL_VERIFIED	0x0001	/* Device data validated from disk */
@@ -71,6 +72,8 @@ struct blkid_struct_tag
 	char			*bit_name;	/* NAME of tag (shared) */
 	char			*bit_val;	/* value of tag */
 	blkid_dev		bit_dev;	/* pointer to device */
+	struct blkid_struct_tag	*bit_hnext;	/* Next tag in cache value hash */
+	unsigned long		bit_seq;	/* Order of tag in bit_names */
 };
 typedef struct blkid_struct_tag *blkid_tag;
 
@@ -93,6 +96,10 @@ typedef struct blkid_struct_tag *blkid_tag;
  * We can traverse all of the tag types by bic_tags, which hold empty tags
  * for each tag type.  Those tags can be used as list_heads for iterating
  * through all devices with a specific tag type (e.g. LABEL).
+ *
+ * Devices are also hashed by name, and their tags by NAME and value, so
+ * that looking up a device or resolving LABEL=/UUID= does not have to
+ * walk the lists when the cache holds many devices.
  */
 struct blkid_struct_cache
 {
@@ -102,8 +109,18 @@ struct blkid_struct_cache
 	time_t			bic_ftime; 	/* Mod time of the cachefile */
 	unsigned int		bic_flags;	/* Status flags of the cache */
 	char			*bic_filename;	/* filename of cache */
+	blkid_dev		*bic_dev_hash;	/* Devices hashed by name */
+	unsigned int		bic_dev_hash_size;
+	unsigned int		bic_dev_count;
+	struct blkid_struct_tag	**bic_tag_hash;	/* Tags hashed by NAME=value */
+	unsigned int		bic_tag_hash_size;
+	unsigned int		bic_tag_count;
+	unsigned long		bic_tag_seq;	/* Next bit_seq to hand out */
 };
 
+/* Initial number of buckets in the cache hashes; always a power of 2 */
+#define BLKID_HASH_MIN		64
+
 #define BLKID_BIC_FL_PROBED	0x0002	/* We probed /proc/partition devices */
 #define BLKID_BIC_FL_CHANGED	0x0004	/* Cache has changed from disk */
 
@@ -167,6 +184,16 @@ static inline int blkidP_is_disk_device(mode_t mode)
 #endif
 }
 
+/* FNV-1a string hash used for the cache hashes */
+#define BLKID_HASH_INIT		2166136261U
+
+static inline unsigned int blkid_hash_str(unsigned int h, const char *s)
+{
+	while (*s)
+		h = (h ^ (unsigned char) *s++) * 16777619U;
+	return h;
+}
+
 /* devno.c */
 struct dir_list {
 	char	*name;
@@ -177,6 +204,9 @@ extern void blkid__scan_dir(const char *, dev_t, struct dir_list **, char **);
 /* lseek.c */
 extern blkid_loff_t blkid_llseek(int fd, blkid_loff_t offset, int whence);
 
+/* probe.c */
+extern int blkid__probe_readahead(const char *devname);
+
 /* read.c */
 extern void blkid_read_cache(blkid_cache cache);
 
@@ -196,6 +226,8 @@ extern int blkid_set_tag(blkid_dev dev, const char *name,
  */
 extern blkid_dev blkid_new_dev(void);
 extern void blkid_free_dev(blkid_dev dev);
+extern void blkid_hash_dev(blkid_dev dev);
+extern blkid_dev blkid_find_dev_name(blkid_cache cache, const char *devname);
 
 #ifdef __cplusplus
 }
@@ -101,6 +101,17 @@ int blkid_get_cache(blkid_cache *ret_cache, const char *filename)
 	INIT_LIST_HEAD(&cache->bic_devs);
 	INIT_LIST_HEAD(&cache->bic_tags);
 
+	cache->bic_dev_hash = calloc(BLKID_HASH_MIN, sizeof(blkid_dev));
+	cache->bic_tag_hash = calloc(BLKID_HASH_MIN, sizeof(blkid_tag));
+	if (!cache->bic_dev_hash || !cache->bic_tag_hash) {
+		free(cache->bic_dev_hash);
+		free(cache->bic_tag_hash);
+		free(cache);
+		return -BLKID_ERR_MEM;
+	}
+	cache->bic_dev_hash_size = BLKID_HASH_MIN;
+	cache->bic_tag_hash_size = BLKID_HASH_MIN;
+
 	if (filename && !strlen(filename))
 		filename = 0;
 	if (!filename)
@@ -150,6 +161,8 @@ void blkid_put_cache(blkid_cache cache)
 		blkid_free_tag(tag);
 	}
 	free(cache->bic_filename);
+	free(cache->bic_dev_hash);
+	free(cache->bic_tag_hash);
 
 	free(cache);
 }
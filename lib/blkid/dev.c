@@ -30,6 +30,102 @@ blkid_dev blkid_new_dev(void)
 	return dev;
 }
 
+static unsigned int dev_hash_bucket(blkid_cache cache, const char *devname)
+{
+	return blkid_hash_str(BLKID_HASH_INIT, devname) &
+		(cache->bic_dev_hash_size - 1);
+}
+
+/*
+ * Double the size of the device name hash.  If we can't get the
+ * memory, just keep going with longer chains.
+ */
+static void dev_hash_grow(blkid_cache cache)
+{
+	blkid_dev	*new_hash, dev, next;
+	unsigned int	i, b, size = cache->bic_dev_hash_size * 2;
+
+	new_hash = calloc(size, sizeof(blkid_dev));
+	if (!new_hash)
+		return;
+
+	for (i = 0; i < cache->bic_dev_hash_size; i++) {
+		for (dev = cache->bic_dev_hash[i]; dev; dev = next) {
+			next = dev->bid_hnext;
+			b = blkid_hash_str(BLKID_HASH_INIT, dev->bid_name) &
+				(size - 1);
+			dev->bid_hnext = new_hash[b];
+			new_hash[b] = dev;
+		}
+	}
+	free(cache->bic_dev_hash);
+	cache->bic_dev_hash = new_hash;
+	cache->bic_dev_hash_size = size;
+}
+
+/*
+ * Add a device which has just been put on its cache's device list to
+ * the name hash.
+ */
+void blkid_hash_dev(blkid_dev dev)
+{
+	blkid_cache	cache = dev->bid_cache;
+	unsigned int	b;
+
+	if (!cache || !cache->bic_dev_hash || !dev->bid_name)
+		return;
+
+	if (cache->bic_dev_count >= cache->bic_dev_hash_size)
+		dev_hash_grow(cache);
+
+	b = dev_hash_bucket(cache, dev->bid_name);
+	dev->bid_hnext = cache->bic_dev_hash[b];
+	cache->bic_dev_hash[b] = dev;
+	cache->bic_dev_count++;
+}
+
+static void unhash_dev(blkid_dev dev)
+{
+	blkid_cache	cache = dev->bid_cache;
+	blkid_dev	*pp;
+
+	if (!cache || !cache->bic_dev_hash || !dev->bid_name)
+		return;
+
+	for (pp = &cache->bic_dev_hash[dev_hash_bucket(cache, dev->bid_name)];
+	     *pp; pp = &(*pp)->bid_hnext) {
+		if (*pp == dev) {
+			*pp = dev->bid_hnext;
+			cache->bic_dev_count--;
+			break;
+		}
+	}
+}
+
+/*
+ * Find a device in the cache by its name.
+ */
+blkid_dev blkid_find_dev_name(blkid_cache cache, const char *devname)
+{
+	struct list_head *p;
+	blkid_dev	dev;
+
+	if (!cache->bic_dev_hash) {
+		list_for_each(p, &cache->bic_devs) {
+			dev = list_entry(p, struct blkid_struct_dev, bid_devs);
+			if (!strcmp(dev->bid_name, devname))
+				return dev;
+		}
+		return NULL;
+	}
+
+	for (dev = cache->bic_dev_hash[dev_hash_bucket(cache, devname)];
+	     dev; dev = dev->bid_hnext)
+		if (!strcmp(dev->bid_name, devname))
+			return dev;
+	return NULL;
+}
+
 void blkid_free_dev(blkid_dev dev)
 {
 	if (!dev)
@@ -40,6 +136,7 @@ void blkid_free_dev(blkid_dev dev)
 		   dev->bid_type : "(null)"));
 	DBG(DEBUG_DEV, blkid_debug_dump_dev(dev));
 
+	unhash_dev(dev);
 	list_del(&dev->bid_devs);
 	while (!list_empty(&dev->bid_tags)) {
 		blkid_tag tag = list_entry(dev->bid_tags.next,
@@ -51,22 +51,16 @@
  */
 blkid_dev blkid_get_dev(blkid_cache cache, const char *devname, int flags)
 {
-	blkid_dev dev = NULL, tmp;
+	blkid_dev dev;
 	struct list_head *p, *pnext;
 
 	if (!cache || !devname)
 		return NULL;
 
-	list_for_each(p, &cache->bic_devs) {
-		tmp = list_entry(p, struct blkid_struct_dev, bid_devs);
-		if (strcmp(tmp->bid_name, devname))
-			continue;
-
+	dev = blkid_find_dev_name(cache, devname);
+	if (dev)
 		DBG(DEBUG_DEVNAME,
-		    printf("found devname %s in cache\n", tmp->bid_name));
-		dev = tmp;
-		break;
-	}
+		    printf("found devname %s in cache\n", dev->bid_name));
 
 	if (!dev && (flags & BLKID_DEV_CREATE)) {
 		if (access(devname, F_OK) < 0)
@@ -78,6 +72,7 @@ blkid_dev blkid_get_dev(blkid_cache cache, const char *devname, int flags)
 		dev->bid_name = blkid_strdup(devname);
 		dev->bid_cache = cache;
 		list_add_tail(&dev->bid_devs, &cache->bic_devs);
+		blkid_hash_dev(dev);
 		cache->bic_flags |= BLKID_BIC_FL_CHANGED;
 	}
 
@@ -391,6 +386,102 @@ evms_probe_all(blkid_cache cache, int only_if_new)
 	return num;
 }
 
+/*
+ * Number of partitions whose superblocks are read ahead of the one
+ * being probed, so that probing many devices keeps several reads in
+ * flight while the cache itself is only ever updated from one place.
+ */
+#define PROBE_AHEAD	16
+
+struct probe_req {
+	char	ptname[129];
+	dev_t	devno;
+	int	fd;
+};
+
+/*
+ * Start reading the superblocks of a device which probe_one() is about
+ * to verify.  Only the cheap ways of finding the device node are tried
+ * here; anything harder is left to probe_one() itself.
+ */
+static int readahead_one(blkid_cache cache, const char *ptname, dev_t devno,
+			 int only_if_new)
+{
+	struct list_head *p;
+	const char **dir;
+	struct stat st;
+	char device[256];
+
+	list_for_each(p, &cache->bic_devs) {
+		blkid_dev tmp = list_entry(p, struct blkid_struct_dev,
+					   bid_devs);
+
+		if (tmp->bid_devno != devno)
+			continue;
+		if (only_if_new ||
+		    ((tmp->bid_flags & BLKID_BID_FL_VERIFIED) &&
+		     time(0) - tmp->bid_time < BLKID_PROBE_INTERVAL))
+			return -1;
+		return blkid__probe_readahead(tmp->bid_name);
+	}
+
+	for (dir = dirlist; *dir; dir++) {
+		sprintf(device, "%s/%s", *dir, ptname);
+		if (stat(device, &st) == 0 &&
+		    blkidP_is_disk_device(st.st_mode) &&
+		    st.st_rdev == devno)
+			return blkid__probe_readahead(device);
+	}
+	return -1;
+}
+
+/*
+ * Add a partition to the list of devices to probe.  If the list can't
+ * be grown, just probe the device right away.
+ */
+static void queue_probe(blkid_cache cache, struct probe_req **reqs,
+			int *nr, int *max, const char *ptname, dev_t devno,
+			int only_if_new)
+{
+	struct probe_req *new_reqs;
+
+	if (*nr >= *max) {
+		new_reqs = realloc(*reqs, (*max + 64) * sizeof(**reqs));
+		if (!new_reqs) {
+			probe_one(cache, ptname, devno, 0, only_if_new);
+			return;
+		}
+		*reqs = new_reqs;
+		*max += 64;
+	}
+	strcpy((*reqs)[*nr].ptname, ptname);
+	(*reqs)[*nr].devno = devno;
+	(*reqs)[*nr].fd = -1;
+	(*nr)++;
+}
+
+/*
+ * Probe the queued partitions in order, keeping readahead started on
+ * the next PROBE_AHEAD of them.
+ */
+static void probe_queued(blkid_cache cache, struct probe_req *reqs, int nr,
+			 int only_if_new)
+{
+	int i, ahead = 0;
+
+	for (i = 0; i < nr; i++) {
+		for (; ahead < nr && ahead < i + PROBE_AHEAD; ahead++)
+			reqs[ahead].fd = readahead_one(cache,
+						       reqs[ahead].ptname,
+						       reqs[ahead].devno,
+						       only_if_new);
+		probe_one(cache, reqs[i].ptname, reqs[i].devno, 0,
+			  only_if_new);
+		if (reqs[i].fd >= 0)
+			close(reqs[i].fd);
+	}
+}
+
 /*
  * Read the device data for all available block devices in the system.
  */
@@ -406,6 +497,8 @@ static int probe_all(blkid_cache cache, int only_if_new)
 	int lens[2] = { 0, 0 };
 	int which = 0, last = 0;
 	struct list_head *p, *pnext;
+	struct probe_req *reqs = NULL;
+	int nr_reqs = 0, max_reqs = 0;
 
 	ptnames[0] = ptname0;
 	ptnames[1] = ptname1;
@@ -460,8 +553,8 @@ static int probe_all(blkid_cache cache, int only_if_new)
 				   ptname, (unsigned int) devs[which]));
 
 			if (sz > 1)
-				probe_one(cache, ptname, devs[which], 0,
-					  only_if_new);
+				queue_probe(cache, &reqs, &nr_reqs, &max_reqs,
+					    ptname, devs[which], only_if_new);
 			lens[which] = 0;	/* mark as checked */
 		}
 
@@ -497,17 +590,21 @@ static int probe_all(blkid_cache cache, int only_if_new)
 			DBG(DEBUG_DEVNAME,
 			    printf("whole dev %s, devno 0x%04X\n",
 				   ptnames[last], (unsigned int) devs[last]));
-			probe_one(cache, ptnames[last], devs[last], 0,
-				  only_if_new);
+			queue_probe(cache, &reqs, &nr_reqs, &max_reqs,
+				    ptnames[last], devs[last], only_if_new);
 			lens[last] = 0;
 		}
 	}
 
 	/* Handle the last device if it wasn't partitioned */
 	if (lens[which])
-		probe_one(cache, ptname, devs[which], 0, only_if_new);
+		queue_probe(cache, &reqs, &nr_reqs, &max_reqs,
+			    ptname, devs[which], only_if_new);
 
 	fclose(proc);
+
+	probe_queued(cache, reqs, nr_reqs, only_if_new);
+	free(reqs);
 	blkid_flush_cache(cache);
 	return 0;
 }
@@ -48,42 +48,77 @@ static int figure_label_len(const unsigned char *label, int len)
 	return 0;
 }
 
+/*
+ * Windows of the device which get_buffer() reads in one go; computed
+ * from type_array by probe_init_windows().
+ */
+struct probe_window {
+	blkid_loff_t	start;
+	size_t		len;
+};
+
+static struct probe_window probe_windows[PROBE_MAX_WINDOWS];
+static int probe_nr_windows;
+
+static void probe_init_windows(void);
+
+static ssize_t read_all(int fd, unsigned char *buf, size_t len)
+{
+	ssize_t		ret;
+	size_t		done = 0;
+
+	while (done < len) {
+		ret = read(fd, buf + done, len - done);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			break;
+		done += ret;
+	}
+	return done;
+}
+
 static unsigned char *get_buffer(struct blkid_probe *pr,
 			  blkid_loff_t off, size_t len)
 {
+	struct probe_window *win = probe_windows;
 	ssize_t		ret_read;
 	unsigned char	*newbuf;
+	int		i;
 
-	if (off + len <= SB_BUFFER_SIZE) {
-		if (!pr->sbbuf) {
-			pr->sbbuf = malloc(SB_BUFFER_SIZE);
-			if (!pr->sbbuf)
-				return NULL;
-			if (lseek(pr->fd, 0, SEEK_SET) < 0)
-				return NULL;
-			ret_read = read(pr->fd, pr->sbbuf, SB_BUFFER_SIZE);
-			if (ret_read < 0)
-				ret_read = 0;
-			pr->sb_valid = ret_read;
-		}
-		if (off+len > pr->sb_valid)
-			return NULL;
-		return pr->sbbuf + off;
-	} else {
-		if (len > pr->buf_max) {
-			newbuf = realloc(pr->buf, len);
-			if (newbuf == NULL)
+	probe_init_windows();
+	for (i = 0; i < probe_nr_windows; i++, win++) {
+		if (off < win->start ||
+		    off + len > win->start + (blkid_loff_t) win->len)
+			continue;
+		if (!pr->winbuf[i]) {
+			pr->winbuf[i] = malloc(win->len);
+			if (!pr->winbuf[i])
 				return NULL;
-			pr->buf = newbuf;
-			pr->buf_max = len;
+			pr->win_valid[i] = 0;
+			if (blkid_llseek(pr->fd, win->start, SEEK_SET) >= 0)
+				pr->win_valid[i] = read_all(pr->fd,
+							    pr->winbuf[i],
+							    win->len);
 		}
-		if (blkid_llseek(pr->fd, off, SEEK_SET) < 0)
+		if (off + len > win->start + (blkid_loff_t) pr->win_valid[i])
 			return NULL;
-		ret_read = read(pr->fd, pr->buf, len);
-		if (ret_read != (ssize_t) len)
+		return pr->winbuf[i] + (off - win->start);
+	}
+
+	if (len > pr->buf_max) {
+		newbuf = realloc(pr->buf, len);
+		if (newbuf == NULL)
 			return NULL;
-		return pr->buf;
+		pr->buf = newbuf;
+		pr->buf_max = len;
 	}
+	if (blkid_llseek(pr->fd, off, SEEK_SET) < 0)
+		return NULL;
+	ret_read = read(pr->fd, pr->buf, len);
+	if (ret_read != (ssize_t) len)
+		return NULL;
+	return pr->buf;
 }
 
 
@@ -1647,6 +1682,119 @@ static struct blkid_magic type_array[] = {
   {   NULL,	 0,	 0,  0, NULL,			NULL }
 };
 
+#define PROBE_NR_MAGICS	(sizeof(type_array) / sizeof(type_array[0]))
+
+/*
+ * Superblock locations closer together than this are read as part of
+ * the same window.
+ */
+#define PROBE_WINDOW_GAP	(64 * 1024)
+
+/*
+ * Offset index of type_array: each magic maps to a slot, one per
+ * distinct 1k block which the table looks at, so blkid_verify() only
+ * fetches each block once no matter how many magics live in it.
+ */
+#define PROBE_MAX_SLOTS		32
+
+static blkid_loff_t probe_slot_off[PROBE_MAX_SLOTS];
+static int probe_nr_slots;
+static signed char probe_magic_slot[PROBE_NR_MAGICS];
+
+static blkid_loff_t magic_block(const struct blkid_magic *id)
+{
+	return ((blkid_loff_t) id->bim_kboff + (id->bim_sboff >> 10)) << 10;
+}
+
+static int cmp_loff(const void *a, const void *b)
+{
+	blkid_loff_t x = *(const blkid_loff_t *) a;
+	blkid_loff_t y = *(const blkid_loff_t *) b;
+
+	return (x > y) - (x < y);
+}
+
+/*
+ * Group the superblock locations in type_array into a few windows, so
+ * that probing a device takes a handful of large reads instead of a
+ * seek and read for every candidate offset.  The first window always
+ * covers the start of the device, where most of the probe functions
+ * look for further data.
+ */
+static void probe_init_windows(void)
+{
+	blkid_loff_t		blocks[PROBE_NR_MAGICS];
+	struct probe_window	*win = probe_windows;
+	struct blkid_magic	*id;
+	blkid_loff_t		end;
+	int			i, j, n = 0;
+
+	if (probe_nr_windows)
+		return;
+
+	for (id = type_array; id->bim_type; id++)
+		blocks[n++] = magic_block(id);
+	qsort(blocks, n, sizeof(blocks[0]), cmp_loff);
+
+	win->start = 0;
+	win->len = SB_BUFFER_SIZE;
+	probe_nr_windows = 1;
+	for (i = 0; i < n; i++) {
+		if (i && blocks[i] == blocks[i - 1])
+			continue;
+		if (probe_nr_slots < PROBE_MAX_SLOTS)
+			probe_slot_off[probe_nr_slots++] = blocks[i];
+
+		end = blocks[i] + 1024;
+		if (blocks[i] > win->start + (blkid_loff_t) win->len +
+		    PROBE_WINDOW_GAP &&
+		    probe_nr_windows < PROBE_MAX_WINDOWS) {
+			win++;
+			probe_nr_windows++;
+			win->start = blocks[i];
+		}
+		if (end > win->start + (blkid_loff_t) win->len)
+			win->len = end - win->start;
+	}
+
+	for (i = 0, id = type_array; id->bim_type; i++, id++) {
+		probe_magic_slot[i] = -1;
+		for (j = 0; j < probe_nr_slots; j++) {
+			if (probe_slot_off[j] == magic_block(id)) {
+				probe_magic_slot[i] = j;
+				break;
+			}
+		}
+	}
+}
+
+/*
+ * Start readahead of the probe windows of devname, so that a batch of
+ * devices can have their reads in flight while they are verified one
+ * at a time.  The returned descriptor should be held open until the
+ * device has been verified, since the last close of a block device may
+ * drop its page cache.  Returns -1 if no readahead was started.
+ */
+int blkid__probe_readahead(const char *devname)
+{
+#if defined(HAVE_POSIX_FADVISE) && defined(POSIX_FADV_WILLNEED)
+	int	fd, i;
+
+	fd = open(devname, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	probe_init_windows();
+	for (i = 0; i < probe_nr_windows; i++)
+		(void) posix_fadvise(fd, probe_windows[i].start,
+				     probe_windows[i].len,
+				     POSIX_FADV_WILLNEED);
+	return fd;
+#else
+	return -1;
+#endif
+}
+
 /*
  * Verify that the data in dev is consistent with what is on the actual
  * block device (using the devname field only).  Normally this will be
@@ -1662,11 +1810,13 @@ blkid_dev blkid_verify(blkid_cache cache, blkid_dev dev)
 	struct blkid_probe probe;
 	blkid_tag_iterate iter;
 	unsigned char *buf;
+	unsigned char *slot_buf[PROBE_MAX_SLOTS];
+	char slot_read[PROBE_MAX_SLOTS];
 	const char *type, *value;
 	struct stat st;
 	time_t now;
 	double diff;
-	int idx;
+	int slot, i;
 
 	if (!dev)
 		return NULL;
@@ -1712,10 +1862,13 @@ blkid_dev blkid_verify(blkid_cache cache, blkid_dev dev)
 
 	probe.cache = cache;
 	probe.dev = dev;
-	probe.sbbuf = 0;
+	memset(probe.winbuf, 0, sizeof(probe.winbuf));
 	probe.buf = 0;
 	probe.buf_max = 0;
 
+	probe_init_windows();
+	memset(slot_read, 0, sizeof(slot_read));
+
 	/*
 	 * Iterate over the type array.  If we already know the type,
 	 * then try that first.  If it doesn't work, then blow away
@@ -1738,8 +1891,17 @@ try_again:
 		    strcmp(id->bim_type, dev->bid_type))
 			continue;
 
-		idx = id->bim_kboff + (id->bim_sboff >> 10);
-		buf = get_buffer(&probe, (__u64) idx << 10, 1024);
+		slot = probe_magic_slot[id - type_array];
+		if (slot < 0) {
+			buf = get_buffer(&probe, magic_block(id), 1024);
+		} else {
+			if (!slot_read[slot]) {
+				slot_buf[slot] = get_buffer(&probe,
+						probe_slot_off[slot], 1024);
+				slot_read[slot] = 1;
+			}
+			buf = slot_buf[slot];
+		}
 		if (!buf)
 			continue;
 
@@ -1787,7 +1949,8 @@ found_type:
 			   dev->bid_name, (long long)st.st_rdev, type));
 	}
 
-	free(probe.sbbuf);
+	for (i = 0; i < PROBE_MAX_WINDOWS; i++)
+		free(probe.winbuf[i]);
 	free(probe.buf);
 	if (probe.fd >= 0)
 		close(probe.fd);
@@ -22,12 +22,18 @@ struct blkid_magic;
 
 #define SB_BUFFER_SIZE		0x11000
 
+/*
+ * The superblock locations named in the magic table are read in at
+ * most PROBE_MAX_WINDOWS large reads; see probe_init_windows().
+ */
+#define PROBE_MAX_WINDOWS	4
+
 struct blkid_probe {
 	int			fd;
 	blkid_cache		cache;
 	blkid_dev		dev;
-	unsigned char		*sbbuf;
-	size_t			sb_valid;
+	unsigned char		*winbuf[PROBE_MAX_WINDOWS];
+	size_t			win_valid[PROBE_MAX_WINDOWS];
 	unsigned char		*buf;
 	size_t			buf_max;
 };
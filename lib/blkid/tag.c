@@ -43,6 +43,81 @@ void blkid_debug_dump_tag(blkid_tag tag)
 }
 #endif
 
+static unsigned int tag_hash(const char *type, const char *value)
+{
+	return blkid_hash_str(blkid_hash_str(BLKID_HASH_INIT, type), value);
+}
+
+/*
+ * Double the size of the tag value hash.  If we can't get the memory,
+ * just keep going with longer chains.
+ */
+static void tag_hash_grow(blkid_cache cache)
+{
+	blkid_tag	*new_hash, tag, next;
+	unsigned int	i, b, size = cache->bic_tag_hash_size * 2;
+
+	new_hash = calloc(size, sizeof(blkid_tag));
+	if (!new_hash)
+		return;
+
+	for (i = 0; i < cache->bic_tag_hash_size; i++) {
+		for (tag = cache->bic_tag_hash[i]; tag; tag = next) {
+			next = tag->bit_hnext;
+			b = tag_hash(tag->bit_name, tag->bit_val) & (size - 1);
+			tag->bit_hnext = new_hash[b];
+			new_hash[b] = tag;
+		}
+	}
+	free(cache->bic_tag_hash);
+	cache->bic_tag_hash = new_hash;
+	cache->bic_tag_hash_size = size;
+}
+
+/*
+ * Add a device tag to its cache's value hash.
+ */
+static void hash_tag(blkid_tag tag)
+{
+	blkid_cache	cache = tag->bit_dev->bid_cache;
+	unsigned int	b;
+
+	if (!cache || !cache->bic_tag_hash || !tag->bit_name || !tag->bit_val)
+		return;
+
+	if (cache->bic_tag_count >= cache->bic_tag_hash_size)
+		tag_hash_grow(cache);
+
+	b = tag_hash(tag->bit_name, tag->bit_val) &
+		(cache->bic_tag_hash_size - 1);
+	tag->bit_hnext = cache->bic_tag_hash[b];
+	cache->bic_tag_hash[b] = tag;
+	cache->bic_tag_count++;
+}
+
+static void unhash_tag(blkid_tag tag)
+{
+	blkid_cache	cache;
+	blkid_tag	*pp;
+	unsigned int	b;
+
+	if (!tag->bit_dev || !tag->bit_name || !tag->bit_val)
+		return;
+	cache = tag->bit_dev->bid_cache;
+	if (!cache || !cache->bic_tag_hash)
+		return;
+
+	b = tag_hash(tag->bit_name, tag->bit_val) &
+		(cache->bic_tag_hash_size - 1);
+	for (pp = &cache->bic_tag_hash[b]; *pp; pp = &(*pp)->bit_hnext) {
+		if (*pp == tag) {
+			*pp = tag->bit_hnext;
+			cache->bic_tag_count--;
+			break;
+		}
+	}
+}
+
 void blkid_free_tag(blkid_tag tag)
 {
 	if (!tag)
@@ -52,6 +127,7 @@ void blkid_free_tag(blkid_tag tag)
 		   tag->bit_val ? tag->bit_val : "(NULL)"));
 	DBG(DEBUG_TAG, blkid_debug_dump_tag(tag));
 
+	unhash_tag(tag);
 	list_del(&tag->bit_tags);	/* list of tags for this device */
 	list_del(&tag->bit_names);	/* list of tags with this type */
 
@@ -162,8 +238,10 @@ int blkid_set_tag(blkid_dev dev, const char *name,
 			free(val);
 			return 0;
 		}
+		unhash_tag(t);
 		free(t->bit_val);
 		t->bit_val = val;
+		hash_tag(t);
 	} else {
 		/* Existing tag not present, add to device */
 		if (!(t = blkid_new_tag()))
@@ -191,6 +269,8 @@ int blkid_set_tag(blkid_dev dev, const char *name,
 					      &dev->bid_cache->bic_tags);
 			}
 			list_add_tail(&t->bit_names, &head->bit_names);
+			t->bit_seq = dev->bid_cache->bic_tag_seq++;
+			hash_tag(t);
 		}
 	}
 
@@ -346,9 +426,32 @@ extern blkid_dev blkid_find_dev_with_tag(blkid_cache cache,
 try_again:
 	pri = -1;
 	dev = 0;
-	head = blkid_find_head_cache(cache, type);
-
-	if (head) {
+	if (cache->bic_tag_hash) {
+		blkid_tag tmp;
+		unsigned long seq = 0;
+
+		/*
+		 * The hash chain is in no particular order, so break
+		 * ties on priority by the position on the bit_names
+		 * list, the same as the list walk below would.
+		 */
+		tmp = cache->bic_tag_hash[tag_hash(type, value) &
+					  (cache->bic_tag_hash_size - 1)];
+		for (; tmp; tmp = tmp->bit_hnext) {
+			if (strcmp(tmp->bit_name, type) ||
+			    strcmp(tmp->bit_val, value))
+				continue;
+			if (!(tmp->bit_dev->bid_pri > pri ||
+			      (dev && tmp->bit_dev->bid_pri == pri &&
+			       tmp->bit_seq < seq)))
+				continue;
+			if (!access(tmp->bit_dev->bid_name, F_OK)) {
+				dev = tmp->bit_dev;
+				pri = dev->bid_pri;
+				seq = tmp->bit_seq;
+			}
+		}
+	} else if ((head = blkid_find_head_cache(cache, type))) {
 		list_for_each(p, &head->bit_names) {
 			blkid_tag tmp = list_entry(p, struct blkid_struct_tag,
 						   bit_names);
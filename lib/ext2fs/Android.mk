@@ -13,6 +13,7 @@ libext2fs_src_files := \
 	bitops.c \
 	blkmap64_ba.c \
 	blkmap64_rb.c \
+	blkmap64_hy.c \
 	blknum.c \
 	block.c \
 	bmap.c \
@@ -25,6 +26,7 @@ libext2fs_src_files := \
 	dblist_dir.c \
 	digest_encode.c \
 	dirblock.c \
+	dirbuild.c \
 	dirhash.c \
 	dir_iterate.c \
 	dupfs.c \
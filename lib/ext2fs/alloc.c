@@ -552,3 +552,250 @@ errcode_t ext2fs_alloc_range(ext2_filsys fs, int flags, blk64_t goal,
 	ext2fs_block_alloc_stats_range(fs, *ret, len, +1);
 	return retval;
 }
+
+/*
+ * Block allocation pools.
+ *
+ * A pool reserves a run of free blocks from the filesystem (starting from
+ * its own flex group, so that several pools do not fight over the same
+ * part of the disk) and hands out blocks from that run without touching
+ * the global block bitmap or the group descriptors.  The reserved run is
+ * marked in fs->block_map as soon as it is taken, so that nobody else
+ * allocates it, but the free block counters are only updated in batches,
+ * when the pool is flushed or has to take a new reservation.
+ *
+ * Handing out a block from a pool that still has reserved blocks left
+ * touches no shared state at all.  Taking a new reservation, flushing
+ * and releasing a pool do; if pools are used from several threads at
+ * once, the caller must supply lock functions with
+ * ext2fs_alloc_pool_set_lock() (normally wrapping the same lock that
+ * already serializes access to the ext2_filsys).
+ *
+ * If the application has installed its own allocator (fs->new_range or
+ * fs->get_alloc_block, as e2fsck and resize2fs do), reservations are
+ * taken through it instead, and are accounted with
+ * ext2fs_block_alloc_stats_range() as soon as they are taken so that the
+ * application's own maps see them; the unused part is given back the
+ * same way when the pool is released.
+ *
+ * Pools must be released with ext2fs_alloc_pool_free() before the
+ * filesystem is flushed or closed, or the unused part of the reservation
+ * would be written out as in use.
+ */
+struct ext2_alloc_pool {
+	ext2_filsys	fs;
+	blk64_t		goal;		/* where to look for the next run */
+	blk64_t		batch;		/* blocks to reserve at once */
+	blk64_t		start;		/* start of the current run */
+	blk64_t		next;		/* next block to hand out */
+	blk64_t		end;		/* end of the current run */
+	blk64_t		allocated;	/* blocks handed out in total */
+	int		accounted;	/* current run already accounted */
+	void		(*lock)(void *data);
+	void		(*unlock)(void *data);
+	void		*lock_data;
+};
+
+#define EXT2_ALLOC_POOL_DEFAULT_BATCH	1024
+
+static void alloc_pool_lock(ext2_alloc_pool_t pool)
+{
+	if (pool->lock)
+		pool->lock(pool->lock_data);
+}
+
+static void alloc_pool_unlock(ext2_alloc_pool_t pool)
+{
+	if (pool->unlock)
+		pool->unlock(pool->lock_data);
+}
+
+/*
+ * Account for the blocks handed out from the current run and give back
+ * the ones that were not.  Called with the pool lock held.
+ */
+static void alloc_pool_retire(ext2_alloc_pool_t pool, int release)
+{
+	ext2_filsys fs = pool->fs;
+
+	if (pool->next > pool->start && !pool->accounted)
+		ext2fs_block_alloc_stats_range(fs, pool->start,
+					       pool->next - pool->start, +1);
+	pool->start = pool->next;
+	if (!release)
+		return;
+	if (pool->end > pool->next) {
+		if (pool->accounted)
+			ext2fs_block_alloc_stats_range(fs, pool->next,
+						pool->end - pool->next, -1);
+		else
+			ext2fs_unmark_block_bitmap_range2(fs->block_map,
+						pool->next,
+						pool->end - pool->next);
+	}
+	pool->start = pool->next = pool->end = 0;
+	pool->accounted = 0;
+}
+
+/*
+ * Take a new run of free blocks for the pool.  Called with the pool lock
+ * held.
+ */
+static errcode_t alloc_pool_refill(ext2_alloc_pool_t pool)
+{
+	ext2_filsys fs = pool->fs;
+	blk64_t pblk, plen;
+	errcode_t retval;
+
+	alloc_pool_retire(pool, 1);
+
+	pool->accounted = (fs->new_range || fs->get_alloc_block ||
+			   fs->get_alloc_block2);
+	if (pool->accounted && !fs->new_range) {
+		/* The application hands out blocks one at a time */
+		retval = ext2fs_new_block2(fs, pool->goal, NULL, &pblk);
+		pblk &= ~EXT2FS_CLUSTER_MASK(fs);
+		plen = EXT2FS_CLUSTER_RATIO(fs);
+	} else
+		retval = ext2fs_new_range(fs, 0, pool->goal, pool->batch,
+					  NULL, &pblk, &plen);
+	if (retval) {
+		pool->accounted = 0;
+		return retval;
+	}
+
+	if (pool->accounted)
+		ext2fs_block_alloc_stats_range(fs, pblk, plen, +1);
+	else
+		ext2fs_mark_block_bitmap_range2(fs->block_map, pblk, plen);
+	pool->start = pool->next = pblk;
+	pool->end = pblk + plen;
+	pool->goal = pool->end;
+	return 0;
+}
+
+/*
+ * Create a block allocation pool which will start reserving blocks from
+ * the flex group containing @group, @batch blocks at a time (0 selects a
+ * default).
+ */
+errcode_t ext2fs_alloc_pool_create(ext2_filsys fs, dgrp_t group,
+				   blk64_t batch, ext2_alloc_pool_t *ret)
+{
+	ext2_alloc_pool_t pool;
+	errcode_t retval;
+	__u8 log_flex;
+
+	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
+	if (!fs->block_map)
+		return EXT2_ET_NO_BLOCK_BITMAP;
+	if (group >= fs->group_desc_count)
+		return EXT2_ET_INVALID_ARGUMENT;
+
+	retval = ext2fs_get_memzero(sizeof(struct ext2_alloc_pool), &pool);
+	if (retval)
+		return retval;
+
+	log_flex = fs->super->s_log_groups_per_flex;
+	if (ext2fs_has_feature_flex_bg(fs->super) && log_flex &&
+	    log_flex < 32)
+		group &= ~((1U << log_flex) - 1);
+
+	pool->fs = fs;
+	pool->goal = ext2fs_group_first_block2(fs, group);
+	pool->batch = batch ? batch : EXT2_ALLOC_POOL_DEFAULT_BATCH;
+	pool->batch = EXT2FS_C2B(fs, EXT2FS_NUM_B2C(fs, pool->batch));
+	*ret = pool;
+	return 0;
+}
+
+void ext2fs_alloc_pool_set_lock(ext2_alloc_pool_t pool,
+				void (*lock)(void *data),
+				void (*unlock)(void *data), void *data)
+{
+	pool->lock = lock;
+	pool->unlock = unlock;
+	pool->lock_data = data;
+}
+
+/*
+ * Hand out the next block (or cluster, on bigalloc file systems) from the
+ * pool.  The block is accounted for in the group descriptors the next time
+ * the pool is flushed or refilled.
+ */
+errcode_t ext2fs_alloc_pool_new_block(ext2_alloc_pool_t pool, blk64_t *ret)
+{
+	errcode_t retval;
+
+	if (pool->next >= pool->end) {
+		alloc_pool_lock(pool);
+		retval = alloc_pool_refill(pool);
+		alloc_pool_unlock(pool);
+		if (retval)
+			return retval;
+	}
+
+	*ret = pool->next;
+	pool->next += EXT2FS_CLUSTER_RATIO(pool->fs);
+	pool->allocated += EXT2FS_CLUSTER_RATIO(pool->fs);
+	return 0;
+}
+
+/*
+ * Hand out up to @len contiguous blocks from the pool.  Fewer blocks may
+ * be returned in *plen if the current reservation runs out first.
+ */
+errcode_t ext2fs_alloc_pool_new_range(ext2_alloc_pool_t pool, blk64_t len,
+				      blk64_t *pblk, blk64_t *plen)
+{
+	errcode_t retval;
+
+	if (len == 0)
+		return EXT2_ET_INVALID_ARGUMENT;
+	if (pool->next >= pool->end) {
+		alloc_pool_lock(pool);
+		retval = alloc_pool_refill(pool);
+		alloc_pool_unlock(pool);
+		if (retval)
+			return retval;
+	}
+
+	len = EXT2FS_C2B(pool->fs, EXT2FS_NUM_B2C(pool->fs, len));
+	if (len > pool->end - pool->next)
+		len = pool->end - pool->next;
+	*pblk = pool->next;
+	*plen = len;
+	pool->next += len;
+	pool->allocated += len;
+	return 0;
+}
+
+/*
+ * Update the group descriptors and superblock for the blocks handed out
+ * so far, keeping the rest of the reservation.
+ */
+void ext2fs_alloc_pool_flush(ext2_alloc_pool_t pool)
+{
+	alloc_pool_lock(pool);
+	alloc_pool_retire(pool, 0);
+	alloc_pool_unlock(pool);
+}
+
+blk64_t ext2fs_alloc_pool_allocated(ext2_alloc_pool_t pool)
+{
+	return pool->allocated;
+}
+
+/*
+ * Account for the blocks handed out, return the unused reservation to
+ * the filesystem and free the pool.
+ */
+void ext2fs_alloc_pool_free(ext2_alloc_pool_t pool)
+{
+	if (!pool)
+		return;
+	alloc_pool_lock(pool);
+	alloc_pool_retire(pool, 1);
+	alloc_pool_unlock(pool);
+	ext2fs_free_mem(&pool);
+}
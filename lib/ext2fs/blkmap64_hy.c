@@ -0,0 +1,1008 @@
+/*
+ * blkmap64_hy.c --- Hybrid container implementation for bitmaps
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Public
+ * License.
+ * %End-Header%
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <fcntl.h>
+#include <time.h>
+#if HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+#if HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+
+#include "ext2_fs.h"
+#include "ext2fsP.h"
+#include "bmap64.h"
+
+/*
+ * The bitmap is cut into chunks of 64k bits, and each chunk is kept in
+ * whichever container is smallest for what it holds, much like a
+ * roaring bitmap:
+ *
+ *  - an array of the sorted offsets of its set bits, for a few scattered
+ *    bits (at most HY_ARRAY_MAX);
+ *  - a sorted list of runs of set bits, for a few extents (at most
+ *    HY_RUN_MAX), which also covers a completely full chunk;
+ *  - a plain 8k bitmap when the chunk is too fragmented for either.
+ *
+ * An empty chunk costs nothing beyond its slot in the chunk table.  So
+ * a mostly empty or mostly full bitmap is as small as an rbtree, while
+ * finding the container for a bit is a simple index however fragmented
+ * the bitmap gets, and no chunk ever grows past the size of the plain
+ * bitarray.
+ *
+ * Containers change type as bits are set and cleared: the cheap updates
+ * are done in place, and anything that would overflow a container (or
+ * turn a bitmap container nearly empty) goes through a scratch bitmap
+ * from which the best container is chosen afresh.
+ */
+
+#define HY_CHUNK_BITS	16
+#define HY_CHUNK_SIZE	(1U << HY_CHUNK_BITS)
+#define HY_CHUNK_MASK	(HY_CHUNK_SIZE - 1)
+#define HY_WORDS	(HY_CHUNK_SIZE / 64)
+#define HY_ARRAY_MAX	4096		/* 8k worth of __u16 */
+#define HY_RUN_MAX	2048		/* 8k worth of struct hy_run */
+#define HY_ARRAY_RANGE	16		/* longest range added to an array */
+
+#define HY_EMPTY	0
+#define HY_ARRAY	1
+#define HY_RUN		2
+#define HY_BITMAP	3
+
+struct hy_run {
+	__u16	start;
+	__u16	last;			/* inclusive */
+};
+
+struct hy_container {
+	union {
+		__u16		*array;
+		struct hy_run	*runs;
+		__u64		*words;
+	} u;
+	__u32	n;			/* entries, runs or bits set */
+	__u16	size;			/* entries or runs allocated */
+	__u8	type;
+};
+
+struct ext2fs_hy_private {
+	struct hy_container	*chunks;
+	__u64			nr_chunks;
+};
+
+static __u64 hy_nr_chunks(ext2fs_generic_bitmap_64 bitmap)
+{
+	return ((bitmap->real_end - bitmap->start) >> HY_CHUNK_BITS) + 1;
+}
+
+static unsigned int hy_popcount64(__u64 w)
+{
+	w = w - ((w >> 1) & 0x5555555555555555ULL);
+	w = (w & 0x3333333333333333ULL) + ((w >> 2) & 0x3333333333333333ULL);
+	w = (w + (w >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+	return (w * 0x0101010101010101ULL) >> 56;
+}
+
+/* Index of the lowest set bit; w must not be zero */
+static unsigned int hy_ctz64(__u64 w)
+{
+	unsigned int n = 0;
+
+	if (!(w & 0xFFFFFFFFULL)) {
+		n += 32;
+		w >>= 32;
+	}
+	if (!(w & 0xFFFF)) {
+		n += 16;
+		w >>= 16;
+	}
+	if (!(w & 0xFF)) {
+		n += 8;
+		w >>= 8;
+	}
+	if (!(w & 0xF)) {
+		n += 4;
+		w >>= 4;
+	}
+	if (!(w & 0x3)) {
+		n += 2;
+		w >>= 2;
+	}
+	if (!(w & 0x1))
+		n++;
+	return n;
+}
+
+static __u64 hy_low_mask(unsigned int n)
+{
+	return n >= 64 ? ~0ULL : (1ULL << n) - 1;
+}
+
+/* Bits lo..hi (inclusive) of a word */
+static __u64 hy_mask(unsigned int lo, unsigned int hi)
+{
+	return (~0ULL << lo) & (~0ULL >> (63 - hi));
+}
+
+/*
+ * Operations on the words of a bitmap container, or of a scratch
+ * bitmap.  Bit i of a chunk is bit (i % 64) of word (i / 64).
+ */
+static unsigned int hy_words_set(__u64 *words, unsigned int lo,
+				 unsigned int hi)
+{
+	unsigned int	w, first = lo >> 6, last = hi >> 6, added = 0;
+	__u64		m;
+
+	for (w = first; w <= last; w++) {
+		m = hy_mask(w == first ? lo & 63 : 0,
+			    w == last ? hi & 63 : 63);
+		added += hy_popcount64(m & ~words[w]);
+		words[w] |= m;
+	}
+	return added;
+}
+
+static unsigned int hy_words_clear(__u64 *words, unsigned int lo,
+				   unsigned int hi)
+{
+	unsigned int	w, first = lo >> 6, last = hi >> 6, removed = 0;
+	__u64		m;
+
+	for (w = first; w <= last; w++) {
+		m = hy_mask(w == first ? lo & 63 : 0,
+			    w == last ? hi & 63 : 63);
+		removed += hy_popcount64(m & words[w]);
+		words[w] &= ~m;
+	}
+	return removed;
+}
+
+/* The first bit at or after pos which is set (or clear), or HY_CHUNK_SIZE */
+static unsigned int hy_words_next(const __u64 *words, unsigned int pos,
+				  int set)
+{
+	unsigned int	w = pos >> 6;
+	__u64		v;
+
+	if (pos >= HY_CHUNK_SIZE)
+		return HY_CHUNK_SIZE;
+	v = set ? words[w] : ~words[w];
+	v &= ~0ULL << (pos & 63);
+	while (!v) {
+		if (++w >= HY_WORDS)
+			return HY_CHUNK_SIZE;
+		v = set ? words[w] : ~words[w];
+	}
+	return (w << 6) + hy_ctz64(v);
+}
+
+/* Read n (at most 64) bits from pos onwards */
+static __u64 hy_words_get(const __u64 *words, unsigned int pos,
+			  unsigned int n)
+{
+	unsigned int	w = pos >> 6, s = pos & 63;
+	__u64		v = words[w] >> s;
+
+	if (s && s + n > 64)
+		v |= words[w + 1] << (64 - s);
+	return v & hy_low_mask(n);
+}
+
+/* Overwrite n (at most 64) bits from pos onwards */
+static void hy_words_put(__u64 *words, unsigned int pos, unsigned int n,
+			 __u64 v)
+{
+	unsigned int	w = pos >> 6, s = pos & 63;
+	__u64		m = hy_low_mask(n);
+
+	v &= m;
+	words[w] = (words[w] & ~(m << s)) | (v << s);
+	if (s && s + n > 64)
+		words[w + 1] = (words[w + 1] & ~(m >> (64 - s))) |
+			(v >> (64 - s));
+}
+
+/* Read n (at most 64) bits from a little-endian bit array */
+static __u64 hy_get_bits(const unsigned char *buf, __u64 bit,
+			 unsigned int n)
+{
+	const unsigned char *p = buf + (bit >> 3);
+	unsigned int	shift = bit & 7, nbytes = (shift + n + 7) >> 3, k;
+	__u64		v = 0;
+
+	for (k = 0; k < nbytes && k < 8; k++)
+		v |= (__u64) p[k] << (8 * k);
+	v >>= shift;
+	if (nbytes > 8)
+		v |= (__u64) p[8] << (64 - shift);
+	return v & hy_low_mask(n);
+}
+
+/* Or n (at most 64) bits into a little-endian bit array */
+static void hy_put_bits(unsigned char *buf, __u64 bit, unsigned int n,
+			__u64 v)
+{
+	unsigned char	*p = buf + (bit >> 3);
+	unsigned int	shift = bit & 7, nbytes = (shift + n + 7) >> 3, k;
+	__u64		lo;
+
+	v &= hy_low_mask(n);
+	lo = v << shift;
+	for (k = 0; k < nbytes && k < 8; k++)
+		p[k] |= (lo >> (8 * k)) & 0xFF;
+	if (nbytes > 8)
+		p[8] |= v >> (64 - shift);
+}
+
+/*
+ * Container storage.  Like the rbtree code, running out of memory in
+ * the middle of marking a bit is not something we can report.
+ */
+static void hy_resize(struct hy_container *c, unsigned int elem_size,
+		      unsigned int size)
+{
+	if (ext2fs_resize_mem((unsigned long) c->size * elem_size,
+			      (unsigned long) size * elem_size, &c->u.array))
+		abort();
+	c->size = size;
+}
+
+/* Make room for at least need entries, but never more than max */
+static void hy_reserve(struct hy_container *c, unsigned int elem_size,
+		       unsigned int need, unsigned int max)
+{
+	unsigned int size = c->size ? c->size : 4;
+
+	if (need <= c->size)
+		return;
+	while (size < need)
+		size *= 2;
+	hy_resize(c, elem_size, size < max ? size : max);
+}
+
+static void hy_shrink(struct hy_container *c, unsigned int elem_size)
+{
+	if (c->size > 4 && c->n < c->size / 4)
+		hy_resize(c, elem_size, c->size / 2);
+}
+
+static void hy_free_container(struct hy_container *c)
+{
+	ext2fs_free_mem(&c->u.array);
+	memset(c, 0, sizeof(struct hy_container));
+}
+
+static unsigned int hy_elem_size(const struct hy_container *c)
+{
+	switch (c->type) {
+	case HY_ARRAY:
+		return sizeof(__u16);
+	case HY_RUN:
+		return sizeof(struct hy_run);
+	case HY_BITMAP:
+		return sizeof(__u64);
+	}
+	return 0;
+}
+
+/* Index of the first array entry >= v */
+static unsigned int hy_array_find(const struct hy_container *c,
+				  unsigned int v)
+{
+	unsigned int lo = 0, hi = c->n, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (c->u.array[mid] < v)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* Index of the first run ending at or after v */
+static unsigned int hy_run_find(const struct hy_container *c,
+				unsigned int v)
+{
+	unsigned int lo = 0, hi = c->n, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (c->u.runs[mid].last < v)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* Expand a container into a scratch bitmap */
+static void hy_get_words(const struct hy_container *c, __u64 *words)
+{
+	unsigned int i;
+
+	memset(words, 0, HY_WORDS * sizeof(__u64));
+	switch (c->type) {
+	case HY_ARRAY:
+		for (i = 0; i < c->n; i++)
+			words[c->u.array[i] >> 6] |=
+				1ULL << (c->u.array[i] & 63);
+		break;
+	case HY_RUN:
+		for (i = 0; i < c->n; i++)
+			hy_words_set(words, c->u.runs[i].start,
+				     c->u.runs[i].last);
+		break;
+	case HY_BITMAP:
+		memcpy(words, c->u.words, HY_WORDS * sizeof(__u64));
+		break;
+	}
+}
+
+/*
+ * Replace the contents of a container with a scratch bitmap (which may
+ * be the container's own words), in whichever container is smallest.
+ */
+static void hy_set_words(struct hy_container *c, const __u64 *words)
+{
+	struct hy_container new;
+	unsigned int	card = 0, nr_runs = 0, i, pos, end;
+	__u64		w, prev = 0;
+
+	for (i = 0; i < HY_WORDS; i++) {
+		w = words[i];
+		card += hy_popcount64(w);
+		nr_runs += hy_popcount64(w & ~((w << 1) | (prev >> 63)));
+		prev = w;
+	}
+	if (card == 0) {
+		hy_free_container(c);
+		return;
+	}
+
+	memset(&new, 0, sizeof(new));
+	if (card <= HY_ARRAY_MAX && card <= 2 * nr_runs) {
+		new.type = HY_ARRAY;
+		hy_resize(&new, sizeof(__u16), card);
+		for (i = 0; i < HY_WORDS; i++) {
+			for (w = words[i]; w; w &= w - 1)
+				new.u.array[new.n++] = (i << 6) + hy_ctz64(w);
+		}
+	} else if (nr_runs < HY_RUN_MAX) {
+		new.type = HY_RUN;
+		hy_resize(&new, sizeof(struct hy_run), nr_runs);
+		pos = hy_words_next(words, 0, 1);
+		while (pos < HY_CHUNK_SIZE) {
+			end = hy_words_next(words, pos, 0);
+			new.u.runs[new.n].start = pos;
+			new.u.runs[new.n].last = end - 1;
+			new.n++;
+			pos = hy_words_next(words, end, 1);
+		}
+	} else if (c->type == HY_BITMAP) {
+		if (words != c->u.words)
+			memcpy(c->u.words, words, HY_WORDS * sizeof(__u64));
+		c->n = card;
+		return;
+	} else {
+		new.type = HY_BITMAP;
+		hy_resize(&new, sizeof(__u64), HY_WORDS);
+		memcpy(new.u.words, words, HY_WORDS * sizeof(__u64));
+		new.n = card;
+	}
+	hy_free_container(c);
+	*c = new;
+}
+
+static void hy_update_slow(struct hy_container *c, unsigned int lo,
+			   unsigned int hi, int set)
+{
+	__u64 words[HY_WORDS];
+
+	hy_get_words(c, words);
+	if (set)
+		hy_words_set(words, lo, hi);
+	else
+		hy_words_clear(words, lo, hi);
+	hy_set_words(c, words);
+}
+
+static int hy_test(const struct hy_container *c, unsigned int off)
+{
+	unsigned int i;
+
+	switch (c->type) {
+	case HY_ARRAY:
+		i = hy_array_find(c, off);
+		return i < c->n && c->u.array[i] == off;
+	case HY_RUN:
+		i = hy_run_find(c, off);
+		return i < c->n && c->u.runs[i].start <= off;
+	case HY_BITMAP:
+		return (c->u.words[off >> 6] >> (off & 63)) & 1;
+	}
+	return 0;
+}
+
+/* Set bits lo..hi of a container */
+static void hy_add(struct hy_container *c, unsigned int lo, unsigned int hi)
+{
+	unsigned int	i, j, len = hi - lo + 1;
+
+	switch (c->type) {
+	case HY_EMPTY:
+		if (lo == hi) {
+			c->type = HY_ARRAY;
+			hy_reserve(c, sizeof(__u16), c->n + 1, HY_ARRAY_MAX);
+			c->u.array[0] = lo;
+		} else {
+			c->type = HY_RUN;
+			hy_reserve(c, sizeof(struct hy_run), c->n + 1,
+				   HY_RUN_MAX);
+			c->u.runs[0].start = lo;
+			c->u.runs[0].last = hi;
+		}
+		c->n = 1;
+		return;
+	case HY_ARRAY:
+		if (len > HY_ARRAY_RANGE)
+			break;
+		i = hy_array_find(c, lo);
+		j = hy_array_find(c, hi + 1);
+		if (j - i == len)
+			return;
+		if (c->n - (j - i) + len > HY_ARRAY_MAX)
+			break;
+		hy_reserve(c, sizeof(__u16), c->n - (j - i) + len,
+			   HY_ARRAY_MAX);
+		memmove(c->u.array + i + len, c->u.array + j,
+			(c->n - j) * sizeof(__u16));
+		c->n += len - (j - i);
+		for (j = 0; j < len; j++)
+			c->u.array[i + j] = lo + j;
+		return;
+	case HY_RUN:
+		/* Merge with every run overlapping or touching lo..hi */
+		i = hy_run_find(c, lo ? lo - 1 : 0);
+		for (j = i; j < c->n && c->u.runs[j].start <= hi + 1; j++)
+			;
+		if (j > i) {
+			if (lo < c->u.runs[i].start)
+				c->u.runs[i].start = lo;
+			c->u.runs[i].last = hi > c->u.runs[j - 1].last ?
+				hi : c->u.runs[j - 1].last;
+			memmove(c->u.runs + i + 1, c->u.runs + j,
+				(c->n - j) * sizeof(struct hy_run));
+			c->n -= j - i - 1;
+			return;
+		}
+		if (c->n >= HY_RUN_MAX)
+			break;
+		hy_reserve(c, sizeof(struct hy_run), c->n + 1,
+				   HY_RUN_MAX);
+		memmove(c->u.runs + i + 1, c->u.runs + i,
+			(c->n - i) * sizeof(struct hy_run));
+		c->u.runs[i].start = lo;
+		c->u.runs[i].last = hi;
+		c->n++;
+		return;
+	case HY_BITMAP:
+		c->n += hy_words_set(c->u.words, lo, hi);
+		/* A full chunk is a single run */
+		if (c->n == HY_CHUNK_SIZE)
+			hy_set_words(c, c->u.words);
+		return;
+	}
+	hy_update_slow(c, lo, hi, 1);
+}
+
+/* Clear bits lo..hi of a container */
+static void hy_remove(struct hy_container *c, unsigned int lo,
+		      unsigned int hi)
+{
+	unsigned int	i, j;
+
+	switch (c->type) {
+	case HY_EMPTY:
+		return;
+	case HY_ARRAY:
+		i = hy_array_find(c, lo);
+		j = hy_array_find(c, hi + 1);
+		if (i == j)
+			return;
+		memmove(c->u.array + i, c->u.array + j,
+			(c->n - j) * sizeof(__u16));
+		c->n -= j - i;
+		break;
+	case HY_RUN:
+		i = hy_run_find(c, lo);
+		if (i == c->n || c->u.runs[i].start > hi)
+			return;
+		if (c->u.runs[i].start < lo && c->u.runs[i].last > hi) {
+			/* Split the run in two */
+			if (c->n >= HY_RUN_MAX) {
+				hy_update_slow(c, lo, hi, 0);
+				return;
+			}
+			hy_reserve(c, sizeof(struct hy_run), c->n + 1,
+				   HY_RUN_MAX);
+			memmove(c->u.runs + i + 1, c->u.runs + i,
+				(c->n - i) * sizeof(struct hy_run));
+			c->u.runs[i].last = lo - 1;
+			c->u.runs[i + 1].start = hi + 1;
+			c->n++;
+			return;
+		}
+		if (c->u.runs[i].start < lo)
+			c->u.runs[i++].last = lo - 1;
+		for (j = i; j < c->n && c->u.runs[j].last <= hi; j++)
+			;
+		if (j < c->n && c->u.runs[j].start <= hi)
+			c->u.runs[j].start = hi + 1;
+		memmove(c->u.runs + i, c->u.runs + j,
+			(c->n - j) * sizeof(struct hy_run));
+		c->n -= j - i;
+		break;
+	case HY_BITMAP:
+		c->n -= hy_words_clear(c->u.words, lo, hi);
+		/* Well below HY_ARRAY_MAX, an array or runs will be smaller */
+		if (c->n <= HY_ARRAY_MAX / 2)
+			hy_set_words(c, c->u.words);
+		return;
+	}
+	if (c->n == 0)
+		hy_free_container(c);
+	else
+		hy_shrink(c, hy_elem_size(c));
+}
+
+/*
+ * Look for the first set (or clear) bit between lo and hi of a
+ * container.  Returns 1 and the bit in *out if there is one.
+ */
+static int hy_find(const struct hy_container *c, unsigned int lo,
+		   unsigned int hi, int set, unsigned int *out)
+{
+	unsigned int	i, v = HY_CHUNK_SIZE;
+
+	switch (c->type) {
+	case HY_EMPTY:
+		if (set)
+			return 0;
+		v = lo;
+		break;
+	case HY_ARRAY:
+		i = hy_array_find(c, lo);
+		if (set) {
+			if (i < c->n)
+				v = c->u.array[i];
+			break;
+		}
+		for (v = lo; i < c->n && c->u.array[i] == v; i++, v++)
+			;
+		break;
+	case HY_RUN:
+		i = hy_run_find(c, lo);
+		if (set) {
+			if (i < c->n)
+				v = c->u.runs[i].start > lo ?
+					c->u.runs[i].start : lo;
+			break;
+		}
+		/* Runs never touch, so the bit after one is clear */
+		v = lo;
+		if (i < c->n && c->u.runs[i].start <= lo)
+			v = c->u.runs[i].last + 1;
+		break;
+	case HY_BITMAP:
+		v = hy_words_next(c->u.words, lo, set);
+		break;
+	}
+	if (v > hi)
+		return 0;
+	*out = v;
+	return 1;
+}
+
+static errcode_t hy_alloc_private_data(ext2fs_generic_bitmap_64 bitmap)
+{
+	struct ext2fs_hy_private *bp;
+	errcode_t	retval;
+
+	retval = ext2fs_get_mem(sizeof(struct ext2fs_hy_private), &bp);
+	if (retval)
+		return retval;
+
+	bp->nr_chunks = hy_nr_chunks(bitmap);
+	retval = ext2fs_get_arrayzero(bp->nr_chunks,
+				      sizeof(struct hy_container),
+				      &bp->chunks);
+	if (retval) {
+		ext2fs_free_mem(&bp);
+		return retval;
+	}
+	bitmap->private = (void *) bp;
+	return 0;
+}
+
+static errcode_t hy_new_bmap(ext2_filsys fs EXT2FS_ATTR((unused)),
+			     ext2fs_generic_bitmap_64 bitmap)
+{
+	return hy_alloc_private_data(bitmap);
+}
+
+static void hy_free_chunks(struct ext2fs_hy_private *bp, __u64 first)
+{
+	__u64 i;
+
+	for (i = first; i < bp->nr_chunks; i++)
+		if (bp->chunks[i].type != HY_EMPTY)
+			hy_free_container(&bp->chunks[i]);
+}
+
+static void hy_free_bmap(ext2fs_generic_bitmap_64 bitmap)
+{
+	struct ext2fs_hy_private *bp;
+
+	bp = (struct ext2fs_hy_private *) bitmap->private;
+	if (!bp)
+		return;
+
+	hy_free_chunks(bp, 0);
+	ext2fs_free_mem(&bp->chunks);
+	ext2fs_free_mem(&bp);
+	bitmap->private = NULL;
+}
+
+static errcode_t hy_copy_bmap(ext2fs_generic_bitmap_64 src,
+			      ext2fs_generic_bitmap_64 dest)
+{
+	struct ext2fs_hy_private *src_bp, *dest_bp;
+	struct hy_container *s, *d;
+	unsigned int	elem_size;
+	errcode_t	retval;
+	__u64		i;
+
+	retval = hy_alloc_private_data(dest);
+	if (retval)
+		return retval;
+
+	src_bp = (struct ext2fs_hy_private *) src->private;
+	dest_bp = (struct ext2fs_hy_private *) dest->private;
+	for (i = 0; i < src_bp->nr_chunks; i++) {
+		s = &src_bp->chunks[i];
+		d = &dest_bp->chunks[i];
+		if (s->type == HY_EMPTY)
+			continue;
+		elem_size = hy_elem_size(s);
+		retval = ext2fs_get_array(s->type == HY_BITMAP ? HY_WORDS : s->n,
+					  elem_size, &d->u.array);
+		if (retval) {
+			hy_free_bmap(dest);
+			return retval;
+		}
+		memcpy(d->u.array, s->u.array,
+		       (s->type == HY_BITMAP ? HY_WORDS : s->n) * elem_size);
+		d->type = s->type;
+		d->n = s->n;
+		d->size = s->type == HY_BITMAP ? HY_WORDS : s->n;
+	}
+	return 0;
+}
+
+static void hy_update_range(struct ext2fs_hy_private *bp, __u64 bit,
+			    __u64 num, int set)
+{
+	__u64		end = bit + num, chunk;
+	unsigned int	lo, hi;
+
+	while (bit < end) {
+		chunk = bit >> HY_CHUNK_BITS;
+		lo = bit & HY_CHUNK_MASK;
+		if (((end - 1) >> HY_CHUNK_BITS) == chunk)
+			hi = (end - 1) & HY_CHUNK_MASK;
+		else
+			hi = HY_CHUNK_MASK;
+		if (set)
+			hy_add(&bp->chunks[chunk], lo, hi);
+		else
+			hy_remove(&bp->chunks[chunk], lo, hi);
+		bit = (chunk + 1) << HY_CHUNK_BITS;
+	}
+}
+
+static errcode_t hy_resize_bmap(ext2fs_generic_bitmap_64 bmap,
+				__u64 new_end, __u64 new_real_end)
+{
+	struct ext2fs_hy_private *bp;
+	__u64		keep, nr_chunks;
+	errcode_t	retval;
+
+	bp = (struct ext2fs_hy_private *) bmap->private;
+
+	/* Clear everything past the end of the bitmap */
+	keep = ((new_end < bmap->end) ? new_end : bmap->end) - bmap->start + 1;
+	if (keep <= bmap->real_end - bmap->start)
+		hy_update_range(bp, keep,
+				bmap->real_end - bmap->start + 1 - keep, 0);
+
+	nr_chunks = ((new_real_end - bmap->start) >> HY_CHUNK_BITS) + 1;
+	if (nr_chunks != bp->nr_chunks) {
+		hy_free_chunks(bp, nr_chunks);
+		retval = ext2fs_resize_mem(bp->nr_chunks *
+					   sizeof(struct hy_container),
+					   nr_chunks *
+					   sizeof(struct hy_container),
+					   &bp->chunks);
+		if (retval)
+			return retval;
+		if (nr_chunks > bp->nr_chunks)
+			memset(bp->chunks + bp->nr_chunks, 0,
+			       (nr_chunks - bp->nr_chunks) *
+			       sizeof(struct hy_container));
+		bp->nr_chunks = nr_chunks;
+	}
+
+	bmap->end = new_end;
+	bmap->real_end = new_real_end;
+	return 0;
+}
+
+static int hy_mark_bmap(ext2fs_generic_bitmap_64 bitmap, __u64 arg)
+{
+	struct ext2fs_hy_private *bp;
+	struct hy_container *c;
+	unsigned int	off;
+
+	bp = (struct ext2fs_hy_private *) bitmap->private;
+	arg -= bitmap->start;
+	c = &bp->chunks[arg >> HY_CHUNK_BITS];
+	off = arg & HY_CHUNK_MASK;
+
+	if (hy_test(c, off))
+		return 1;
+	hy_add(c, off, off);
+	return 0;
+}
+
+static int hy_unmark_bmap(ext2fs_generic_bitmap_64 bitmap, __u64 arg)
+{
+	struct ext2fs_hy_private *bp;
+	struct hy_container *c;
+	unsigned int	off;
+
+	bp = (struct ext2fs_hy_private *) bitmap->private;
+	arg -= bitmap->start;
+	c = &bp->chunks[arg >> HY_CHUNK_BITS];
+	off = arg & HY_CHUNK_MASK;
+
+	if (!hy_test(c, off))
+		return 0;
+	hy_remove(c, off, off);
+	return 1;
+}
+
+static int hy_test_bmap(ext2fs_generic_bitmap_64 bitmap, __u64 arg)
+{
+	struct ext2fs_hy_private *bp;
+
+	bp = (struct ext2fs_hy_private *) bitmap->private;
+	arg -= bitmap->start;
+	return hy_test(&bp->chunks[arg >> HY_CHUNK_BITS],
+		       arg & HY_CHUNK_MASK);
+}
+
+static void hy_mark_bmap_extent(ext2fs_generic_bitmap_64 bitmap, __u64 arg,
+				unsigned int num)
+{
+	struct ext2fs_hy_private *bp;
+
+	bp = (struct ext2fs_hy_private *) bitmap->private;
+	hy_update_range(bp, arg - bitmap->start, num, 1);
+}
+
+static void hy_unmark_bmap_extent(ext2fs_generic_bitmap_64 bitmap, __u64 arg,
+				  unsigned int num)
+{
+	struct ext2fs_hy_private *bp;
+
+	bp = (struct ext2fs_hy_private *) bitmap->private;
+	hy_update_range(bp, arg - bitmap->start, num, 0);
+}
+
+/* Find the first set (or clear) bit between start and end, inclusive. */
+static errcode_t hy_find_first(ext2fs_generic_bitmap_64 bitmap,
+			       __u64 start, __u64 end, int set, __u64 *out)
+{
+	struct ext2fs_hy_private *bp;
+	__u64		bit, last, chunk;
+	unsigned int	lo, hi, off;
+
+	bp = (struct ext2fs_hy_private *) bitmap->private;
+	bit = start - bitmap->start;
+	last = end - bitmap->start;
+
+	while (bit <= last) {
+		chunk = bit >> HY_CHUNK_BITS;
+		lo = bit & HY_CHUNK_MASK;
+		if ((last >> HY_CHUNK_BITS) == chunk)
+			hi = last & HY_CHUNK_MASK;
+		else
+			hi = HY_CHUNK_MASK;
+		if (hy_find(&bp->chunks[chunk], lo, hi, set, &off)) {
+			*out = (chunk << HY_CHUNK_BITS) + off + bitmap->start;
+			return 0;
+		}
+		bit = (chunk + 1) << HY_CHUNK_BITS;
+	}
+	return ENOENT;
+}
+
+static int hy_test_clear_bmap_extent(ext2fs_generic_bitmap_64 bitmap,
+				     __u64 start, unsigned int len)
+{
+	__u64 found;
+
+	if (len == 0)
+		return 1;
+	return hy_find_first(bitmap, start, start + len - 1, 1,
+			     &found) == ENOENT;
+}
+
+static errcode_t hy_set_bmap_range(ext2fs_generic_bitmap_64 bitmap,
+				   __u64 start, size_t num, void *in)
+{
+	struct ext2fs_hy_private *bp;
+	struct hy_container *c;
+	__u64		words[HY_WORDS];
+	__u64		bit, i = 0;
+	unsigned int	lo, n, k, count;
+
+	bp = (struct ext2fs_hy_private *) bitmap->private;
+	bit = start - bitmap->start;
+
+	while (i < num) {
+		c = &bp->chunks[bit >> HY_CHUNK_BITS];
+		lo = bit & HY_CHUNK_MASK;
+		n = HY_CHUNK_SIZE - lo;
+		if (n > num - i)
+			n = num - i;
+		if (n == HY_CHUNK_SIZE)
+			memset(words, 0, sizeof(words));
+		else
+			hy_get_words(c, words);
+		for (k = 0; k < n; k += count) {
+			count = n - k < 64 ? n - k : 64;
+			hy_words_put(words, lo + k, count,
+				     hy_get_bits(in, i + k, count));
+		}
+		hy_set_words(c, words);
+		bit += n;
+		i += n;
+	}
+	return 0;
+}
+
+static errcode_t hy_get_bmap_range(ext2fs_generic_bitmap_64 bitmap,
+				   __u64 start, size_t num, void *out)
+{
+	struct ext2fs_hy_private *bp;
+	struct hy_container *c;
+	__u64		words[HY_WORDS];
+	__u64		bit, i = 0, v;
+	unsigned int	lo, n, k, count;
+
+	bp = (struct ext2fs_hy_private *) bitmap->private;
+	bit = start - bitmap->start;
+	memset(out, 0, (num + 7) >> 3);
+
+	while (i < num) {
+		c = &bp->chunks[bit >> HY_CHUNK_BITS];
+		lo = bit & HY_CHUNK_MASK;
+		n = HY_CHUNK_SIZE - lo;
+		if (n > num - i)
+			n = num - i;
+		if (c->type != HY_EMPTY) {
+			hy_get_words(c, words);
+			for (k = 0; k < n; k += count) {
+				count = n - k < 64 ? n - k : 64;
+				v = hy_words_get(words, lo + k, count);
+				if (v)
+					hy_put_bits(out, i + k, count, v);
+			}
+		}
+		bit += n;
+		i += n;
+	}
+	return 0;
+}
+
+static void hy_clear_bmap(ext2fs_generic_bitmap_64 bitmap)
+{
+	struct ext2fs_hy_private *bp;
+
+	bp = (struct ext2fs_hy_private *) bitmap->private;
+	hy_free_chunks(bp, 0);
+}
+
+#ifdef ENABLE_BMAP_STATS
+static void hy_print_stats(ext2fs_generic_bitmap_64 bitmap)
+{
+	struct ext2fs_hy_private *bp;
+	struct hy_container *c;
+	__u64		count[4] = { 0, 0, 0, 0 };
+	__u64		bytes, i;
+	double		eff;
+
+	bp = (struct ext2fs_hy_private *) bitmap->private;
+	bytes = sizeof(struct ext2fs_hy_private) +
+		bp->nr_chunks * sizeof(struct hy_container);
+	for (i = 0; i < bp->nr_chunks; i++) {
+		c = &bp->chunks[i];
+		count[c->type]++;
+		bytes += (__u64) c->size * hy_elem_size(c);
+	}
+	eff = (double)(bytes << 3) / (bitmap->real_end - bitmap->start);
+
+	fprintf(stderr, "%16llu empty chunks\n%16llu array chunks\n"
+		"%16llu run chunks\n%16llu bitmap chunks\n",
+		count[HY_EMPTY], count[HY_ARRAY], count[HY_RUN],
+		count[HY_BITMAP]);
+	fprintf(stderr, "%16llu bytes used by hybrid bitmap\n", bytes);
+	fprintf(stderr,
+		"%16.4lf memory / bitmap bit memory ratio (bitarray = 1)\n",
+		eff);
+}
+#else
+static void hy_print_stats(ext2fs_generic_bitmap_64 bitmap EXT2FS_ATTR((unused)))
+{
+}
+#endif
+
+static errcode_t hy_find_first_zero(ext2fs_generic_bitmap_64 bitmap,
+				    __u64 start, __u64 end, __u64 *out)
+{
+	return hy_find_first(bitmap, start, end, 0, out);
+}
+
+static errcode_t hy_find_first_set(ext2fs_generic_bitmap_64 bitmap,
+				   __u64 start, __u64 end, __u64 *out)
+{
+	return hy_find_first(bitmap, start, end, 1, out);
+}
+
+struct ext2_bitmap_ops ext2fs_blkmap64_hybrid = {
+	.type = EXT2FS_BMAP64_HYBRID,
+	.new_bmap = hy_new_bmap,
+	.free_bmap = hy_free_bmap,
+	.copy_bmap = hy_copy_bmap,
+	.resize_bmap = hy_resize_bmap,
+	.mark_bmap = hy_mark_bmap,
+	.unmark_bmap = hy_unmark_bmap,
+	.test_bmap = hy_test_bmap,
+	.test_clear_bmap_extent = hy_test_clear_bmap_extent,
+	.mark_bmap_extent = hy_mark_bmap_extent,
+	.unmark_bmap_extent = hy_unmark_bmap_extent,
+	.set_bmap_range = hy_set_bmap_range,
+	.get_bmap_range = hy_get_bmap_range,
+	.clear_bmap = hy_clear_bmap,
+	.print_stats = hy_print_stats,
+	.find_first_zero = hy_find_first_zero,
+	.find_first_set = hy_find_first_set
+};
@@ -40,11 +40,31 @@ struct bmap_rb_extent {
 	__u64 count;
 };
 
+/*
+ * Extents are carved out of slabs, which grow as the tree does, and
+ * freed extents are chained through node.rb_right for reuse.  Busy
+ * bitmaps then spend little time in malloc, the nodes of a tree stay
+ * close together in memory, and a whole tree can be thrown away by
+ * freeing its slabs.
+ */
+#define RB_SLAB_MIN	32
+#define RB_SLAB_MAX	8192
+
+struct bmap_rb_slab {
+	struct bmap_rb_slab *next;
+	unsigned int size;		/* extents following this header */
+};
+
 struct ext2fs_rb_private {
 	struct rb_root root;
 	struct bmap_rb_extent *wcursor;
+	__u64 wcursor_limit;		/* start of the extent after wcursor;
+					 * ~0 if none, 0 if not known */
 	struct bmap_rb_extent *rcursor;
 	struct bmap_rb_extent *rcursor_next;
+	struct bmap_rb_slab *slabs;
+	unsigned int slab_used;		/* extents used in slabs */
+	struct bmap_rb_extent *free_extents;
 #ifdef ENABLE_BMAP_STATS_OPS
 	__u64 mark_hit;
 	__u64 test_hit;
@@ -64,11 +84,12 @@ inline static struct bmap_rb_extent *node_to_extent(struct rb_node *node)
 
 static int rb_insert_extent(__u64 start, __u64 count,
 			    struct ext2fs_rb_private *);
-static void rb_get_new_extent(struct bmap_rb_extent **, __u64, __u64);
 
 /* #define DEBUG_RB */
 
 #ifdef DEBUG_RB
+int ext2fs_rb_check_tree = 1;	/* tst_bitmaps turns this off to time ops */
+
 static void print_tree(struct rb_root *root)
 {
 	struct rb_node *node = NULL;
@@ -90,6 +111,8 @@ static void check_tree(struct rb_root *root, const char *msg)
 	struct rb_node *node;
 	struct bmap_rb_extent *ext, *old = NULL;
 
+	if (!ext2fs_rb_check_tree)
+		return;
 	for (node = ext2fs_rb_first(root); node;
 	     node = ext2fs_rb_next(node)) {
 		ext = node_to_extent(node);
@@ -148,15 +171,40 @@ err_out:
 #define print_tree(root) do {} while (0)
 #endif
 
-static void rb_get_new_extent(struct bmap_rb_extent **ext, __u64 start,
-			     __u64 count)
+static struct bmap_rb_extent *rb_alloc_extent(struct ext2fs_rb_private *bp)
+{
+	struct bmap_rb_extent *ext = bp->free_extents;
+	struct bmap_rb_slab *slab = bp->slabs;
+	unsigned int size;
+
+	if (ext) {
+		bp->free_extents = node_to_extent(ext->node.rb_right);
+		return ext;
+	}
+	if (!slab || bp->slab_used == slab->size) {
+		size = slab ? slab->size * 2 : RB_SLAB_MIN;
+		if (size > RB_SLAB_MAX)
+			size = RB_SLAB_MAX;
+		if (ext2fs_get_mem(sizeof(struct bmap_rb_slab) +
+				   size * sizeof(struct bmap_rb_extent),
+				   &slab))
+			return NULL;
+		slab->next = bp->slabs;
+		slab->size = size;
+		bp->slabs = slab;
+		bp->slab_used = 0;
+	}
+	return (struct bmap_rb_extent *) (slab + 1) + bp->slab_used++;
+}
+
+static void rb_get_new_extent(struct ext2fs_rb_private *bp,
+			      struct bmap_rb_extent **ext, __u64 start,
+			      __u64 count)
 {
 	struct bmap_rb_extent *new_ext;
-	int retval;
 
-	retval = ext2fs_get_mem(sizeof (struct bmap_rb_extent),
-				&new_ext);
-	if (retval)
+	new_ext = rb_alloc_extent(bp);
+	if (!new_ext)
 		abort();
 
 	new_ext->start = start;
@@ -174,7 +222,41 @@ static void rb_free_extent(struct ext2fs_rb_private *bp,
 		bp->rcursor = NULL;
 	if (bp->rcursor_next == ext)
 		bp->rcursor_next = NULL;
-	ext2fs_free_mem(&ext);
+	bp->wcursor_limit = 0;
+	ext->node.rb_right = (struct rb_node *) bp->free_extents;
+	bp->free_extents = ext;
+}
+
+/* Free every extent at once */
+static void rb_free_extents(struct ext2fs_rb_private *bp)
+{
+	struct bmap_rb_slab *slab, *next;
+
+	for (slab = bp->slabs; slab; slab = next) {
+		next = slab->next;
+		ext2fs_free_mem(&slab);
+	}
+	bp->root = RB_ROOT;
+	bp->slabs = NULL;
+	bp->slab_used = 0;
+	bp->free_extents = NULL;
+	bp->wcursor = NULL;
+	bp->wcursor_limit = 0;
+	bp->rcursor = NULL;
+	bp->rcursor_next = NULL;
+}
+
+/* Start of the extent after the write cursor, or ~0 if there is none */
+static __u64 rb_wcursor_limit(struct ext2fs_rb_private *bp)
+{
+	struct rb_node *next;
+
+	if (!bp->wcursor_limit) {
+		next = ext2fs_rb_next(&bp->wcursor->node);
+		bp->wcursor_limit = next ? node_to_extent(next)->start :
+			~0ULL;
+	}
+	return bp->wcursor_limit;
 }
 
 static errcode_t rb_alloc_private_data (ext2fs_generic_bitmap_64 bitmap)
@@ -190,6 +272,10 @@ static errcode_t rb_alloc_private_data (ext2fs_generic_bitmap_64 bitmap)
 	bp->rcursor = NULL;
 	bp->rcursor_next = NULL;
 	bp->wcursor = NULL;
+	bp->wcursor_limit = 0;
+	bp->slabs = NULL;
+	bp->slab_used = 0;
+	bp->free_extents = NULL;
 
 #ifdef ENABLE_BMAP_STATS_OPS
 	bp->test_hit = 0;
@@ -212,36 +298,49 @@ static errcode_t rb_new_bmap(ext2_filsys fs EXT2FS_ATTR((unused)),
 	return 0;
 }
 
-static void rb_free_tree(struct rb_root *root)
-{
-	struct bmap_rb_extent *ext;
-	struct rb_node *node, *next;
-
-	for (node = ext2fs_rb_first(root); node; node = next) {
-		next = ext2fs_rb_next(node);
-		ext = node_to_extent(node);
-		ext2fs_rb_erase(node, root);
-		ext2fs_free_mem(&ext);
-	}
-}
-
 static void rb_free_bmap(ext2fs_generic_bitmap_64 bitmap)
 {
 	struct ext2fs_rb_private *bp;
 
 	bp = (struct ext2fs_rb_private *) bitmap->private;
 
-	rb_free_tree(&bp->root);
+	rb_free_extents(bp);
 	ext2fs_free_mem(&bp);
 	bp = 0;
 }
 
+/* Copy the subtree at @src node for node, keeping its shape and colours */
+static errcode_t rb_copy_subtree(struct ext2fs_rb_private *bp,
+				 struct rb_node *src, struct rb_node *parent,
+				 struct rb_node **dest)
+{
+	struct bmap_rb_extent *ext;
+	errcode_t retval;
+
+	*dest = NULL;
+	if (!src)
+		return 0;
+	ext = rb_alloc_extent(bp);
+	if (!ext)
+		return EXT2_ET_NO_MEMORY;
+	ext->start = node_to_extent(src)->start;
+	ext->count = node_to_extent(src)->count;
+	ext->node.rb_parent_color = (uintptr_t) parent |
+		ext2fs_rb_color(src);
+	*dest = &ext->node;
+
+	retval = rb_copy_subtree(bp, src->rb_left, &ext->node,
+				 &ext->node.rb_left);
+	if (retval)
+		return retval;
+	return rb_copy_subtree(bp, src->rb_right, &ext->node,
+			       &ext->node.rb_right);
+}
+
 static errcode_t rb_copy_bmap(ext2fs_generic_bitmap_64 src,
 			      ext2fs_generic_bitmap_64 dest)
 {
 	struct ext2fs_rb_private *src_bp, *dest_bp;
-	struct bmap_rb_extent *src_ext, *dest_ext;
-	struct rb_node *dest_node, *src_node, *dest_last, **n;
 	errcode_t retval = 0;
 
 	retval = rb_alloc_private_data (dest);
@@ -251,38 +350,20 @@ static errcode_t rb_copy_bmap(ext2fs_generic_bitmap_64 src,
 	src_bp = (struct ext2fs_rb_private *) src->private;
 	dest_bp = (struct ext2fs_rb_private *) dest->private;
 	src_bp->rcursor = NULL;
-	dest_bp->rcursor = NULL;
-
-	src_node = ext2fs_rb_first(&src_bp->root);
-	while (src_node) {
-		src_ext = node_to_extent(src_node);
-		retval = ext2fs_get_mem(sizeof (struct bmap_rb_extent),
-					&dest_ext);
-		if (retval)
-			break;
-
-		memcpy(dest_ext, src_ext, sizeof(struct bmap_rb_extent));
-
-		dest_node = &dest_ext->node;
-		n = &dest_bp->root.rb_node;
-
-		dest_last = NULL;
-		if (*n) {
-			dest_last = ext2fs_rb_last(&dest_bp->root);
-			n = &(dest_last)->rb_right;
-		}
 
-		ext2fs_rb_link_node(dest_node, dest_last, n);
-		ext2fs_rb_insert_color(dest_node, &dest_bp->root);
-
-		src_node = ext2fs_rb_next(src_node);
+	retval = rb_copy_subtree(dest_bp, src_bp->root.rb_node, NULL,
+				 &dest_bp->root.rb_node);
+	if (retval) {
+		rb_free_extents(dest_bp);
+		ext2fs_free_mem(&dest_bp);
+		dest->private = NULL;
 	}
-
 	return retval;
 }
 
-static void rb_truncate(__u64 new_max, struct rb_root *root)
+static void rb_truncate(__u64 new_max, struct ext2fs_rb_private *bp)
 {
+	struct rb_root *root = &bp->root;
 	struct bmap_rb_extent *ext;
 	struct rb_node *node;
 
@@ -294,7 +375,7 @@ static void rb_truncate(__u64 new_max, struct rb_root *root)
 			break;
 		else if (ext->start > new_max) {
 			ext2fs_rb_erase(node, root);
-			ext2fs_free_mem(&ext);
+			rb_free_extent(bp, ext);
 			node = ext2fs_rb_last(root);
 			continue;
 		} else
@@ -312,7 +393,7 @@ static errcode_t rb_resize_bmap(ext2fs_generic_bitmap_64 bmap,
 	bp->wcursor = NULL;
 
 	rb_truncate(((new_end < bmap->end) ? new_end : bmap->end) - bmap->start,
-		    &bp->root);
+		    bp);
 
 	bmap->end = new_end;
 	bmap->real_end = new_real_end;
@@ -344,7 +425,7 @@ rb_test_bit(struct ext2fs_rb_private *bp, __u64 bit)
 	}
 
 	next_ext = bp->rcursor_next;
-	if (!next_ext) {
+	if (!next_ext && bit == rcursor->start + rcursor->count) {
 		next = ext2fs_rb_next(&rcursor->node);
 		if (next)
 			next_ext = node_to_extent(next);
@@ -358,6 +439,13 @@ rb_test_bit(struct ext2fs_rb_private *bp, __u64 bit)
 #endif
 			return 0;
 		}
+		/* Step on to the next extent */
+		if (bit >= next_ext->start &&
+		    bit < next_ext->start + next_ext->count) {
+			bp->rcursor = next_ext;
+			bp->rcursor_next = NULL;
+			return 1;
+		}
 	}
 	bp->rcursor = NULL;
 	bp->rcursor_next = NULL;
@@ -395,6 +483,7 @@ static int rb_insert_extent(__u64 start, __u64 count,
 	struct rb_node *new_node, *node, *next;
 	struct bmap_rb_extent *new_ext;
 	struct bmap_rb_extent *ext;
+	__u64 end, limit;
 	int retval = 0;
 
 	if (count == 0)
@@ -402,13 +491,41 @@ static int rb_insert_extent(__u64 start, __u64 count,
 
 	bp->rcursor_next = NULL;
 	ext = bp->wcursor;
-	if (ext) {
-		if (start >= ext->start &&
-		    start <= (ext->start + ext->count)) {
+	if (ext && start >= ext->start) {
+		/*
+		 * Bits set in ascending order, the common case, either
+		 * extend the write cursor or go in the gap just after it;
+		 * either way no search or merging is needed as long as
+		 * they stay clear of the next extent.
+		 */
+		end = ext->start + ext->count;
+		limit = rb_wcursor_limit(bp);
+		if (start <= end) {
 #ifdef ENABLE_BMAP_STATS_OPS
 			bp->mark_hit++;
 #endif
-			goto got_extent;
+			if (start + count <= end)
+				return 1;
+			if (start + count >= limit)
+				goto got_extent;
+			ext->count = start + count - ext->start;
+			return start < end;
+		}
+		if (start + count < limit) {
+			rb_get_new_extent(bp, &new_ext, start, count);
+			node = ext->node.rb_right;
+			if (node) {
+				while (node->rb_left)
+					node = node->rb_left;
+				n = &node->rb_left;
+			} else {
+				node = &ext->node;
+				n = &node->rb_right;
+			}
+			ext2fs_rb_link_node(&new_ext->node, node, n);
+			ext2fs_rb_insert_color(&new_ext->node, root);
+			bp->wcursor = new_ext;
+			return 0;
 		}
 	}
 
@@ -439,12 +556,11 @@ got_extent:
 		}
 	}
 
-	rb_get_new_extent(&new_ext, start, count);
+	rb_get_new_extent(bp, &new_ext, start, count);
 
 	new_node = &new_ext->node;
 	ext2fs_rb_link_node(new_node, parent, n);
 	ext2fs_rb_insert_color(new_node, root);
-	bp->wcursor = new_ext;
 
 	node = ext2fs_rb_prev(new_node);
 	if (node) {
@@ -487,6 +603,8 @@ skip_insert:
 
 	new_ext->start = start;
 	new_ext->count = count;
+	bp->wcursor = new_ext;
+	bp->wcursor_limit = 0;
 
 	return retval;
 }
@@ -810,92 +928,133 @@ static void rb_clear_bmap(ext2fs_generic_bitmap_64 bitmap)
 
 	bp = (struct ext2fs_rb_private *) bitmap->private;
 
-	rb_free_tree(&bp->root);
-	bp->rcursor = NULL;
-	bp->rcursor_next = NULL;
-	bp->wcursor = NULL;
+	rb_free_extents(bp);
 	check_tree(&bp->root, __func__);
 }
 
+/*
+ * Find the extent containing @bit, trying the read cursor and the extent
+ * after it before searching the tree.  If @bit is clear, returns NULL
+ * and, if @next isn't NULL, sets *next to the first extent after @bit
+ * (NULL if there is none).  A walk over the bitmap in ascending order
+ * thus steps from one extent to the next without searching.
+ */
+static struct bmap_rb_extent *rb_find_extent(struct ext2fs_rb_private *bp,
+					     __u64 bit,
+					     struct bmap_rb_extent **next)
+{
+	struct rb_node *parent = NULL, **n = &bp->root.rb_node;
+	struct bmap_rb_extent *ext, *next_ext, *unused;
+	struct rb_node *node;
+	int want_next = (next != NULL);
+
+	if (!next)
+		next = &unused;
+	ext = bp->rcursor;
+	if (ext && bit >= ext->start) {
+		if (bit < ext->start + ext->count)
+			return ext;
+		/* Only step forward when just past the cursor */
+		next_ext = bp->rcursor_next;
+		if (!next_ext && bit == ext->start + ext->count) {
+			node = ext2fs_rb_next(&ext->node);
+			if (!node) {
+				*next = NULL;
+				return NULL;
+			}
+			next_ext = bp->rcursor_next = node_to_extent(node);
+		}
+		if (next_ext && bit < next_ext->start) {
+			*next = next_ext;
+			return NULL;
+		}
+		if (next_ext && bit < next_ext->start + next_ext->count) {
+			bp->rcursor = next_ext;
+			bp->rcursor_next = NULL;
+			return next_ext;
+		}
+	}
+
+	while (*n) {
+		parent = *n;
+		ext = node_to_extent(parent);
+		if (bit < ext->start) {
+			n = &(*n)->rb_left;
+		} else if (bit >= (ext->start + ext->count)) {
+			n = &(*n)->rb_right;
+		} else {
+			bp->rcursor = ext;
+			bp->rcursor_next = NULL;
+			return ext;
+		}
+	}
+
+	/* The search ended next to @bit, on one side or the other */
+	*next = NULL;
+	if (!want_next)
+		return NULL;
+	if (!parent)
+		return NULL;
+	ext = node_to_extent(parent);
+	if (ext->start < bit) {
+		bp->rcursor = ext;
+		parent = ext2fs_rb_next(parent);
+		ext = parent ? node_to_extent(parent) : NULL;
+		bp->rcursor_next = ext;
+	}
+	*next = ext;
+	return NULL;
+}
+
 static errcode_t rb_find_first_zero(ext2fs_generic_bitmap_64 bitmap,
 				   __u64 start, __u64 end, __u64 *out)
 {
-	struct rb_node *parent = NULL, **n;
 	struct ext2fs_rb_private *bp;
 	struct bmap_rb_extent *ext;
 
 	bp = (struct ext2fs_rb_private *) bitmap->private;
-	n = &bp->root.rb_node;
 	start -= bitmap->start;
 	end -= bitmap->start;
 
 	if (start > end)
 		return EINVAL;
 
-	if (ext2fs_rb_empty_root(&bp->root))
-		return ENOENT;
-
-	while (*n) {
-		parent = *n;
-		ext = node_to_extent(parent);
-		if (start < ext->start) {
-			n = &(*n)->rb_left;
-		} else if (start >= (ext->start + ext->count)) {
-			n = &(*n)->rb_right;
-		} else if (ext->start + ext->count <= end) {
-			*out = ext->start + ext->count + bitmap->start;
-			return 0;
-		} else
-			return ENOENT;
+	ext = rb_find_extent(bp, start, NULL);
+	if (!ext) {
+		*out = start + bitmap->start;
+		return 0;
 	}
-
-	*out = start + bitmap->start;
-	return 0;
+	/* Extents never touch, so the bit after one is always clear */
+	if (ext->start + ext->count <= end) {
+		*out = ext->start + ext->count + bitmap->start;
+		return 0;
+	}
+	return ENOENT;
 }
 
 static errcode_t rb_find_first_set(ext2fs_generic_bitmap_64 bitmap,
 				   __u64 start, __u64 end, __u64 *out)
 {
-	struct rb_node *parent = NULL, **n;
-	struct rb_node *node;
 	struct ext2fs_rb_private *bp;
-	struct bmap_rb_extent *ext;
+	struct bmap_rb_extent *ext, *next;
 
 	bp = (struct ext2fs_rb_private *) bitmap->private;
-	n = &bp->root.rb_node;
 	start -= bitmap->start;
 	end -= bitmap->start;
 
 	if (start > end)
 		return EINVAL;
 
-	if (ext2fs_rb_empty_root(&bp->root))
-		return ENOENT;
-
-	while (*n) {
-		parent = *n;
-		ext = node_to_extent(parent);
-		if (start < ext->start) {
-			n = &(*n)->rb_left;
-		} else if (start >= (ext->start + ext->count)) {
-			n = &(*n)->rb_right;
-		} else {
-			/* The start bit is set */
-			*out = start + bitmap->start;
-			return 0;
-		}
-	}
-
-	node = parent;
-	ext = node_to_extent(node);
-	if (ext->start < start) {
-		node = ext2fs_rb_next(node);
-		if (node == NULL)
-			return ENOENT;
-		ext = node_to_extent(node);
+	ext = rb_find_extent(bp, start, &next);
+	if (ext) {
+		*out = start + bitmap->start;
+		return 0;
 	}
-	if (ext->start <= end) {
-		*out = ext->start + bitmap->start;
+	if (next && next->start <= end) {
+		/* A scan will most likely carry on from there */
+		bp->rcursor = next;
+		bp->rcursor_next = NULL;
+		*out = next->start + bitmap->start;
 		return 0;
 	}
 	return ENOENT;
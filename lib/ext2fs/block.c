@@ -567,6 +567,165 @@ errout:
 	return (ret & BLOCK_ERROR) ? ctx.errcode : 0;
 }
 
+/*
+ * Iterate over the blocks of an inode a run at a time.
+ *
+ * The callback is handed runs of physically and logically contiguous
+ * data blocks, (lblk, pblk, len), instead of being called once per
+ * block; extent-mapped inodes are walked an extent at a time, and the
+ * block-mapped ones have their blocks coalesced into runs.  Metadata
+ * blocks (extent tree blocks, indirect blocks and the HURD translator
+ * block) are passed as runs of length one with BLOCK_RUN_METADATA set
+ * in run_flags and lblk set to the usual BLOCK_COUNT_* value, in the
+ * same order ext2fs_block_iterate3() would report them.  Inodes with
+ * inline data have no blocks, so the callback is never called.
+ *
+ * Only BLOCK_FLAG_DATA_ONLY and BLOCK_FLAG_DEPTH_TRAVERSE are
+ * honoured; the block numbers can't be changed, and the callback
+ * returns BLOCK_ABORT to stop early.
+ */
+struct run_context {
+	int (*func)(ext2_filsys fs,
+		    e2_blkcnt_t	lblk,
+		    blk64_t	pblk,
+		    blk64_t	len,
+		    int		run_flags,
+		    void	*priv_data);
+	void		*priv_data;
+	e2_blkcnt_t	lblk;
+	blk64_t		pblk;
+	blk64_t		len;
+	int		ret;
+};
+
+static int flush_run(ext2_filsys fs, struct run_context *rc)
+{
+	int	ret = 0;
+
+	if (rc->len) {
+		ret = (*rc->func)(fs, rc->lblk, rc->pblk, rc->len, 0,
+				  rc->priv_data);
+		rc->len = 0;
+	}
+	return ret;
+}
+
+static int coalesce_run_func(ext2_filsys fs, blk64_t *blocknr,
+			     e2_blkcnt_t blockcnt,
+			     blk64_t ref_blk EXT2FS_ATTR((unused)),
+			     int ref_offset EXT2FS_ATTR((unused)),
+			     void *priv_data)
+{
+	struct run_context *rc = (struct run_context *) priv_data;
+
+	if (blockcnt < 0) {
+		rc->ret = flush_run(fs, rc);
+		if (!(rc->ret & BLOCK_ABORT))
+			rc->ret = (*rc->func)(fs, blockcnt, *blocknr, 1,
+					      BLOCK_RUN_METADATA,
+					      rc->priv_data);
+		return rc->ret & BLOCK_ABORT;
+	}
+	if (rc->len && blockcnt == rc->lblk + (e2_blkcnt_t) rc->len &&
+	    *blocknr == rc->pblk + rc->len) {
+		rc->len++;
+		return 0;
+	}
+	rc->ret = flush_run(fs, rc);
+	rc->lblk = blockcnt;
+	rc->pblk = *blocknr;
+	rc->len = 1;
+	return rc->ret & BLOCK_ABORT;
+}
+
+errcode_t ext2fs_block_iterate_runs(ext2_filsys fs,
+				    ext2_ino_t ino,
+				    int	flags,
+				    char *block_buf,
+				    int (*func)(ext2_filsys fs,
+						e2_blkcnt_t	lblk,
+						blk64_t		pblk,
+						blk64_t		len,
+						int		run_flags,
+						void		*priv_data),
+				    void *priv_data)
+{
+	struct ext2_inode	inode;
+	ext2_extent_handle_t	handle;
+	struct ext2fs_extent	extent;
+	struct run_context	rc;
+	errcode_t		retval;
+	int			second, ret;
+
+	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
+
+	flags &= BLOCK_FLAG_DATA_ONLY | BLOCK_FLAG_DEPTH_TRAVERSE;
+
+	retval = ext2fs_read_inode(fs, ino, &inode);
+	if (retval)
+		return retval;
+
+	if (inode.i_flags & EXT4_INLINE_DATA_FL)
+		return 0;
+
+	if (!(inode.i_flags & EXT4_EXTENTS_FL)) {
+		memset(&rc, 0, sizeof(rc));
+		rc.func = func;
+		rc.priv_data = priv_data;
+		retval = ext2fs_block_iterate3(fs, ino,
+					       flags | BLOCK_FLAG_READ_ONLY,
+					       block_buf, coalesce_run_func,
+					       &rc);
+		if (!retval && !(rc.ret & BLOCK_ABORT))
+			flush_run(fs, &rc);
+		return retval;
+	}
+
+	if ((fs->super->s_creator_os == EXT2_OS_HURD) &&
+	    !(flags & BLOCK_FLAG_DATA_ONLY) &&
+	    inode.osd1.hurd1.h_i_translator) {
+		ret = (*func)(fs, BLOCK_COUNT_TRANSLATOR,
+			      inode.osd1.hurd1.h_i_translator, 1,
+			      BLOCK_RUN_METADATA, priv_data);
+		if (ret & BLOCK_ABORT)
+			return 0;
+	}
+
+	retval = ext2fs_extent_open2(fs, ino, &inode, &handle);
+	if (retval)
+		return retval;
+
+	retval = ext2fs_extent_get(handle, EXT2_EXTENT_ROOT, &extent);
+	while (!retval) {
+		if (extent.e_flags & EXT2_EXTENT_FLAGS_LEAF) {
+			if (!extent.e_len)
+				goto next;
+			ret = (*func)(fs, extent.e_lblk, extent.e_pblk,
+				      extent.e_len,
+				      (extent.e_flags &
+				       EXT2_EXTENT_FLAGS_UNINIT) ?
+				      BLOCK_RUN_UNINIT : 0, priv_data);
+			if (ret & BLOCK_ABORT)
+				break;
+		} else if (!(flags & BLOCK_FLAG_DATA_ONLY)) {
+			second = !!(extent.e_flags &
+				    EXT2_EXTENT_FLAGS_SECOND_VISIT);
+			if (second == !!(flags & BLOCK_FLAG_DEPTH_TRAVERSE)) {
+				ret = (*func)(fs, -1, extent.e_pblk, 1,
+					      BLOCK_RUN_METADATA, priv_data);
+				if (ret & BLOCK_ABORT)
+					break;
+			}
+		}
+	next:
+		retval = ext2fs_extent_get(handle, EXT2_EXTENT_NEXT, &extent);
+	}
+	if (retval == EXT2_ET_EXTENT_NO_NEXT)
+		retval = 0;
+	ext2fs_extent_free(handle);
+	return retval;
+}
+
 /*
  * Emulate the old ext2fs_block_iterate function!
  */
@@ -497,3 +497,88 @@ errcode_t ext2fs_bmap(ext2_filsys fs, ext2_ino_t ino, struct ext2_inode *inode,
 	*phys_blk = ret_blk;
 	return 0;
 }
+
+void ext2fs_bmap_cache_invalidate(struct ext2_bmap_cache *cache)
+{
+	memset(cache, 0, sizeof(struct ext2_bmap_cache));
+}
+
+/*
+ * Look up (but never allocate) the physical block for logical block
+ * @block, consulting and filling @cache for extent-mapped inodes.  On
+ * return *count holds the number of blocks, starting at @block, that are
+ * known to be mapped contiguously with the same flags; for holes and for
+ * block-mapped files it is 1.
+ */
+errcode_t ext2fs_bmap_cached(ext2_filsys fs, ext2_ino_t ino,
+			     struct ext2_inode *inode,
+			     struct ext2_bmap_cache *cache,
+			     char *block_buf, blk64_t block,
+			     int *ret_flags, blk64_t *phys_blk,
+			     blk64_t *count)
+{
+	struct ext2_bmap_cache_ent *ent;
+	ext2_extent_handle_t handle;
+	struct ext2fs_extent extent;
+	errcode_t retval;
+	unsigned int i;
+
+	*count = 1;
+	if (!(inode->i_flags & EXT4_EXTENTS_FL) ||
+	    (inode->i_flags & EXT4_INLINE_DATA_FL))
+		return ext2fs_bmap2(fs, ino, inode, block_buf, 0, block,
+				    ret_flags, phys_blk);
+
+	if (cache->generation != fs->map_generation) {
+		ext2fs_bmap_cache_invalidate(cache);
+		cache->generation = fs->map_generation;
+	}
+
+	for (i = 0, ent = cache->ent; i < EXT2_BMAP_CACHE_SIZE; i++, ent++) {
+		if (ent->len && block >= ent->lblk &&
+		    block - ent->lblk < ent->len) {
+			*phys_blk = ent->pblk + (block - ent->lblk);
+			*count = ent->len - (block - ent->lblk);
+			if (ret_flags)
+				*ret_flags = ent->ret_flags;
+			return 0;
+		}
+	}
+
+	*phys_blk = 0;
+	if (ret_flags)
+		*ret_flags = 0;
+	if (ext2fs_file_block_offset_too_big(fs, inode, block))
+		return EXT2_ET_FILE_TOO_BIG;
+
+	retval = ext2fs_extent_open2(fs, ino, inode, &handle);
+	if (retval)
+		return retval;
+	retval = ext2fs_extent_goto(handle, block);
+	if (retval) {
+		if (retval == EXT2_ET_EXTENT_NOT_FOUND)
+			retval = 0;
+		goto out;
+	}
+	retval = ext2fs_extent_get(handle, EXT2_EXTENT_CURRENT, &extent);
+	if (retval)
+		goto out;
+	if (block < extent.e_lblk || block - extent.e_lblk >= extent.e_len)
+		goto out;
+
+	ent = &cache->ent[cache->next];
+	cache->next = (cache->next + 1) % EXT2_BMAP_CACHE_SIZE;
+	ent->lblk = extent.e_lblk;
+	ent->pblk = extent.e_pblk;
+	ent->len = extent.e_len;
+	ent->ret_flags = (extent.e_flags & EXT2_EXTENT_FLAGS_UNINIT) ?
+		BMAP_RET_UNINIT : 0;
+
+	*phys_blk = ent->pblk + (block - ent->lblk);
+	*count = ent->len - (block - ent->lblk);
+	if (ret_flags)
+		*ret_flags = ent->ret_flags;
+out:
+	ext2fs_extent_free(handle);
+	return retval;
+}
@@ -0,0 +1,705 @@
+/*
+ * dirbuild.c --- write out a whole directory at once
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Library
+ * General Public License, version 2.
+ * %End-Header%
+ *
+ * Programs which create a directory's worth of entries in one go (for
+ * example mke2fs -d) can queue them in a directory builder and have
+ * them written with a single pass over the directory, instead of one
+ * ext2fs_link() call per name.  The entries already in the directory
+ * are kept; the directory is then rewritten as packed linear blocks or,
+ * if requested, as a hash tree with the leaves sorted by hash, much as
+ * e2fsck -D does, but never made smaller than it was.  All of the
+ * directory's blocks are built in memory, the extra blocks are allocated
+ * contiguously, and the result is written in as few I/O requests as
+ * possible.
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <string.h>
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include "ext2_fs.h"
+#include "ext2fsP.h"
+
+struct dir_build_ent {
+	const char	*name;		/* only valid while sorting */
+	unsigned int	name_off;	/* offset into db->names */
+	unsigned int	name_len;
+	ext2_ino_t	ino;
+	int		filetype;
+	ext2_dirhash_t	hash;
+	ext2_dirhash_t	minor_hash;
+};
+
+struct ext2_dir_builder {
+	ext2_filsys		fs;
+	ext2_ino_t		dir;
+	int			flags;
+	char			*names;
+	unsigned int		names_len;
+	unsigned int		names_size;
+	struct dir_build_ent	*ents;
+	unsigned int		count;		/* entries queued */
+	unsigned int		size;		/* entries allocated */
+	unsigned int		nr_new;		/* of which were added by us */
+	ext2_ino_t		parent;		/* from ".." */
+	errcode_t		err;
+};
+
+/* State used while laying out directory entries into blocks */
+struct dir_build_out {
+	ext2_filsys		fs;
+	char			*buf;
+	unsigned int		csum_size;
+	blk64_t			blocks;		/* blocks started so far */
+	unsigned int		offset;		/* in the current block */
+	struct ext2_dir_entry	*last;		/* in the current block */
+};
+
+errcode_t ext2fs_dir_builder_init(ext2_filsys fs, ext2_ino_t dir, int flags,
+				  ext2_dir_builder_t *ret)
+{
+	ext2_dir_builder_t	db;
+	errcode_t		retval;
+
+	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
+
+	if (!(fs->flags & EXT2_FLAG_RW))
+		return EXT2_ET_RO_FILSYS;
+
+	retval = ext2fs_get_memzero(sizeof(struct ext2_dir_builder), &db);
+	if (retval)
+		return retval;
+	db->fs = fs;
+	db->dir = dir;
+	db->flags = flags;
+	*ret = db;
+	return 0;
+}
+
+void ext2fs_dir_builder_free(ext2_dir_builder_t db)
+{
+	if (!db)
+		return;
+	ext2fs_free_mem(&db->names);
+	ext2fs_free_mem(&db->ents);
+	ext2fs_free_mem(&db);
+}
+
+static errcode_t dir_builder_queue(ext2_dir_builder_t db, const char *name,
+				   unsigned int name_len, ext2_ino_t ino,
+				   int filetype)
+{
+	struct dir_build_ent	*ent;
+	unsigned int		new_size;
+	errcode_t		retval;
+
+	if (db->count == db->size) {
+		new_size = db->size ? db->size * 2 : 64;
+		retval = ext2fs_resize_mem(db->size *
+					   sizeof(struct dir_build_ent),
+					   new_size * sizeof(struct dir_build_ent),
+					   &db->ents);
+		if (retval)
+			return retval;
+		db->size = new_size;
+	}
+	if (db->names_len + name_len > db->names_size) {
+		new_size = db->names_size ? db->names_size * 2 : 4096;
+		while (new_size < db->names_len + name_len)
+			new_size *= 2;
+		retval = ext2fs_resize_mem(db->names_size, new_size,
+					   &db->names);
+		if (retval)
+			return retval;
+		db->names_size = new_size;
+	}
+
+	ent = &db->ents[db->count++];
+	ent->name_off = db->names_len;
+	ent->name_len = name_len;
+	ent->ino = ino;
+	ent->filetype = filetype;
+	memcpy(db->names + db->names_len, name, name_len);
+	db->names_len += name_len;
+	return 0;
+}
+
+/*
+ * Queue a new entry.  Like ext2fs_link(), the low 3 bits of @flags are
+ * the directory entry filetype; no check is made for duplicate names.
+ */
+errcode_t ext2fs_dir_builder_add(ext2_dir_builder_t db, const char *name,
+				 ext2_ino_t ino, int flags)
+{
+	size_t		name_len = strlen(name);
+	errcode_t	retval;
+
+	if (name_len == 0 || name_len > EXT2_NAME_LEN)
+		return EXT2_ET_INVALID_ARGUMENT;
+	retval = dir_builder_queue(db, name, name_len, ino, flags & 0x7);
+	if (retval)
+		return retval;
+	db->nr_new++;
+	return 0;
+}
+
+static int read_dir_proc(ext2_ino_t dir EXT2FS_ATTR((unused)),
+			 int entry,
+			 struct ext2_dir_entry *dirent,
+			 int offset EXT2FS_ATTR((unused)),
+			 int blocksize EXT2FS_ATTR((unused)),
+			 char *buf EXT2FS_ATTR((unused)),
+			 void *priv_data)
+{
+	ext2_dir_builder_t db = (ext2_dir_builder_t) priv_data;
+
+	if (entry == DIRENT_DOT_FILE)
+		return 0;
+	if (entry == DIRENT_DOT_DOT_FILE) {
+		db->parent = dirent->inode;
+		return 0;
+	}
+	db->err = dir_builder_queue(db, dirent->name,
+				    ext2fs_dirent_name_len(dirent),
+				    dirent->inode,
+				    ext2fs_dirent_file_type(dirent));
+	return db->err ? DIRENT_ABORT : 0;
+}
+
+/*
+ * Read the entries already in the directory and move them in front of
+ * the queued ones, so that a linear directory keeps its original order.
+ */
+static errcode_t read_existing(ext2_dir_builder_t db)
+{
+	struct dir_build_ent	*ents;
+	unsigned int		nr_new = db->count, nr_old;
+	errcode_t		retval;
+
+	db->parent = 0;
+	db->err = 0;
+	retval = ext2fs_dir_iterate2(db->fs, db->dir, 0, 0, read_dir_proc,
+				     db);
+	if (retval)
+		return retval;
+	if (db->err)
+		return db->err;
+	if (!db->parent)
+		return EXT2_ET_DIR_CORRUPTED;
+
+	nr_old = db->count - nr_new;
+	if (!nr_old || !nr_new)
+		return 0;
+	retval = ext2fs_get_array(db->size, sizeof(struct dir_build_ent),
+				  &ents);
+	if (retval)
+		return retval;
+	memcpy(ents, db->ents + nr_new, nr_old * sizeof(struct dir_build_ent));
+	memcpy(ents + nr_old, db->ents, nr_new * sizeof(struct dir_build_ent));
+	ext2fs_free_mem(&db->ents);
+	db->ents = ents;
+	return 0;
+}
+
+static EXT2_QSORT_TYPE dir_build_hash_cmp(const void *a, const void *b)
+{
+	const struct dir_build_ent *ent_a = (const struct dir_build_ent *) a;
+	const struct dir_build_ent *ent_b = (const struct dir_build_ent *) b;
+	unsigned int	min_len;
+	int		ret;
+
+	if (ent_a->hash != ent_b->hash)
+		return ent_a->hash > ent_b->hash ? 1 : -1;
+	if (ent_a->minor_hash != ent_b->minor_hash)
+		return ent_a->minor_hash > ent_b->minor_hash ? 1 : -1;
+	min_len = ent_a->name_len < ent_b->name_len ?
+		ent_a->name_len : ent_b->name_len;
+	ret = memcmp(ent_a->name, ent_b->name, min_len);
+	if (ret)
+		return ret;
+	return (int) ent_a->name_len - (int) ent_b->name_len;
+}
+
+static errcode_t hash_entries(ext2_dir_builder_t db,
+			      struct ext2_inode *inode)
+{
+	ext2_filsys		fs = db->fs;
+	struct dir_build_ent	*ent;
+	int			hash_alg, hash_flags;
+	unsigned int		i;
+	errcode_t		retval;
+
+	hash_alg = fs->super->s_def_hash_version;
+	if ((hash_alg <= EXT2_HASH_TEA) &&
+	    (fs->super->s_flags & EXT2_FLAGS_UNSIGNED_HASH))
+		hash_alg += 3;
+	hash_flags = inode->i_flags & EXT4_CASEFOLD_FL;
+
+	for (i = 0, ent = db->ents; i < db->count; i++, ent++) {
+		ent->name = db->names + ent->name_off;
+		retval = ext2fs_dirhash2(hash_alg, ent->name, ent->name_len,
+					 fs->encoding, hash_flags,
+					 fs->super->s_hash_seed,
+					 &ent->hash, &ent->minor_hash);
+		if (retval)
+			return retval;
+	}
+	qsort(db->ents, db->count, sizeof(struct dir_build_ent),
+	      dir_build_hash_cmp);
+	return 0;
+}
+
+/* Close off the current block: stretch its last entry, add the tail */
+static errcode_t finish_block(struct dir_build_out *out)
+{
+	ext2_filsys	fs = out->fs;
+	char		*block = out->buf + (out->blocks - 1) * fs->blocksize;
+	errcode_t	retval;
+
+	if (!out->last) {
+		out->last = (struct ext2_dir_entry *) block;
+		out->offset = 0;
+	}
+	retval = ext2fs_set_rec_len(fs, fs->blocksize - out->csum_size -
+				    ((char *) out->last - block), out->last);
+	if (retval)
+		return retval;
+	if (out->csum_size)
+		ext2fs_initialize_dirent_tail(fs,
+					EXT2_DIRENT_TAIL(block, fs->blocksize));
+	out->last = NULL;
+	return 0;
+}
+
+static void start_block(struct dir_build_out *out)
+{
+	out->blocks++;
+	out->offset = 0;
+	out->last = NULL;
+}
+
+/*
+ * Append an entry to the current block; returns 0 if it doesn't fit.
+ * With a NULL buffer only the space is accounted for.
+ */
+static int add_dirent(struct dir_build_out *out, const char *name,
+		      unsigned int name_len, ext2_ino_t ino, int filetype)
+{
+	ext2_filsys	fs = out->fs;
+	struct ext2_dir_entry *dirent;
+	unsigned int	rec_len = EXT2_DIR_REC_LEN(name_len);
+
+	if (out->offset + rec_len > fs->blocksize - out->csum_size)
+		return 0;
+	if (out->buf) {
+		dirent = (struct ext2_dir_entry *) (out->buf +
+			(out->blocks - 1) * fs->blocksize + out->offset);
+		dirent->inode = ino;
+		ext2fs_dirent_set_name_len(dirent, name_len);
+		ext2fs_dirent_set_file_type(dirent,
+			ext2fs_has_feature_filetype(fs->super) ? filetype : 0);
+		memcpy(dirent->name, name, name_len);
+		if (ext2fs_set_rec_len(fs, rec_len, dirent))
+			return 0;
+		out->last = dirent;
+	}
+	out->offset += rec_len;
+	return 1;
+}
+
+static errcode_t add_dots(struct dir_build_out *out, ext2_ino_t dir,
+			  ext2_ino_t parent, int indexed)
+{
+	ext2_filsys	fs = out->fs;
+	errcode_t	retval;
+
+	add_dirent(out, ".", 1, dir, EXT2_FT_DIR);
+	add_dirent(out, "..", 2, parent, EXT2_FT_DIR);
+	if (indexed && out->buf) {
+		retval = ext2fs_set_rec_len(fs, fs->blocksize -
+					    EXT2_DIR_REC_LEN(1), out->last);
+		if (retval)
+			return retval;
+		out->last = NULL;
+	}
+	return 0;
+}
+
+/*
+ * Lay out the entries as a linear directory.  Called first with a NULL
+ * buffer to count the blocks needed.
+ */
+static errcode_t layout_linear(ext2_dir_builder_t db,
+			       struct dir_build_out *out)
+{
+	struct dir_build_ent	*ent;
+	unsigned int		i;
+	errcode_t		retval;
+
+	start_block(out);
+	add_dots(out, db->dir, db->parent, 0);
+	for (i = 0, ent = db->ents; i < db->count; i++, ent++) {
+		if (add_dirent(out, db->names + ent->name_off, ent->name_len,
+			       ent->ino, ent->filetype))
+			continue;
+		if (out->buf) {
+			retval = finish_block(out);
+			if (retval)
+				return retval;
+		}
+		start_block(out);
+		add_dirent(out, db->names + ent->name_off, ent->name_len,
+			   ent->ino, ent->filetype);
+	}
+	return out->buf ? finish_block(out) : 0;
+}
+
+struct dir_build_leaf {
+	unsigned int	first;		/* index of the first entry */
+	ext2_dirhash_t	hash;		/* with the continuation bit */
+};
+
+static void dx_set_countlimit(struct ext2_dx_entry *entries,
+			      unsigned int count, unsigned int limit)
+{
+	struct ext2_dx_countlimit *cl = (struct ext2_dx_countlimit *) entries;
+
+	cl->limit = ext2fs_cpu_to_le16(limit);
+	cl->count = ext2fs_cpu_to_le16(count);
+}
+
+/*
+ * Lay out the entries as a hash tree: the dx_root in block 0, then the
+ * dx_node blocks if a second level is needed, then the leaves.  Returns
+ * EXT2_ET_DIR_NO_SPACE if the tree would need more than two levels.
+ */
+static errcode_t layout_htree(ext2_dir_builder_t db,
+			      struct dir_build_out *out,
+			      struct dir_build_leaf **ret_leaves,
+			      unsigned int *ret_nr_leaves,
+			      unsigned int *ret_nr_nodes)
+{
+	ext2_filsys		fs = out->fs;
+	struct dir_build_leaf	*leaves = *ret_leaves;
+	struct dir_build_ent	*ent;
+	struct ext2_dx_root_info *root;
+	struct ext2_dx_entry	*entries;
+	unsigned int		dx_csum = 0, root_limit, node_limit;
+	unsigned int		nr_leaves = 0, nr_nodes = 0;
+	unsigned int		i, j, n;
+	char			*block;
+	errcode_t		retval;
+
+	if (ext2fs_has_feature_metadata_csum(fs->super))
+		dx_csum = sizeof(struct ext2_dx_tail);
+	root_limit = (fs->blocksize - (32 + dx_csum)) /
+		sizeof(struct ext2_dx_entry);
+	node_limit = (fs->blocksize - (8 + dx_csum)) /
+		sizeof(struct ext2_dx_entry);
+
+	if (!out->buf) {
+		/* First pass: work out where the leaves start */
+		retval = ext2fs_get_array(db->count + 1,
+					  sizeof(struct dir_build_leaf),
+					  &leaves);
+		if (retval)
+			return retval;
+		*ret_leaves = leaves;
+		out->blocks = 0;
+		out->offset = fs->blocksize;
+		for (i = 0, ent = db->ents; i < db->count; i++, ent++) {
+			if (add_dirent(out, NULL, ent->name_len, 0, 0))
+				continue;
+			start_block(out);
+			add_dirent(out, NULL, ent->name_len, 0, 0);
+			leaves[nr_leaves].first = i;
+			leaves[nr_leaves].hash = ent->hash;
+			if (nr_leaves && ent->hash == ent[-1].hash)
+				leaves[nr_leaves].hash |= 1;
+			nr_leaves++;
+		}
+		if (nr_leaves > root_limit) {
+			nr_nodes = (nr_leaves + node_limit - 1) / node_limit;
+			if (nr_nodes > root_limit)
+				return EXT2_ET_DIR_NO_SPACE;
+		}
+		out->blocks = 1 + nr_nodes + nr_leaves;
+		*ret_nr_leaves = nr_leaves;
+		*ret_nr_nodes = nr_nodes;
+		return 0;
+	}
+
+	nr_leaves = *ret_nr_leaves;
+	nr_nodes = *ret_nr_nodes;
+	leaves[nr_leaves].first = db->count;
+
+	/* The root */
+	start_block(out);
+	retval = add_dots(out, db->dir, db->parent, 1);
+	if (retval)
+		return retval;
+	root = (struct ext2_dx_root_info *) (out->buf + 24);
+	root->hash_version = fs->super->s_def_hash_version;
+	root->info_length = 8;
+	root->indirect_levels = nr_nodes ? 1 : 0;
+	entries = (struct ext2_dx_entry *) (out->buf + 32);
+	n = nr_nodes ? nr_nodes : nr_leaves;
+	dx_set_countlimit(entries, n, root_limit);
+	for (i = 0; i < n; i++) {
+		j = nr_nodes ? i * node_limit : i;
+		if (i)
+			entries[i].hash = ext2fs_cpu_to_le32(leaves[j].hash);
+		entries[i].block = ext2fs_cpu_to_le32(1 + i);
+	}
+
+	/* The index nodes */
+	for (i = 0; i < nr_nodes; i++) {
+		start_block(out);
+		block = out->buf + i * fs->blocksize + fs->blocksize;
+		retval = ext2fs_set_rec_len(fs, fs->blocksize,
+					    (struct ext2_dir_entry *) block);
+		if (retval)
+			return retval;
+		entries = (struct ext2_dx_entry *) (block + 8);
+		n = nr_leaves - i * node_limit;
+		if (n > node_limit)
+			n = node_limit;
+		dx_set_countlimit(entries, n, node_limit);
+		for (j = 0; j < n; j++) {
+			if (j)
+				entries[j].hash = ext2fs_cpu_to_le32(
+					leaves[i * node_limit + j].hash);
+			entries[j].block = ext2fs_cpu_to_le32(1 + nr_nodes +
+							i * node_limit + j);
+		}
+	}
+
+	/* The leaves */
+	for (i = 0; i < nr_leaves; i++) {
+		start_block(out);
+		for (j = leaves[i].first; j < leaves[i + 1].first; j++) {
+			ent = &db->ents[j];
+			add_dirent(out, db->names + ent->name_off,
+				   ent->name_len, ent->ino, ent->filetype);
+		}
+		retval = finish_block(out);
+		if (retval)
+			return retval;
+	}
+	return 0;
+}
+
+/* Write the directory image in @buf to the blocks of the directory */
+static errcode_t write_dir_blocks(ext2_dir_builder_t db,
+				  struct ext2_inode *inode, char *buf,
+				  blk64_t nr_blocks)
+{
+	ext2_filsys		fs = db->fs;
+	struct ext2_bmap_cache	cache;
+	blk64_t			lblk, pblk, count;
+	errcode_t		retval;
+
+#ifdef WORDS_BIGENDIAN
+	retval = ext2fs_dirent_swab_out2(fs, buf, nr_blocks * fs->blocksize,
+					 0);
+	if (retval)
+		return retval;
+#endif
+	for (lblk = 0; lblk < nr_blocks; lblk++) {
+		retval = ext2fs_dir_block_csum_set(fs, db->dir,
+				(struct ext2_dir_entry *)
+				(buf + lblk * fs->blocksize));
+		if (retval)
+			return retval;
+	}
+
+	ext2fs_bmap_cache_invalidate(&cache);
+	for (lblk = 0; lblk < nr_blocks; lblk += count) {
+		retval = ext2fs_bmap_cached(fs, db->dir, inode, &cache, NULL,
+					    lblk, NULL, &pblk, &count);
+		if (retval)
+			return retval;
+		if (!pblk)
+			return EXT2_ET_DIR_CORRUPTED;
+		if (count > nr_blocks - lblk)
+			count = nr_blocks - lblk;
+		retval = io_channel_write_blk64(fs->io, pblk, count,
+						buf + lblk * fs->blocksize);
+		if (retval)
+			return retval;
+	}
+	return 0;
+}
+
+/*
+ * An inline data directory can't be rewritten as blocks here, so link
+ * the queued entries into it one by one until it has been expanded out
+ * of the inode; the rest are dropped from the front of the queue.
+ */
+static errcode_t link_inline_entries(ext2_dir_builder_t db,
+				     struct ext2_inode *inode)
+{
+	struct dir_build_ent	*ent = db->ents;
+	char			name[EXT2_NAME_LEN + 1];
+	unsigned int		done = 0;
+	errcode_t		retval = 0;
+
+	while (done < db->count) {
+		memcpy(name, db->names + ent->name_off, ent->name_len);
+		name[ent->name_len] = 0;
+		retval = ext2fs_link(db->fs, db->dir, name, ent->ino,
+				     ent->filetype);
+		if (retval == EXT2_ET_DIR_NO_SPACE) {
+			retval = ext2fs_expand_dir(db->fs, db->dir);
+			if (retval)
+				break;
+			retval = ext2fs_link(db->fs, db->dir, name, ent->ino,
+					     ent->filetype);
+		}
+		if (retval)
+			break;
+		done++;
+		ent++;
+		retval = ext2fs_read_inode(db->fs, db->dir, inode);
+		if (retval || !(inode->i_flags & EXT4_INLINE_DATA_FL))
+			break;
+	}
+	memmove(db->ents, db->ents + done,
+		(db->count - done) * sizeof(struct dir_build_ent));
+	db->count -= done;
+	db->nr_new -= done;
+	return retval;
+}
+
+/*
+ * Rewrite the directory with its existing entries followed by all of
+ * the queued ones.
+ */
+errcode_t ext2fs_dir_builder_write(ext2_dir_builder_t db)
+{
+	ext2_filsys		fs = db->fs;
+	struct ext2_inode	inode;
+	struct dir_build_out	out;
+	struct dir_build_leaf	*leaves = NULL;
+	unsigned int		nr_leaves = 0, nr_nodes = 0;
+	blk64_t			old_blocks, nr_blocks;
+	int			indexed = 0;
+	errcode_t		retval;
+
+	if (db->nr_new == 0)
+		return 0;
+
+	memset(&out, 0, sizeof(out));
+	out.fs = fs;
+	if (ext2fs_has_feature_metadata_csum(fs->super))
+		out.csum_size = sizeof(struct ext2_dir_entry_tail);
+
+	retval = ext2fs_read_inode(fs, db->dir, &inode);
+	if (retval)
+		goto out;
+	if (!LINUX_S_ISDIR(inode.i_mode)) {
+		retval = EXT2_ET_NO_DIRECTORY;
+		goto out;
+	}
+	if (inode.i_flags & EXT4_INLINE_DATA_FL) {
+		retval = link_inline_entries(db, &inode);
+		if (retval || db->nr_new == 0)
+			goto out;
+	}
+
+	retval = read_existing(db);
+	if (retval)
+		goto out;
+
+	retval = layout_linear(db, &out);
+	if (retval)
+		goto out;
+	nr_blocks = out.blocks;
+	old_blocks = EXT2_I_SIZE(&inode) / fs->blocksize;
+
+	if (nr_blocks > 1 && (db->flags & EXT2_DIRBUILD_INDEX) &&
+	    ext2fs_has_feature_dir_index(fs->super)) {
+		retval = hash_entries(db, &inode);
+		if (retval)
+			goto out;
+		retval = layout_htree(db, &out, &leaves, &nr_leaves,
+				      &nr_nodes);
+		if (retval && retval != EXT2_ET_DIR_NO_SPACE)
+			goto out;
+		/*
+		 * Every block of an indexed directory must be referenced
+		 * from the index, so one which already has more blocks
+		 * than the tree needs is left linear.
+		 */
+		if (retval == 0 && out.blocks >= old_blocks) {
+			indexed = 1;
+			nr_blocks = out.blocks;
+		} else {
+			/* The entries are in hash order now; count again */
+			out.blocks = 0;
+			retval = layout_linear(db, &out);
+			if (retval)
+				goto out;
+			nr_blocks = out.blocks;
+		}
+	}
+
+	/*
+	 * Never shrink the directory (mke2fs preallocates lost+found, for
+	 * one); blocks which aren't needed are kept as empty blocks.  Any
+	 * extra blocks are allocated contiguously at the end.
+	 */
+	if (nr_blocks < old_blocks)
+		nr_blocks = old_blocks;
+	if (nr_blocks > old_blocks) {
+		retval = ext2fs_fallocate(fs, EXT2_FALLOCATE_FORCE_INIT,
+				db->dir, &inode,
+				ext2fs_find_inode_goal(fs, db->dir, &inode,
+						       old_blocks),
+				old_blocks, nr_blocks - old_blocks);
+		if (retval)
+			goto out;
+	}
+	retval = ext2fs_inode_size_set(fs, &inode, nr_blocks * fs->blocksize);
+	if (retval)
+		goto out;
+	if (indexed)
+		inode.i_flags |= EXT2_INDEX_FL;
+	else
+		inode.i_flags &= ~EXT2_INDEX_FL;
+	retval = ext2fs_write_inode(fs, db->dir, &inode);
+	if (retval)
+		goto out;
+
+	retval = ext2fs_get_memzero(nr_blocks * fs->blocksize, &out.buf);
+	if (retval)
+		goto out;
+	out.blocks = 0;
+	out.offset = 0;
+	if (indexed)
+		retval = layout_htree(db, &out, &leaves, &nr_leaves,
+				      &nr_nodes);
+	else
+		retval = layout_linear(db, &out);
+	while (!retval && out.blocks < nr_blocks) {
+		start_block(&out);
+		retval = finish_block(&out);
+	}
+	if (retval)
+		goto out;
+	retval = write_dir_blocks(db, &inode, out.buf, nr_blocks);
+out:
+	ext2fs_free_mem(&out.buf);
+	ext2fs_free_mem(&leaves);
+	/* The queue now holds the old entries as well; start afresh */
+	db->count = db->nr_new = db->names_len = 0;
+	return retval;
+}
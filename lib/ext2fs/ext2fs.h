@@ -204,6 +204,7 @@ typedef struct ext2_file *ext2_file_t;
 #define EXT2_FLAG_IGNORE_CSUM_ERRORS	0x200000
 #define EXT2_FLAG_SHARE_DUP		0x400000
 #define EXT2_FLAG_IGNORE_SB_ERRORS	0x800000
+#define EXT2_FLAG_INDEX_DIRS		0x1000000
 
 /*
  * Special flag in the ext2 inode i_flag field that means that this is
@@ -309,6 +310,12 @@ struct struct_ext2_filsys {
 	struct ext2fs_hashmap* block_sha_map;
 
 	const struct nls_table *encoding;
+
+	/*
+	 * Bumped whenever an inode or an extent tree block is written, so
+	 * that cached logical to physical block mappings can be dropped.
+	 */
+	__u32 map_generation;
 };
 
 #if EXT2_FLAT_INCLUDES
@@ -323,6 +330,7 @@ struct struct_ext2_filsys {
 #define EXT2FS_BMAP64_BITARRAY	1
 #define EXT2FS_BMAP64_RBTREE	2
 #define EXT2FS_BMAP64_AUTODIR	3
+#define EXT2FS_BMAP64_HYBRID	4
 
 /*
  * Return flags for the block iterator functions
@@ -372,6 +380,12 @@ struct struct_ext2_filsys {
 #define BLOCK_COUNT_TIND	(-3)
 #define BLOCK_COUNT_TRANSLATOR	(-4)
 
+/*
+ * Run flags passed to the ext2fs_block_iterate_runs() callback
+ */
+#define BLOCK_RUN_UNINIT	0x0001
+#define BLOCK_RUN_METADATA	0x0002
+
 #define BLOCK_ALLOC_UNKNOWN	0
 #define BLOCK_ALLOC_DATA	1
 #define BLOCK_ALLOC_METADATA	2
@@ -383,6 +397,11 @@ struct blk_alloc_ctx {
 	int			flags;
 };
 
+/*
+ * Block allocation pool; see ext2fs_alloc_pool_create()
+ */
+typedef struct ext2_alloc_pool *ext2_alloc_pool_t;
+
 #if 0
 /*
  * Flags for ext2fs_move_blocks
@@ -755,6 +774,21 @@ errcode_t ext2fs_new_range(ext2_filsys fs, int flags, blk64_t goal,
 #define EXT2_ALLOCRANGE_ALL_FLAGS	(0x3)
 errcode_t ext2fs_alloc_range(ext2_filsys fs, int flags, blk64_t goal,
 			     blk_t len, blk64_t *ret);
+extern errcode_t ext2fs_alloc_pool_create(ext2_filsys fs, dgrp_t group,
+					  blk64_t batch,
+					  ext2_alloc_pool_t *ret);
+extern void ext2fs_alloc_pool_set_lock(ext2_alloc_pool_t pool,
+				       void (*lock)(void *data),
+				       void (*unlock)(void *data),
+				       void *data);
+extern errcode_t ext2fs_alloc_pool_new_block(ext2_alloc_pool_t pool,
+					     blk64_t *ret);
+extern errcode_t ext2fs_alloc_pool_new_range(ext2_alloc_pool_t pool,
+					     blk64_t len, blk64_t *pblk,
+					     blk64_t *plen);
+extern void ext2fs_alloc_pool_flush(ext2_alloc_pool_t pool);
+extern blk64_t ext2fs_alloc_pool_allocated(ext2_alloc_pool_t pool);
+extern void ext2fs_alloc_pool_free(ext2_alloc_pool_t pool);
 
 /* alloc_sb.c */
 extern int ext2fs_reserve_super_and_bgd(ext2_filsys fs,
@@ -995,6 +1029,17 @@ errcode_t ext2fs_block_iterate3(ext2_filsys fs,
 					    int		ref_offset,
 					    void	*priv_data),
 				void *priv_data);
+errcode_t ext2fs_block_iterate_runs(ext2_filsys fs,
+				    ext2_ino_t ino,
+				    int	flags,
+				    char *block_buf,
+				    int (*func)(ext2_filsys fs,
+						e2_blkcnt_t	lblk,
+						blk64_t		pblk,
+						blk64_t		len,
+						int		run_flags,
+						void		*priv_data),
+				    void *priv_data);
 
 /* bmap.c */
 extern errcode_t ext2fs_bmap(ext2_filsys fs, ext2_ino_t ino,
@@ -1044,6 +1089,8 @@ extern void ext2fs_update_dynamic_rev(ext2_filsys fs);
 /* crc32c.c */
 extern __u32 ext2fs_crc32_be(__u32 crc, unsigned char const *p, size_t len);
 extern __u32 ext2fs_crc32c_le(__u32 crc, unsigned char const *p, size_t len);
+extern void ext2fs_crc32c_le_multi(__u32 *crc, unsigned char const **buf,
+				   int nr, size_t len);
 
 /* csum.c */
 extern void ext2fs_init_csum_seed(ext2_filsys fs);
@@ -1096,6 +1143,10 @@ extern errcode_t ext2fs_inode_csum_set(ext2_filsys fs, ext2_ino_t inum,
 				       struct ext2_inode_large *inode);
 extern int ext2fs_inode_csum_verify(ext2_filsys fs, ext2_ino_t inum,
 				    struct ext2_inode_large *inode);
+extern errcode_t ext2fs_inode_csum_verify_multi(ext2_filsys fs,
+						ext2_ino_t inum, void *buf,
+						unsigned int nr,
+						char *bad_csum);
 extern void ext2fs_group_desc_csum_set(ext2_filsys fs, dgrp_t group);
 extern int ext2fs_group_desc_csum_verify(ext2_filsys fs, dgrp_t group);
 extern errcode_t ext2fs_set_gdt_csum(ext2_filsys fs);
@@ -1180,6 +1231,19 @@ extern errcode_t ext2fs_write_dir_block3(ext2_filsys fs, blk64_t block,
 extern errcode_t ext2fs_write_dir_block4(ext2_filsys fs, blk64_t block,
 					 void *buf, int flags, ext2_ino_t ino);
 
+/* dirbuild.c */
+typedef struct ext2_dir_builder *ext2_dir_builder_t;
+
+#define EXT2_DIRBUILD_INDEX	0x0001	/* build a hash tree if it helps */
+
+extern errcode_t ext2fs_dir_builder_init(ext2_filsys fs, ext2_ino_t dir,
+					 int flags, ext2_dir_builder_t *ret);
+extern errcode_t ext2fs_dir_builder_add(ext2_dir_builder_t db,
+					const char *name, ext2_ino_t ino,
+					int flags);
+extern errcode_t ext2fs_dir_builder_write(ext2_dir_builder_t db);
+extern void ext2fs_dir_builder_free(ext2_dir_builder_t db);
+
 /* dirhash.c */
 extern errcode_t ext2fs_dirhash(int version, const char *name, int len,
 				const __u32 *seed,
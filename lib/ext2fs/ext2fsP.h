@@ -179,6 +179,35 @@ extern void ext2fs_warn_bitmap32(ext2fs_generic_bitmap bitmap,const char *func);
 
 extern int ext2fs_mem_is_zero(const char *mem, size_t len);
 
+/*
+ * A small cache of the extents most recently looked up in one inode, so
+ * that sequential access to an extent-mapped file walks the extent tree
+ * once per extent instead of once per block.  The cache is dropped
+ * whenever fs->map_generation changes.
+ */
+#define EXT2_BMAP_CACHE_SIZE	8
+
+struct ext2_bmap_cache_ent {
+	blk64_t		lblk;
+	blk64_t		pblk;
+	blk64_t		len;		/* 0 if the slot is unused */
+	int		ret_flags;	/* BMAP_RET_* */
+};
+
+struct ext2_bmap_cache {
+	__u32				generation;
+	unsigned int			next;
+	struct ext2_bmap_cache_ent	ent[EXT2_BMAP_CACHE_SIZE];
+};
+
+extern void ext2fs_bmap_cache_invalidate(struct ext2_bmap_cache *cache);
+extern errcode_t ext2fs_bmap_cached(ext2_filsys fs, ext2_ino_t ino,
+				    struct ext2_inode *inode,
+				    struct ext2_bmap_cache *cache,
+				    char *block_buf, blk64_t block,
+				    int *ret_flags, blk64_t *phys_blk,
+				    blk64_t *count);
+
 extern int ext2fs_file_block_offset_too_big(ext2_filsys fs,
 					    struct ext2_inode *inode,
 					    blk64_t offset);
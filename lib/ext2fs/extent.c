@@ -582,6 +582,7 @@ static errcode_t update_path(ext2_extent_handle_t handle)
 	struct ext3_extent_idx		*ix;
 	struct ext3_extent_header	*eh;
 
+	handle->fs->map_generation++;
 	if (handle->level == 0) {
 		retval = ext2fs_write_inode(handle->fs, handle->ino,
 					    handle->inode);
@@ -30,6 +30,8 @@ struct ext2_file {
 	blk64_t			blockno;
 	blk64_t			physblock;
 	char 			*buf;
+	struct ext2_bmap_cache	bmap_cache;
+	blk64_t			ra_start, ra_end;
 };
 
 struct block_entry {
@@ -40,6 +42,9 @@ typedef struct block_entry *block_entry_t;
 
 #define BMAP_BUFFER (file->buf + fs->blocksize)
 
+/* Maximum number of blocks read ahead at a time within an extent */
+#define FILE_READAHEAD_BLOCKS(fs)	((1024 * 1024) / (fs)->blocksize)
+
 errcode_t ext2fs_file_open2(ext2_filsys fs, ext2_ino_t ino,
 			    struct ext2_inode *inode,
 			    int flags, ext2_file_t *ret)
@@ -130,7 +135,7 @@ errcode_t ext2fs_file_flush(ext2_file_t file)
 	errcode_t	retval;
 	ext2_filsys fs;
 	int		ret_flags;
-	blk64_t		dontcare;
+	blk64_t		dontcare, count;
 
 	EXT2_CHECK_MAGIC(file, EXT2_ET_MAGIC_EXT2_FILE);
 	fs = file->fs;
@@ -141,8 +146,10 @@ errcode_t ext2fs_file_flush(ext2_file_t file)
 
 	/* Is this an uninit block? */
 	if (file->physblock && file->inode.i_flags & EXT4_EXTENTS_FL) {
-		retval = ext2fs_bmap2(fs, file->ino, &file->inode, BMAP_BUFFER,
-				      0, file->blockno, &ret_flags, &dontcare);
+		retval = ext2fs_bmap_cached(fs, file->ino, &file->inode,
+					    &file->bmap_cache, BMAP_BUFFER,
+					    file->blockno, &ret_flags,
+					    &dontcare, &count);
 		if (retval)
 			return retval;
 		if (ret_flags & BMAP_RET_UNINIT) {
@@ -196,6 +203,29 @@ static errcode_t sync_buffer_position(ext2_file_t file)
 	return 0;
 }
 
+/*
+ * When reading sequentially through an extent, ask the I/O channel to
+ * start reading the rest of it (up to FILE_READAHEAD_BLOCKS at a time)
+ * so that the one-block reads which follow are served from memory.
+ * @count is the number of blocks known to be contiguous from
+ * file->blockno.
+ */
+static void file_readahead(ext2_file_t file, blk64_t count)
+{
+	ext2_filsys	fs = file->fs;
+	blk64_t		max = FILE_READAHEAD_BLOCKS(fs);
+
+	if (count <= 1)
+		return;
+	if (file->blockno >= file->ra_start && file->blockno < file->ra_end)
+		return;
+	if (count > max)
+		count = max;
+	io_channel_cache_readahead(fs->io, file->physblock, count);
+	file->ra_start = file->blockno;
+	file->ra_end = file->blockno + count;
+}
+
 /*
  * This function loads the file's block buffer with valid data from
  * the disk as necessary.
@@ -210,16 +240,19 @@ static errcode_t load_buffer(ext2_file_t file, int dontfill)
 	ext2_filsys	fs = file->fs;
 	errcode_t	retval;
 	int		ret_flags;
+	blk64_t		count;
 
 	if (!(file->flags & EXT2_FILE_BUF_VALID)) {
-		retval = ext2fs_bmap2(fs, file->ino, &file->inode,
-				     BMAP_BUFFER, 0, file->blockno, &ret_flags,
-				     &file->physblock);
+		retval = ext2fs_bmap_cached(fs, file->ino, &file->inode,
+					    &file->bmap_cache, BMAP_BUFFER,
+					    file->blockno, &ret_flags,
+					    &file->physblock, &count);
 		if (retval)
 			return retval;
 		if (!dontfill) {
 			if (file->physblock &&
 			    !(ret_flags & BMAP_RET_UNINIT)) {
+				file_readahead(file, count);
 				retval = io_channel_read_blk64(fs->io,
 							       file->physblock,
 							       1, file->buf);
@@ -234,6 +267,270 @@ static errcode_t load_buffer(ext2_file_t file, int dontfill)
 }
 
 
+/*
+ * Whole-block requests skip the block buffer: the range is mapped an
+ * extent at a time and each physically contiguous run is transferred
+ * with a single I/O straight to or from the caller's buffer.  Partial
+ * blocks at either end still go through the buffer.
+ */
+struct file_run {
+	blk64_t		phys;
+	blk64_t		len;
+	blk64_t		start;		/* in blocks from the caller's buffer */
+};
+
+static errcode_t file_run_io(ext2_file_t file, struct file_run *run,
+			     char *base, int write)
+{
+	char		*ptr = base + run->start * file->fs->blocksize;
+	errcode_t	retval;
+
+	if (!run->len)
+		return 0;
+	if (write)
+		retval = io_channel_write_blk64(file->fs->io, run->phys,
+						run->len, ptr);
+	else
+		retval = io_channel_read_blk64(file->fs->io, run->phys,
+					       run->len, ptr);
+	if (!retval)
+		run->len = 0;
+	return retval;
+}
+
+/*
+ * Add @count blocks at @phys, for block @i of the caller's buffer, to
+ * the current run, issuing the run first if they don't follow on.
+ */
+static errcode_t file_run_add(ext2_file_t file, struct file_run *run,
+			      char *base, blk64_t phys, blk64_t i,
+			      blk64_t count, int write)
+{
+	errcode_t	retval;
+
+	if (run->len && phys == run->phys + run->len &&
+	    i == run->start + run->len) {
+		run->len += count;
+		return 0;
+	}
+	retval = file_run_io(file, run, base, write);
+	if (retval)
+		return retval;
+	run->phys = phys;
+	run->start = i;
+	run->len = count;
+	return 0;
+}
+
+/*
+ * Read @nblocks whole blocks from the current position into @ptr.
+ * *@done is set to the number of blocks which were read successfully.
+ */
+static errcode_t file_read_blocks(ext2_file_t file, char *ptr,
+				  blk64_t nblocks, blk64_t *done)
+{
+	ext2_filsys	fs = file->fs;
+	struct file_run	run = { 0, 0, 0 };
+	blk64_t		b = file->pos / fs->blocksize;
+	blk64_t		i = 0, phys, count;
+	int		ret_flags;
+	errcode_t	retval;
+
+	/* The block buffer may be newer than what's on disk */
+	*done = 0;
+	retval = ext2fs_file_flush(file);
+	if (retval)
+		return retval;
+
+	while (i < nblocks) {
+		retval = ext2fs_bmap_cached(fs, file->ino, &file->inode,
+					    &file->bmap_cache, BMAP_BUFFER,
+					    b + i, &ret_flags, &phys, &count);
+		if (retval)
+			break;
+		if (count > nblocks - i)
+			count = nblocks - i;
+		if (phys && !(ret_flags & BMAP_RET_UNINIT)) {
+			retval = file_run_add(file, &run, ptr, phys, i,
+					      count, 0);
+			if (retval)
+				break;
+		} else
+			memset(ptr + i * fs->blocksize, 0,
+			       count * fs->blocksize);
+		i += count;
+	}
+	if (!retval)
+		retval = file_run_io(file, &run, ptr, 0);
+	/* Anything still in the run wasn't transferred */
+	*done = run.len ? run.start : i;
+	return retval;
+}
+
+/*
+ * Allocate blocks for the hole at @lblk in an extent-mapped file, up to
+ * @max of them, as a single extent (or by growing the one before it).
+ * Returns the first physical block in *@ret_pblk and the number of
+ * blocks mapped in *@ret_len.
+ */
+static errcode_t file_alloc_range(ext2_file_t file, blk64_t lblk,
+				  blk64_t max, blk64_t *ret_pblk,
+				  blk64_t *ret_len)
+{
+	ext2_filsys		fs = file->fs;
+	ext2_extent_handle_t	handle;
+	struct ext2fs_extent	left, right, newex;
+	int			has_left = 0, has_right = 0;
+	blk64_t			pblk, plen;
+	errcode_t		retval;
+
+	if (max > EXT_INIT_MAX_LEN)
+		max = EXT_INIT_MAX_LEN;
+
+	retval = ext2fs_extent_open2(fs, file->ino, &file->inode, &handle);
+	if (retval)
+		return retval;
+
+	/* Find the extents on either side of the hole */
+	retval = ext2fs_extent_goto(handle, lblk);
+	if (retval != EXT2_ET_EXTENT_NOT_FOUND) {
+		if (!retval)
+			retval = EXT2_ET_INVALID_ARGUMENT;
+		goto out;
+	}
+	retval = ext2fs_extent_get(handle, EXT2_EXTENT_CURRENT, &left);
+	if (retval == 0 && left.e_lblk < lblk) {
+		has_left = 1;
+		retval = ext2fs_extent_get(handle, EXT2_EXTENT_NEXT_LEAF,
+					   &right);
+		if (retval == 0)
+			has_right = 1;
+	} else if (retval == 0) {
+		right = left;
+		has_right = 1;
+	}
+	if (has_right && right.e_lblk - lblk < max)
+		max = right.e_lblk - lblk;
+
+	retval = ext2fs_new_range(fs, 0,
+				  ext2fs_find_inode_goal(fs, file->ino,
+							 &file->inode, lblk),
+				  max, NULL, &pblk, &plen);
+	if (retval)
+		goto out;
+	ext2fs_block_alloc_stats_range(fs, pblk, plen, +1);
+	retval = ext2fs_iblk_add_blocks(fs, &file->inode, plen);
+	if (retval)
+		goto errout;
+
+	if (has_left && !(left.e_flags & EXT2_EXTENT_FLAGS_UNINIT) &&
+	    left.e_lblk + left.e_len == lblk &&
+	    left.e_pblk + left.e_len == pblk &&
+	    left.e_len + plen <= EXT_INIT_MAX_LEN) {
+		retval = ext2fs_extent_goto(handle, left.e_lblk);
+		if (retval)
+			goto errout;
+		left.e_len += plen;
+		retval = ext2fs_extent_replace(handle, 0, &left);
+	} else {
+		newex.e_lblk = lblk;
+		newex.e_pblk = pblk;
+		newex.e_len = plen;
+		newex.e_flags = 0;
+		if (has_left || has_right) {
+			retval = ext2fs_extent_goto(handle, has_left ?
+						    left.e_lblk : right.e_lblk);
+			if (retval)
+				goto errout;
+		}
+		retval = ext2fs_extent_insert(handle, has_left ?
+					      EXT2_EXTENT_INSERT_AFTER : 0,
+					      &newex);
+	}
+	if (retval)
+		goto errout;
+	retval = ext2fs_extent_fix_parents(handle);
+	if (retval)
+		goto out;
+
+	*ret_pblk = pblk;
+	*ret_len = plen;
+out:
+	ext2fs_extent_free(handle);
+	return retval;
+
+errout:
+	ext2fs_block_alloc_stats_range(fs, pblk, plen, -1);
+	ext2fs_iblk_sub_blocks(fs, &file->inode, plen);
+	goto out;
+}
+
+/*
+ * Write @nblocks whole blocks from @ptr at the current position,
+ * allocating any holes in the range as they are reached.  *@done is set
+ * to the number of blocks which were written successfully.
+ */
+static errcode_t file_write_blocks(ext2_file_t file, const char *ptr,
+				   blk64_t nblocks, blk64_t *done)
+{
+	ext2_filsys	fs = file->fs;
+	struct file_run	run = { 0, 0, 0 };
+	char		*base = (char *) ptr;
+	blk64_t		b = file->pos / fs->blocksize;
+	blk64_t		i = 0, phys, count;
+	int		ret_flags, allocated = 0;
+	errcode_t	retval = 0, rc;
+
+	/* The block buffer is about to be overwritten */
+	if ((file->flags & EXT2_FILE_BUF_VALID) &&
+	    file->blockno >= b && file->blockno - b < nblocks)
+		file->flags &= ~(EXT2_FILE_BUF_VALID | EXT2_FILE_BUF_DIRTY);
+
+	while (i < nblocks) {
+		retval = ext2fs_bmap_cached(fs, file->ino, &file->inode,
+					    &file->bmap_cache, BMAP_BUFFER,
+					    b + i, &ret_flags, &phys, &count);
+		if (retval)
+			break;
+		if (phys && (ret_flags & BMAP_RET_UNINIT)) {
+			/* Mark it written, as ext2fs_file_flush() would */
+			count = 1;
+			retval = ext2fs_bmap2(fs, file->ino, &file->inode,
+					      BMAP_BUFFER, BMAP_SET, b + i, 0,
+					      &phys);
+		} else if (!phys && (file->inode.i_flags & EXT4_EXTENTS_FL) &&
+			   EXT2FS_CLUSTER_RATIO(fs) == 1) {
+			retval = file_alloc_range(file, b + i, nblocks - i,
+						  &phys, &count);
+			allocated = 1;
+		} else if (!phys) {
+			count = 1;
+			retval = ext2fs_bmap2(fs, file->ino, &file->inode,
+					      BMAP_BUFFER, BMAP_ALLOC, b + i, 0,
+					      &phys);
+		}
+		if (retval)
+			break;
+		if (count > nblocks - i)
+			count = nblocks - i;
+		retval = file_run_add(file, &run, base, phys, i, count, 1);
+		if (retval)
+			break;
+		i += count;
+	}
+	if (!retval)
+		retval = file_run_io(file, &run, base, 1);
+	/* Anything still in the run wasn't transferred */
+	*done = run.len ? run.start : i;
+
+	if (allocated) {
+		rc = ext2fs_write_inode(fs, file->ino, &file->inode);
+		if (!retval)
+			retval = rc;
+	}
+	return retval;
+}
+
 errcode_t ext2fs_file_close(ext2_file_t file)
 {
 	errcode_t	retval;
@@ -289,6 +586,7 @@ errcode_t ext2fs_file_read(ext2_file_t file, void *buf,
 	errcode_t	retval = 0;
 	unsigned int	start, c, count = 0;
 	__u64		left;
+	blk64_t		nblocks, done;
 	char		*ptr = (char *) buf;
 
 	EXT2_CHECK_MAGIC(file, EXT2_ET_MAGIC_EXT2_FILE);
@@ -299,6 +597,22 @@ errcode_t ext2fs_file_read(ext2_file_t file, void *buf,
 		return ext2fs_file_read_inline_data(file, buf, wanted, got);
 
 	while ((file->pos < EXT2_I_SIZE(&file->inode)) && (wanted > 0)) {
+		left = EXT2_I_SIZE(&file->inode) - file->pos;
+		if ((file->pos % fs->blocksize) == 0 &&
+		    wanted >= fs->blocksize && left >= fs->blocksize) {
+			nblocks = (wanted < left ? wanted : left) /
+				fs->blocksize;
+			retval = file_read_blocks(file, ptr, nblocks, &done);
+			c = done * fs->blocksize;
+			file->pos += c;
+			ptr += c;
+			count += c;
+			wanted -= c;
+			if (retval)
+				goto fail;
+			continue;
+		}
+
 		retval = sync_buffer_position(file);
 		if (retval)
 			goto fail;
@@ -310,7 +624,6 @@ errcode_t ext2fs_file_read(ext2_file_t file, void *buf,
 		c = fs->blocksize - start;
 		if (c > wanted)
 			c = wanted;
-		left = EXT2_I_SIZE(&file->inode) - file->pos ;
 		if (c > left)
 			c = left;
 
@@ -397,6 +710,7 @@ errcode_t ext2fs_file_write(ext2_file_t file, const void *buf,
 	const char	*ptr = (const char *) buf;
 	block_entry_t	new_block = NULL, old_block = NULL;
 	int		bmap_flags = 0;
+	blk64_t		nblocks, done;
 
 	EXT2_CHECK_MAGIC(file, EXT2_ET_MAGIC_EXT2_FILE);
 	fs = file->fs;
@@ -415,6 +729,23 @@ errcode_t ext2fs_file_write(ext2_file_t file, const void *buf,
 	}
 
 	while (nbytes > 0) {
+		nblocks = nbytes / fs->blocksize;
+		if ((file->pos % fs->blocksize) == 0 && nblocks &&
+		    file->ino && !(fs->flags & EXT2_FLAG_SHARE_DUP) &&
+		    !(file->inode.i_flags & EXT4_INLINE_DATA_FL) &&
+		    !ext2fs_file_block_offset_too_big(fs, &file->inode,
+				file->pos / fs->blocksize + nblocks - 1)) {
+			retval = file_write_blocks(file, ptr, nblocks, &done);
+			c = done * fs->blocksize;
+			file->pos += c;
+			ptr += c;
+			count += c;
+			nbytes -= c;
+			if (retval)
+				goto fail;
+			continue;
+		}
+
 		retval = sync_buffer_position(file);
 		if (retval)
 			goto fail;
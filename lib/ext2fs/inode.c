@@ -56,6 +56,8 @@ struct ext2_struct_inode_scan {
 	void *			done_group_data;
 	int			bad_block_ptr;
 	int			scan_flags;
+	char			*csum_bad;
+	unsigned int		csum_count;
 	int			reserved[6];
 };
 
@@ -209,6 +211,17 @@ errcode_t ext2fs_open_inode_scan(ext2_filsys fs, int buffer_blocks,
 		return retval;
 	}
 	memset(SCAN_BLOCK_STATUS(scan), 0, scan->inode_buffer_blocks);
+	if (ext2fs_has_feature_metadata_csum(fs->super)) {
+		retval = ext2fs_get_array(scan->inode_buffer_blocks,
+					  fs->blocksize / scan->inode_size,
+					  &scan->csum_bad);
+		if (retval) {
+			ext2fs_free_mem(&scan->temp_buffer);
+			ext2fs_free_mem(&scan->inode_buffer);
+			ext2fs_free_mem(&scan);
+			return retval;
+		}
+	}
 	if (scan->fs->badblocks && scan->fs->badblocks->num)
 		scan->scan_flags |= EXT2_SF_CHK_BADBLOCKS;
 	if (ext2fs_has_group_desc_csum(fs))
@@ -226,6 +239,8 @@ void ext2fs_close_inode_scan(ext2_inode_scan scan)
 	scan->inode_buffer = NULL;
 	ext2fs_free_mem(&scan->temp_buffer);
 	scan->temp_buffer = NULL;
+	if (scan->csum_bad)
+		ext2fs_free_mem(&scan->csum_bad);
 	ext2fs_free_mem(&scan);
 	return;
 }
@@ -275,6 +290,7 @@ static errcode_t get_next_blockgroup(ext2_inode_scan scan)
 		EXT2_INODES_PER_GROUP(fs->super);
 
 	scan->bytes_left = 0;
+	scan->csum_count = 0;
 	scan->inodes_left = EXT2_INODES_PER_GROUP(fs->super);
 	scan->blocks_left = fs->inode_blocks_per_group;
 	if (ext2fs_has_group_desc_csum(fs)) {
@@ -400,6 +416,51 @@ static int extent_head_looks_insane(struct ext2_inode_large *inode)
 	return 1;
 }
 
+/*
+ * Returns non-zero if the inode at @p in the inode buffer, which is inode
+ * number @ino, fails checksum verification.  The result is taken from the
+ * batch verification done when the buffer was filled if there is one.
+ */
+static int scan_inode_csum_bad(ext2_inode_scan scan, ext2_ino_t ino, char *p)
+{
+	unsigned int idx = (p - scan->inode_buffer) / scan->inode_size;
+
+	if (idx < scan->csum_count &&
+	    (p - scan->inode_buffer) % scan->inode_size == 0)
+		return scan->csum_bad[idx];
+	return !ext2fs_inode_csum_verify(scan->fs, ino,
+					 (struct ext2_inode_large *) p);
+}
+
+/*
+ * Verify the checksums of all the whole inodes that we just read into the
+ * buffer in one go.  This is only done when the buffer starts on an inode
+ * boundary; otherwise get_next_inode falls back to checking each inode
+ * individually.
+ */
+static void verify_inode_buffer_csums(ext2_inode_scan scan,
+				      blk64_t num_blocks)
+{
+	unsigned int	nr;
+
+	scan->csum_count = 0;
+	if (!scan->csum_bad || scan->bytes_left ||
+	    (scan->scan_flags & EXT2_SF_BAD_INODE_BLK) ||
+	    scan->current_block == 0)
+		return;
+	if ((scan->fs->flags & EXT2_FLAG_IGNORE_CSUM_ERRORS) &&
+	    !(scan->scan_flags & EXT2_SF_WARN_GARBAGE_INODES))
+		return;
+
+	nr = num_blocks * scan->fs->blocksize / scan->inode_size;
+	if (nr > scan->inodes_left)
+		nr = scan->inodes_left;
+	if (ext2fs_inode_csum_verify_multi(scan->fs, scan->current_inode + 1,
+					   scan->inode_buffer, nr,
+					   scan->csum_bad) == 0)
+		scan->csum_count = nr;
+}
+
 /*
  * Check all the inodes that we just read into the buffer.  Record what we
  * find here -- currently, we can observe that all checksums are ok; more
@@ -440,8 +501,7 @@ static void check_inode_block_sanity(ext2_inode_scan scan, blk64_t num_blocks)
 
 	while (inodes_to_scan > 0) {
 		blk = (p - (char *)scan->inode_buffer) / scan->fs->blocksize;
-		bad_csum = ext2fs_inode_csum_verify(scan->fs, ino,
-				(struct ext2_inode_large *) p) == 0;
+		bad_csum = scan_inode_csum_bad(scan, ino, p);
 
 #ifdef WORDS_BIGENDIAN
 		ext2fs_swap_inode_full(scan->fs,
@@ -509,6 +569,11 @@ static errcode_t get_next_blocks(ext2_inode_scan scan)
 	if (num_blocks > scan->blocks_left)
 		num_blocks = scan->blocks_left;
 
+	/*
+	 * Forget the checksum results for the old buffer contents.
+	 */
+	scan->csum_count = 0;
+
 	/*
 	 * If the past block "read" was a bad block, then mark the
 	 * left-over extra bytes as also being bad.
@@ -540,6 +605,7 @@ static errcode_t get_next_blocks(ext2_inode_scan scan)
 		if (retval)
 			return EXT2_ET_NEXT_INODE_READ;
 	}
+	verify_inode_buffer_csums(scan, num_blocks);
 	check_inode_block_sanity(scan, num_blocks);
 
 	scan->ptr = scan->inode_buffer;
@@ -686,8 +752,8 @@ errcode_t ext2fs_get_next_inode_full(ext2_inode_scan scan, ext2_ino_t *ino,
 		/* Verify the inode checksum. */
 		if (!(iblock_status[iblk] & IBLOCK_STATUS_CSUMS_OK) &&
 		    !(scan->fs->flags & EXT2_FLAG_IGNORE_CSUM_ERRORS) &&
-		    !ext2fs_inode_csum_verify(scan->fs, scan->current_inode + 1,
-				(struct ext2_inode_large *)scan->ptr))
+		    scan_inode_csum_bad(scan, scan->current_inode + 1,
+					scan->ptr))
 			retval = EXT2_ET_INODE_CSUM_INVALID;
 
 #ifdef WORDS_BIGENDIAN
@@ -879,6 +945,8 @@ errcode_t ext2fs_write_inode2(ext2_filsys fs, ext2_ino_t ino,
 	if ((ino == 0) || (ino > fs->super->s_inodes_count))
 		return EXT2_ET_BAD_INODE_NUM;
 
+	fs->map_generation++;
+
 	/* Prepare our shadow buffer for read/modify/byteswap/write */
 	retval = ext2fs_get_mem(length, &w_inode);
 	if (retval)
@@ -144,6 +144,699 @@ static int link_proc(struct ext2_dir_entry *dirent,
 	return DIRENT_ABORT|DIRENT_CHANGED;
 }
 
+/*
+ * Try to insert the entry described by @ls into the single directory
+ * block in @buf, in the same way ext2fs_dir_iterate() would feed it to
+ * link_proc().  Returns 1 if the entry was added.
+ */
+static int link_block(struct link_struct *ls, char *buf)
+{
+	struct ext2_dir_entry *dirent;
+	unsigned int	offset = 0, rec_len;
+	unsigned int	end = ls->blocksize;
+	int		ret;
+
+	if (ext2fs_has_feature_metadata_csum(ls->fs->super) &&
+	    ext2fs_dirent_has_tail(ls->fs, (struct ext2_dir_entry *) buf))
+		end -= sizeof(struct ext2_dir_entry_tail);
+
+	while (offset < end) {
+		dirent = (struct ext2_dir_entry *) (buf + offset);
+		ls->err = ext2fs_get_rec_len(ls->fs, dirent, &rec_len);
+		if (ls->err)
+			return 0;
+		if (rec_len < 8 || (rec_len % 4) || offset + rec_len > end) {
+			ls->err = EXT2_ET_DIR_CORRUPTED;
+			return 0;
+		}
+		ret = link_proc(dirent, offset, ls->blocksize, buf, ls);
+		if (ls->err)
+			return 0;
+		if (ret & DIRENT_ABORT)
+			break;
+		ls->err = ext2fs_get_rec_len(ls->fs, dirent, &rec_len);
+		if (ls->err)
+			return 0;
+		offset += rec_len;
+	}
+	return ls->done;
+}
+
+/*
+ * Hash tree insertion.  The directory is walked from the dx_root down
+ * to the leaf covering the new name's hash, as the kernel does.  If the
+ * leaf is full it is split in two by hash, splitting full index nodes
+ * (or adding an index level) on the way down to make room for the new
+ * leaf's index entry.  All of the changes are made in memory first, so
+ * that if the index turns out to be unusable nothing has been written
+ * and the caller can fall back to a linear insertion.
+ */
+#define DX_MAX_LEVELS	3
+/* Index blocks on the path, the new index blocks, and two leaves */
+#define DX_MAX_BLOCKS	(2 * DX_MAX_LEVELS + 2)
+
+struct dx_block {
+	char		*buf;
+	blk64_t		lblk;
+	int		dirty;
+};
+
+struct dx_frame {
+	struct dx_block		*blk;
+	struct ext2_dx_entry	*entries;
+	struct ext2_dx_entry	*at;
+};
+
+struct dx_link {
+	ext2_filsys		fs;
+	ext2_ino_t		dir;
+	struct ext2_inode	*inode;
+	int			hash_alg;
+	int			hash_flags;
+	ext2_dirhash_t		hash;
+	int			levels;
+	blk64_t			old_size;	/* in blocks */
+	blk64_t			new_size;
+	int			nr_blocks;
+	struct dx_block		blocks[DX_MAX_BLOCKS];
+	struct dx_frame		frames[DX_MAX_LEVELS];
+};
+
+struct dx_hash_ent {
+	struct ext2_dir_entry	*dirent;
+	ext2_dirhash_t		hash;
+};
+
+static unsigned int dx_get_count(struct ext2_dx_entry *entries)
+{
+	return ext2fs_le16_to_cpu(((struct ext2_dx_countlimit *)
+				   entries)->count);
+}
+
+static unsigned int dx_get_limit(struct ext2_dx_entry *entries)
+{
+	return ext2fs_le16_to_cpu(((struct ext2_dx_countlimit *)
+				   entries)->limit);
+}
+
+static void dx_set_count(struct ext2_dx_entry *entries, unsigned int count)
+{
+	((struct ext2_dx_countlimit *) entries)->count =
+		ext2fs_cpu_to_le16(count);
+}
+
+static void dx_set_limit(struct ext2_dx_entry *entries, unsigned int limit)
+{
+	((struct ext2_dx_countlimit *) entries)->limit =
+		ext2fs_cpu_to_le16(limit);
+}
+
+static unsigned int dx_node_limit(ext2_filsys fs)
+{
+	unsigned int csum_size = 0;
+
+	if (ext2fs_has_feature_metadata_csum(fs->super))
+		csum_size = sizeof(struct ext2_dx_tail);
+	return (fs->blocksize - 8 - csum_size) / sizeof(struct ext2_dx_entry);
+}
+
+/* Get a buffer for logical block @lblk, reading it in if it exists */
+static errcode_t dx_get_block(struct dx_link *dx, blk64_t lblk,
+			      struct dx_block **ret)
+{
+	struct dx_block	*blk;
+	blk64_t		pblk;
+	errcode_t	retval;
+
+	if (dx->nr_blocks >= DX_MAX_BLOCKS)
+		return EXT2_ET_DIR_CORRUPTED;
+	blk = &dx->blocks[dx->nr_blocks];
+	if (!blk->buf) {
+		retval = ext2fs_get_mem(dx->fs->blocksize, &blk->buf);
+		if (retval)
+			return retval;
+	}
+	blk->lblk = lblk;
+	blk->dirty = 0;
+	if (lblk >= dx->old_size) {
+		/* A new block, allocated when the changes are written */
+		memset(blk->buf, 0, dx->fs->blocksize);
+		blk->dirty = 1;
+	} else {
+		retval = ext2fs_bmap2(dx->fs, dx->dir, dx->inode, NULL, 0,
+				      lblk, 0, &pblk);
+		if (retval)
+			return retval;
+		if (pblk == 0)
+			return EXT2_ET_DIR_CORRUPTED;
+		retval = ext2fs_read_dir_block4(dx->fs, pblk, blk->buf, 0,
+						dx->dir);
+		if (retval)
+			return retval;
+	}
+	dx->nr_blocks++;
+	*ret = blk;
+	return 0;
+}
+
+/* Point @frame at the index in @blk and search it for dx->hash */
+static errcode_t dx_load_frame(struct dx_link *dx, struct dx_frame *frame,
+			       struct dx_block *blk, unsigned int offset)
+{
+	struct ext2_dx_entry *p, *q, *m;
+	unsigned int	count, limit;
+
+	frame->blk = blk;
+	frame->entries = (struct ext2_dx_entry *) (blk->buf + offset);
+	count = dx_get_count(frame->entries);
+	limit = dx_get_limit(frame->entries);
+	if (count == 0 || count > limit ||
+	    offset + limit * sizeof(struct ext2_dx_entry) > dx->fs->blocksize)
+		return EXT2_ET_DIR_CORRUPTED;
+
+	p = frame->entries + 1;
+	q = frame->entries + count - 1;
+	while (p <= q) {
+		m = p + (q - p) / 2;
+		if (ext2fs_le32_to_cpu(m->hash) > dx->hash)
+			q = m - 1;
+		else
+			p = m + 1;
+	}
+	frame->at = p - 1;
+	return 0;
+}
+
+static blk64_t dx_get_block_nr(struct ext2_dx_entry *entry)
+{
+	return ext2fs_le32_to_cpu(entry->block) & EXT4_DX_BLOCK_MASK;
+}
+
+/* Insert an index entry after frame->at; the caller checked for room */
+static void dx_insert_entry(struct dx_frame *frame, ext2_dirhash_t hash,
+			    blk64_t lblk)
+{
+	unsigned int	count = dx_get_count(frame->entries);
+	struct ext2_dx_entry *new = frame->at + 1;
+
+	memmove(new + 1, new, (char *) (frame->entries + count) -
+		(char *) new);
+	new->hash = ext2fs_cpu_to_le32(hash);
+	new->block = ext2fs_cpu_to_le32(lblk);
+	dx_set_count(frame->entries, count + 1);
+	frame->blk->dirty = 1;
+}
+
+/* Start a new dx_node block, with the fake dirent covering the block */
+static errcode_t dx_new_node(struct dx_link *dx, struct dx_block **ret)
+{
+	struct ext2_dir_entry *dirent;
+	errcode_t	retval;
+
+	retval = dx_get_block(dx, dx->new_size++, ret);
+	if (retval)
+		return retval;
+	dirent = (struct ext2_dir_entry *) (*ret)->buf;
+	retval = ext2fs_set_rec_len(dx->fs, dx->fs->blocksize, dirent);
+	if (retval)
+		return retval;
+	dx_set_limit((struct ext2_dx_entry *) ((*ret)->buf + 8),
+		     dx_node_limit(dx->fs));
+	return 0;
+}
+
+/*
+ * The root is full: move its entries into a new index node and point
+ * the root at that node, adding a level to the tree.
+ */
+static errcode_t dx_add_level(struct dx_link *dx)
+{
+	struct ext2_dx_root_info *root;
+	struct dx_frame	*frame = &dx->frames[0];
+	struct ext2_dx_entry *entries;
+	struct dx_block	*blk;
+	unsigned int	count = dx_get_count(frame->entries);
+	errcode_t	retval;
+	int		i;
+
+	if (dx->levels >= (int) ext2_dir_htree_level(dx->fs) ||
+	    dx->levels >= DX_MAX_LEVELS)
+		return EXT2_ET_DIR_NO_SPACE;
+
+	retval = dx_new_node(dx, &blk);
+	if (retval)
+		return retval;
+	entries = (struct ext2_dx_entry *) (blk->buf + 8);
+	entries[0].block = frame->entries[0].block;
+	memcpy(entries + 1, frame->entries + 1,
+	       (count - 1) * sizeof(struct ext2_dx_entry));
+	dx_set_count(entries, count);
+
+	for (i = dx->levels; i > 1; i--)
+		dx->frames[i] = dx->frames[i - 1];
+	dx->frames[1].blk = blk;
+	dx->frames[1].entries = entries;
+	dx->frames[1].at = entries + (frame->at - frame->entries);
+	dx->levels++;
+
+	frame->entries[0].block = ext2fs_cpu_to_le32(blk->lblk);
+	dx_set_count(frame->entries, 1);
+	frame->at = frame->entries;
+	root = (struct ext2_dx_root_info *) (frame->blk->buf + 24);
+	root->indirect_levels++;
+	frame->blk->dirty = 1;
+	return 0;
+}
+
+/* Split the full index node at @level in two, moving the upper half */
+static errcode_t dx_split_node(struct dx_link *dx, int level)
+{
+	struct dx_frame	*frame = &dx->frames[level];
+	struct dx_frame	*parent = &dx->frames[level - 1];
+	struct ext2_dx_entry *entries;
+	struct dx_block	*blk;
+	unsigned int	count = dx_get_count(frame->entries);
+	unsigned int	split = count / 2;
+	errcode_t	retval;
+
+	retval = dx_new_node(dx, &blk);
+	if (retval)
+		return retval;
+	entries = (struct ext2_dx_entry *) (blk->buf + 8);
+	entries[0].block = frame->entries[split].block;
+	memcpy(entries + 1, frame->entries + split + 1,
+	       (count - split - 1) * sizeof(struct ext2_dx_entry));
+	dx_set_count(entries, count - split);
+	dx_set_count(frame->entries, split);
+	frame->blk->dirty = 1;
+
+	dx_insert_entry(parent,
+			ext2fs_le32_to_cpu(frame->entries[split].hash),
+			blk->lblk);
+	if (frame->at >= frame->entries + split) {
+		frame->at = entries + (frame->at - (frame->entries + split));
+		frame->entries = entries;
+		frame->blk = blk;
+		parent->at++;
+	}
+	return 0;
+}
+
+static int dx_hash_cmp(const void *a, const void *b)
+{
+	const struct dx_hash_ent *he_a = (const struct dx_hash_ent *) a;
+	const struct dx_hash_ent *he_b = (const struct dx_hash_ent *) b;
+
+	if (he_a->hash != he_b->hash)
+		return he_a->hash < he_b->hash ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Write the @count entries in @ents into @buf as a packed leaf block,
+ * with a checksum tail if the file system has metadata_csum.
+ */
+static errcode_t dx_pack_leaf(ext2_filsys fs, char *buf,
+			      struct dx_hash_ent *ents, int count)
+{
+	struct ext2_dir_entry *dirent = (struct ext2_dir_entry *) buf;
+	unsigned int	offset = 0, rec_len = 0, csum_size = 0;
+	errcode_t	retval;
+	int		i;
+
+	if (ext2fs_has_feature_metadata_csum(fs->super))
+		csum_size = sizeof(struct ext2_dir_entry_tail);
+
+	memset(buf, 0, fs->blocksize);
+	for (i = 0; i < count; i++) {
+		offset += rec_len;
+		rec_len = EXT2_DIR_REC_LEN(ext2fs_dirent_name_len(ents[i].dirent));
+		dirent = (struct ext2_dir_entry *) (buf + offset);
+		memcpy(dirent, ents[i].dirent, rec_len);
+		retval = ext2fs_set_rec_len(fs, rec_len, dirent);
+		if (retval)
+			return retval;
+	}
+	/* The last entry takes up the rest of the block */
+	retval = ext2fs_set_rec_len(fs, fs->blocksize - csum_size - offset,
+				    dirent);
+	if (retval)
+		return retval;
+	if (csum_size)
+		ext2fs_initialize_dirent_tail(fs,
+					EXT2_DIRENT_TAIL(buf, fs->blocksize));
+	return 0;
+}
+
+/*
+ * Read the live entries of the leaf in @buf into @ents (which point into
+ * @buf) along with their hashes, sorted by hash.
+ */
+static errcode_t dx_sort_leaf(struct dx_link *dx, char *buf,
+			      struct dx_hash_ent *ents, int *ret_count)
+{
+	struct ext2_dir_entry *dirent;
+	unsigned int	offset = 0, rec_len;
+	errcode_t	retval;
+	int		count = 0;
+
+	while (offset < dx->fs->blocksize) {
+		dirent = (struct ext2_dir_entry *) (buf + offset);
+		retval = ext2fs_get_rec_len(dx->fs, dirent, &rec_len);
+		if (retval)
+			return retval;
+		if (rec_len < 8 || (rec_len % 4) ||
+		    offset + rec_len > dx->fs->blocksize ||
+		    (unsigned) ext2fs_dirent_name_len(dirent) + 8 > rec_len)
+			return EXT2_ET_DIR_CORRUPTED;
+		if (dirent->inode) {
+			ents[count].dirent = dirent;
+			retval = ext2fs_dirhash2(dx->hash_alg, dirent->name,
+					ext2fs_dirent_name_len(dirent),
+					dx->fs->encoding, dx->hash_flags,
+					dx->fs->super->s_hash_seed,
+					&ents[count].hash, NULL);
+			if (retval)
+				return retval;
+			count++;
+		}
+		offset += rec_len;
+	}
+	qsort(ents, count, sizeof(struct dx_hash_ent), dx_hash_cmp);
+	*ret_count = count;
+	return 0;
+}
+
+/*
+ * Split the leaf @leaf in two by hash, moving the upper half to a new
+ * block, and insert the new leaf into the bottom index node.  Returns
+ * the leaf which should receive the new name.
+ */
+static errcode_t dx_split_leaf(struct dx_link *dx, struct dx_block *leaf,
+			       struct dx_block **ret)
+{
+	ext2_filsys	fs = dx->fs;
+	struct dx_hash_ent *ents = NULL;
+	struct dx_block	*new_leaf;
+	ext2_dirhash_t	split_hash;
+	char		*copy = NULL;
+	int		count, split, continued;
+	errcode_t	retval;
+
+	retval = ext2fs_get_mem(fs->blocksize, &copy);
+	if (retval)
+		return retval;
+	retval = ext2fs_get_array(fs->blocksize / EXT2_DIR_REC_LEN(1),
+				  sizeof(struct dx_hash_ent), &ents);
+	if (retval)
+		goto out;
+	memcpy(copy, leaf->buf, fs->blocksize);
+	retval = dx_sort_leaf(dx, copy, ents, &count);
+	if (retval)
+		goto out;
+	if (count < 2) {
+		retval = EXT2_ET_DIR_NO_SPACE;
+		goto out;
+	}
+
+	retval = dx_get_block(dx, dx->new_size++, &new_leaf);
+	if (retval)
+		goto out;
+	split = count / 2;
+	split_hash = ents[split].hash;
+	continued = (ents[split - 1].hash == split_hash);
+
+	retval = dx_pack_leaf(fs, leaf->buf, ents, split);
+	if (retval)
+		goto out;
+	retval = dx_pack_leaf(fs, new_leaf->buf, ents + split, count - split);
+	if (retval)
+		goto out;
+	leaf->dirty = 1;
+
+	dx_insert_entry(&dx->frames[dx->levels - 1], split_hash + continued,
+			new_leaf->lblk);
+	*ret = (dx->hash >= split_hash) ? new_leaf : leaf;
+out:
+	ext2fs_free_mem(&ents);
+	ext2fs_free_mem(&copy);
+	return retval;
+}
+
+/* Allocate the new blocks and write out everything that changed */
+static errcode_t dx_commit(struct dx_link *dx)
+{
+	ext2_filsys	fs = dx->fs;
+	blk64_t		lblk, pblk;
+	errcode_t	retval;
+	int		i;
+
+	for (lblk = dx->old_size; lblk < dx->new_size; lblk++) {
+		pblk = 0;
+		retval = ext2fs_bmap2(fs, dx->dir, dx->inode, NULL,
+				      BMAP_ALLOC, lblk, 0, &pblk);
+		if (retval)
+			return retval;
+	}
+	if (dx->new_size != dx->old_size) {
+		retval = ext2fs_inode_size_set(fs, dx->inode,
+					       dx->new_size * fs->blocksize);
+		if (retval)
+			return retval;
+		retval = ext2fs_write_inode(fs, dx->dir, dx->inode);
+		if (retval)
+			return retval;
+	}
+
+	for (i = 0; i < dx->nr_blocks; i++) {
+		if (!dx->blocks[i].dirty)
+			continue;
+		retval = ext2fs_bmap2(fs, dx->dir, dx->inode, NULL, 0,
+				      dx->blocks[i].lblk, 0, &pblk);
+		if (retval)
+			return retval;
+		retval = ext2fs_write_dir_block4(fs, pblk, dx->blocks[i].buf,
+						 0, dx->dir);
+		if (retval)
+			return retval;
+	}
+	return 0;
+}
+
+/*
+ * Add the entry to the hash tree directory @dir.  *committed is set once
+ * anything has been written to disk; until then a failure leaves the
+ * directory untouched.
+ */
+static errcode_t dx_link(struct link_struct *ls, ext2_ino_t dir,
+			 struct ext2_inode *inode, int *committed)
+{
+	ext2_filsys	fs = ls->fs;
+	struct dx_link	dx;
+	struct ext2_dx_root_info *root;
+	struct dx_block	*blk, *leaf;
+	errcode_t	retval;
+	int		i;
+
+	*committed = 0;
+	memset(&dx, 0, sizeof(dx));
+	dx.fs = fs;
+	dx.dir = dir;
+	dx.inode = inode;
+	dx.old_size = EXT2_I_SIZE(inode) / fs->blocksize;
+	dx.new_size = dx.old_size;
+	dx.hash_flags = inode->i_flags & EXT4_CASEFOLD_FL;
+
+	retval = dx_get_block(&dx, 0, &blk);
+	if (retval)
+		goto out;
+	root = (struct ext2_dx_root_info *) (blk->buf + 24);
+	if (root->reserved_zero || root->info_length < 8 ||
+	    root->indirect_levels >= ext2_dir_htree_level(fs) ||
+	    root->indirect_levels >= DX_MAX_LEVELS) {
+		retval = EXT2_ET_DIR_CORRUPTED;
+		goto out;
+	}
+	dx.levels = root->indirect_levels + 1;
+	dx.hash_alg = root->hash_version;
+	if ((dx.hash_alg <= EXT2_HASH_TEA) &&
+	    (fs->super->s_flags & EXT2_FLAGS_UNSIGNED_HASH))
+		dx.hash_alg += 3;
+	retval = ext2fs_dirhash2(dx.hash_alg, ls->name, ls->namelen,
+				 fs->encoding, dx.hash_flags,
+				 fs->super->s_hash_seed, &dx.hash, NULL);
+	if (retval)
+		goto out;
+
+	retval = dx_load_frame(&dx, &dx.frames[0], blk,
+			       24 + root->info_length);
+	for (i = 1; !retval && i < dx.levels; i++) {
+		retval = dx_get_block(&dx, dx_get_block_nr(dx.frames[i-1].at),
+				      &blk);
+		if (!retval)
+			retval = dx_load_frame(&dx, &dx.frames[i], blk, 8);
+	}
+	if (retval)
+		goto out;
+
+	retval = dx_get_block(&dx, dx_get_block_nr(dx.frames[dx.levels-1].at),
+			      &leaf);
+	if (retval)
+		goto out;
+	if (!link_block(ls, leaf->buf)) {
+		if (ls->err) {
+			retval = ls->err;
+			goto out;
+		}
+
+		/* Make room in the index for one more leaf */
+		for (i = dx.levels - 1; i >= 0; i--)
+			if (dx_get_count(dx.frames[i].entries) <
+			    dx_get_limit(dx.frames[i].entries))
+				break;
+		if (i < 0) {
+			retval = dx_add_level(&dx);
+			if (retval)
+				goto out;
+			i = 1;
+		}
+		for (i++; i < dx.levels; i++) {
+			retval = dx_split_node(&dx, i);
+			if (retval)
+				goto out;
+		}
+
+		retval = dx_split_leaf(&dx, leaf, &leaf);
+		if (retval)
+			goto out;
+		if (!link_block(ls, leaf->buf)) {
+			retval = ls->err ? ls->err : EXT2_ET_DIR_NO_SPACE;
+			goto out;
+		}
+	}
+	leaf->dirty = 1;
+
+	*committed = 1;
+	retval = dx_commit(&dx);
+out:
+	for (i = 0; i < DX_MAX_BLOCKS; i++)
+		if (dx.blocks[i].buf)
+			ext2fs_free_mem(&dx.blocks[i].buf);
+	return retval;
+}
+
+/*
+ * Turn the single block directory @dir into a hash tree directory: its
+ * entries (other than "." and "..") move to a new leaf block and block 0
+ * becomes the dx_root.  Used when EXT2_FLAG_INDEX_DIRS is set and a
+ * directory outgrows its first block, as the kernel does.
+ */
+static errcode_t make_indexed_dir(ext2_filsys fs, ext2_ino_t dir,
+				  struct ext2_inode *inode)
+{
+	struct ext2_dir_entry *dirent;
+	struct ext2_dx_root_info *root;
+	struct ext2_dx_entry *entries;
+	struct dx_hash_ent *ents = NULL;
+	char		*buf = NULL, *leaf = NULL;
+	unsigned int	offset, rec_len, csum_size = 0;
+	blk64_t		pblk, leaf_pblk = 0;
+	errcode_t	retval;
+	int		count = 0;
+
+	if (ext2fs_has_feature_metadata_csum(fs->super))
+		csum_size = sizeof(struct ext2_dx_tail);
+
+	retval = ext2fs_get_array(2, fs->blocksize, &buf);
+	if (retval)
+		return retval;
+	leaf = buf + fs->blocksize;
+	retval = ext2fs_get_array(fs->blocksize / EXT2_DIR_REC_LEN(1),
+				  sizeof(struct dx_hash_ent), &ents);
+	if (retval)
+		goto out;
+
+	retval = ext2fs_bmap2(fs, dir, inode, NULL, 0, 0, 0, &pblk);
+	if (retval)
+		goto out;
+	retval = ext2fs_read_dir_block4(fs, pblk, buf, 0, dir);
+	if (retval)
+		goto out;
+
+	/* Block 0 must start with "." and ".." for the root to fit */
+	dirent = (struct ext2_dir_entry *) buf;
+	if (ext2fs_dirent_name_len(dirent) != 1 || dirent->name[0] != '.' ||
+	    ext2fs_get_rec_len(fs, dirent, &rec_len) ||
+	    rec_len != EXT2_DIR_REC_LEN(1)) {
+		retval = EXT2_ET_DIR_NO_SPACE;
+		goto out;
+	}
+	dirent = (struct ext2_dir_entry *) (buf + rec_len);
+	if (ext2fs_dirent_name_len(dirent) != 2 ||
+	    strncmp(dirent->name, "..", 2)) {
+		retval = EXT2_ET_DIR_NO_SPACE;
+		goto out;
+	}
+
+	offset = EXT2_DIR_REC_LEN(1);
+	while (offset < fs->blocksize) {
+		dirent = (struct ext2_dir_entry *) (buf + offset);
+		retval = ext2fs_get_rec_len(fs, dirent, &rec_len);
+		if (retval)
+			goto out;
+		if (rec_len < 8 || (rec_len % 4) ||
+		    offset + rec_len > fs->blocksize ||
+		    (unsigned) ext2fs_dirent_name_len(dirent) + 8 > rec_len) {
+			retval = EXT2_ET_DIR_CORRUPTED;
+			goto out;
+		}
+		if (dirent->inode && offset > EXT2_DIR_REC_LEN(1))
+			ents[count++].dirent = dirent;
+		offset += rec_len;
+	}
+	retval = dx_pack_leaf(fs, leaf, ents, count);
+	if (retval)
+		goto out;
+
+	/* Build the root in place after "." and ".." */
+	dirent = (struct ext2_dir_entry *) (buf + EXT2_DIR_REC_LEN(1));
+	retval = ext2fs_set_rec_len(fs, fs->blocksize - EXT2_DIR_REC_LEN(1),
+				    dirent);
+	if (retval)
+		goto out;
+	memset(buf + 2 * EXT2_DIR_REC_LEN(1), 0,
+	       fs->blocksize - 2 * EXT2_DIR_REC_LEN(1));
+	root = (struct ext2_dx_root_info *) (buf + 24);
+	root->hash_version = fs->super->s_def_hash_version;
+	root->info_length = 8;
+	entries = (struct ext2_dx_entry *) (buf + 32);
+	dx_set_limit(entries, (fs->blocksize - (32 + csum_size)) /
+		     sizeof(struct ext2_dx_entry));
+	dx_set_count(entries, 1);
+	entries[0].block = ext2fs_cpu_to_le32(1);
+
+	retval = ext2fs_bmap2(fs, dir, inode, NULL, BMAP_ALLOC, 1, 0,
+			      &leaf_pblk);
+	if (retval)
+		goto out;
+	retval = ext2fs_write_dir_block4(fs, leaf_pblk, leaf, 0, dir);
+	if (retval)
+		goto out;
+	retval = ext2fs_write_dir_block4(fs, pblk, buf, 0, dir);
+	if (retval)
+		goto out;
+
+	retval = ext2fs_inode_size_set(fs, inode, 2 * fs->blocksize);
+	if (retval)
+		goto out;
+	inode->i_flags |= EXT2_INDEX_FL;
+	retval = ext2fs_write_inode(fs, dir, inode);
+out:
+	ext2fs_free_mem(&ents);
+	ext2fs_free_mem(&buf);
+	return retval;
+}
+
 /*
  * Note: the low 3 bits of the flags field are used as the directory
  * entry filetype.
@@ -157,6 +850,7 @@ errcode_t ext2fs_link(ext2_filsys fs, ext2_ino_t dir, const char *name,
 	errcode_t		retval;
 	struct link_struct	ls;
 	struct ext2_inode	inode;
+	int			committed;
 
 	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
 
@@ -173,6 +867,21 @@ errcode_t ext2fs_link(ext2_filsys fs, ext2_ino_t dir, const char *name,
 	ls.blocksize = fs->blocksize;
 	ls.err = 0;
 
+	if ((retval = ext2fs_read_inode(fs, dir, &inode)) != 0)
+		return retval;
+
+	if ((inode.i_flags & EXT2_INDEX_FL) &&
+	    !(inode.i_flags & EXT4_INLINE_DATA_FL) &&
+	    ext2fs_has_feature_dir_index(fs->super)) {
+		retval = dx_link(&ls, dir, &inode, &committed);
+		if (retval == 0 || committed ||
+		    retval == EXT2_ET_NO_MEMORY)
+			return retval;
+		/* The index is unusable or full; fall back to a linear scan */
+		ls.done = 0;
+		ls.err = 0;
+	}
+
 	retval = ext2fs_dir_iterate(fs, dir, DIRENT_FLAG_INCLUDE_EMPTY,
 				    0, link_proc, &ls);
 	if (retval)
@@ -180,16 +889,29 @@ errcode_t ext2fs_link(ext2_filsys fs, ext2_ino_t dir, const char *name,
 	if (ls.err)
 		return ls.err;
 
-	if (!ls.done)
-		return EXT2_ET_DIR_NO_SPACE;
+	if (!ls.done) {
+		if (!(fs->flags & EXT2_FLAG_INDEX_DIRS) ||
+		    !ext2fs_has_feature_dir_index(fs->super) ||
+		    (inode.i_flags & (EXT2_INDEX_FL | EXT4_INLINE_DATA_FL)) ||
+		    EXT2_I_SIZE(&inode) != fs->blocksize)
+			return EXT2_ET_DIR_NO_SPACE;
+		retval = make_indexed_dir(fs, dir, &inode);
+		if (retval)
+			return retval;
+		retval = dx_link(&ls, dir, &inode, &committed);
+		if (retval && !committed && retval != EXT2_ET_NO_MEMORY)
+			retval = EXT2_ET_DIR_NO_SPACE;
+		return retval;
+	}
 
 	if ((retval = ext2fs_read_inode(fs, dir, &inode)) != 0)
 		return retval;
 
 	/*
-	 * If this function changes to preserve the htree, remove the
-	 * two hunks in link_proc that shove checksum tails into the
-	 * former dx_root/dx_node blocks.
+	 * We only get here for a hash tree directory if its index could
+	 * not be used, so drop the index.  The two hunks in link_proc
+	 * that shove checksum tails into the former dx_root/dx_node
+	 * blocks make them valid leaf blocks again.
 	 */
 	if (inode.i_flags & EXT2_INDEX_FL) {
 		inode.i_flags &= ~EXT2_INDEX_FL;
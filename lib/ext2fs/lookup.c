@@ -46,15 +46,290 @@ static int lookup_proc(struct ext2_dir_entry *dirent,
 	return DIRENT_ABORT;
 }
 
+/*
+ * Hash tree lookup.  Rather than scanning every block of an indexed
+ * directory, hash the name and walk the dx_root and dx_node blocks down
+ * to the leaf that can hold it, following on to the next leaves only if
+ * the hash continues there.  Any inconsistency in the index is reported
+ * as EXT2_ET_DIR_CORRUPTED so that the caller can fall back to a linear
+ * scan of the directory.
+ */
+#define DX_MAX_LEVELS	3
+
+struct dx_frame {
+	struct ext2_dx_entry	*entries;
+	struct ext2_dx_entry	*at;
+	unsigned int		count;
+};
+
+struct dx_lookup {
+	ext2_filsys		fs;
+	ext2_ino_t		dir;
+	struct ext2_inode	*inode;
+	ext2_dirhash_t		hash;
+	int			levels;
+	char			*buf;	/* one block per level, plus a leaf */
+	struct dx_frame		frames[DX_MAX_LEVELS];
+};
+
+static errcode_t dx_read_block(struct dx_lookup *dx, blk64_t lblk,
+			       char *buf)
+{
+	ext2_filsys	fs = dx->fs;
+	blk64_t		pblk;
+	errcode_t	retval;
+
+	if (lblk >= EXT2_I_SIZE(dx->inode) / fs->blocksize)
+		return EXT2_ET_DIR_CORRUPTED;
+	retval = ext2fs_bmap2(fs, dx->dir, dx->inode, NULL, 0, lblk, 0,
+			      &pblk);
+	if (retval)
+		return retval;
+	if (pblk == 0)
+		return EXT2_ET_DIR_CORRUPTED;
+	return ext2fs_read_dir_block4(fs, pblk, buf, 0, dx->dir);
+}
+
+/*
+ * Check the count/limit header of an index block and binary search it
+ * for the last entry whose hash is not greater than the one we want.
+ */
+static errcode_t dx_search_frame(struct dx_lookup *dx, struct dx_frame *frame,
+				 char *buf, unsigned int offset)
+{
+	struct ext2_dx_countlimit *cl;
+	struct ext2_dx_entry *p, *q, *m;
+	unsigned int limit, count;
+
+	if (offset + sizeof(struct ext2_dx_entry) > dx->fs->blocksize)
+		return EXT2_ET_DIR_CORRUPTED;
+	cl = (struct ext2_dx_countlimit *) (buf + offset);
+	limit = ext2fs_le16_to_cpu(cl->limit);
+	count = ext2fs_le16_to_cpu(cl->count);
+	if (count == 0 || count > limit ||
+	    offset + limit * sizeof(struct ext2_dx_entry) > dx->fs->blocksize)
+		return EXT2_ET_DIR_CORRUPTED;
+
+	frame->entries = (struct ext2_dx_entry *) (buf + offset);
+	frame->count = count;
+
+	p = frame->entries + 1;
+	q = frame->entries + count - 1;
+	while (p <= q) {
+		m = p + (q - p) / 2;
+		if (ext2fs_le32_to_cpu(m->hash) > dx->hash)
+			q = m - 1;
+		else
+			p = m + 1;
+	}
+	frame->at = p - 1;
+	return 0;
+}
+
+/*
+ * Fill in the frames from @level down to the bottom of the tree, starting
+ * at the index block referenced by the parent frame.
+ */
+static errcode_t dx_descend(struct dx_lookup *dx, int level)
+{
+	ext2_filsys	fs = dx->fs;
+	struct ext2_dx_entry *parent;
+	char		*buf;
+	errcode_t	retval;
+
+	for (; level < dx->levels; level++) {
+		parent = dx->frames[level - 1].at;
+		buf = dx->buf + level * fs->blocksize;
+		retval = dx_read_block(dx, ext2fs_le32_to_cpu(parent->block) &
+				       EXT4_DX_BLOCK_MASK, buf);
+		if (retval)
+			return retval;
+		retval = dx_search_frame(dx, &dx->frames[level], buf, 8);
+		if (retval)
+			return retval;
+	}
+	return 0;
+}
+
+/*
+ * Advance to the next leaf that might contain our hash.  Returns 1 if
+ * there is one (with the frames updated to point at it), 0 if not.
+ */
+static int dx_next_leaf(struct dx_lookup *dx, errcode_t *retval)
+{
+	struct dx_frame	*frame;
+	ext2_dirhash_t	bhash;
+	int		level = dx->levels - 1;
+
+	*retval = 0;
+	while (1) {
+		frame = &dx->frames[level];
+		if (++frame->at < frame->entries + frame->count)
+			break;
+		if (level == 0)
+			return 0;
+		level--;
+	}
+
+	/* Only follow on if the hash collision continues into this block */
+	bhash = ext2fs_le32_to_cpu(frame->at->hash);
+	if ((bhash & ~1) != dx->hash)
+		return 0;
+
+	*retval = dx_descend(dx, level + 1);
+	return *retval ? 0 : 1;
+}
+
+static errcode_t dx_search_leaf(struct dx_lookup *dx, char *buf,
+				const char *name, int namelen,
+				ext2_ino_t *inode)
+{
+	ext2_filsys	fs = dx->fs;
+	struct ext2_dir_entry *dirent;
+	unsigned int	offset = 0, rec_len;
+	errcode_t	retval;
+
+	while (offset < fs->blocksize) {
+		dirent = (struct ext2_dir_entry *) (buf + offset);
+		retval = ext2fs_get_rec_len(fs, dirent, &rec_len);
+		if (retval)
+			return retval;
+		if (rec_len < 8 || (rec_len % 4) ||
+		    offset + rec_len > fs->blocksize ||
+		    (unsigned) ext2fs_dirent_name_len(dirent) + 8 > rec_len)
+			return EXT2_ET_DIR_CORRUPTED;
+		if (dirent->inode &&
+		    ext2fs_dirent_name_len(dirent) == namelen &&
+		    !strncmp(name, dirent->name, namelen)) {
+			*inode = dirent->inode;
+			return 0;
+		}
+		offset += rec_len;
+	}
+	return EXT2_ET_FILE_NOT_FOUND;
+}
+
+/*
+ * "." and ".." are the first two entries of the dx_root block and are
+ * not in any leaf, so they can't be found by hash.
+ */
+static errcode_t dx_lookup_dots(struct dx_lookup *dx, int namelen,
+				ext2_ino_t *inode)
+{
+	struct ext2_dir_entry *dirent;
+	unsigned int	rec_len;
+	errcode_t	retval;
+
+	dirent = (struct ext2_dir_entry *) dx->buf;
+	retval = ext2fs_get_rec_len(dx->fs, dirent, &rec_len);
+	if (retval)
+		return retval;
+	if (ext2fs_dirent_name_len(dirent) != 1 || dirent->name[0] != '.' ||
+	    rec_len < 12 || rec_len + 12 > dx->fs->blocksize)
+		return EXT2_ET_DIR_CORRUPTED;
+	if (namelen == 2) {
+		dirent = (struct ext2_dir_entry *) (dx->buf + rec_len);
+		if (ext2fs_dirent_name_len(dirent) != 2 ||
+		    strncmp(dirent->name, "..", 2))
+			return EXT2_ET_DIR_CORRUPTED;
+	}
+	*inode = dirent->inode;
+	return 0;
+}
+
+static errcode_t dx_lookup(ext2_filsys fs, ext2_ino_t dir,
+			   struct ext2_inode *dir_inode, const char *name,
+			   int namelen, ext2_ino_t *inode)
+{
+	struct dx_lookup dx;
+	struct ext2_dx_root_info *root;
+	char		*leaf;
+	int		hash_alg;
+	errcode_t	retval;
+
+	memset(&dx, 0, sizeof(dx));
+	dx.fs = fs;
+	dx.dir = dir;
+	dx.inode = dir_inode;
+
+	retval = ext2fs_get_array(DX_MAX_LEVELS + 1, fs->blocksize, &dx.buf);
+	if (retval)
+		return retval;
+
+	retval = dx_read_block(&dx, 0, dx.buf);
+	if (retval)
+		goto out;
+
+	if ((namelen == 1 && name[0] == '.') ||
+	    (namelen == 2 && name[0] == '.' && name[1] == '.')) {
+		retval = dx_lookup_dots(&dx, namelen, inode);
+		goto out;
+	}
+
+	root = (struct ext2_dx_root_info *) (dx.buf + 24);
+	if (root->reserved_zero || root->info_length < 8 ||
+	    root->indirect_levels >= ext2_dir_htree_level(fs) ||
+	    root->indirect_levels >= DX_MAX_LEVELS) {
+		retval = EXT2_ET_DIR_CORRUPTED;
+		goto out;
+	}
+	dx.levels = root->indirect_levels + 1;
+
+	hash_alg = root->hash_version;
+	if ((hash_alg <= EXT2_HASH_TEA) &&
+	    (fs->super->s_flags & EXT2_FLAGS_UNSIGNED_HASH))
+		hash_alg += 3;
+	retval = ext2fs_dirhash2(hash_alg, name, namelen, fs->encoding,
+				 dir_inode->i_flags & EXT4_CASEFOLD_FL,
+				 fs->super->s_hash_seed, &dx.hash, NULL);
+	if (retval)
+		goto out;
+
+	retval = dx_search_frame(&dx, &dx.frames[0], dx.buf,
+				 24 + root->info_length);
+	if (retval)
+		goto out;
+	retval = dx_descend(&dx, 1);
+	if (retval)
+		goto out;
+
+	leaf = dx.buf + DX_MAX_LEVELS * fs->blocksize;
+	do {
+		retval = dx_read_block(&dx, ext2fs_le32_to_cpu(
+				dx.frames[dx.levels - 1].at->block) &
+				EXT4_DX_BLOCK_MASK, leaf);
+		if (retval)
+			goto out;
+		retval = dx_search_leaf(&dx, leaf, name, namelen, inode);
+		if (retval != EXT2_ET_FILE_NOT_FOUND)
+			goto out;
+	} while (dx_next_leaf(&dx, &retval));
+	if (!retval)
+		retval = EXT2_ET_FILE_NOT_FOUND;
+out:
+	ext2fs_free_mem(&dx.buf);
+	return retval;
+}
 
 errcode_t ext2fs_lookup(ext2_filsys fs, ext2_ino_t dir, const char *name,
 			int namelen, char *buf, ext2_ino_t *inode)
 {
 	errcode_t	retval;
 	struct lookup_struct ls;
+	struct ext2_inode dir_inode;
 
 	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
 
+	if (ext2fs_has_feature_dir_index(fs->super) &&
+	    ext2fs_read_inode(fs, dir, &dir_inode) == 0 &&
+	    (dir_inode.i_flags & EXT2_INDEX_FL) &&
+	    !(dir_inode.i_flags & EXT4_INLINE_DATA_FL)) {
+		retval = dx_lookup(fs, dir, &dir_inode, name, namelen, inode);
+		if (retval == 0 || retval == EXT2_ET_FILE_NOT_FOUND)
+			return retval;
+		/* The index is unusable; fall back to a linear scan */
+	}
+
 	ls.name = name;
 	ls.len = namelen;
 	ls.inode = inode;
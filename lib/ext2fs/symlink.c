@@ -52,6 +52,7 @@ errcode_t ext2fs_symlink(ext2_filsys fs, ext2_ino_t parent, ext2_ino_t ino,
 	ext2_ino_t		scratch_ino;
 	blk64_t			blk;
 	int			fastlink, inlinelink;
+	int			drop_refcount = 0;
 	unsigned int		target_len;
 	char			*block_buf = 0;
 
@@ -162,6 +163,16 @@ need_block:
 			goto cleanup;
 	}
 
+	/*
+	 * Update accounting before linking the symlink in, since
+	 * ext2fs_link() may need to allocate blocks for the parent and
+	 * must not be handed the one we just took.
+	 */
+	if (!fastlink && !inlinelink)
+		ext2fs_block_alloc_stats2(fs, blk, +1);
+	ext2fs_inode_alloc_stats2(fs, ino, +1, 0);
+	drop_refcount = 1;
+
 	/*
 	 * Link the symlink into the filesystem hierarchy
 	 */
@@ -179,16 +190,16 @@ need_block:
 			goto cleanup;
 	}
 
-	/*
-	 * Update accounting....
-	 */
-	if (!fastlink && !inlinelink)
-		ext2fs_block_alloc_stats2(fs, blk, +1);
-	ext2fs_inode_alloc_stats2(fs, ino, +1, 0);
+	drop_refcount = 0;
 
 cleanup:
 	if (block_buf)
 		ext2fs_free_mem(&block_buf);
+	if (drop_refcount) {
+		if (!fastlink && !inlinelink)
+			ext2fs_block_alloc_stats2(fs, blk, -1);
+		ext2fs_inode_alloc_stats2(fs, ino, -1, 0);
+	}
 	return retval;
 }
 
@@ -0,0 +1,225 @@
+/*
+ * tst_alloc_pool.c --- test the block allocation pools
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Library
+ * General Public License, version 2.
+ * %End-Header%
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include "ext2_fs.h"
+#include "ext2fs.h"
+
+static int failed;
+
+#define CHECK(cond)							\
+	do {								\
+		if (!(cond)) {						\
+			printf("%s:%d: check failed: %s\n", __func__,	\
+			       __LINE__, #cond);			\
+			failed++;					\
+		}							\
+	} while (0)
+
+static ext2fs_block_bitmap found_map;	/* the "application's" own map */
+static int new_range_calls, get_alloc_block_calls;
+
+static errcode_t test_new_range(ext2_filsys fs, int flags, blk64_t goal,
+				blk64_t len, blk64_t *pblk, blk64_t *plen)
+{
+	new_range_calls++;
+	return ext2fs_new_range(fs, flags, goal, len, found_map, pblk, plen);
+}
+
+static errcode_t test_get_alloc_block(ext2_filsys fs, blk64_t goal,
+				      blk64_t *ret)
+{
+	get_alloc_block_calls++;
+	return ext2fs_new_block2(fs, goal, found_map, ret);
+}
+
+static void test_alloc_stats_range(ext2_filsys fs EXT2FS_ATTR((unused)),
+				   blk64_t blk, blk_t num, int inuse)
+{
+	if (inuse > 0)
+		ext2fs_mark_block_bitmap_range2(found_map, blk, num);
+	else
+		ext2fs_unmark_block_bitmap_range2(found_map, blk, num);
+}
+
+static ext2_filsys setup(void)
+{
+	struct ext2_super_block param;
+	ext2_filsys	fs;
+	errcode_t	retval;
+
+	memset(&param, 0, sizeof(param));
+	ext2fs_blocks_count_set(&param, 32768);
+	param.s_inodes_count = 1024;
+
+	retval = ext2fs_initialize("test fs", EXT2_FLAG_64BITS, &param,
+				   test_io_manager, &fs);
+	if (retval) {
+		com_err("setup", retval, "while initializing filesystem");
+		exit(1);
+	}
+	retval = ext2fs_allocate_tables(fs);
+	if (retval) {
+		com_err("setup", retval,
+			"while allocating tables for test filesystem");
+		exit(1);
+	}
+	return fs;
+}
+
+static blk64_t count_free(ext2_filsys fs, ext2fs_block_bitmap map)
+{
+	blk64_t blk, n = 0;
+
+	for (blk = fs->super->s_first_data_block;
+	     blk < ext2fs_blocks_count(fs->super); blk++)
+		if (!ext2fs_test_block_bitmap2(map, blk))
+			n++;
+	return n;
+}
+
+static blk64_t group_free(ext2_filsys fs)
+{
+	blk64_t n = 0;
+	dgrp_t	i;
+
+	for (i = 0; i < fs->group_desc_count; i++)
+		n += ext2fs_bg_free_blocks_count(fs, i);
+	return n;
+}
+
+/*
+ * The superblock and the group descriptors must agree with each other
+ * and with the bitmap once the pool has been released.
+ */
+static void check_stats(ext2_filsys fs, blk64_t expect_free)
+{
+	CHECK(ext2fs_free_blocks_count(fs->super) == expect_free);
+	CHECK(group_free(fs) == expect_free);
+	CHECK(count_free(fs, fs->block_map) == expect_free);
+}
+
+static void test_plain(void)
+{
+	ext2_filsys	fs = setup();
+	ext2_alloc_pool_t pool;
+	blk64_t		free0, blk, prev = 0, pblk, plen, first = 0;
+	int		i;
+
+	free0 = ext2fs_free_blocks_count(fs->super);
+	CHECK(ext2fs_alloc_pool_create(fs, 0, 16, &pool) == 0);
+
+	/* The first run is reserved but not yet accounted */
+	for (i = 0; i < 16; i++) {
+		CHECK(ext2fs_alloc_pool_new_block(pool, &blk) == 0);
+		if (i == 0)
+			first = blk;
+		else
+			CHECK(blk == prev + 1);
+		CHECK(ext2fs_test_block_bitmap2(fs->block_map, blk));
+		prev = blk;
+	}
+	CHECK(ext2fs_free_blocks_count(fs->super) == free0);
+	CHECK(count_free(fs, fs->block_map) == free0 - 16);
+
+	/* Refilling accounts for the run that was used up */
+	for (i = 0; i < 4; i++) {
+		CHECK(ext2fs_alloc_pool_new_block(pool, &blk) == 0);
+		CHECK(blk > prev);
+		CHECK(blk < first || blk >= first + 16);
+		prev = blk;
+	}
+	CHECK(ext2fs_free_blocks_count(fs->super) == free0 - 16);
+	CHECK(count_free(fs, fs->block_map) == free0 - 32);
+
+	/* Flushing accounts for the rest, and keeps the reservation */
+	ext2fs_alloc_pool_flush(pool);
+	CHECK(ext2fs_free_blocks_count(fs->super) == free0 - 20);
+	CHECK(group_free(fs) == free0 - 20);
+	CHECK(count_free(fs, fs->block_map) == free0 - 32);
+	CHECK(ext2fs_alloc_pool_allocated(pool) == 20);
+
+	/* A range stops at the end of the current run... */
+	CHECK(ext2fs_alloc_pool_new_range(pool, 100, &pblk, &plen) == 0);
+	CHECK(pblk == prev + 1);
+	CHECK(plen == 12);
+	/* ... and the next one starts a new run */
+	CHECK(ext2fs_alloc_pool_new_range(pool, 5, &pblk, &plen) == 0);
+	CHECK(plen == 5);
+	CHECK(ext2fs_alloc_pool_allocated(pool) == 37);
+
+	/* Freeing the pool gives back what was not handed out */
+	ext2fs_alloc_pool_free(pool);
+	check_stats(fs, free0 - 37);
+	ext2fs_close_free(&fs);
+}
+
+/*
+ * When the application has its own allocator, the pool must take its
+ * runs from it and let it see them straight away.
+ */
+static void test_hooks(int range_hook)
+{
+	ext2_filsys	fs = setup();
+	ext2_alloc_pool_t pool;
+	blk64_t		free0, found_free0, blk;
+	int		i;
+
+	CHECK(ext2fs_allocate_block_bitmap(fs, "found map", &found_map) == 0);
+	CHECK(ext2fs_copy_bitmap(fs->block_map, &found_map) == 0);
+	if (range_hook)
+		ext2fs_set_new_range_callback(fs, test_new_range, NULL);
+	else
+		ext2fs_set_alloc_block_callback(fs, test_get_alloc_block,
+						NULL);
+	ext2fs_set_block_alloc_stats_range_callback(fs,
+					test_alloc_stats_range, NULL);
+	new_range_calls = get_alloc_block_calls = 0;
+	free0 = ext2fs_free_blocks_count(fs->super);
+	found_free0 = count_free(fs, found_map);
+
+	CHECK(ext2fs_alloc_pool_create(fs, 0, 16, &pool) == 0);
+	for (i = 0; i < 20; i++) {
+		CHECK(ext2fs_alloc_pool_new_block(pool, &blk) == 0);
+		CHECK(ext2fs_test_block_bitmap2(found_map, blk));
+	}
+	if (range_hook)
+		CHECK(new_range_calls == 2);
+	else
+		CHECK(get_alloc_block_calls == 20);
+	ext2fs_alloc_pool_free(pool);
+
+	check_stats(fs, free0 - 20);
+	CHECK(count_free(fs, found_map) == found_free0 - 20);
+	ext2fs_free_block_bitmap(found_map);
+	ext2fs_close_free(&fs);
+}
+
+int main(int argc EXT2FS_ATTR((unused)), char **argv EXT2FS_ATTR((unused)))
+{
+	initialize_ext2_error_table();
+
+	test_plain();
+	test_hooks(1);
+	test_hooks(0);
+
+	if (failed) {
+		printf("tst_alloc_pool: %d checks FAILED\n", failed);
+		return 1;
+	}
+	printf("tst_alloc_pool: OK\n");
+	return 0;
+}
@@ -20,6 +20,7 @@
 #include <fcntl.h>
 #include <time.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include "ss/ss.h"
 
@@ -28,6 +29,7 @@
 #include "ext2fsP.h"
 
 extern ss_request_table tst_bitmaps_cmds;
+extern int ext2fs_rb_check_tree;
 
 static char subsystem_name[] = "tst_bitmaps";
 static char version[] = "1.0";
@@ -648,6 +650,228 @@ void do_zeroi(int argc, char *argv[], int sci_idx EXT2FS_ATTR((unused)),
 	ext2fs_clear_inode_bitmap(test_fs->inode_map);
 }
 
+/*
+ * Benchmark the bitmap backends.  The block bitmap is filled with runs
+ * of assorted lengths separated by small gaps, the way a well used,
+ * fragmented file system looks, and then put through the operations
+ * e2fsck and the block allocator use most, timing each in turn.
+ */
+struct bench_run {
+	blk64_t		start;
+	unsigned int	len;
+};
+
+static __u64 bench_seed;
+
+static unsigned int bench_random(void)
+{
+	bench_seed = bench_seed * 6364136223846793005ULL +
+		1442695040888963407ULL;
+	return bench_seed >> 33;
+}
+
+static double bench_time(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static const char *bench_type_name(int type)
+{
+	switch (type) {
+	case EXT2FS_BMAP64_BITARRAY:
+		return "bitarray";
+	case EXT2FS_BMAP64_RBTREE:
+		return "rbtree";
+	case EXT2FS_BMAP64_HYBRID:
+		return "hybrid";
+	}
+	return "unknown";
+}
+
+#define BENCH_PHASES 10
+static const char *bench_phases[BENCH_PHASES] = {
+	"mark", "test", "ffz", "ffs", "scan", "unmark", "remark", "copy",
+	"get/set", "clear"
+};
+
+static void bench_type(const char *name, int type, unsigned int blocks,
+		       struct bench_run *runs, unsigned int nr_runs,
+		       unsigned int ops)
+{
+	ext2fs_block_bitmap bmap, copy;
+	double t[BENCH_PHASES + 1], total = 0;
+	blk64_t first, last, blk, out;
+	unsigned int i, phase = 0;
+	char *buf;
+	errcode_t retval;
+
+	setup_filesystem(name, blocks, 0, type, EXT2_FLAG_64BITS);
+	if (!test_fs)
+		return;
+	bmap = test_fs->block_map;
+	first = test_fs->super->s_first_data_block;
+	last = ext2fs_blocks_count(test_fs->super) - 1;
+	buf = malloc((last - first + 8) / 8);
+	if (!buf) {
+		com_err(name, 0, "couldn't allocate buffer");
+		goto out;
+	}
+
+	t[phase++] = bench_time();
+	for (i = 0; i < nr_runs; i++)
+		for (blk = runs[i].start; blk < runs[i].start + runs[i].len;
+		     blk++)
+			ext2fs_mark_block_bitmap2(bmap, blk);
+	t[phase++] = bench_time();
+	bench_seed = 1;
+	for (i = 0; i < ops; i++)
+		ext2fs_test_block_bitmap2(bmap, first +
+					  bench_random() % (last - first));
+	t[phase++] = bench_time();
+	for (i = 0; i < ops; i++)
+		ext2fs_find_first_zero_block_bitmap2(bmap, first +
+				bench_random() % (last - first), last, &out);
+	t[phase++] = bench_time();
+	for (i = 0; i < ops; i++)
+		ext2fs_find_first_set_block_bitmap2(bmap, first +
+				bench_random() % (last - first), last, &out);
+	t[phase++] = bench_time();
+	/* Walk every run of set bits, as pass 5 or a discard would */
+	for (blk = first; blk <= last; blk = out) {
+		if (ext2fs_find_first_set_block_bitmap2(bmap, blk, last,
+							&out) ||
+		    ext2fs_find_first_zero_block_bitmap2(bmap, out, last,
+							 &out))
+			break;
+	}
+	t[phase++] = bench_time();
+	for (i = 0; i < nr_runs; i += 2)
+		ext2fs_unmark_block_bitmap_range2(bmap, runs[i].start,
+						  runs[i].len);
+	t[phase++] = bench_time();
+	for (i = 0; i < nr_runs; i += 2)
+		ext2fs_mark_block_bitmap_range2(bmap, runs[i].start,
+						runs[i].len);
+	t[phase++] = bench_time();
+	retval = ext2fs_copy_bitmap(bmap, &copy);
+	if (retval) {
+		com_err(name, retval, "while copying bitmap");
+		goto out;
+	}
+	ext2fs_free_block_bitmap(copy);
+	t[phase++] = bench_time();
+	retval = ext2fs_get_block_bitmap_range2(bmap, first,
+						last - first + 1, buf);
+	if (!retval)
+		retval = ext2fs_allocate_block_bitmap(test_fs, "copy", &copy);
+	if (!retval) {
+		retval = ext2fs_set_block_bitmap_range2(copy, first,
+							last - first + 1, buf);
+		ext2fs_free_block_bitmap(copy);
+	}
+	if (retval) {
+		com_err(name, retval, "while copying bitmap range");
+		goto out;
+	}
+	t[phase++] = bench_time();
+	ext2fs_clear_block_bitmap(bmap);
+	t[phase] = bench_time();
+
+	printf("%-10s", bench_type_name(type));
+	for (i = 0; i < BENCH_PHASES; i++) {
+		printf(" %8.3f", t[i + 1] - t[i]);
+		total += t[i + 1] - t[i];
+	}
+	printf(" %8.3f\n", total);
+out:
+	free(buf);
+	ext2fs_close_free(&test_fs);
+}
+
+void do_bench(int argc, char *argv[], int sci_idx EXT2FS_ATTR((unused)),
+	      void *infop EXT2FS_ATTR((unused)))
+{
+	static const int types[] = { EXT2FS_BMAP64_BITARRAY,
+				     EXT2FS_BMAP64_RBTREE,
+				     EXT2FS_BMAP64_HYBRID };
+	unsigned int	blocks = 1 << 24, ops = 1000000;
+	unsigned int	nr_runs = 0, max_runs, i, len;
+	struct bench_run *runs;
+	blk64_t		blk;
+	int		c, err, type = 0;
+
+	reset_getopt();
+	while ((c = getopt(argc, argv, "b:n:t:")) != EOF) {
+		switch (c) {
+		case 'b':
+			blocks = parse_ulong(optarg, argv[0],
+					     "number of blocks", &err);
+			if (err)
+				return;
+			break;
+		case 'n':
+			ops = parse_ulong(optarg, argv[0],
+					  "number of operations", &err);
+			if (err)
+				return;
+			break;
+		case 't':
+			type = parse_ulong(optarg, argv[0],
+					   "bitmap backend type", &err);
+			if (err)
+				return;
+			break;
+		default:
+			fprintf(stderr, "%s: usage: bench [-b blocks] "
+				"[-n ops] [-t type]\n", argv[0]);
+			return;
+		}
+	}
+	if (blocks < 1024) {
+		com_err(argv[0], 0, "too few blocks");
+		return;
+	}
+
+	/* Mostly short runs with the odd long one */
+	max_runs = blocks / 2;
+	runs = malloc(max_runs * sizeof(struct bench_run));
+	if (!runs) {
+		com_err(argv[0], 0, "couldn't allocate runs");
+		return;
+	}
+	bench_seed = 42;
+	for (blk = 1; nr_runs < max_runs; nr_runs++) {
+		blk += bench_random() % 16;
+		len = 1 + bench_random() % 64;
+		if (bench_random() % 16 == 0)
+			len += bench_random() % 2048;
+		if (blk + len >= blocks)
+			break;
+		runs[nr_runs].start = blk;
+		runs[nr_runs].len = len;
+		blk += len;
+	}
+
+	if (test_fs)
+		ext2fs_close_free(&test_fs);
+	ext2fs_rb_check_tree = 0;
+	printf("%u blocks, %u runs, %u random operations\n", blocks,
+	       nr_runs, ops);
+	printf("%-10s", "backend");
+	for (i = 0; i < BENCH_PHASES; i++)
+		printf(" %8s", bench_phases[i]);
+	printf(" %8s\n", "total");
+	for (i = 0; i < sizeof(types) / sizeof(types[0]); i++)
+		if (!type || type == types[i])
+			bench_type(argv[0], types[i], blocks, runs, nr_runs,
+				   ops);
+	ext2fs_rb_check_tree = 1;
+	free(runs);
+}
+
 int main(int argc, char **argv)
 {
 	unsigned int	blocks = 128;
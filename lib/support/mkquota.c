@@ -19,11 +19,6 @@
 #include "quotaio_v2.h"
 #include "quotaio_tree.h"
 #include "common.h"
-#include "dict.h"
-
-/* Needed for architectures where sizeof(int) != sizeof(void *) */
-#define UINT_TO_VOIDPTR(val)  ((void *)(intptr_t)(val))
-#define VOIDPTR_TO_UINT(ptr)  ((unsigned int)(intptr_t)(ptr))
 
 #if DEBUG_QUOTA
 static void print_inode(struct ext2_inode *inode)
@@ -144,27 +139,74 @@ errcode_t quota_remove_inode(ext2_filsys fs, enum quota_type qtype)
 	return 0;
 }
 
-static void write_dquots(dict_t *dict, struct quota_handle *qh)
+static int dquot_id_cmp(const void *a, const void *b)
 {
-	dnode_t		*n;
-	struct dquot	*dq;
+	const struct dquot *c = *(const struct dquot * const *) a;
+	const struct dquot *d = *(const struct dquot * const *) b;
+
+	if (c->dq_id == d->dq_id)
+		return 0;
+	else if (c->dq_id > d->dq_id)
+		return 1;
+	else
+		return -1;
+}
+
+/*
+ * Return an array of all the dquots in the table, sorted by id, so that
+ * the quota files we write and the messages we print don't depend on
+ * the hash order.
+ */
+static errcode_t sorted_dquots(struct dquot_hash *dh, struct dquot ***ret)
+{
+	struct dquot	**array, *dq;
+	unsigned int	i, n = 0;
+	errcode_t	err;
+
+	err = ext2fs_get_array(dh->dh_count ? dh->dh_count : 1,
+			       sizeof(struct dquot *), &array);
+	if (err)
+		return err;
+	for (i = 0; i < dh->dh_size; i++)
+		for (dq = dh->dh_buckets[i]; dq; dq = dq->dq_next)
+			array[n++] = dq;
+	qsort(array, n, sizeof(struct dquot *), dquot_id_cmp);
+	*ret = array;
+	return 0;
+}
 
-	for (n = dict_first(dict); n; n = dict_next(dict, n)) {
-		dq = dnode_get(n);
-		if (dq) {
-			print_dquot("write", dq);
-			dq->dq_h = qh;
-			update_grace_times(dq);
+static errcode_t write_dquots(struct dquot_hash *dh, struct quota_handle *qh)
+{
+	struct dquot	**array, *dq;
+	unsigned int	i;
+	errcode_t	err;
+	int		ret;
+
+	err = sorted_dquots(dh, &array);
+	if (err)
+		return err;
+	for (i = 0; i < dh->dh_count; i++) {
+		dq = array[i];
+		print_dquot("write", dq);
+		dq->dq_h = qh;
+		update_grace_times(dq);
+		if (!qh->qh_ops->commit_dquots)
 			qh->qh_ops->commit_dquot(dq);
-		}
 	}
+	if (qh->qh_ops->commit_dquots) {
+		ret = qh->qh_ops->commit_dquots(qh, array, dh->dh_count);
+		if (ret < 0)
+			err = -ret;
+	}
+	ext2fs_free_mem(&array);
+	return err;
 }
 
 errcode_t quota_write_inode(quota_ctx_t qctx, unsigned int qtype_bits)
 {
 	int		retval = 0;
 	enum quota_type	qtype;
-	dict_t		*dict;
+	struct dquot_hash *dh;
 	ext2_filsys	fs;
 	struct quota_handle *h = NULL;
 	int		fmt = QFMT_VFS_V1;
@@ -190,8 +232,8 @@ errcode_t quota_write_inode(quota_ctx_t qctx, unsigned int qtype_bits)
 		if (((1 << qtype) & qtype_bits) == 0)
 			continue;
 
-		dict = qctx->quota_dict[qtype];
-		if (!dict)
+		dh = qctx->quota_dict[qtype];
+		if (!dh)
 			continue;
 
 		retval = quota_file_create(h, fs, qtype, fmt);
@@ -201,7 +243,15 @@ errcode_t quota_write_inode(quota_ctx_t qctx, unsigned int qtype_bits)
 			goto out;
 		}
 
-		write_dquots(dict, h);
+		retval = write_dquots(dh, h);
+		if (retval) {
+			log_debug("Cannot write dquots: %s",
+				  error_message(retval));
+			if (h->qh_qf.e2_file)
+				ext2fs_file_close(h->qh_qf.e2_file);
+			(void) quota_inode_truncate(fs, h->qh_qf.ino);
+			goto out;
+		}
 		retval = quota_file_close(qctx, h);
 		if (retval) {
 			log_debug("Cannot finish IO on new quotafile: %s",
@@ -234,21 +284,6 @@ out:
 /* Helper functions for computing quota in memory.                */
 /******************************************************************/
 
-static int dict_uint_cmp(const void *a, const void *b)
-{
-	unsigned int	c, d;
-
-	c = VOIDPTR_TO_UINT(a);
-	d = VOIDPTR_TO_UINT(b);
-
-	if (c == d)
-		return 0;
-	else if (c > d)
-		return 1;
-	else
-		return -1;
-}
-
 static inline int project_quota_valid(quota_ctx_t qctx)
 {
 	return (EXT2_INODE_SIZE(qctx->fs->super) > EXT2_GOOD_OLD_INODE_SIZE);
@@ -276,13 +311,71 @@ static inline qid_t get_qid(struct ext2_inode_large *inode, enum quota_type qtyp
 	return 0;
 }
 
-static void quota_dnode_free(dnode_t *node,
-			     void *context EXT2FS_ATTR((unused)))
+#define DQUOT_HASH_MIN	64
+
+static unsigned int dquot_hash_bucket(unsigned int size, qid_t id)
+{
+	__u32 h = id * 0x9E3779B1U;
+
+	return (h ^ (h >> 16)) & (size - 1);
+}
+
+static errcode_t dquot_hash_init(struct dquot_hash **ret)
+{
+	struct dquot_hash *dh;
+	errcode_t	err;
+
+	err = ext2fs_get_memzero(sizeof(struct dquot_hash), &dh);
+	if (err)
+		return err;
+	err = ext2fs_get_arrayzero(DQUOT_HASH_MIN, sizeof(struct dquot *),
+				   &dh->dh_buckets);
+	if (err) {
+		ext2fs_free_mem(&dh);
+		return err;
+	}
+	dh->dh_size = DQUOT_HASH_MIN;
+	*ret = dh;
+	return 0;
+}
+
+static void dquot_hash_free(struct dquot_hash *dh)
 {
-	void *ptr = node ? dnode_get(node) : 0;
+	struct dquot	*dq, *next;
+	unsigned int	i;
 
-	ext2fs_free_mem(&ptr);
-	free(node);
+	for (i = 0; i < dh->dh_size; i++) {
+		for (dq = dh->dh_buckets[i]; dq; dq = next) {
+			next = dq->dq_next;
+			ext2fs_free_mem(&dq);
+		}
+	}
+	ext2fs_free_mem(&dh->dh_buckets);
+	ext2fs_free_mem(&dh);
+}
+
+/*
+ * Double the number of buckets.  If we can't get the memory, just
+ * carry on with longer chains.
+ */
+static void dquot_hash_grow(struct dquot_hash *dh)
+{
+	struct dquot	**buckets, *dq, *next;
+	unsigned int	i, b, size = dh->dh_size * 2;
+
+	if (ext2fs_get_arrayzero(size, sizeof(struct dquot *), &buckets))
+		return;
+	for (i = 0; i < dh->dh_size; i++) {
+		for (dq = dh->dh_buckets[i]; dq; dq = next) {
+			next = dq->dq_next;
+			b = dquot_hash_bucket(size, dq->dq_id);
+			dq->dq_next = buckets[b];
+			buckets[b] = dq;
+		}
+	}
+	ext2fs_free_mem(&dh->dh_buckets);
+	dh->dh_buckets = buckets;
+	dh->dh_size = size;
 }
 
 /*
@@ -292,7 +385,6 @@ errcode_t quota_init_context(quota_ctx_t *qctx, ext2_filsys fs,
 			     unsigned int qtype_bits)
 {
 	errcode_t err;
-	dict_t	*dict;
 	quota_ctx_t ctx;
 	enum quota_type	qtype;
 
@@ -312,15 +404,12 @@ errcode_t quota_init_context(quota_ctx_t *qctx, ext2_filsys fs,
 			if (*quota_sb_inump(fs->super, qtype) == 0)
 				continue;
 		}
-		err = ext2fs_get_mem(sizeof(dict_t), &dict);
+		err = dquot_hash_init(&ctx->quota_dict[qtype]);
 		if (err) {
-			log_debug("Failed to allocate dictionary");
+			log_debug("Failed to allocate dquot table");
 			quota_release_context(&ctx);
 			return err;
 		}
-		ctx->quota_dict[qtype] = dict;
-		dict_init(dict, DICTCOUNT_T_MAX, dict_uint_cmp);
-		dict_set_allocator(dict, NULL, quota_dnode_free, NULL);
 	}
 
 	ctx->fs = fs;
@@ -331,7 +420,7 @@ errcode_t quota_init_context(quota_ctx_t *qctx, ext2_filsys fs,
 void quota_release_context(quota_ctx_t *qctx)
 {
 	errcode_t err;
-	dict_t	*dict;
+	struct dquot_hash *dh;
 	enum quota_type	qtype;
 	quota_ctx_t ctx;
 
@@ -340,12 +429,10 @@ void quota_release_context(quota_ctx_t *qctx)
 
 	ctx = *qctx;
 	for (qtype = 0; qtype < MAXQUOTAS; qtype++) {
-		dict = ctx->quota_dict[qtype];
+		dh = ctx->quota_dict[qtype];
 		ctx->quota_dict[qtype] = 0;
-		if (dict) {
-			dict_free_nodes(dict);
-			free(dict);
-		}
+		if (dh)
+			dquot_hash_free(dh);
 		if (ctx->quota_file[qtype]) {
 			err = quota_file_close(ctx, ctx->quota_file[qtype]);
 			if (err) {
@@ -359,26 +446,59 @@ void quota_release_context(quota_ctx_t *qctx)
 	free(ctx);
 }
 
-static struct dquot *get_dq(dict_t *dict, __u32 key)
+static struct dquot *get_dq(struct dquot_hash *dh, __u32 key)
 {
 	struct dquot	*dq;
-	dnode_t		*n;
-
-	n = dict_lookup(dict, UINT_TO_VOIDPTR(key));
-	if (n)
-		dq = dnode_get(n);
-	else {
-		if (ext2fs_get_mem(sizeof(struct dquot), &dq)) {
-			log_err("Unable to allocate dquot");
-			return NULL;
-		}
-		memset(dq, 0, sizeof(struct dquot));
-		dict_alloc_insert(dict, UINT_TO_VOIDPTR(key), dq);
-		dq->dq_id = key;
+	unsigned int	b;
+
+	if (dh->dh_last && dh->dh_last->dq_id == key)
+		return dh->dh_last;
+
+	b = dquot_hash_bucket(dh->dh_size, key);
+	for (dq = dh->dh_buckets[b]; dq; dq = dq->dq_next)
+		if (dq->dq_id == key)
+			return (dh->dh_last = dq);
+
+	if (ext2fs_get_memzero(sizeof(struct dquot), &dq)) {
+		log_err("Unable to allocate dquot");
+		return NULL;
+	}
+	dq->dq_id = key;
+
+	if (dh->dh_count >= dh->dh_size) {
+		dquot_hash_grow(dh);
+		b = dquot_hash_bucket(dh->dh_size, key);
 	}
-	return dq;
+	dq->dq_next = dh->dh_buckets[b];
+	dh->dh_buckets[b] = dq;
+	dh->dh_count++;
+	return (dh->dh_last = dq);
 }
 
+/*
+ * Charge (or with negative arguments, credit) space and inodes to each
+ * of the inode's quota ids.
+ */
+static void quota_data_update(quota_ctx_t qctx, struct ext2_inode_large *inode,
+			      qsize_t space, int adjust)
+{
+	struct dquot	*dq;
+	struct dquot_hash *dh;
+	enum quota_type	qtype;
+
+	for (qtype = 0; qtype < MAXQUOTAS; qtype++) {
+		if (qtype == PRJQUOTA && !project_quota_valid(qctx))
+			continue;
+		dh = qctx->quota_dict[qtype];
+		if (dh) {
+			dq = get_dq(dh, get_qid(inode, qtype));
+			if (dq) {
+				dq->dq_dqb.dqb_curspace += space;
+				dq->dq_dqb.dqb_curinodes += adjust;
+			}
+		}
+	}
+}
 
 /*
  * Called to update the blocks used by a particular inode
@@ -387,26 +507,13 @@ void quota_data_add(quota_ctx_t qctx, struct ext2_inode_large *inode,
 		    ext2_ino_t ino EXT2FS_ATTR((unused)),
 		    qsize_t space)
 {
-	struct dquot	*dq;
-	dict_t		*dict;
-	enum quota_type	qtype;
-
 	if (!qctx)
 		return;
 
 	log_debug("ADD_DATA: Inode: %u, UID/GID: %u/%u, space: %ld", ino,
 			inode_uid(*inode),
 			inode_gid(*inode), space);
-	for (qtype = 0; qtype < MAXQUOTAS; qtype++) {
-		if (qtype == PRJQUOTA && !project_quota_valid(qctx))
-			continue;
-		dict = qctx->quota_dict[qtype];
-		if (dict) {
-			dq = get_dq(dict, get_qid(inode, qtype));
-			if (dq)
-				dq->dq_dqb.dqb_curspace += space;
-		}
-	}
+	quota_data_update(qctx, inode, space, 0);
 }
 
 /*
@@ -416,25 +523,13 @@ void quota_data_sub(quota_ctx_t qctx, struct ext2_inode_large *inode,
 		    ext2_ino_t ino EXT2FS_ATTR((unused)),
 		    qsize_t space)
 {
-	struct dquot	*dq;
-	dict_t		*dict;
-	enum quota_type	qtype;
-
 	if (!qctx)
 		return;
 
 	log_debug("SUB_DATA: Inode: %u, UID/GID: %u/%u, space: %ld", ino,
 			inode_uid(*inode),
 			inode_gid(*inode), space);
-	for (qtype = 0; qtype < MAXQUOTAS; qtype++) {
-		if (qtype == PRJQUOTA && !project_quota_valid(qctx))
-			continue;
-		dict = qctx->quota_dict[qtype];
-		if (dict) {
-			dq = get_dq(dict, get_qid(inode, qtype));
-			dq->dq_dqb.dqb_curspace -= space;
-		}
-	}
+	quota_data_update(qctx, inode, -space, 0);
 }
 
 /*
@@ -443,25 +538,35 @@ void quota_data_sub(quota_ctx_t qctx, struct ext2_inode_large *inode,
 void quota_data_inodes(quota_ctx_t qctx, struct ext2_inode_large *inode,
 		       ext2_ino_t ino EXT2FS_ATTR((unused)), int adjust)
 {
-	struct dquot	*dq;
-	dict_t		*dict;
-	enum quota_type	qtype;
-
 	if (!qctx)
 		return;
 
 	log_debug("ADJ_INODE: Inode: %u, UID/GID: %u/%u, adjust: %d", ino,
 			inode_uid(*inode),
 			inode_gid(*inode), adjust);
-	for (qtype = 0; qtype < MAXQUOTAS; qtype++) {
-		if (qtype == PRJQUOTA && !project_quota_valid(qctx))
-			continue;
-		dict = qctx->quota_dict[qtype];
-		if (dict) {
-			dq = get_dq(dict, get_qid(inode, qtype));
-			dq->dq_dqb.dqb_curinodes += adjust;
-		}
-	}
+	quota_data_update(qctx, inode, 0, adjust);
+}
+
+/*
+ * Account for one inode of an inode scan.  Callers which already walk
+ * every inode can call this for each of them instead of paying for the
+ * separate scan in quota_compute_usage().
+ */
+void quota_compute_inode(quota_ctx_t qctx, ext2_ino_t ino,
+			 struct ext2_inode_large *inode)
+{
+	ext2_filsys fs;
+
+	if (!qctx)
+		return;
+
+	fs = qctx->fs;
+	if (inode->i_links_count &&
+	    (ino == EXT2_ROOT_INO ||
+	     ino >= EXT2_FIRST_INODE(fs->super)))
+		quota_data_update(qctx, inode,
+				  ext2fs_inode_i_blocks(fs,
+						EXT2_INODE(inode)) << 9, 1);
 }
 
 errcode_t quota_compute_usage(quota_ctx_t qctx)
@@ -471,7 +576,6 @@ errcode_t quota_compute_usage(quota_ctx_t qctx)
 	errcode_t ret;
 	struct ext2_inode_large *inode;
 	int inode_size;
-	qsize_t space;
 	ext2_inode_scan scan;
 
 	if (!qctx)
@@ -500,14 +604,7 @@ errcode_t quota_compute_usage(quota_ctx_t qctx)
 		}
 		if (ino == 0)
 			break;
-		if (inode->i_links_count &&
-		    (ino == EXT2_ROOT_INO ||
-		     ino >= EXT2_FIRST_INODE(fs->super))) {
-			space = ext2fs_inode_i_blocks(fs,
-						      EXT2_INODE(inode)) << 9;
-			quota_data_add(qctx, inode, ino, space);
-			quota_data_inodes(qctx, inode, ino, +1);
-		}
+		quota_compute_inode(qctx, ino, inode);
 	}
 
 	ext2fs_close_inode_scan(scan);
@@ -516,7 +613,7 @@ errcode_t quota_compute_usage(quota_ctx_t qctx)
 }
 
 struct scan_dquots_data {
-	dict_t		*quota_dict;
+	struct dquot_hash *quota_dict;
 	int             update_limits; /* update limits from disk */
 	int		update_usage;
 	int		check_consistency;
@@ -526,10 +623,12 @@ struct scan_dquots_data {
 static int scan_dquots_callback(struct dquot *dquot, void *cb_data)
 {
 	struct scan_dquots_data *scan_data = cb_data;
-	dict_t *quota_dict = scan_data->quota_dict;
+	struct dquot_hash *quota_dict = scan_data->quota_dict;
 	struct dquot *dq;
 
 	dq = get_dq(quota_dict, dquot->dq_id);
+	if (!dq)
+		return -1;
 	dq->dq_id = dquot->dq_id;
 	dq->dq_flags |= DQF_SEEN;
 
@@ -649,12 +748,12 @@ errcode_t quota_compare_and_update(quota_ctx_t qctx, enum quota_type qtype,
 {
 	struct quota_handle qh;
 	struct scan_dquots_data scan_data;
-	struct dquot *dq;
-	dnode_t *n;
-	dict_t *dict = qctx->quota_dict[qtype];
+	struct dquot **array, *dq;
+	struct dquot_hash *dh = qctx->quota_dict[qtype];
+	unsigned int i;
 	errcode_t err = 0;
 
-	if (!dict)
+	if (!dh)
 		goto out;
 
 	err = quota_file_open(qctx, &qh, 0, qtype, -1, 0);
@@ -674,16 +773,18 @@ errcode_t quota_compare_and_update(quota_ctx_t qctx, enum quota_type qtype,
 		goto out_close_qh;
 	}
 
-	for (n = dict_first(dict); n; n = dict_next(dict, n)) {
-		dq = dnode_get(n);
-		if (!dq)
-			continue;
+	err = sorted_dquots(dh, &array);
+	if (err)
+		goto out_close_qh;
+	for (i = 0; i < dh->dh_count; i++) {
+		dq = array[i];
 		if ((dq->dq_flags & DQF_SEEN) == 0) {
 			fprintf(stderr, "[QUOTA WARNING] "
 				"Missing quota entry ID %d\n", dq->dq_id);
 			scan_data.usage_is_inconsistent = 1;
 		}
 	}
+	ext2fs_free_mem(&array);
 	*usage_inconsistent = scan_data.usage_is_inconsistent;
 
 out_close_qh:
@@ -14,6 +14,9 @@
  *	{
  *		quota_compute_usage(qctx);
  *		AND/OR
+ *		quota_compute_inode(qctx, ino, inode) for each inode of
+ *		an inode scan the caller is doing anyway;
+ *		AND/OR
  *		quota_data_add/quota_data_sub/quota_data_inodes();
  *	}
  *	quota_write_inode(qctx, USRQUOTA);
@@ -60,11 +63,23 @@ enum quota_type {
 #define QUOTA_ALL_BIT (QUOTA_USR_BIT | QUOTA_GRP_BIT | QUOTA_PRJ_BIT)
 
 typedef struct quota_ctx *quota_ctx_t;
-struct dict_t;
+struct dquot;
+
+/*
+ * In-memory dquots of one quota type, hashed by id and chained through
+ * dq_next.  dh_last caches the most recent lookup, since consecutive
+ * inodes usually have the same owner.
+ */
+struct dquot_hash {
+	struct dquot	**dh_buckets;
+	unsigned int	dh_size;	/* number of buckets, a power of 2 */
+	unsigned int	dh_count;	/* number of dquots in the table */
+	struct dquot	*dh_last;
+};
 
 struct quota_ctx {
 	ext2_filsys	fs;
-	struct dict_t	*quota_dict[MAXQUOTAS];
+	struct dquot_hash *quota_dict[MAXQUOTAS];
 	struct quota_handle *quota_file[MAXQUOTAS];
 };
 
@@ -172,6 +187,9 @@ struct quotafile_ops {
 	struct dquot *(*read_dquot) (struct quota_handle *h, qid_t id);
 	/* Write given dquot to disk */
 	int (*commit_dquot) (struct dquot *dquot);
+	/* Write dquots, sorted by id, to a newly created quotafile */
+	int (*commit_dquots) (struct quota_handle *h, struct dquot **dquots,
+			      unsigned int count);
 	/* Scan quotafile and call callback on every structure */
 	int (*scan_dquots) (struct quota_handle *h,
 			    int (*process_dquot) (struct dquot *dquot,
@@ -227,6 +245,8 @@ errcode_t quota_write_inode(quota_ctx_t qctx, enum quota_type qtype);
 errcode_t quota_update_limits(quota_ctx_t qctx, ext2_ino_t qf_ino,
 			      enum quota_type type);
 errcode_t quota_compute_usage(quota_ctx_t qctx);
+void quota_compute_inode(quota_ctx_t qctx, ext2_ino_t ino,
+			 struct ext2_inode_large *inode);
 void quota_release_context(quota_ctx_t *qctx);
 errcode_t quota_remove_inode(ext2_filsys fs, enum quota_type qtype);
 int quota_file_exists(ext2_filsys fs, enum quota_type qtype);
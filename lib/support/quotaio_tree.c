@@ -662,3 +662,330 @@ int qtree_scan_dquots(struct quota_handle *h,
 	ext2fs_free_mem(&dquot);
 	return 0;
 }
+
+/*
+ * Bulk writer for a newly created quota file.
+ *
+ * Inserting dquots one at a time reads and rewrites every tree block on
+ * the path to each new entry.  When a whole file is written from scratch
+ * with the dquots sorted by id, only one block per tree level is being
+ * filled at any moment and data blocks fill up in order, so the tree can
+ * be built in a single pass and written out mostly sequentially.  Blocks
+ * are numbered just as the incremental inserts would number them, so the
+ * resulting file is the same.
+ */
+#define QT_BULK_CHUNK	64	/* blocks gathered per write */
+
+struct qtree_bulk {
+	struct quota_handle *h;
+	char		*chunk;
+	unsigned int	chunk_start;	/* first block held in chunk */
+	unsigned int	chunk_end;	/* one past the last block allocated */
+	int		err;
+};
+
+static void bulk_flush(struct qtree_bulk *b)
+{
+	struct quota_handle *h = b->h;
+	unsigned int size = (b->chunk_end - b->chunk_start) << QT_BLKSIZE_BITS;
+
+	if (size && !b->err &&
+	    h->e2fs_write(&h->qh_qf, b->chunk_start << QT_BLKSIZE_BITS,
+			  b->chunk, size) != size)
+		b->err = -ENOSPC;
+	memset(b->chunk, 0, QT_BULK_CHUNK << QT_BLKSIZE_BITS);
+	b->chunk_start = b->chunk_end;
+}
+
+/* Allocate the next block at the end of the file */
+static unsigned int bulk_alloc(struct qtree_bulk *b)
+{
+	struct qtree_mem_dqinfo *info = &b->h->qh_info.u.v2_mdqi.dqi_qtree;
+	unsigned int blk = info->dqi_blocks++;
+
+	if (blk >= b->chunk_start + QT_BULK_CHUNK)
+		bulk_flush(b);
+	b->chunk_end = blk + 1;
+	return blk;
+}
+
+/* Store a finished block, in the chunk if it hasn't been written yet */
+static void bulk_put(struct qtree_bulk *b, unsigned int blk, dqbuf_t buf)
+{
+	if (blk >= b->chunk_start) {
+		memcpy(b->chunk + ((blk - b->chunk_start) << QT_BLKSIZE_BITS),
+		       buf, QT_BLKSIZE);
+	} else if (!b->err) {
+		b->err = write_blk(b->h, blk, buf);
+	}
+	memset(buf, 0, QT_BLKSIZE);
+}
+
+/*
+ * Write @count dquots, sorted by ascending id, to a quota file which
+ * has just been created by new_io().  Returns 0 or a negative errno;
+ * -EINVAL, with nothing written, if the file isn't new or the dquots
+ * aren't sorted.
+ */
+int qtree_write_dquots(struct quota_handle *h, struct dquot **dquots,
+		       unsigned int count)
+{
+	struct qtree_mem_dqinfo *info = &h->qh_info.u.v2_mdqi.dqi_qtree;
+	struct qt_disk_dqdbheader *dh;
+	struct qtree_bulk b;
+	struct dquot *dquot;
+	dqbuf_t tree[QT_TREEDEPTH], data;
+	unsigned int treeblk[QT_TREEDEPTH], datablk = 0, entries = 0;
+	unsigned int i;
+	int depth, d, per_blk = qtree_dqstr_in_blk(info);
+	qid_t prev_id = 0;
+	char *ddquot;
+
+	if (info->dqi_blocks != QT_TREEOFF + 1 || info->dqi_free_blk ||
+	    info->dqi_free_entry)
+		return -EINVAL;
+	for (i = 1; i < count; i++)
+		if (dquots[i]->dq_id <= dquots[i - 1]->dq_id)
+			return -EINVAL;
+	if (!count)
+		return 0;
+
+	memset(&b, 0, sizeof(b));
+	memset(tree, 0, sizeof(tree));
+	data = NULL;
+	b.h = h;
+	b.err = -ENOMEM;
+	if (ext2fs_get_memzero(QT_BULK_CHUNK << QT_BLKSIZE_BITS, &b.chunk))
+		goto out;
+	for (depth = 0; depth < QT_TREEDEPTH; depth++) {
+		tree[depth] = getdqbuf();
+		if (!tree[depth])
+			goto out;
+	}
+	data = getdqbuf();
+	if (!data)
+		goto out;
+	b.err = 0;
+	b.chunk_start = QT_TREEOFF;
+	b.chunk_end = QT_TREEOFF + 1;
+	treeblk[0] = QT_TREEOFF;
+	dh = (struct qt_disk_dqdbheader *) data;
+
+	for (i = 0; i < count; i++) {
+		dquot = dquots[i];
+
+		/* Finish the index blocks this id doesn't belong to */
+		depth = 1;
+		if (i) {
+			while (depth < QT_TREEDEPTH &&
+			       !((dquot->dq_id ^ prev_id) >>
+				 ((QT_TREEDEPTH - depth) * 8)))
+				depth++;
+			for (d = QT_TREEDEPTH - 1; d >= depth; d--)
+				bulk_put(&b, treeblk[d], tree[d]);
+		}
+		for (; depth < QT_TREEDEPTH; depth++) {
+			treeblk[depth] = bulk_alloc(&b);
+			((__le32 *) tree[depth - 1])[get_index(dquot->dq_id,
+							       depth - 1)] =
+				ext2fs_cpu_to_le32(treeblk[depth]);
+		}
+
+		if (!entries)
+			datablk = bulk_alloc(&b);
+		((__le32 *) tree[QT_TREEDEPTH - 1])[get_index(dquot->dq_id,
+						      QT_TREEDEPTH - 1)] =
+			ext2fs_cpu_to_le32(datablk);
+		ddquot = data + sizeof(struct qt_disk_dqdbheader) +
+			entries * info->dqi_entry_size;
+		dquot->dq_h = h;
+		info->dqi_ops->mem2disk_dqblk(ddquot, dquot);
+		dquot->dq_dqb.u.v2_mdqb.dqb_off =
+			(datablk << QT_BLKSIZE_BITS) + (ddquot - data);
+		if (++entries == per_blk) {
+			dh->dqdh_entries = ext2fs_cpu_to_le16(entries);
+			bulk_put(&b, datablk, data);
+			entries = 0;
+		}
+		prev_id = dquot->dq_id;
+	}
+
+	/* A partly filled data block heads the list of free entries */
+	if (entries) {
+		dh->dqdh_entries = ext2fs_cpu_to_le16(entries);
+		bulk_put(&b, datablk, data);
+		info->dqi_free_entry = datablk;
+	}
+	for (depth = QT_TREEDEPTH - 1; depth >= 0; depth--)
+		bulk_put(&b, treeblk[depth], tree[depth]);
+	bulk_flush(&b);
+	mark_quotafile_info_dirty(h);
+out:
+	if (data)
+		freedqbuf(data);
+	for (depth = 0; depth < QT_TREEDEPTH; depth++)
+		if (tree[depth])
+			freedqbuf(tree[depth]);
+	ext2fs_free_mem(&b.chunk);
+	return b.err;
+}
+
+#ifdef DEBUG_PROGRAM
+/*
+ * Build a user quota file for a number of ids, once with the bulk writer
+ * and once inserting the dquots one at a time, check that both files
+ * come out the same, and report how long each took.
+ *
+ * usage: test_quota_tree [count [stride]]
+ */
+#include <sys/time.h>
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static int dquot_cmp(const void *a, const void *b)
+{
+	qid_t id_a = (*(struct dquot **) a)->dq_id;
+	qid_t id_b = (*(struct dquot **) b)->dq_id;
+
+	return id_a < id_b ? -1 : id_a > id_b;
+}
+
+static errcode_t build_file(ext2_filsys fs, struct dquot **dquots,
+			    unsigned int count, int bulk, double *secs,
+			    char **ret_buf, unsigned int *ret_size)
+{
+	struct quota_handle h;
+	ext2_file_t e2_file;
+	unsigned int i, got;
+	__u64 size;
+	double start;
+	errcode_t err;
+	char *buf;
+
+	memset(&h, 0, sizeof(h));
+	start = now();
+	err = quota_file_create(&h, fs, USRQUOTA, QFMT_VFS_V1);
+	if (err)
+		return err;
+	for (i = 0; i < count; i++) {
+		dquots[i]->dq_h = &h;
+		dquots[i]->dq_dqb.u.v2_mdqb.dqb_off = 0;
+	}
+	if (bulk) {
+		if (h.qh_ops->commit_dquots(&h, dquots, count) < 0)
+			return EIO;
+	} else {
+		for (i = 0; i < count; i++)
+			h.qh_ops->commit_dquot(dquots[i]);
+	}
+	if (h.qh_io_flags & IOFL_INFODIRTY)
+		h.qh_ops->write_info(&h);
+	ext2fs_file_flush(h.qh_qf.e2_file);
+	err = io_channel_flush(fs->io);
+	if (err)
+		return err;
+	*secs = now() - start;
+	size = (__u64) h.qh_info.u.v2_mdqi.dqi_qtree.dqi_blocks <<
+		QT_BLKSIZE_BITS;
+	ext2fs_file_close(h.qh_qf.e2_file);
+
+	err = ext2fs_get_memzero(size, &buf);
+	if (err)
+		return err;
+	err = ext2fs_file_open(fs, h.qh_qf.ino, 0, &e2_file);
+	if (err)
+		return err;
+	err = ext2fs_file_read(e2_file, buf, size, &got);
+	ext2fs_file_close(e2_file);
+	if (err)
+		return err;
+	*ret_buf = buf;
+	*ret_size = size;
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	char tmpname[] = "/tmp/test_quota_tree.XXXXXX";
+	struct ext2_super_block param;
+	struct dquot **dquots;
+	ext2_filsys fs;
+	unsigned int count = 100000, stride = 1, i, size[2];
+	char *buf[2];
+	double secs[2];
+	errcode_t err;
+	int fd, ret = 1;
+
+	add_error_table(&et_ext2_error_table);
+	if (argc > 1)
+		count = strtoul(argv[1], NULL, 0);
+	if (argc > 2)
+		stride = strtoul(argv[2], NULL, 0);
+	if (!stride)
+		stride = 1;
+
+	fd = mkstemp(tmpname);
+	if (fd < 0 || ftruncate(fd, (ext2_loff_t) 1 << 32) < 0) {
+		perror(tmpname);
+		exit(1);
+	}
+	close(fd);
+
+	memset(&param, 0, sizeof(param));
+	param.s_log_block_size = 2;
+	ext2fs_blocks_count_set(&param, 1 << 20);
+	param.s_inodes_count = 1 << 14;
+	err = ext2fs_initialize(tmpname, EXT2_FLAG_64BITS, &param,
+				unix_io_manager, &fs);
+	if (!err)
+		err = ext2fs_allocate_tables(fs);
+	if (err) {
+		com_err("test_quota_tree", err, "while setting up %s", tmpname);
+		goto out_unlink;
+	}
+
+	if (ext2fs_get_array(count, sizeof(struct dquot *), &dquots))
+		goto out_close;
+	for (i = 0; i < count; i++) {
+		dquots[i] = get_empty_dquot();
+		if (!dquots[i])
+			goto out_close;
+		dquots[i]->dq_id = i * stride;
+		dquots[i]->dq_dqb.dqb_curinodes = i + 1;
+		dquots[i]->dq_dqb.dqb_curspace = (qsize_t) i << 12;
+	}
+	qsort(dquots, count, sizeof(struct dquot *), dquot_cmp);
+
+	for (i = 0; i < 2; i++) {
+		err = build_file(fs, dquots, count, i == 0, &secs[i],
+				 &buf[i], &size[i]);
+		if (err) {
+			com_err("test_quota_tree", err, "while writing %s",
+				i == 0 ? "in bulk" : "incrementally");
+			goto out_close;
+		}
+	}
+
+	printf("%u ids, stride %u: %u blocks\n", count, stride,
+	       size[0] >> QT_BLKSIZE_BITS);
+	printf("bulk:        %8.3f s\n", secs[0]);
+	printf("incremental: %8.3f s\n", secs[1]);
+	if (size[0] != size[1] || memcmp(buf[0], buf[1], size[0])) {
+		printf("quota files differ!\n");
+		goto out_close;
+	}
+	printf("quota files match\n");
+	ret = 0;
+out_close:
+	ext2fs_close_free(&fs);
+out_unlink:
+	unlink(tmpname);
+	return ret;
+}
+#endif /* DEBUG_PROGRAM */
@@ -24,6 +24,8 @@ static int v2_new_io(struct quota_handle *h);
 static int v2_write_info(struct quota_handle *h);
 static struct dquot *v2_read_dquot(struct quota_handle *h, qid_t id);
 static int v2_commit_dquot(struct dquot *dquot);
+static int v2_commit_dquots(struct quota_handle *h, struct dquot **dquots,
+			    unsigned int count);
 static int v2_scan_dquots(struct quota_handle *h,
 			  int (*process_dquot) (struct dquot *dquot,
 						void *data),
@@ -37,6 +39,7 @@ struct quotafile_ops quotafile_ops_2 = {
 	.write_info	= v2_write_info,
 	.read_dquot	= v2_read_dquot,
 	.commit_dquot	= v2_commit_dquot,
+	.commit_dquots	= v2_commit_dquots,
 	.scan_dquots	= v2_scan_dquots,
 	.report		= v2_report,
 };
@@ -254,18 +257,49 @@ static struct dquot *v2_read_dquot(struct quota_handle *h, qid_t id)
  * became fake one and user has no blocks.
  * User can process use 'errno' to detect errstr.
  */
-static int v2_commit_dquot(struct dquot *dquot)
+static int v2_dquot_empty(struct dquot *dquot)
 {
 	struct util_dqblk *b = &dquot->dq_dqb;
 
-	if (!b->dqb_curspace && !b->dqb_curinodes && !b->dqb_bsoftlimit &&
-	    !b->dqb_isoftlimit && !b->dqb_bhardlimit && !b->dqb_ihardlimit)
+	return !b->dqb_curspace && !b->dqb_curinodes && !b->dqb_bsoftlimit &&
+		!b->dqb_isoftlimit && !b->dqb_bhardlimit && !b->dqb_ihardlimit;
+}
+
+static int v2_commit_dquot(struct dquot *dquot)
+{
+	if (v2_dquot_empty(dquot))
 		qtree_delete_dquot(dquot);
 	else
 		qtree_write_dquot(dquot);
 	return 0;
 }
 
+/*
+ * Write a whole new quotafile at once; empty dquots are left out just as
+ * v2_commit_dquot() would delete them.  Anything the bulk writer can't
+ * handle is committed one dquot at a time.
+ */
+static int v2_commit_dquots(struct quota_handle *h, struct dquot **dquots,
+			    unsigned int count)
+{
+	struct dquot **used;
+	unsigned int i, n = 0;
+	int ret;
+
+	if (ext2fs_get_array(count ? count : 1, sizeof(struct dquot *), &used))
+		return -ENOMEM;
+	for (i = 0; i < count; i++)
+		if (!v2_dquot_empty(dquots[i]))
+			used[n++] = dquots[i];
+	ret = qtree_write_dquots(h, used, n);
+	ext2fs_free_mem(&used);
+	if (ret != -EINVAL)
+		return ret;
+	for (i = 0; i < count; i++)
+		v2_commit_dquot(dquots[i]);
+	return 0;
+}
+
 static int v2_scan_dquots(struct quota_handle *h,
 			  int (*process_dquot) (struct dquot *, void *),
 			  void *data)
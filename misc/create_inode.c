@@ -67,21 +67,21 @@ static int ext2_file_type(unsigned int mode)
 	return 0;
 }
 
-/* Link an inode number to a directory */
-static errcode_t add_link(ext2_filsys fs, ext2_ino_t parent_ino,
-			  ext2_ino_t ino, const char *name)
+/*
+ * Enter a name for an inode into a directory, expanding the directory if
+ * needed, or queue it on @db if the whole directory is being built at
+ * once by __populate_fs().
+ */
+static errcode_t link_inode(ext2_filsys fs, ext2_dir_builder_t db,
+			    ext2_ino_t parent_ino, const char *name,
+			    ext2_ino_t ino, int filetype)
 {
-	struct ext2_inode	inode;
 	errcode_t		retval;
 
-	retval = ext2fs_read_inode(fs, ino, &inode);
-        if (retval) {
-		com_err(__func__, retval, _("while reading inode %u"), ino);
-		return retval;
-	}
+	if (db)
+		return ext2fs_dir_builder_add(db, name, ino, filetype);
 
-	retval = ext2fs_link(fs, parent_ino, name, ino,
-			     ext2_file_type(inode.i_mode));
+	retval = ext2fs_link(fs, parent_ino, name, ino, filetype);
 	if (retval == EXT2_ET_DIR_NO_SPACE) {
 		retval = ext2fs_expand_dir(fs, parent_ino);
 		if (retval) {
@@ -89,9 +89,27 @@ static errcode_t add_link(ext2_filsys fs, ext2_ino_t parent_ino,
 				_("while expanding directory"));
 			return retval;
 		}
-		retval = ext2fs_link(fs, parent_ino, name, ino,
-				     ext2_file_type(inode.i_mode));
+		retval = ext2fs_link(fs, parent_ino, name, ino, filetype);
+	}
+	return retval;
+}
+
+/* Link an inode number to a directory */
+static errcode_t add_link(ext2_filsys fs, ext2_dir_builder_t db,
+			  ext2_ino_t parent_ino, ext2_ino_t ino,
+			  const char *name)
+{
+	struct ext2_inode	inode;
+	errcode_t		retval;
+
+	retval = ext2fs_read_inode(fs, ino, &inode);
+        if (retval) {
+		com_err(__func__, retval, _("while reading inode %u"), ino);
+		return retval;
 	}
+
+	retval = link_inode(fs, db, parent_ino, name, ino,
+			    ext2_file_type(inode.i_mode));
 	if (retval) {
 		com_err(__func__, retval, _("while linking \"%s\""), name);
 		return retval;
@@ -237,8 +255,11 @@ static errcode_t set_inode_xattr(ext2_filsys fs EXT2FS_ATTR((unused)),
 
 #ifndef _WIN32
 /* Make a special files (block and character devices), fifo's, and sockets  */
-errcode_t do_mknod_internal(ext2_filsys fs, ext2_ino_t cwd, const char *name,
-			    unsigned int st_mode, unsigned int st_rdev)
+static errcode_t __do_mknod_internal(ext2_filsys fs, ext2_ino_t cwd,
+				     const char *name, unsigned int st_mode,
+				     unsigned int st_rdev,
+				     ext2_dir_builder_t db,
+				     ext2_ino_t *ret_ino)
 {
 	ext2_ino_t		ino;
 	errcode_t		retval;
@@ -279,16 +300,7 @@ errcode_t do_mknod_internal(ext2_filsys fs, ext2_ino_t cwd, const char *name,
 #ifdef DEBUGFS
 	printf("Allocated inode: %u\n", ino);
 #endif
-	retval = ext2fs_link(fs, cwd, name, ino, filetype);
-	if (retval == EXT2_ET_DIR_NO_SPACE) {
-		retval = ext2fs_expand_dir(fs, cwd);
-		if (retval) {
-			com_err(__func__, retval,
-				_("while expanding directory"));
-			return retval;
-		}
-		retval = ext2fs_link(fs, cwd, name, ino, filetype);
-	}
+	retval = link_inode(fs, db, cwd, name, ino, filetype);
 	if (retval) {
 		com_err(name, retval, _("while creating inode \"%s\""), name);
 		return retval;
@@ -319,9 +331,18 @@ errcode_t do_mknod_internal(ext2_filsys fs, ext2_ino_t cwd, const char *name,
 	retval = ext2fs_write_new_inode(fs, ino, &inode);
 	if (retval)
 		com_err(__func__, retval, _("while writing inode %u"), ino);
+	else if (ret_ino)
+		*ret_ino = ino;
 
 	return retval;
 }
+
+errcode_t do_mknod_internal(ext2_filsys fs, ext2_ino_t cwd, const char *name,
+			    unsigned int st_mode, unsigned int st_rdev)
+{
+	return __do_mknod_internal(fs, cwd, name, st_mode, st_rdev, NULL,
+				   NULL);
+}
 #endif
 
 /* Make a symlink name -> target */
@@ -360,6 +381,45 @@ errcode_t do_symlink_internal(ext2_filsys fs, ext2_ino_t cwd, const char *name,
 	return retval;
 }
 
+/*
+ * Create a symlink or directory for __populate_fs(), queueing its name on
+ * @db rather than linking it in straight away.
+ */
+static errcode_t populate_symlink(ext2_filsys fs, ext2_dir_builder_t db,
+				  ext2_ino_t cwd, const char *name,
+				  char *target, ext2_ino_t *ret_ino)
+{
+	errcode_t		retval;
+
+	retval = ext2fs_new_inode(fs, cwd, LINUX_S_IFLNK | 0755, 0, ret_ino);
+	if (!retval)
+		retval = ext2fs_symlink(fs, cwd, *ret_ino, NULL, target);
+	if (!retval)
+		retval = link_inode(fs, db, cwd, name, *ret_ino,
+				    EXT2_FT_SYMLINK);
+	if (retval)
+		com_err("ext2fs_symlink", retval,
+			_("while creating symlink \"%s\""), name);
+	return retval;
+}
+
+static errcode_t populate_mkdir(ext2_filsys fs, ext2_dir_builder_t db,
+				ext2_ino_t cwd, const char *name,
+				ext2_ino_t *ret_ino)
+{
+	errcode_t		retval;
+
+	retval = ext2fs_new_inode(fs, cwd, LINUX_S_IFDIR | 0755, 0, ret_ino);
+	if (!retval)
+		retval = ext2fs_mkdir(fs, cwd, *ret_ino, NULL);
+	if (!retval)
+		retval = link_inode(fs, db, cwd, name, *ret_ino, EXT2_FT_DIR);
+	if (retval)
+		com_err("ext2fs_mkdir", retval,
+			_("while creating directory \"%s\""), name);
+	return retval;
+}
+
 /* Make a directory in the fs */
 errcode_t do_mkdir_internal(ext2_filsys fs, ext2_ino_t cwd, const char *name,
 			    ext2_ino_t root)
@@ -413,7 +473,7 @@ static errcode_t copy_file_chunk(ext2_filsys fs, int fd, ext2_file_t e2_file,
 				 char *zerobuf)
 {
 	off_t off, bpos;
-	ssize_t got, blen;
+	ssize_t got, blen, left;
 	unsigned int written;
 	char *ptr;
 	errcode_t err = 0;
@@ -430,7 +490,7 @@ static errcode_t copy_file_chunk(ext2_filsys fs, int fd, ext2_file_t e2_file,
 			err = errno;
 			goto fail;
 		}
-		for (bpos = 0, ptr = buf; bpos < got; bpos += fs->blocksize) {
+		for (bpos = 0, ptr = buf; bpos < got; bpos += blen) {
 			blen = fs->blocksize;
 			if (blen > got - bpos)
 				blen = got - bpos;
@@ -438,12 +498,22 @@ static errcode_t copy_file_chunk(ext2_filsys fs, int fd, ext2_file_t e2_file,
 				ptr += blen;
 				continue;
 			}
+			/* Write out the whole run of non-zero blocks at once */
+			while (bpos + blen < got) {
+				ssize_t next = fs->blocksize;
+
+				if (next > got - bpos - blen)
+					next = got - bpos - blen;
+				if (memcmp(ptr + blen, zerobuf, next) == 0)
+					break;
+				blen += next;
+			}
 			err = ext2fs_file_lseek(e2_file, off + bpos,
 						EXT2_SEEK_SET, NULL);
 			if (err)
 				goto fail;
-			while (blen > 0) {
-				err = ext2fs_file_write(e2_file, ptr, blen,
+			for (left = blen; left > 0; left -= written) {
+				err = ext2fs_file_write(e2_file, ptr, left,
 							&written);
 				if (err)
 					goto fail;
@@ -451,7 +521,6 @@ static errcode_t copy_file_chunk(ext2_filsys fs, int fd, ext2_file_t e2_file,
 					err = EIO;
 					goto fail;
 				}
-				blen -= written;
 				ptr += written;
 			}
 		}
@@ -610,8 +679,10 @@ static int is_hardlink(struct hdlinks_s *hdlinks, dev_t dev, ino_t ino)
 }
 
 /* Copy the native file to the fs */
-errcode_t do_write_internal(ext2_filsys fs, ext2_ino_t cwd, const char *src,
-			    const char *dest, ext2_ino_t root)
+static errcode_t __do_write_internal(ext2_filsys fs, ext2_ino_t cwd,
+				     const char *src, const char *dest,
+				     ext2_ino_t root, ext2_dir_builder_t db,
+				     ext2_ino_t *ret_ino)
 {
 	int		fd;
 	struct stat	statbuf;
@@ -643,15 +714,7 @@ errcode_t do_write_internal(ext2_filsys fs, ext2_ino_t cwd, const char *src,
 #ifdef DEBUGFS
 	printf("Allocated inode: %u\n", newfile);
 #endif
-	retval = ext2fs_link(fs, cwd, dest, newfile,
-				EXT2_FT_REG_FILE);
-	if (retval == EXT2_ET_DIR_NO_SPACE) {
-		retval = ext2fs_expand_dir(fs, cwd);
-		if (retval)
-			goto out;
-		retval = ext2fs_link(fs, cwd, dest, newfile,
-					EXT2_FT_REG_FILE);
-	}
+	retval = link_inode(fs, db, cwd, dest, newfile, EXT2_FT_REG_FILE);
 	if (retval)
 		goto out;
 	if (ext2fs_test_inode_bitmap2(fs->inode_map, newfile))
@@ -690,11 +753,19 @@ errcode_t do_write_internal(ext2_filsys fs, ext2_ino_t cwd, const char *src,
 		if (retval)
 			goto out;
 	}
+	if (ret_ino)
+		*ret_ino = newfile;
 out:
 	close(fd);
 	return retval;
 }
 
+errcode_t do_write_internal(ext2_filsys fs, ext2_ino_t cwd, const char *src,
+			    const char *dest, ext2_ino_t root)
+{
+	return __do_write_internal(fs, cwd, src, dest, root, NULL, NULL);
+}
+
 struct file_info {
 	char *path;
 	size_t path_len;
@@ -732,6 +803,7 @@ static errcode_t __populate_fs(ext2_filsys fs, ext2_ino_t parent_ino,
 	int		read_cnt;
 	int		hdlink;
 	size_t		cur_dir_path_len;
+	ext2_dir_builder_t db = NULL;
 
 	if (chdir(source_dir) < 0) {
 		retval = errno;
@@ -748,6 +820,16 @@ static errcode_t __populate_fs(ext2_filsys fs, ext2_ino_t parent_ino,
 		return retval;
 	}
 
+	/* Queue up this directory's entries and write them out at the end */
+	retval = ext2fs_dir_builder_init(fs, parent_ino,
+				(fs->flags & EXT2_FLAG_INDEX_DIRS) ?
+				EXT2_DIRBUILD_INDEX : 0, &db);
+	if (retval) {
+		com_err(__func__, retval,
+			_("while starting directory \"%s\""), source_dir);
+		goto out;
+	}
+
 	while ((dent = readdir(dh))) {
 		if ((!strcmp(dent->d_name, ".")) ||
 		    (!strcmp(dent->d_name, "..")))
@@ -766,7 +848,7 @@ static errcode_t __populate_fs(ext2_filsys fs, ext2_ino_t parent_ino,
 		    st.st_nlink > 1) {
 			hdlink = is_hardlink(hdlinks, st.st_dev, st.st_ino);
 			if (hdlink >= 0) {
-				retval = add_link(fs, parent_ino,
+				retval = add_link(fs, db, parent_ino,
 						  hdlinks->hdl[hdlink].dst_ino,
 						  name);
 				if (retval) {
@@ -795,14 +877,16 @@ static errcode_t __populate_fs(ext2_filsys fs, ext2_ino_t parent_ino,
 				goto out;
 		}
 
+		ino = 0;
 		switch(st.st_mode & S_IFMT) {
 		case S_IFCHR:
 		case S_IFBLK:
 		case S_IFIFO:
 #ifndef _WIN32
 		case S_IFSOCK:
-			retval = do_mknod_internal(fs, parent_ino, name,
-						   st.st_mode, st.st_rdev);
+			retval = __do_mknod_internal(fs, parent_ino, name,
+						     st.st_mode, st.st_rdev,
+						     db, &ino);
 			if (retval) {
 				com_err(__func__, retval,
 					_("while creating special file "
@@ -835,8 +919,8 @@ static errcode_t __populate_fs(ext2_filsys fs, ext2_ino_t parent_ino,
 				goto out;
 			}
 			ln_target[read_cnt] = '\0';
-			retval = do_symlink_internal(fs, parent_ino, name,
-						     ln_target, root);
+			retval = populate_symlink(fs, db, parent_ino, name,
+						  ln_target, &ino);
 			free(ln_target);
 			if (retval) {
 				com_err(__func__, retval,
@@ -847,8 +931,8 @@ static errcode_t __populate_fs(ext2_filsys fs, ext2_ino_t parent_ino,
 			break;
 #endif
 		case S_IFREG:
-			retval = do_write_internal(fs, parent_ino, name, name,
-						   root);
+			retval = __do_write_internal(fs, parent_ino, name,
+						     name, root, db, &ino);
 			if (retval) {
 				com_err(__func__, retval,
 					_("while writing file \"%s\""), name);
@@ -860,13 +944,14 @@ static errcode_t __populate_fs(ext2_filsys fs, ext2_ino_t parent_ino,
 			if (parent_ino == EXT2_ROOT_INO &&
 			    strcmp(name, "lost+found") == 0)
 				goto find_lnf;
-			retval = do_mkdir_internal(fs, parent_ino, name,
-						   root);
+			retval = populate_mkdir(fs, db, parent_ino, name,
+						&ino);
 			if (retval) {
 				com_err(__func__, retval,
 					_("while making dir \"%s\""), name);
 				goto out;
 			}
+			goto populate_dir;
 find_lnf:
 			retval = ext2fs_namei(fs, root, parent_ino,
 					      name, &ino);
@@ -874,6 +959,7 @@ find_lnf:
 				com_err(name, retval, 0);
 					goto out;
 			}
+populate_dir:
 			/* Populate the dir recursively*/
 			retval = __populate_fs(fs, ino, name, root, hdlinks,
 					       target, fs_callbacks);
@@ -891,11 +977,14 @@ find_lnf:
 				_("ignoring entry \"%s\""), name);
 		}
 
-		retval =  ext2fs_namei(fs, root, parent_ino, name, &ino);
-		if (retval) {
-			com_err(name, retval, _("while looking up \"%s\""),
-				name);
-			goto out;
+		if (!ino) {
+			retval = ext2fs_namei(fs, root, parent_ino, name,
+					      &ino);
+			if (retval) {
+				com_err(name, retval,
+					_("while looking up \"%s\""), name);
+				goto out;
+			}
 		}
 
 		retval = set_inode_extra(fs, ino, &st);
@@ -949,7 +1038,12 @@ find_lnf:
 		target->path[target->path_len] = 0;
 	}
 
+	retval = ext2fs_dir_builder_write(db);
+	if (retval)
+		com_err(__func__, retval,
+			_("while writing directory \"%s\""), source_dir);
 out:
+	ext2fs_dir_builder_free(db);
 	closedir(dh);
 	return retval;
 }
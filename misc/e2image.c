@@ -363,34 +363,47 @@ static void use_inode_shortcuts(ext2_filsys fs, int use_shortcuts)
 	}
 }
 
-static int process_dir_block(ext2_filsys fs EXT2FS_ATTR((unused)),
-			     blk64_t *block_nr,
-			     e2_blkcnt_t blockcnt EXT2FS_ATTR((unused)),
-			     blk64_t ref_block EXT2FS_ATTR((unused)),
-			     int ref_offset EXT2FS_ATTR((unused)),
+static void mark_meta_run(ext2_filsys fs, ext2fs_block_bitmap bmap,
+			  blk64_t pblk, blk64_t len)
+{
+	if (len > 1 && pblk >= fs->super->s_first_data_block &&
+	    pblk + len <= ext2fs_blocks_count(fs->super)) {
+		ext2fs_mark_block_bitmap_range2(bmap, pblk, len);
+		return;
+	}
+	while (len--)
+		ext2fs_mark_block_bitmap2(bmap, pblk++);
+}
+
+static int process_dir_block(ext2_filsys fs,
+			     e2_blkcnt_t lblk EXT2FS_ATTR((unused)),
+			     blk64_t pblk,
+			     blk64_t len,
+			     int run_flags,
 			     void *priv_data EXT2FS_ATTR((unused)))
 {
 	struct process_block_struct *p;
 
 	p = (struct process_block_struct *) priv_data;
 
-	ext2fs_mark_block_bitmap2(meta_block_map, *block_nr);
-	meta_blocks_count++;
-	if (scramble_block_map && p->is_dir && blockcnt >= 0)
-		ext2fs_mark_block_bitmap2(scramble_block_map, *block_nr);
+	mark_meta_run(fs, meta_block_map, pblk, len);
+	meta_blocks_count += len;
+	if (scramble_block_map && p->is_dir &&
+	    !(run_flags & BLOCK_RUN_METADATA))
+		mark_meta_run(fs, scramble_block_map, pblk, len);
 	return 0;
 }
 
-static int process_file_block(ext2_filsys fs EXT2FS_ATTR((unused)),
-			      blk64_t *block_nr,
-			      e2_blkcnt_t blockcnt,
-			      blk64_t ref_block EXT2FS_ATTR((unused)),
-			      int ref_offset EXT2FS_ATTR((unused)),
+static int process_file_block(ext2_filsys fs,
+			      e2_blkcnt_t lblk EXT2FS_ATTR((unused)),
+			      blk64_t pblk,
+			      blk64_t len,
+			      int run_flags,
 			      void *priv_data EXT2FS_ATTR((unused)))
 {
-	if (blockcnt < 0 || all_data) {
-		ext2fs_mark_block_bitmap2(meta_block_map, *block_nr);
-		meta_blocks_count++;
+	if ((run_flags & BLOCK_RUN_METADATA) || all_data) {
+		mark_meta_run(fs, meta_block_map, pblk, len);
+		meta_blocks_count += len;
 	}
 	return 0;
 }
@@ -1343,9 +1356,8 @@ static void write_raw_image_file(ext2_filsys fs, int fd, int type, int flags)
 		    (LINUX_S_ISLNK(inode.i_mode) &&
 		     ext2fs_inode_has_valid_blocks2(fs, &inode)) ||
 		    ino == fs->super->s_journal_inum) {
-			retval = ext2fs_block_iterate3(fs, ino,
-					BLOCK_FLAG_READ_ONLY, block_buf,
-					process_dir_block, &pb);
+			retval = ext2fs_block_iterate_runs(fs, ino, 0,
+					block_buf, process_dir_block, &pb);
 			if (retval) {
 				com_err(program_name, retval,
 					_("while iterating over inode %u"),
@@ -1357,8 +1369,8 @@ static void write_raw_image_file(ext2_filsys fs, int fd, int type, int flags)
 			    inode.i_block[EXT2_IND_BLOCK] ||
 			    inode.i_block[EXT2_DIND_BLOCK] ||
 			    inode.i_block[EXT2_TIND_BLOCK] || all_data) {
-				retval = ext2fs_block_iterate3(fs,
-				       ino, BLOCK_FLAG_READ_ONLY, block_buf,
+				retval = ext2fs_block_iterate_runs(fs,
+				       ino, 0, block_buf,
 				       process_file_block, &pb);
 				if (retval) {
 					com_err(program_name, retval,
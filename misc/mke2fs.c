@@ -85,6 +85,7 @@ int	verbose;
 int	quiet;
 static int	super_only;
 static int	discard = 1;	/* attempt to discard device before fs creation */
+static int	index_dirs;	/* build hash tree directories with -d */
 static int	direct_io;
 static int	force;
 static int	noaction;
@@ -1034,6 +1035,8 @@ static void parse_extended_opts(struct ext2_super_block *param,
 			discard = 1;
 		} else if (!strcmp(token, "nodiscard")) {
 			discard = 0;
+		} else if (!strcmp(token, "index_dirs")) {
+			index_dirs = 1;
 		} else if (!strcmp(token, "quotatype")) {
 			char *errtok = NULL;
 
@@ -1107,6 +1110,7 @@ static void parse_extended_opts(struct ext2_super_block *param,
 			"\ttest_fs\n"
 			"\tdiscard\n"
 			"\tnodiscard\n"
+			"\tindex_dirs\n"
 			"\tfname_encoding=<encoding>\n"
 			"\tfname_encoding_flags=<flags>\n"
 			"\tquotatype=<quota type(s) to be enabled>\n\n"),
@@ -3370,8 +3374,11 @@ no_journal:
 		if (!quiet)
 			printf("%s", _("Copying files into the device: "));
 
+		if (index_dirs && ext2fs_has_feature_dir_index(fs->super))
+			fs->flags |= EXT2_FLAG_INDEX_DIRS;
 		retval = populate_fs(fs, EXT2_ROOT_INO, src_root_dir,
 				     EXT2_ROOT_INO);
+		fs->flags &= ~EXT2_FLAG_INDEX_DIRS;
 		if (retval) {
 			com_err(program_name, retval, "%s",
 				_("while populating file system"));
@@ -54,7 +54,7 @@ extern int optind;
 #include <limits.h>
 
 #include "ext2fs/ext2_fs.h"
-#include "ext2fs/ext2fs.h"
+#include "ext2fs/ext2fsP.h"
 #include "ext2fs/kernel-jbd.h"
 #include "et/com_err.h"
 #include "support/plausible.h"
@@ -97,6 +97,7 @@ static char *extended_cmd;
 static unsigned long new_inode_size;
 static char *ext_mount_opts;
 static int quota_enable[MAXQUOTAS];
+static quota_ctx_t quota_scan_ctx;	/* usage counted by rewrite_inodes() */
 static int rewrite_checksums;
 static int feature_64bit;
 static int fsck_requested;
@@ -106,14 +107,20 @@ int journal_size, journal_flags;
 char *journal_device;
 static blk64_t journal_location = ~0LL;
 
-static struct list_head blk_move_list;
-
+/*
+ * Blocks relocated to make room for larger inode tables, as runs of
+ * contiguous blocks sorted by old_loc.
+ */
 struct blk_move {
-	struct list_head list;
 	blk64_t old_loc;
 	blk64_t new_loc;
+	blk64_t len;
 };
 
+static struct blk_move *blk_move_list;
+static size_t blk_move_count, blk_move_size;
+static blk64_t blk_move_blocks;
+
 errcode_t ext2fs_run_ext3_journal(ext2_filsys *fs);
 
 static const char *fsck_explain = N_("\nThis operation requires a freshly checked filesystem.\n");
@@ -673,9 +680,16 @@ static errcode_t rewrite_directory(ext2_filsys fs, ext2_ino_t dir,
  */
 struct rewrite_context {
 	ext2_filsys fs;
+	struct ext2_inode *inode;
 	struct ext2_inode *zero_inode;
 	char *ea_buf;
 	int inode_size;
+	char *itable_buf;
+	char *chunk_dirty;
+	ext2_ino_t chunk_inodes;
+	ext2_ino_t inodes_done;
+	struct ext2fs_numeric_progress_struct progress;
+	quota_ctx_t qctx;
 };
 
 #define fatal_err(code, args...)		\
@@ -768,15 +782,17 @@ static void update_block_xattr_hashes(struct rewrite_context *ctx,
 		ext2fs_ext_attr_block_rehash(header, end);
 }
 
-static void rewrite_one_inode(struct rewrite_context *ctx, ext2_ino_t ino,
+/*
+ * Update the fields of an inode that depend on the checksum seed.  Returns
+ * 0 if the inode is unused and already zeroed, so that nothing needs to be
+ * written back.
+ */
+static int rewrite_inode_body(struct rewrite_context *ctx, ext2_ino_t ino,
 			      struct ext2_inode *inode)
 {
-	blk64_t file_acl_block;
-	errcode_t retval;
-
 	if (!ext2fs_test_inode_bitmap2(ctx->fs->inode_map, ino)) {
 		if (!memcmp(inode, ctx->zero_inode, ctx->inode_size))
-			return;
+			return 0;
 		memset(inode, 0, ctx->inode_size);
 	}
 
@@ -786,10 +802,18 @@ static void rewrite_one_inode(struct rewrite_context *ctx, ext2_ino_t ino,
 	if (ctx->inode_size != EXT2_GOOD_OLD_INODE_SIZE)
 		update_inline_xattr_hashes(ctx,
 					   (struct ext2_inode_large *)inode);
+	return 1;
+}
 
-	retval = ext2fs_write_inode_full(ctx->fs, ino, inode, ctx->inode_size);
-	if (retval)
-		fatal_err(retval, "while writing inode");
+/*
+ * Rewrite the extent tree, directory blocks and xattr block belonging
+ * to an inode whose own checksum has already been updated.
+ */
+static void rewrite_inode_metadata(struct rewrite_context *ctx,
+				   ext2_ino_t ino, struct ext2_inode *inode)
+{
+	blk64_t file_acl_block;
+	errcode_t retval;
 
 	retval = ext2fs_fix_extents_checksums(ctx->fs, ino, inode);
 	if (retval)
@@ -818,25 +842,149 @@ static void rewrite_one_inode(struct rewrite_context *ctx, ext2_ino_t ino,
 		fatal_err(retval, "while rewriting extended attribute");
 }
 
+/*
+ * Inode tables are rewritten in chunks of at most this many bytes.
+ */
+#define REWRITE_ITABLE_CHUNK	(1024 * 1024)
+
+/*
+ * Rewrite the inodes of one block group.  Rather than going through
+ * ext2fs_write_inode_full() (a read-modify-write of an inode table block
+ * for every inode), each chunk of the inode table is read with one large
+ * read, its inodes are updated and checksummed in place, and the chunk is
+ * written back with one large write.  Only then are the extent blocks,
+ * directory blocks and xattr blocks of the chunk's inodes rewritten, since
+ * those paths may themselves write the inode.
+ */
+static void rewrite_inode_group(struct rewrite_context *ctx, dgrp_t group,
+				int pass)
+{
+	ext2_filsys fs = ctx->fs;
+	struct ext2_inode *inode = ctx->inode;
+	ext2_ino_t first_ino, ino, nr_inodes, i, n, done;
+	blk64_t itable, blk, nr_blocks;
+	struct ext2_inode_large *disk_inode;
+	char *dirty;
+	errcode_t retval;
+	int changed;
+
+	nr_inodes = EXT2_INODES_PER_GROUP(fs->super);
+	if (ext2fs_has_group_desc_csum(fs)) {
+		__u32 unused = ext2fs_bg_itable_unused(fs, group);
+
+		if (ext2fs_bg_flags_test(fs, group, EXT2_BG_INODE_UNINIT))
+			return;
+		nr_inodes = (nr_inodes > unused) ? nr_inodes - unused : 0;
+	}
+	if (nr_inodes == 0)
+		return;
+
+	itable = ext2fs_inode_table_loc(fs, group);
+	if (!itable)
+		fatal_err(EXT2_ET_MISSING_INODE_TABLE,
+			  "while rewriting inode table");
+
+	first_ino = group * EXT2_INODES_PER_GROUP(fs->super) + 1;
+	dirty = ctx->chunk_dirty;
+	for (done = 0; done < nr_inodes; done += n) {
+		n = nr_inodes - done;
+		if (n > ctx->chunk_inodes)
+			n = ctx->chunk_inodes;
+		blk = itable + ((blk64_t) done * ctx->inode_size) /
+			fs->blocksize;
+		nr_blocks = ((blk64_t) n * ctx->inode_size + fs->blocksize - 1) /
+			fs->blocksize;
+
+		retval = io_channel_read_blk64(fs->io, blk, nr_blocks,
+					       ctx->itable_buf);
+		if (retval)
+			fatal_err(retval, "while reading inode table");
+
+		changed = 0;
+		for (i = 0; i < n; i++) {
+			ino = first_ino + done + i;
+			disk_inode = (struct ext2_inode_large *)
+				(ctx->itable_buf + i * ctx->inode_size);
+#ifdef WORDS_BIGENDIAN
+			ext2fs_swap_inode_full(fs,
+				(struct ext2_inode_large *) inode,
+				disk_inode, 0, ctx->inode_size);
+#else
+			memcpy(inode, disk_inode, ctx->inode_size);
+#endif
+			dirty[i] = 0;
+			if (pass == 2)
+				quota_compute_inode(ctx->qctx, ino,
+					(struct ext2_inode_large *) inode);
+			if ((pass == 1) != !!(inode->i_flags & EXT4_EA_INODE_FL))
+				continue;
+			if (!rewrite_inode_body(ctx, ino, inode))
+				continue;
+#ifdef WORDS_BIGENDIAN
+			ext2fs_swap_inode_full(fs, disk_inode,
+				(struct ext2_inode_large *) inode,
+				1, ctx->inode_size);
+#else
+			memcpy(disk_inode, inode, ctx->inode_size);
+#endif
+			retval = ext2fs_inode_csum_set(fs, ino, disk_inode);
+			if (retval)
+				fatal_err(retval, "while writing inode");
+			dirty[i] = 1;
+			changed = 1;
+		}
+		if (!changed)
+			goto next;
+
+		retval = io_channel_write_blk64(fs->io, blk, nr_blocks,
+						ctx->itable_buf);
+		if (retval)
+			fatal_err(retval, "while writing inode table");
+		fs->flags |= EXT2_FLAG_CHANGED;
+		/* The inode cache may hold stale copies of these inodes */
+		ext2fs_flush_icache(fs);
+
+		for (i = 0; i < n; i++) {
+			if (!dirty[i])
+				continue;
+			disk_inode = (struct ext2_inode_large *)
+				(ctx->itable_buf + i * ctx->inode_size);
+#ifdef WORDS_BIGENDIAN
+			ext2fs_swap_inode_full(fs,
+				(struct ext2_inode_large *) inode,
+				disk_inode, 0, ctx->inode_size);
+#else
+			memcpy(inode, disk_inode, ctx->inode_size);
+#endif
+			rewrite_inode_metadata(ctx, first_ino + done + i,
+					       inode);
+		}
+	next:
+		ctx->inodes_done += n;
+		ext2fs_numeric_progress_update(fs, &ctx->progress,
+					       ctx->inodes_done);
+	}
+}
+
 /*
  * Forcibly set checksums in all inodes.
  */
 static void rewrite_inodes(ext2_filsys fs)
 {
-	ext2_inode_scan	scan;
 	errcode_t	retval;
-	ext2_ino_t	ino;
-	struct ext2_inode *inode;
+	dgrp_t		group;
+	blk64_t		chunk_blocks;
 	int pass;
 	struct rewrite_context ctx = {
 		.fs = fs,
 		.inode_size = EXT2_INODE_SIZE(fs->super),
+		.qctx = quota_scan_ctx,
 	};
 
 	if (fs->super->s_creator_os == EXT2_OS_HURD)
 		return;
 
-	retval = ext2fs_get_mem(ctx.inode_size, &inode);
+	retval = ext2fs_get_mem(ctx.inode_size, &ctx.inode);
 	if (retval)
 		fatal_err(retval, "while allocating memory");
 
@@ -848,6 +996,22 @@ static void rewrite_inodes(ext2_filsys fs)
 	if (retval)
 		fatal_err(retval, "while allocating memory");
 
+	chunk_blocks = REWRITE_ITABLE_CHUNK / fs->blocksize;
+	if (chunk_blocks > fs->inode_blocks_per_group)
+		chunk_blocks = fs->inode_blocks_per_group;
+	if (chunk_blocks == 0)
+		chunk_blocks = 1;
+	ctx.chunk_inodes = chunk_blocks * fs->blocksize / ctx.inode_size;
+	retval = io_channel_alloc_buf(fs->io, chunk_blocks, &ctx.itable_buf);
+	if (retval)
+		fatal_err(retval, "while allocating memory");
+	retval = ext2fs_get_mem(ctx.chunk_inodes, &ctx.chunk_dirty);
+	if (retval)
+		fatal_err(retval, "while allocating memory");
+
+	if (isatty(1))
+		fs->flags |= EXT2_FLAG_PRINT_PROGRESS;
+
 	/*
 	 * Extended attribute inodes have a lookup hash that needs to be
 	 * recalculated with the new csum_seed. Other inodes referencing xattr
@@ -863,31 +1027,25 @@ static void rewrite_inodes(ext2_filsys fs)
 	else
 		pass = 2;
 	for (;pass <= 2; pass++) {
-		retval = ext2fs_open_inode_scan(fs, 0, &scan);
-		if (retval)
-			fatal_err(retval, "while opening inode scan");
-
-		do {
-			retval = ext2fs_get_next_inode_full(scan, &ino, inode,
-							    ctx.inode_size);
-			if (retval)
-				fatal_err(retval, "while getting next inode");
-			if (!ino)
-				break;
-
-			if (((pass == 1) &&
-			     (inode->i_flags & EXT4_EA_INODE_FL)) ||
-			    ((pass == 2) &&
-			     !(inode->i_flags & EXT4_EA_INODE_FL)))
-				rewrite_one_inode(&ctx, ino, inode);
-		} while (ino);
-
-		ext2fs_close_inode_scan(scan);
-	}
-
+		ctx.inodes_done = 0;
+		ext2fs_numeric_progress_init(fs, &ctx.progress,
+				pass == 1 ? _("Rewriting xattr inode checksums: ") :
+					    _("Rewriting inode checksums: "),
+				fs->super->s_inodes_count);
+		for (group = 0; group < fs->group_desc_count; group++) {
+			rewrite_inode_group(&ctx, group, pass);
+			ctx.inodes_done = (ext2_ino_t) (group + 1) *
+				EXT2_INODES_PER_GROUP(fs->super);
+		}
+		ext2fs_numeric_progress_close(fs, &ctx.progress, _("done\n"));
+	}
+	fs->flags &= ~EXT2_FLAG_PRINT_PROGRESS;
+
+	ext2fs_free_mem(&ctx.chunk_dirty);
+	ext2fs_free_mem(&ctx.itable_buf);
 	ext2fs_free_mem(&ctx.zero_inode);
 	ext2fs_free_mem(&ctx.ea_buf);
-	ext2fs_free_mem(&inode);
+	ext2fs_free_mem(&ctx.inode);
 }
 
 static void rewrite_metadata_checksums(ext2_filsys fs)
@@ -1554,14 +1712,15 @@ err:
 	return 1;
 }
 
+static void finish_quota_options(ext2_filsys fs, quota_ctx_t qctx,
+				 unsigned int qtype_bits);
+
 static void handle_quota_options(ext2_filsys fs)
 {
 	errcode_t retval;
 	quota_ctx_t qctx;
-	ext2_ino_t qf_ino;
 	enum quota_type qtype;
 	unsigned int qtype_bits = 0;
-	int need_dirty = 0;
 
 	for (qtype = 0 ; qtype < MAXQUOTAS; qtype++)
 		if (quota_enable[qtype] != 0)
@@ -1589,8 +1748,32 @@ static void handle_quota_options(ext2_filsys fs)
 		exit(1);
 	}
 
-	if (qtype_bits)
+	if (qtype_bits) {
+		/*
+		 * If every inode is going to be rewritten for new
+		 * checksums anyway, count the usage while doing that
+		 * rather than scanning the inode table twice.
+		 */
+		if (rewrite_checksums &&
+		    fs->super->s_creator_os != EXT2_OS_HURD) {
+			quota_scan_ctx = qctx;
+			return;
+		}
 		quota_compute_usage(qctx);
+	}
+	finish_quota_options(fs, qctx, qtype_bits);
+}
+
+/*
+ * Create or remove the quota files once the usage has been computed.
+ */
+static void finish_quota_options(ext2_filsys fs, quota_ctx_t qctx,
+				 unsigned int qtype_bits)
+{
+	errcode_t retval;
+	ext2_ino_t qf_ino;
+	enum quota_type qtype;
+	int need_dirty = 0;
 
 	for (qtype = 0 ; qtype < MAXQUOTAS; qtype++) {
 		if (quota_enable[qtype] == QOPT_ENABLE &&
@@ -2249,24 +2432,73 @@ static int ext2fs_is_block_in_group(ext2_filsys fs, dgrp_t group, blk64_t blk)
 	return 0;
 }
 
-static int move_block(ext2_filsys fs, ext2fs_block_bitmap bmap)
+/*
+ * Record that blk is to be moved to new_blk, extending the last run if
+ * the two are contiguous with it.
+ */
+static errcode_t add_blk_move(blk64_t blk, blk64_t new_blk)
 {
+	struct blk_move *bmv;
+	errcode_t retval;
 
-	char *buf;
+	if (blk_move_count) {
+		bmv = &blk_move_list[blk_move_count - 1];
+		if (bmv->old_loc + bmv->len == blk &&
+		    bmv->new_loc + bmv->len == new_blk) {
+			bmv->len++;
+			blk_move_blocks++;
+			return 0;
+		}
+	}
+
+	if (blk_move_count >= blk_move_size) {
+		size_t new_size = blk_move_size ? blk_move_size * 2 : 256;
+
+		retval = ext2fs_resize_mem(blk_move_size *
+					   sizeof(struct blk_move),
+					   new_size * sizeof(struct blk_move),
+					   &blk_move_list);
+		if (retval)
+			return retval;
+		blk_move_size = new_size;
+	}
+
+	bmv = &blk_move_list[blk_move_count++];
+	bmv->old_loc = blk;
+	bmv->new_loc = new_blk;
+	bmv->len = 1;
+	blk_move_blocks++;
+	return 0;
+}
+
+/*
+ * Decide where each block in bmap is going to go.  Nothing is copied yet;
+ * the result is a list of runs which copy_moved_blocks() then moves with
+ * large reads and writes.  Ordinary blocks are taken from an allocation
+ * pool, which reserves free space a run at a time instead of searching
+ * the bitmap again for every block.
+ */
+static int plan_block_moves(ext2_filsys fs, ext2fs_block_bitmap bmap)
+{
+	ext2_alloc_pool_t pool;
 	dgrp_t group = 0;
 	errcode_t retval;
-	int meta_data = 0;
-	blk64_t blk, new_blk, goal;
-	struct blk_move *bmv;
+	blk64_t blk, new_blk, goal, end;
 
-	retval = ext2fs_get_mem(fs->blocksize, &buf);
+	retval = ext2fs_alloc_pool_create(fs, 0, 0, &pool);
 	if (retval)
 		return retval;
 
-	for (new_blk = blk = fs->super->s_first_data_block;
-	     blk < ext2fs_blocks_count(fs->super); blk++) {
-		if (!ext2fs_test_block_bitmap2(bmap, blk))
-			continue;
+	end = ext2fs_blocks_count(fs->super) - 1;
+	for (blk = fs->super->s_first_data_block; blk <= end; blk++) {
+		retval = ext2fs_find_first_set_block_bitmap2(bmap, blk, end,
+							     &blk);
+		if (retval == ENOENT) {
+			retval = 0;
+			break;
+		}
+		if (retval)
+			break;
 
 		if (ext2fs_is_meta_block(fs, blk)) {
 			/*
@@ -2278,57 +2510,111 @@ static int move_block(ext2_filsys fs, ext2fs_block_bitmap bmap)
 			 */
 			group = ext2fs_group_of_blk2(fs, blk);
 			goal = ext2fs_group_first_block2(fs, group);
-			meta_data = 1;
+			retval = ext2fs_new_block2(fs, goal, NULL, &new_blk);
+			if (retval)
+				break;
 
-		} else {
-			goal = new_blk;
-		}
-		retval = ext2fs_new_block2(fs, goal, NULL, &new_blk);
-		if (retval)
-			goto err_out;
+			/* new fs meta data block should be in the same group */
+			if (!ext2fs_is_block_in_group(fs, group, new_blk)) {
+				retval = ENOSPC;
+				break;
+			}
 
-		/* new fs meta data block should be in the same group */
-		if (meta_data && !ext2fs_is_block_in_group(fs, group, new_blk)) {
-			retval = ENOSPC;
-			goto err_out;
+			/* Mark this block as allocated */
+			ext2fs_mark_block_bitmap2(fs->block_map, new_blk);
+		} else {
+			retval = ext2fs_alloc_pool_new_block(pool, &new_blk);
+			if (retval)
+				break;
 		}
 
-		/* Mark this block as allocated */
-		ext2fs_mark_block_bitmap2(fs->block_map, new_blk);
-
-		/* Add it to block move list */
-		retval = ext2fs_get_mem(sizeof(struct blk_move), &bmv);
+		retval = add_blk_move(blk, new_blk);
 		if (retval)
-			goto err_out;
+			break;
+	}
+	ext2fs_alloc_pool_free(pool);
+	return retval;
+}
 
-		bmv->old_loc = blk;
-		bmv->new_loc = new_blk;
+/* Largest single read/write used when copying relocated blocks */
+#define MOVE_CHUNK_SIZE		(1024 * 1024)
 
-		list_add(&(bmv->list), &blk_move_list);
+static int copy_moved_blocks(ext2_filsys fs)
+{
+	struct ext2fs_numeric_progress_struct progress;
+	struct blk_move *bmv;
+	blk64_t done = 0, off, count, chunk;
+	errcode_t retval;
+	size_t i;
+	char *buf;
 
-		retval = io_channel_read_blk64(fs->io, blk, 1, buf);
-		if (retval)
-			goto err_out;
+	chunk = MOVE_CHUNK_SIZE / fs->blocksize;
+	if (chunk == 0)
+		chunk = 1;
+	retval = io_channel_alloc_buf(fs->io, chunk, &buf);
+	if (retval)
+		return retval;
 
-		retval = io_channel_write_blk64(fs->io, new_blk, 1, buf);
-		if (retval)
-			goto err_out;
+	ext2fs_numeric_progress_init(fs, &progress,
+				     _("Relocating blocks: "),
+				     blk_move_blocks);
+	for (i = 0, bmv = blk_move_list; i < blk_move_count; i++, bmv++) {
+		for (off = 0; off < bmv->len; off += count) {
+			count = bmv->len - off;
+			if (count > chunk)
+				count = chunk;
+			retval = io_channel_read_blk64(fs->io,
+						       bmv->old_loc + off,
+						       count, buf);
+			if (retval)
+				goto err_out;
+			retval = io_channel_write_blk64(fs->io,
+							bmv->new_loc + off,
+							count, buf);
+			if (retval)
+				goto err_out;
+			done += count;
+			ext2fs_numeric_progress_update(fs, &progress, done);
+		}
 	}
+	ext2fs_numeric_progress_close(fs, &progress, _("done\n"));
 
 err_out:
 	ext2fs_free_mem(&buf);
 	return retval;
 }
 
+static int move_block(ext2_filsys fs, ext2fs_block_bitmap bmap)
+{
+	errcode_t retval;
+
+	retval = plan_block_moves(fs, bmap);
+	if (retval)
+		return retval;
+
+	if (fs->flags & EXT2_FLAG_PRINT_PROGRESS)
+		printf(_("Moving %llu blocks in %llu extents to make room "
+			 "for the larger inode tables\n"),
+		       (unsigned long long) blk_move_blocks,
+		       (unsigned long long) blk_move_count);
+
+	return copy_moved_blocks(fs);
+}
+
 static blk64_t translate_block(blk64_t blk)
 {
-	struct list_head *entry;
+	size_t low = 0, high = blk_move_count, mid;
 	struct blk_move *bmv;
 
-	list_for_each(entry, &blk_move_list) {
-		bmv = list_entry(entry, struct blk_move, list);
-		if (bmv->old_loc == blk)
-			return bmv->new_loc;
+	while (low < high) {
+		mid = (low + high) / 2;
+		bmv = &blk_move_list[mid];
+		if (blk < bmv->old_loc)
+			high = mid;
+		else if (blk >= bmv->old_loc + bmv->len)
+			low = mid + 1;
+		else
+			return bmv->new_loc + (blk - bmv->old_loc);
 	}
 
 	return 0;
@@ -2471,6 +2757,7 @@ static int expand_inode_table(ext2_filsys fs, unsigned long new_ino_size)
 	char *tmp_old_itable = NULL, *tmp_new_itable = NULL;
 	unsigned long old_ino_size;
 	int old_itable_size, new_itable_size;
+	struct ext2fs_numeric_progress_struct progress;
 
 	old_itable_size = fs->inode_blocks_per_group * fs->blocksize;
 	old_ino_size = EXT2_INODE_SIZE(fs->super);
@@ -2493,6 +2780,9 @@ static int expand_inode_table(ext2_filsys fs, unsigned long new_ino_size)
 	tmp_old_itable = old_itable;
 	tmp_new_itable = new_itable;
 
+	ext2fs_numeric_progress_init(fs, &progress,
+				     _("Expanding inode tables: "),
+				     fs->group_desc_count);
 	for (i = 0; i < fs->group_desc_count; i++) {
 		blk = ext2fs_inode_table_loc(fs, i);
 		retval = io_channel_read_blk64(fs->io, blk,
@@ -2518,7 +2808,9 @@ static int expand_inode_table(ext2_filsys fs, unsigned long new_ino_size)
 					new_ino_blks_per_grp, new_itable);
 		if (retval)
 			goto err_out;
+		ext2fs_numeric_progress_update(fs, &progress, i + 1);
 	}
+	ext2fs_numeric_progress_close(fs, &progress, _("done\n"));
 
 	/* Update the meta data */
 	fs->inode_blocks_per_group = new_ino_blks_per_grp;
@@ -2594,21 +2886,12 @@ static errcode_t ext2fs_calculate_summary_stats(ext2_filsys fs)
 	return 0;
 }
 
-#define list_for_each_safe(pos, pnext, head) \
-	for (pos = (head)->next, pnext = pos->next; pos != (head); \
-	     pos = pnext, pnext = pos->next)
-
 static void free_blk_move_list(void)
 {
-	struct list_head *entry, *tmp;
-	struct blk_move *bmv;
-
-	list_for_each_safe(entry, tmp, &blk_move_list) {
-		bmv = list_entry(entry, struct blk_move, list);
-		list_del(entry);
-		ext2fs_free_mem(&bmv);
-	}
-	return;
+	if (blk_move_list)
+		ext2fs_free_mem(&blk_move_list);
+	blk_move_count = blk_move_size = 0;
+	blk_move_blocks = 0;
 }
 
 static int resize_inode(ext2_filsys fs, unsigned long new_size)
@@ -2627,7 +2910,7 @@ static int resize_inode(ext2_filsys fs, unsigned long new_size)
 		fputs(_("Failed to read block bitmap\n"), stderr);
 		return retval;
 	}
-	INIT_LIST_HEAD(&blk_move_list);
+	free_blk_move_list();
 
 
 	new_ino_blks_per_grp = ext2fs_div_ceil(
@@ -2653,19 +2936,23 @@ static int resize_inode(ext2_filsys fs, unsigned long new_size)
 		fputs(_("Not enough space to increase inode size \n"), stderr);
 		goto err_out;
 	}
+	if (isatty(1))
+		fs->flags |= EXT2_FLAG_PRINT_PROGRESS;
 	retval = move_block(fs, bmap);
 	if (retval) {
 		fputs(_("Failed to relocate blocks during inode resize \n"),
 		      stderr);
 		goto err_out;
 	}
-	retval = inode_scan_and_fix(fs, bmap);
-	if (retval)
-		goto err_out_undo;
+	if (blk_move_count) {
+		retval = inode_scan_and_fix(fs, bmap);
+		if (retval)
+			goto err_out_undo;
 
-	retval = group_desc_scan_and_fix(fs, bmap);
-	if (retval)
-		goto err_out_undo;
+		retval = group_desc_scan_and_fix(fs, bmap);
+		if (retval)
+			goto err_out_undo;
+	}
 
 	retval = expand_inode_table(fs, new_size);
 	if (retval)
@@ -2681,12 +2968,14 @@ static int resize_inode(ext2_filsys fs, unsigned long new_size)
 err_out:
 	free_blk_move_list();
 	ext2fs_free_block_bitmap(bmap);
+	fs->flags &= ~EXT2_FLAG_PRINT_PROGRESS;
 
 	return retval;
 
 err_out_undo:
 	free_blk_move_list();
 	ext2fs_free_block_bitmap(bmap);
+	fs->flags &= ~EXT2_FLAG_PRINT_PROGRESS;
 	fputs(_("Error in resizing the inode size.\n"
 			"Run e2undo to undo the "
 			"file system changes. \n"), stderr);
@@ -3301,6 +3590,16 @@ _("Warning: The journal is dirty. You may wish to replay the journal like:\n\n"
 
 	if (rewrite_checksums)
 		rewrite_metadata_checksums(fs);
+	if (quota_scan_ctx) {
+		unsigned int qtype_bits = 0;
+		enum quota_type qtype;
+
+		for (qtype = 0; qtype < MAXQUOTAS; qtype++)
+			if (quota_enable[qtype] == QOPT_ENABLE)
+				qtype_bits |= 1 << qtype;
+		finish_quota_options(fs, quota_scan_ctx, qtype_bits);
+		quota_scan_ctx = NULL;
+	}
 
 	if (l_flag)
 		list_super(sb);
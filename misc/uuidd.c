@@ -26,6 +26,9 @@
 #include <fcntl.h>
 #include <signal.h>
 #include <string.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/wait.h>
 #ifdef HAVE_GETOPT_H
 #include <getopt.h>
 #else
@@ -50,6 +53,8 @@ static void usage(const char *progname)
 			  "[-T timeout]\n"), progname);
 	fprintf(stderr, _("       %s [-r|t] [-n num] [-s socketpath]\n"),
 		progname);
+	fprintf(stderr, _("       %s -L clients [-r|t] [-n num] "
+			  "[-s socketpath]\n"), progname);
 	fprintf(stderr, _("       %s -k\n"), progname);
 	exit(1);
 }
@@ -211,13 +216,13 @@ static int call_daemon(const char *socket_path, int op, char *buf,
 
 	if ((ret > 0) && (op == 4)) {
 		if (reply_len >= (int) (16+sizeof(int)))
-			memcpy(buf+16, num, sizeof(int));
+			memcpy(num, buf+16, sizeof(int));
 		else
 			*num = -1;
 	}
 	if ((ret > 0) && (op == 5)) {
-		if (*num >= (int) sizeof(int))
-			memcpy(buf, num, sizeof(int));
+		if (reply_len >= (int) sizeof(int))
+			memcpy(num, buf, sizeof(int));
 		else
 			*num = -1;
 	}
@@ -227,19 +232,340 @@ static int call_daemon(const char *socket_path, int op, char *buf,
 	return ret;
 }
 
+/*
+ * Time-based UUIDs are handed out of a range of clock ticks which is
+ * reserved from the library in one go, so that the clock state file
+ * only has to be locked and rewritten once per range rather than once
+ * per request.  A range is dropped once it is a couple of seconds old,
+ * so the UUIDs we hand out stay close to the current time.
+ */
+#define UUIDD_TIME_RANGE	100000	/* 10ms worth of clock ticks */
+
+static uuid_t	range_next;
+static int	range_left;
+static time_t	range_time;
+
+/*
+ * Advance the timestamp of a time-based UUID by num clock ticks.
+ */
+static void advance_time_uuid(uuid_t uu, int num)
+{
+	uint64_t	t;
+
+	t = ((uint64_t) (uu[6] & 0x0F) << 56) | ((uint64_t) uu[7] << 48) |
+		((uint64_t) uu[4] << 40) | ((uint64_t) uu[5] << 32) |
+		((uint64_t) uu[0] << 24) | ((uint64_t) uu[1] << 16) |
+		((uint64_t) uu[2] << 8) | (uint64_t) uu[3];
+	t += num;
+	uu[0] = t >> 24;
+	uu[1] = t >> 16;
+	uu[2] = t >> 8;
+	uu[3] = t;
+	uu[4] = t >> 40;
+	uu[5] = t >> 32;
+	uu[6] = (uu[6] & 0xF0) | ((t >> 56) & 0x0F);
+	uu[7] = t >> 48;
+}
+
+static void generate_time_range(uuid_t out, int *num)
+{
+	time_t	now = time(0);
+
+	if (*num < 1)
+		*num = 1;
+	if (*num > UUIDD_TIME_RANGE) {
+		uuid__generate_time(out, num);
+		return;
+	}
+	if (range_left < *num || now > range_time + 1) {
+		range_left = UUIDD_TIME_RANGE;
+		uuid__generate_time(range_next, &range_left);
+		range_time = now;
+	}
+	memcpy(out, range_next, sizeof(uuid_t));
+	advance_time_uuid(range_next, *num);
+	range_left -= *num;
+}
+
+/*
+ * Build the reply to a request in reply_buf, and return its length,
+ * or -1 if the request is not valid.
+ */
+static int process_request(char op, int num, char *reply_buf, int buflen,
+			   int debug)
+{
+	uuid_t	uu;
+	char	str[UUID_STR_SIZE], *cp;
+	int	i, reply_len;
+
+	switch(op) {
+	case UUIDD_OP_GETPID:
+		sprintf(reply_buf, "%d", getpid());
+		reply_len = strlen(reply_buf)+1;
+		break;
+	case UUIDD_OP_GET_MAXOP:
+		sprintf(reply_buf, "%d", UUIDD_MAX_OP);
+		reply_len = strlen(reply_buf)+1;
+		break;
+	case UUIDD_OP_TIME_UUID:
+		num = 1;
+		generate_time_range(uu, &num);
+		if (debug) {
+			uuid_unparse(uu, str);
+			printf(_("Generated time UUID: %s\n"), str);
+		}
+		memcpy(reply_buf, uu, sizeof(uu));
+		reply_len = sizeof(uu);
+		break;
+	case UUIDD_OP_RANDOM_UUID:
+		num = 1;
+		uuid__generate_random(uu, &num);
+		if (debug) {
+			uuid_unparse(uu, str);
+			printf(_("Generated random UUID: %s\n"), str);
+		}
+		memcpy(reply_buf, uu, sizeof(uu));
+		reply_len = sizeof(uu);
+		break;
+	case UUIDD_OP_BULK_TIME_UUID:
+		generate_time_range(uu, &num);
+		if (debug) {
+			uuid_unparse(uu, str);
+			printf(P_("Generated time UUID %s and "
+				  "subsequent UUID\n",
+				  "Generated time UUID %s and %d "
+				  "subsequent UUIDs\n", num),
+			       str, num);
+		}
+		memcpy(reply_buf, uu, sizeof(uu));
+		reply_len = sizeof(uu);
+		memcpy(reply_buf+reply_len, &num, sizeof(num));
+		reply_len += sizeof(num);
+		break;
+	case UUIDD_OP_BULK_RANDOM_UUID:
+		if (num < 0)
+			num = 1;
+		if (num > 1000)
+			num = 1000;
+		if (num*16 > (int) (buflen-sizeof(num)))
+			num = (buflen-sizeof(num)) / 16;
+		uuid__generate_random((unsigned char *) reply_buf +
+				      sizeof(num), &num);
+		if (debug) {
+			printf(_("Generated %d UUID's:\n"), num);
+			for (i=0, cp=reply_buf+sizeof(num);
+			     i < num; i++, cp+=16) {
+				uuid_unparse((unsigned char *)cp, str);
+				printf("\t%s\n", str);
+			}
+		}
+		reply_len = (num*16) + sizeof(num);
+		memcpy(reply_buf, &num, sizeof(num));
+		break;
+	default:
+		if (debug)
+			printf(_("Invalid operation %d\n"), op);
+		return -1;
+	}
+	return reply_len;
+}
+
+/*
+ * Clients are served from a single poll() loop, so that one which is
+ * slow to send its request or read its reply does not hold up the
+ * others.  Connections beyond UUIDD_MAX_CLIENTS wait in the listen
+ * backlog, and a client which has not been served within
+ * UUIDD_CLIENT_TIMEOUT seconds is dropped.
+ */
+#define UUIDD_MAX_CLIENTS	256
+#define UUIDD_CLIENT_TIMEOUT	5
+
+struct uuidd_client {
+	int	fd;
+	time_t	start;
+	int	req_len;		/* request bytes read so far */
+	char	req[1 + sizeof(int)];
+	int	reply_len;		/* reply bytes to write, or 0 */
+	int	reply_done;
+	char	reply[sizeof(int32_t) + 1024];
+};
+
+static int request_size(char op)
+{
+	if ((op == UUIDD_OP_BULK_TIME_UUID) ||
+	    (op == UUIDD_OP_BULK_RANDOM_UUID))
+		return 1 + sizeof(int);
+	return 1;
+}
+
+/*
+ * Read more of a client's request, and build the reply once all of it
+ * has arrived.  Returns -1 if the client should be dropped.
+ */
+static int client_read(struct uuidd_client *cl, int debug)
+{
+	ssize_t		ret;
+	int32_t		reply_len;
+	int		want, num = 0;
+
+	while (1) {
+		want = cl->req_len ? request_size(cl->req[0]) : 1;
+		if (cl->req_len >= want)
+			break;
+		ret = read(cl->fd, cl->req + cl->req_len, want - cl->req_len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0 && errno == EAGAIN)
+			return 0;
+		if (ret <= 0) {
+			if (ret < 0)
+				perror("read");
+			else if (!cl->req_len)
+				printf(_("Error reading from client, "
+					 "len = %d\n"), (int) ret);
+			return -1;
+		}
+		cl->req_len += ret;
+	}
+
+	if (cl->req_len > 1) {
+		memcpy(&num, cl->req + 1, sizeof(num));
+		if (debug)
+			printf(_("operation %d, incoming num = %d\n"),
+			       cl->req[0], num);
+	} else if (debug)
+		printf("operation %d\n", cl->req[0]);
+
+	reply_len = process_request(cl->req[0], num,
+				    cl->reply + sizeof(reply_len),
+				    sizeof(cl->reply) - sizeof(reply_len),
+				    debug);
+	if (reply_len < 0)
+		return -1;
+	memcpy(cl->reply, &reply_len, sizeof(reply_len));
+	cl->reply_len = reply_len + sizeof(reply_len);
+	cl->reply_done = 0;
+	return 0;
+}
+
+/*
+ * Write out more of a client's reply.  Returns 1 once it has all been
+ * sent, and -1 if the client should be dropped.
+ */
+static int client_write(struct uuidd_client *cl)
+{
+	ssize_t		ret;
+
+	while (cl->reply_done < cl->reply_len) {
+		ret = write(cl->fd, cl->reply + cl->reply_done,
+			    cl->reply_len - cl->reply_done);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0 && errno == EAGAIN)
+			return 0;
+		if (ret < 0)
+			return -1;
+		cl->reply_done += ret;
+	}
+	return 1;
+}
+
+static void serve_clients(int s, int debug, int timeout)
+{
+	struct uuidd_client	*clients;
+	struct pollfd		*pfd;
+	struct sockaddr_un	from_addr;
+	socklen_t		fromlen;
+	time_t			now;
+	int			i, ret, ns, nr = 0;
+
+	clients = calloc(UUIDD_MAX_CLIENTS, sizeof(*clients));
+	pfd = calloc(UUIDD_MAX_CLIENTS + 1, sizeof(*pfd));
+	if (!clients || !pfd)
+		die("calloc");
+	if (fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK) < 0)
+		die("fcntl");
+
+	while (1) {
+		pfd[0].fd = s;
+		pfd[0].events = (nr < UUIDD_MAX_CLIENTS) ? POLLIN : 0;
+		for (i = 0; i < nr; i++) {
+			pfd[i + 1].fd = clients[i].fd;
+			pfd[i + 1].events = clients[i].reply_len ?
+				POLLOUT : POLLIN;
+		}
+
+		ret = poll(pfd, nr + 1,
+			   nr ? 1000 : (timeout > 0 ? timeout * 1000 : -1));
+		if (ret < 0) {
+			if ((errno == EAGAIN) || (errno == EINTR))
+				continue;
+			perror("poll");
+			exit(1);
+		}
+		if (ret == 0 && !nr)
+			terminate_intr(0);
+
+		now = time(0);
+		for (i = nr - 1; i >= 0; i--) {
+			struct uuidd_client *cl = &clients[i];
+			short revents = pfd[i + 1].revents;
+
+			ret = 0;
+			if (revents & (POLLERR | POLLNVAL))
+				ret = -1;
+			else if (!cl->reply_len && (revents & (POLLIN|POLLHUP)))
+				ret = client_read(cl, debug);
+			if (ret == 0 && cl->reply_len)
+				ret = client_write(cl);
+			if (ret == 0 && now > cl->start + UUIDD_CLIENT_TIMEOUT)
+				ret = -1;
+			if (ret != 0) {
+				close(cl->fd);
+				*cl = clients[--nr];
+			}
+		}
+
+		if (!(pfd[0].revents & POLLIN))
+			continue;
+		while (nr < UUIDD_MAX_CLIENTS) {
+			fromlen = sizeof(from_addr);
+			ns = accept(s, (struct sockaddr *) &from_addr,
+				    &fromlen);
+			if (ns < 0) {
+				if ((errno == EAGAIN) || (errno == EINTR) ||
+				    (errno == ECONNABORTED))
+					break;
+				perror("accept");
+				exit(1);
+			}
+			if (fcntl(ns, F_SETFL,
+				  fcntl(ns, F_GETFL) | O_NONBLOCK) < 0) {
+				close(ns);
+				continue;
+			}
+			memset(&clients[nr], 0, sizeof(clients[nr]));
+			clients[nr].fd = ns;
+			clients[nr].start = now;
+			ret = client_read(&clients[nr], debug);
+			if (ret == 0 && clients[nr].reply_len)
+				ret = client_write(&clients[nr]);
+			if (ret != 0)
+				close(ns);
+			else
+				nr++;
+		}
+	}
+}
+
 static void server_loop(const char *socket_path, const char *pidfile_path,
 			int debug, int timeout, int quiet)
 {
-	struct sockaddr_un	my_addr, from_addr;
+	struct sockaddr_un	my_addr;
 	struct flock		fl;
-	socklen_t		fromlen;
-	int32_t			reply_len = 0;
-	uuid_t			uu;
 	mode_t			save_umask;
-	char			reply_buf[1024], *cp;
-	char			op, str[UUID_STR_SIZE];
-	int			i, s, ns, len, num;
-	int			fd_pidfile, ret;
+	char			reply_buf[1024];
+	int			s, fd_pidfile, ret;
 
 	fd_pidfile = open(pidfile_path, O_CREAT | O_RDWR, 0664);
 	if (fd_pidfile < 0) {
@@ -311,7 +637,7 @@ static void server_loop(const char *socket_path, const char *pidfile_path,
 	}
 	(void) umask(save_umask);
 
-	if (listen(s, 5) < 0) {
+	if (listen(s, SOMAXCONN) < 0) {
 		if (!quiet)
 			fprintf(stderr, _("Couldn't listen on unix "
 					  "socket %s: %s\n"), socket_path,
@@ -334,109 +660,68 @@ static void server_loop(const char *socket_path, const char *pidfile_path,
 	if (fd_pidfile > 1)
 		close(fd_pidfile); /* Unlock the pid file */
 
-	while (1) {
-		fromlen = sizeof(from_addr);
-		if (timeout > 0)
-			alarm(timeout);
-		ns = accept(s, (struct sockaddr *) &from_addr, &fromlen);
-		alarm(0);
-		if (ns < 0) {
-			if ((errno == EAGAIN) || (errno == EINTR))
-				continue;
-			perror("accept");
-			exit(1);
-		}
-		len = read(ns, &op, 1);
-		if (len != 1) {
-			if (len < 0)
-				perror("read");
-			else
-				printf(_("Error reading from client, "
-					 "len = %d\n"), len);
-			goto shutdown_socket;
-		}
-		if ((op == 4) || (op == 5)) {
-			if (read_all(ns, (char *) &num, sizeof(num)) != 4)
-				goto shutdown_socket;
-			if (debug)
-				printf(_("operation %d, incoming num = %d\n"),
-				       op, num);
-		} else if (debug)
-			printf("operation %d\n", op);
-
-		switch(op) {
-		case UUIDD_OP_GETPID:
-			sprintf(reply_buf, "%d", getpid());
-			reply_len = strlen(reply_buf)+1;
-			break;
-		case UUIDD_OP_GET_MAXOP:
-			sprintf(reply_buf, "%d", UUIDD_MAX_OP);
-			reply_len = strlen(reply_buf)+1;
-			break;
-		case UUIDD_OP_TIME_UUID:
-			num = 1;
-			uuid__generate_time(uu, &num);
-			if (debug) {
-				uuid_unparse(uu, str);
-				printf(_("Generated time UUID: %s\n"), str);
-			}
-			memcpy(reply_buf, uu, sizeof(uu));
-			reply_len = sizeof(uu);
-			break;
-		case UUIDD_OP_RANDOM_UUID:
-			num = 1;
-			uuid__generate_random(uu, &num);
-			if (debug) {
-				uuid_unparse(uu, str);
-				printf(_("Generated random UUID: %s\n"), str);
-			}
-			memcpy(reply_buf, uu, sizeof(uu));
-			reply_len = sizeof(uu);
-			break;
-		case UUIDD_OP_BULK_TIME_UUID:
-			uuid__generate_time(uu, &num);
-			if (debug) {
-				uuid_unparse(uu, str);
-				printf(P_("Generated time UUID %s and "
-					  "subsequent UUID\n",
-					  "Generated time UUID %s and %d "
-					  "subsequent UUIDs\n", num),
-				       str, num);
-			}
-			memcpy(reply_buf, uu, sizeof(uu));
-			reply_len = sizeof(uu);
-			memcpy(reply_buf+reply_len, &num, sizeof(num));
-			reply_len += sizeof(num);
-			break;
-		case UUIDD_OP_BULK_RANDOM_UUID:
-			if (num < 0)
-				num = 1;
-			if (num > 1000)
-				num = 1000;
-			if (num*16 > (int) (sizeof(reply_buf)-sizeof(num)))
-				num = (sizeof(reply_buf)-sizeof(num)) / 16;
-			uuid__generate_random((unsigned char *) reply_buf +
-					      sizeof(num), &num);
-			if (debug) {
-				printf(_("Generated %d UUID's:\n"), num);
-				for (i=0, cp=reply_buf+sizeof(num);
-				     i < num; i++, cp+=16) {
-					uuid_unparse((unsigned char *)cp, str);
-					printf("\t%s\n", str);
-				}
+	serve_clients(s, debug, timeout);
+}
+
+/*
+ * Load test a running uuidd: fork off a number of clients which keep
+ * requesting UUIDs for LOAD_TEST_SECONDS, and report the rate at which
+ * they were handed out.
+ */
+#define LOAD_TEST_SECONDS	5
+
+static void load_test(const char *socket_path, int op, int num, int clients)
+{
+	const char		*err_context;
+	unsigned long long	count, total = 0;
+	char			buf[1024];
+	time_t			end;
+	pid_t			pid;
+	int			fds[2], i, n, ret, status, failed = 0;
+
+	if (pipe(fds) < 0)
+		die("pipe");
+	for (i = 0; i < clients; i++) {
+		pid = fork();
+		if (pid < 0)
+			die("fork");
+		if (pid)
+			continue;
+
+		close(fds[0]);
+		count = 0;
+		end = time(0) + LOAD_TEST_SECONDS;
+		while (time(0) < end) {
+			n = num;
+			ret = call_daemon(socket_path, op, buf, sizeof(buf),
+					  num ? &n : 0, &err_context);
+			if (ret < 0) {
+				fprintf(stderr, _("Error calling uuidd daemon "
+						  "(%s): %s\n"),
+					err_context, strerror(errno));
+				exit(1);
 			}
-			reply_len = (num*16) + sizeof(num);
-			memcpy(reply_buf, &num, sizeof(num));
-			break;
-		default:
-			if (debug)
-				printf(_("Invalid operation %d\n"), op);
-			goto shutdown_socket;
+			count += num ? (n > 0 ? n : 0) : 1;
 		}
-		write_all(ns, (char *) &reply_len, sizeof(reply_len));
-		write_all(ns, reply_buf, reply_len);
-	shutdown_socket:
-		close(ns);
+		if (write_all(fds[1], (char *) &count, sizeof(count)) < 0)
+			exit(1);
+		exit(0);
+	}
+	close(fds[1]);
+
+	while (read_all(fds[0], (char *) &count, sizeof(count)) ==
+	       sizeof(count))
+		total += count;
+	close(fds[0]);
+	while (wait(&status) > 0)
+		if (!WIFEXITED(status) || WEXITSTATUS(status))
+			failed++;
+
+	printf(_("%d clients: %llu UUIDs in %d seconds (%llu UUIDs/sec)\n"),
+	       clients, total, LOAD_TEST_SECONDS, total / LOAD_TEST_SECONDS);
+	if (failed) {
+		printf(_("%d clients failed\n"), failed);
+		exit(1);
 	}
 }
 
@@ -453,6 +738,7 @@ int main(int argc, char **argv)
 	int		i, c, ret;
 	int		debug = 0, do_type = 0, do_kill = 0, num = 0;
 	int		timeout = 0, quiet = 0, drop_privs = 0;
+	int		load_clients = 0;
 
 #ifdef ENABLE_NLS
 	setlocale(LC_MESSAGES, "");
@@ -461,7 +747,7 @@ int main(int argc, char **argv)
 	textdomain(NLS_CAT_NAME);
 #endif
 
-	while ((c = getopt (argc, argv, "dkn:qp:s:tT:r")) != EOF) {
+	while ((c = getopt (argc, argv, "dkL:n:qp:s:tT:r")) != EOF) {
 		switch (c) {
 		case 'd':
 			debug++;
@@ -471,6 +757,14 @@ int main(int argc, char **argv)
 			do_kill++;
 			drop_privs = 1;
 			break;
+		case 'L':
+			load_clients = strtol(optarg, &tmp, 0);
+			if ((load_clients <= 0) || *tmp) {
+				fprintf(stderr, _("Bad number: %s\n"), optarg);
+				exit(1);
+			}
+			drop_privs = 1;
+			break;
 		case 'n':
 			num = strtol(optarg, &tmp, 0);
 			if ((num < 0) || *tmp) {
@@ -527,6 +821,13 @@ int main(int argc, char **argv)
 			die("setreuid");
 #endif
 	}
+	if (load_clients) {
+		if (!do_type)
+			do_type = UUIDD_OP_TIME_UUID;
+		load_test(socket_path, num ? do_type + 2 : do_type, num,
+			  load_clients);
+		exit(0);
+	}
 	if (num && do_type) {
 		ret = call_daemon(socket_path, do_type+2, buf,
 				  sizeof(buf), &num, &err_context);
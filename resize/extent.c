@@ -24,12 +24,26 @@ struct ext2_extent_entry {
 	__u64	size;
 };
 
+/*
+ * Tables which get big enough are given an index to narrow down the
+ * binary search: the range of old locations is cut into buckets of
+ * 2^index_shift locations, and index[i] is the first entry which ends
+ * after the start of bucket i.
+ */
+#define EXTENT_INDEX_MIN	64
+
 struct _ext2_extent {
 	struct ext2_extent_entry *list;
 	__u64	cursor;
 	__u64	size;
 	__u64	num;
 	__u64	sorted;
+	__u64	last;		/* Entry found by the last lookup */
+	__u64	*index;
+	__u64	index_base;
+	__u64	index_buckets;
+	int	index_shift;
+	int	indexed;
 };
 
 /*
@@ -69,6 +83,8 @@ void ext2fs_free_extent_table(ext2_extent extent)
 {
 	if (extent->list)
 		ext2fs_free_mem(&extent->list);
+	if (extent->index)
+		ext2fs_free_mem(&extent->index);
 	extent->list = 0;
 	extent->size = 0;
 	extent->num = 0;
@@ -85,8 +101,10 @@ errcode_t ext2fs_add_extent_entry(ext2_extent extent, __u64 old_loc, __u64 new_l
 	__u64				newsize;
 	__u64				curr;
 
+	extent->indexed = 0;
 	if (extent->num >= extent->size) {
-		newsize = extent->size + 100;
+		/* Grow geometrically; tables can have millions of entries */
+		newsize = extent->size * 2;
 		retval = ext2fs_resize_mem(sizeof(struct ext2_extent_entry) *
 					   extent->size,
 					   sizeof(struct ext2_extent_entry) *
@@ -133,62 +151,154 @@ static EXT2_QSORT_TYPE extent_cmp(const void *a, const void *b)
 	db_a = (const struct ext2_extent_entry *) a;
 	db_b = (const struct ext2_extent_entry *) b;
 
-	return (db_a->old_loc - db_b->old_loc);
+	if (db_a->old_loc < db_b->old_loc)
+		return -1;
+	return (db_a->old_loc > db_b->old_loc);
 }
 
 /*
- * Given an inode map and inode number, look up the old inode number
- * and return the new inode number.
+ * Sort the table and (re)build its index once entries have been
+ * added.  If the index can't be allocated lookups just fall back to
+ * searching the whole table.
  */
-__u64 ext2fs_extent_translate(ext2_extent extent, __u64 old_loc)
+static void extent_prepare(ext2_extent extent)
 {
-	__s64	low, high, mid;
-	__u64	lowval, highval;
-	float	range;
+	struct ext2_extent_entry *ent;
+	__u64	span, b, start, j;
+	int	shift = 0;
 
 	if (!extent->sorted) {
 		qsort(extent->list, extent->num,
 		      sizeof(struct ext2_extent_entry), extent_cmp);
 		extent->sorted = 1;
 	}
-	low = 0;
-	high = extent->num-1;
-	while (low <= high) {
-#if 0
-		mid = (low+high)/2;
-#else
-		if (low == high)
-			mid = low;
-		else {
-			/* Interpolate for efficiency */
-			lowval = extent->list[low].old_loc;
-			highval = extent->list[high].old_loc;
-
-			if (old_loc < lowval)
-				range = 0;
-			else if (old_loc > highval)
-				range = 1;
-			else {
-				range = ((float) (old_loc - lowval)) /
-					(highval - lowval);
-				if (range > 0.9)
-					range = 0.9;
-				if (range < 0.1)
-					range = 0.1;
-			}
-			mid = low + ((__u64) (range * (high-low)));
+	extent->indexed = 1;
+	extent->last = 0;
+	if (extent->index)
+		ext2fs_free_mem(&extent->index);
+	extent->index_buckets = 0;
+	if (extent->num < EXTENT_INDEX_MIN)
+		return;
+
+	ent = extent->list + extent->num - 1;
+	extent->index_base = extent->list[0].old_loc;
+	span = ent->old_loc + ent->size - extent->index_base;
+	while ((span >> shift) > extent->num)
+		shift++;
+	extent->index_shift = shift;
+	if (ext2fs_get_array((span >> shift) + 2, sizeof(__u64),
+			     &extent->index))
+		return;
+	extent->index_buckets = (span >> shift) + 1;
+
+	for (b = 0, j = 0; b < extent->index_buckets; b++) {
+		start = extent->index_base + (b << shift);
+		while (j < extent->num &&
+		       extent->list[j].old_loc + extent->list[j].size <= start)
+			j++;
+		extent->index[b] = j;
+	}
+	extent->index[b] = extent->num;
+}
+
+/*
+ * Return the first entry which ends after old_loc, or extent->num if
+ * there is none.  Lookups tend to walk through the table in order, so
+ * try the entry found last time and the one after it first.
+ */
+static __u64 extent_lookup(ext2_extent extent, __u64 old_loc)
+{
+	struct ext2_extent_entry *ent;
+	__u64	low, high, mid, b;
+
+	if (!extent->indexed)
+		extent_prepare(extent);
+
+	low = extent->last;
+	if (low < extent->num) {
+		ent = extent->list + low;
+		if (old_loc >= ent->old_loc) {
+			if (old_loc < ent->old_loc + ent->size)
+				return low;
+			if (low + 1 == extent->num ||
+			    old_loc < ent[1].old_loc + ent[1].size)
+				return (extent->last = low + 1);
 		}
-#endif
-		if ((old_loc >= extent->list[mid].old_loc) &&
-		    (old_loc < extent->list[mid].old_loc + extent->list[mid].size))
-			return (extent->list[mid].new_loc +
-				(old_loc - extent->list[mid].old_loc));
-		if (old_loc < extent->list[mid].old_loc)
-			high = mid-1;
+	}
+
+	low = 0;
+	high = extent->num;
+	if (extent->index_buckets) {
+		if (old_loc < extent->index_base)
+			return (extent->last = 0);
+		b = (old_loc - extent->index_base) >> extent->index_shift;
+		if (b >= extent->index_buckets)
+			return extent->num;
+		low = extent->index[b];
+		high = extent->index[b + 1];
+	}
+	while (low < high) {
+		mid = low + (high - low) / 2;
+		ent = extent->list + mid;
+		if (ent->old_loc + ent->size <= old_loc)
+			low = mid + 1;
 		else
-			low = mid+1;
+			high = mid;
 	}
-	return 0;
+	if (low < extent->num)
+		extent->last = low;
+	return low;
+}
+
+/*
+ * Given an inode map and inode number, look up the old inode number
+ * and return the new inode number.
+ */
+__u64 ext2fs_extent_translate(ext2_extent extent, __u64 old_loc)
+{
+	struct ext2_extent_entry *ent;
+	__u64	i;
+
+	i = extent_lookup(extent, old_loc);
+	if (i == extent->num)
+		return 0;
+	ent = extent->list + i;
+	if (old_loc < ent->old_loc)
+		return 0;
+	return ent->new_loc + (old_loc - ent->old_loc);
+}
+
+/*
+ * Translate the start of a run of len locations beginning at old_loc.
+ * Returns how many of them are translated as a unit (at least one and
+ * at most len), setting *new_loc to where they go, or to zero if they
+ * aren't moved.
+ */
+__u64 ext2fs_extent_translate_run(ext2_extent extent, __u64 old_loc,
+				  __u64 len, __u64 *new_loc)
+{
+	struct ext2_extent_entry *ent;
+	__u64	i, covered;
+
+	i = extent_lookup(extent, old_loc);
+	ent = extent->list + i;
+	*new_loc = 0;
+	if (i == extent->num)
+		return len;
+	if (ent->old_loc > old_loc)
+		return (ent->old_loc - old_loc < len) ?
+			ent->old_loc - old_loc : len;
+
+	*new_loc = ent->new_loc + (old_loc - ent->old_loc);
+	covered = ent->old_loc + ent->size - old_loc;
+	while (covered < len && ++i < extent->num) {
+		ent++;
+		if (ent->old_loc != old_loc + covered ||
+		    ent->new_loc != *new_loc + covered)
+			break;
+		covered += ent->size;
+	}
+	return (covered < len) ? covered : len;
 }
 
 /*
@@ -49,7 +49,7 @@ static int parse_version_number(const char *s)
 #endif
 
 errcode_t online_resize_fs(ext2_filsys fs, const char *mtpt,
-			   blk64_t *new_size, int flags EXT2FS_ATTR((unused)))
+			   blk64_t *new_size, int flags)
 {
 #ifdef __linux__
 	struct ext2_new_group_input input;
@@ -57,9 +57,11 @@ errcode_t online_resize_fs(ext2_filsys fs, const char *mtpt,
 	struct ext2_super_block *sb = fs->super;
 	unsigned long		new_desc_blocks;
 	ext2_filsys 		new_fs;
+	ext2_sim_progmeter	progress = 0;
+	struct timeval		start, end;
 	errcode_t 		retval;
-	double			percent;
-	dgrp_t			i;
+	double			percent, secs;
+	dgrp_t			i, added;
 	blk_t			size;
 	int			fd;
 	int			use_old_ioctl = 1;
@@ -188,7 +190,20 @@ errcode_t online_resize_fs(ext2_filsys fs, const char *mtpt,
 	percent = (ext2fs_r_blocks_count(sb) * 100.0) /
 		ext2fs_blocks_count(sb);
 
-	retval = ext2fs_read_bitmaps(fs);
+	/*
+	 * Laying out the new block groups only looks at their own
+	 * blocks, and nothing is written back to a mounted file
+	 * system, so start with empty bitmaps instead of reading them
+	 * in.  On a large file system that read is most of the I/O
+	 * done here.
+	 */
+	retval = 0;
+	if (!fs->block_map)
+		retval = ext2fs_allocate_block_bitmap(fs, _("block bitmap"),
+						      &fs->block_map);
+	if (!retval && !fs->inode_map)
+		retval = ext2fs_allocate_inode_bitmap(fs, _("inode bitmap"),
+						      &fs->inode_map);
 	if (retval) {
 		close(fd);
 		return retval;
@@ -231,6 +246,16 @@ errcode_t online_resize_fs(ext2_filsys fs, const char *mtpt,
 		exit(1);
 	}
 
+	added = new_fs->group_desc_count - fs->group_desc_count;
+	if ((flags & RESIZE_PERCENT_COMPLETE) && added) {
+		retval = ext2fs_progress_init(&progress,
+					      _("Adding block groups"),
+					      30, 40, added, 0);
+		if (retval)
+			progress = 0;
+	}
+	gettimeofday(&start, 0);
+
 	for (i = fs->group_desc_count;
 	     i < new_fs->group_desc_count; i++) {
 		input.group = i;
@@ -258,26 +283,38 @@ errcode_t online_resize_fs(ext2_filsys fs, const char *mtpt,
 		printf("Adding group #%d\n", input.group);
 #endif
 
-		if (use_old_ioctl &&
-		    ioctl(fd, EXT2_IOC_GROUP_ADD, &input) == 0)
-			continue;
-		else
+		if (!use_old_ioctl ||
+		    ioctl(fd, EXT2_IOC_GROUP_ADD, &input) != 0) {
 			use_old_ioctl = 0;
 
-		input64.group = input.group;
-		input64.block_bitmap = input.block_bitmap;
-		input64.inode_bitmap = input.inode_bitmap;
-		input64.inode_table = input.inode_table;
-		input64.blocks_count = input.blocks_count;
-		input64.reserved_blocks = input.reserved_blocks;
-		input64.unused = input.unused;
+			input64.group = input.group;
+			input64.block_bitmap = input.block_bitmap;
+			input64.inode_bitmap = input.inode_bitmap;
+			input64.inode_table = input.inode_table;
+			input64.blocks_count = input.blocks_count;
+			input64.reserved_blocks = input.reserved_blocks;
+			input64.unused = input.unused;
 
-		if (ioctl(fd, EXT4_IOC_GROUP_ADD, &input64) < 0) {
-			com_err(program_name, errno,
-				_("While trying to add group #%d"),
-				input.group);
-			exit(1);
+			if (ioctl(fd, EXT4_IOC_GROUP_ADD, &input64) < 0) {
+				com_err(program_name, errno,
+					_("While trying to add group #%d"),
+					input.group);
+				exit(1);
+			}
 		}
+		if (progress)
+			ext2fs_progress_update(progress,
+					       i - fs->group_desc_count + 1);
+	}
+
+	if (progress) {
+		ext2fs_progress_close(progress);
+		gettimeofday(&end, 0);
+		secs = (end.tv_sec - start.tv_sec) +
+			(end.tv_usec - start.tv_usec) / 1000000.0;
+		printf(_("Added %u block groups in %.2f seconds "
+			 "(%.1f groups/sec)\n"), added, secs,
+		       secs > 0 ? added / secs : 0.0);
 	}
 
 	ext2fs_free(new_fs);
@@ -1030,13 +1030,21 @@ static errcode_t adjust_superblock(ext2_resize_t rfs, blk64_t new_size)
 	blk64_t		group_block;
 	unsigned long	i;
 	unsigned long	max_group;
+	int		save_type;
 
 	ext2fs_mark_super_dirty(fs);
 	ext2fs_mark_bb_dirty(fs);
 	ext2fs_mark_ib_dirty(fs);
 
+	/*
+	 * The reserved blocks are whole inode tables and bitmaps, group
+	 * after group: runs which the hybrid bitmap keeps compactly.
+	 */
+	save_type = fs->default_bitmap_type;
+	fs->default_bitmap_type = EXT2FS_BMAP64_HYBRID;
 	retval = ext2fs_allocate_block_bitmap(fs, _("reserved blocks"),
 					      &rfs->reserve_blocks);
+	fs->default_bitmap_type = save_type;
 	if (retval)
 		return retval;
 
@@ -1860,6 +1868,105 @@ static int process_block(ext2_filsys fs, blk64_t	*block_nr,
 	return ret;
 }
 
+/*
+ * Remap an extent-mapped file an extent at a time, rather than
+ * calling ext2fs_extent_set_bmap() for each block the way
+ * ext2fs_block_iterate3() does.  An extent whose blocks were moved to
+ * more than one place is split up, the first piece replacing it and
+ * the others inserted after it.
+ */
+static errcode_t remap_extents(ext2_filsys fs, struct process_block_struct *pb)
+{
+	ext2_extent_handle_t	handle;
+	struct ext2fs_extent	extent;
+	ext2_extent		bmap = pb->rfs->bmap;
+	__u64			new_blk, len;
+	blk64_t			lblk, pblk, left;
+	e2_blkcnt_t		i;
+	errcode_t		retval;
+	int			op = EXT2_EXTENT_ROOT;
+	int			first;
+
+	retval = ext2fs_extent_open2(fs, pb->ino, pb->inode, &handle);
+	if (retval)
+		return retval;
+
+	while (1) {
+		retval = ext2fs_extent_get(handle, op, &extent);
+		if (retval)
+			break;
+		op = EXT2_EXTENT_NEXT;
+		if (!(extent.e_flags & EXT2_EXTENT_FLAGS_LEAF)) {
+			if (extent.e_flags & EXT2_EXTENT_FLAGS_SECOND_VISIT)
+				continue;
+			new_blk = 0;
+			if (bmap)
+				ext2fs_extent_translate_run(bmap,
+						extent.e_pblk, 1, &new_blk);
+			if (new_blk) {
+				extent.e_pblk = new_blk;
+				retval = ext2fs_extent_replace(handle, 0,
+							       &extent);
+				if (retval)
+					goto out;
+				pb->changed = 1;
+			}
+			if (pb->is_dir) {
+				retval = ext2fs_add_dir_block2(fs->dblist,
+						pb->ino, extent.e_pblk, -1);
+				if (retval)
+					goto out;
+			}
+			continue;
+		}
+
+		lblk = extent.e_lblk;
+		pblk = extent.e_pblk;
+		left = extent.e_len;
+		for (first = 1; left; first = 0) {
+			new_blk = 0;
+			len = left;
+			if (bmap)
+				len = ext2fs_extent_translate_run(bmap, pblk,
+							left, &new_blk);
+			extent.e_lblk = lblk;
+			extent.e_pblk = new_blk ? new_blk : pblk;
+			extent.e_len = len;
+#ifdef RESIZE2FS_DEBUG
+			if (new_blk && (pb->rfs->flags & RESIZE_DEBUG_BMOVE))
+				printf("ino=%u, lblk=%llu, %llu->%llu (%llu)\n",
+				       pb->old_ino, lblk, pblk, new_blk, len);
+#endif
+			if (!first)
+				retval = ext2fs_extent_insert(handle,
+						EXT2_EXTENT_INSERT_AFTER,
+						&extent);
+			else if (new_blk || len < left)
+				retval = ext2fs_extent_replace(handle, 0,
+							       &extent);
+			if (retval)
+				goto out;
+			if (new_blk || len < left)
+				pb->changed = 1;
+			for (i = 0; pb->is_dir && i < (e2_blkcnt_t) len; i++) {
+				retval = ext2fs_add_dir_block2(fs->dblist,
+						pb->ino, extent.e_pblk + i,
+						lblk + i);
+				if (retval)
+					goto out;
+			}
+			lblk += len;
+			pblk += len;
+			left -= len;
+		}
+	}
+	if (retval == EXT2_ET_EXTENT_NO_NEXT)
+		retval = 0;
+out:
+	ext2fs_extent_free(handle);
+	return retval;
+}
+
 /*
  * Progress callback
  */
@@ -2202,9 +2309,14 @@ remap_blocks:
 			pb.ino = new_inode;
 			pb.old_ino = ino;
 			pb.has_extents = inode->i_flags & EXT4_EXTENTS_FL;
-			retval = ext2fs_block_iterate3(rfs->old_fs,
-						       new_inode, 0, block_buf,
-						       process_block, &pb);
+			pb.inode = inode;
+			if (pb.has_extents &&
+			    EXT2FS_CLUSTER_RATIO(rfs->old_fs) == 1)
+				retval = remap_extents(rfs->old_fs, &pb);
+			else
+				retval = ext2fs_block_iterate3(rfs->old_fs,
+						new_inode, 0, block_buf,
+						process_block, &pb);
 			if (retval)
 				goto errout;
 			if (pb.error) {
@@ -2266,6 +2378,7 @@ struct istruct {
 	errcode_t	err;
 	unsigned int	max_dirs;
 	unsigned int	num;
+	ext2fs_inode_bitmap changed_dirs;
 };
 
 static int check_and_change_inodes(ext2_ino_t dir,
@@ -2276,9 +2389,7 @@ static int check_and_change_inodes(ext2_ino_t dir,
 				   void *priv_data)
 {
 	struct istruct *is = (struct istruct *) priv_data;
-	struct ext2_inode 	inode;
 	ext2_ino_t		new_inode;
-	errcode_t		retval;
 	int			ret = 0;
 
 	if (is->rfs->progress && offset == 0) {
@@ -2314,18 +2425,39 @@ static int check_and_change_inodes(ext2_ino_t dir,
 
 	dirent->inode = new_inode;
 
-	/* Update the directory mtime and ctime */
-	retval = ext2fs_read_inode(is->rfs->old_fs, dir, &inode);
-	if (retval == 0) {
-		inode.i_mtime = inode.i_ctime = time(0);
-		is->err = ext2fs_write_inode(is->rfs->old_fs, dir, &inode);
-		if (is->err)
-			return ret | DIRENT_ABORT;
-	}
+	/* The directory's mtime and ctime are updated afterwards */
+	ext2fs_mark_inode_bitmap2(is->changed_dirs, dir);
 
 	return ret | DIRENT_CHANGED;
 }
 
+/*
+ * Update the mtime and ctime of each directory which had an entry
+ * changed, once per directory and in inode table order.
+ */
+static errcode_t touch_changed_dirs(ext2_filsys fs,
+				    ext2fs_inode_bitmap changed_dirs)
+{
+	struct ext2_inode	inode;
+	ext2_ino_t		dir = 1;
+	ext2_ino_t		end = fs->super->s_inodes_count;
+	errcode_t		retval;
+	__u32			now = time(0);
+
+	while (dir <= end &&
+	       !ext2fs_find_first_set_inode_bitmap2(changed_dirs, dir, end,
+						    &dir)) {
+		if (ext2fs_read_inode(fs, dir, &inode) == 0) {
+			inode.i_mtime = inode.i_ctime = now;
+			retval = ext2fs_write_inode(fs, dir, &inode);
+			if (retval)
+				return retval;
+		}
+		dir++;
+	}
+	return 0;
+}
+
 static errcode_t inode_ref_fix(ext2_resize_t rfs)
 {
 	errcode_t		retval;
@@ -2342,6 +2474,7 @@ static errcode_t inode_ref_fix(ext2_resize_t rfs)
 	is.max_dirs = ext2fs_dblist_count2(rfs->old_fs->dblist);
 	is.rfs = rfs;
 	is.err = 0;
+	is.changed_dirs = 0;
 
 	if (rfs->progress) {
 		retval = (rfs->progress)(rfs, E2_RSZ_INODE_REF_UPD_PASS,
@@ -2350,6 +2483,12 @@ static errcode_t inode_ref_fix(ext2_resize_t rfs)
 			goto errout;
 	}
 
+	retval = ext2fs_allocate_inode_bitmap(rfs->old_fs,
+					      _("changed directories"),
+					      &is.changed_dirs);
+	if (retval)
+		goto errout;
+
 	rfs->old_fs->flags |= EXT2_FLAG_IGNORE_CSUM_ERRORS;
 	retval = ext2fs_dblist_dir_iterate(rfs->old_fs->dblist,
 					   DIRENT_FLAG_INCLUDE_EMPTY, 0,
@@ -2362,11 +2501,17 @@ static errcode_t inode_ref_fix(ext2_resize_t rfs)
 		goto errout;
 	}
 
+	retval = touch_changed_dirs(rfs->old_fs, is.changed_dirs);
+	if (retval)
+		goto errout;
+
 	if (rfs->progress && (is.num < is.max_dirs))
 		(rfs->progress)(rfs, E2_RSZ_INODE_REF_UPD_PASS,
 				is.max_dirs, is.max_dirs);
 
 errout:
+	if (is.changed_dirs)
+		ext2fs_free_inode_bitmap(is.changed_dirs);
 	ext2fs_free_extent_table(rfs->imap);
 	rfs->imap = 0;
 	return retval;
@@ -159,6 +159,8 @@ extern void ext2fs_free_extent_table(ext2_extent extent);
 extern errcode_t ext2fs_add_extent_entry(ext2_extent extent,
 					 __u64 old_loc, __u64 new_loc);
 extern __u64 ext2fs_extent_translate(ext2_extent extent, __u64 old_loc);
+extern __u64 ext2fs_extent_translate_run(ext2_extent extent, __u64 old_loc,
+					 __u64 len, __u64 *new_loc);
 extern void ext2fs_extent_dump(ext2_extent extent, FILE *out);
 extern errcode_t ext2fs_iterate_extent(ext2_extent extent, __u64 *old_loc,
 				       __u64 *new_loc, __u64 *size);
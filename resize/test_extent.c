@@ -13,10 +13,197 @@
  */
 
 #include "config.h"
+#include <sys/time.h>
 #include "resize2fs.h"
 
 void do_test(FILE *in, FILE *out);
 
+/*
+ * "verify <n>" and "bench <n>" build their own tables of n runs with
+ * gaps between them; verify checks every lookup against the runs it
+ * added (in order, and then in reverse order so that the table has
+ * to be sorted), and bench times adding and looking up entries.
+ */
+struct test_run {
+	__u64	old_loc, new_loc, size;
+};
+
+static unsigned int test_seed;
+
+static unsigned int test_random(void)
+{
+	test_seed = test_seed * 1103515245 + 12345;
+	return (test_seed >> 16) & 0x7fff;
+}
+
+static struct test_run *make_runs(__u64 n)
+{
+	struct test_run	*runs;
+	__u64		i, old_loc = 1000, new_loc = 1;
+
+	runs = malloc(n * sizeof(struct test_run));
+	if (!runs)
+		return NULL;
+	test_seed = 1;
+	for (i = 0; i < n; i++) {
+		old_loc += test_random() % 4;
+		runs[i].old_loc = old_loc;
+		runs[i].new_loc = new_loc;
+		runs[i].size = 1 + test_random() % 8;
+		old_loc += runs[i].size;
+		/* Leave a hole so that adjacent runs aren't coalesced */
+		new_loc += runs[i].size + 1;
+	}
+	return runs;
+}
+
+static errcode_t add_runs(ext2_extent extent, struct test_run *runs,
+			  __u64 n, int reverse)
+{
+	struct test_run	*run;
+	__u64		i, j;
+	errcode_t	retval;
+
+	for (i = 0; i < n; i++) {
+		run = runs + (reverse ? n - 1 - i : i);
+		for (j = 0; j < run->size; j++) {
+			retval = ext2fs_add_extent_entry(extent,
+					run->old_loc + j, run->new_loc + j);
+			if (retval)
+				return retval;
+		}
+	}
+	return 0;
+}
+
+static int verify_runs(ext2_extent extent, struct test_run *runs, __u64 n,
+		       FILE *out)
+{
+	__u64	i, loc, end = 0, expect, got, len, want;
+
+	for (i = 0; i < n; i++) {
+		loc = i ? runs[i-1].old_loc + runs[i-1].size : 0;
+		end = runs[i].old_loc + runs[i].size;
+		for (; loc < end; loc++) {
+			expect = (loc < runs[i].old_loc) ? 0 :
+				runs[i].new_loc + loc - runs[i].old_loc;
+			got = ext2fs_extent_translate(extent, loc);
+			if (got != expect)
+				goto mismatch;
+			len = ext2fs_extent_translate_run(extent, loc, 100,
+							  &got);
+			want = (expect ? end : runs[i].old_loc) - loc;
+			if (got != expect || len != (want < 100 ? want : 100))
+				goto mismatch;
+		}
+	}
+	/* Nothing past the end of the last run may be mapped */
+	loc = end;
+	expect = 0;
+	got = ext2fs_extent_translate(extent, loc);
+	if (got != expect)
+		goto mismatch;
+	return 0;
+
+mismatch:
+	fprintf(out, "# Verify: %llu -> %llu, expected %llu\n",
+		loc, got, expect);
+	return 1;
+}
+
+static void do_verify(__u64 n, FILE *out)
+{
+	struct test_run	*runs;
+	ext2_extent	extent;
+	errcode_t	retval;
+	int		reverse;
+
+	runs = make_runs(n);
+	if (!runs) {
+		fprintf(out, "# Error: %s\n", error_message(ENOMEM));
+		return;
+	}
+	for (reverse = 0; reverse < 2; reverse++) {
+		retval = ext2fs_create_extent_table(&extent, 0);
+		if (!retval)
+			retval = add_runs(extent, runs, n, reverse);
+		if (retval) {
+			fprintf(out, "# Error: %s\n", error_message(retval));
+			goto out;
+		}
+		retval = verify_runs(extent, runs, n, out);
+		ext2fs_free_extent_table(extent);
+		if (retval)
+			goto out;
+	}
+	fputs("# Verify: ok\n", out);
+out:
+	free(runs);
+}
+
+static double test_time(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void do_bench(__u64 n, FILE *out)
+{
+	struct test_run	*runs;
+	ext2_extent	extent;
+	errcode_t	retval;
+	__u64		i, loc, end, found = 0;
+	double		start;
+
+	if (!n) {
+		fprintf(out, "# Error: %s\n", error_message(EINVAL));
+		return;
+	}
+	runs = make_runs(n);
+	if (!runs) {
+		fprintf(out, "# Error: %s\n", error_message(ENOMEM));
+		return;
+	}
+	retval = ext2fs_create_extent_table(&extent, 0);
+	if (retval) {
+		fprintf(out, "# Error: %s\n", error_message(retval));
+		free(runs);
+		return;
+	}
+	end = runs[n-1].old_loc + runs[n-1].size;
+
+	start = test_time();
+	retval = add_runs(extent, runs, n, 0);
+	if (retval) {
+		fprintf(out, "# Error: %s\n", error_message(retval));
+		goto out;
+	}
+	fprintf(out, "# add:        %8.3f s\n", test_time() - start);
+
+	start = test_time();
+	for (loc = runs[0].old_loc; loc < end; loc++)
+		found += !!ext2fs_extent_translate(extent, loc);
+	fprintf(out, "# sequential: %8.3f s (%llu lookups)\n",
+		test_time() - start, end - runs[0].old_loc);
+
+	test_seed = 2;
+	start = test_time();
+	for (i = 0; i < n; i++) {
+		loc = runs[0].old_loc +
+			(((__u64) test_random() << 15) + test_random()) %
+			(end - runs[0].old_loc);
+		found += !!ext2fs_extent_translate(extent, loc);
+	}
+	fprintf(out, "# random:     %8.3f s (%llu lookups)\n",
+		test_time() - start, n);
+	fprintf(out, "# found %llu\n", found);
+out:
+	ext2fs_free_extent_table(extent);
+	free(runs);
+}
+
 void do_test(FILE *in, FILE *out)
 {
 	char		buf[128];
@@ -65,6 +252,14 @@ void do_test(FILE *in, FILE *out)
 			num2 = strtoul(arg2, 0, 0);
 		}
 
+		if (!strcmp(cmd, "verify")) {
+			do_verify(num1, out);
+			continue;
+		}
+		if (!strcmp(cmd, "bench")) {
+			do_bench(num1, out);
+			continue;
+		}
 		if (!strcmp(cmd, "create")) {
 			retval = ext2fs_create_extent_table(&extent, num1);
 			if (retval) {